@@ -0,0 +1,107 @@
+// Compares parse_json() with the rapidjson DOM + json_to_object() conversion
+// it replaced, on a ruleset (the embedded recommended.json by default) or any
+// other JSON file.
+//
+// usage: json_parser_bench [file.json] [iterations]
+
+#include <rapidjson/document.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "ddwaf_obj.h"
+#include "json_parser.h"
+
+namespace dnsec = datadog::nginx::security;
+
+namespace {
+
+constexpr int kMaxDepth = 25;
+
+template <typename F>
+double time_per_iteration_us(int iterations, F &&f) {
+  f();  // warm up
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::micro> const elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+std::size_t count_objects(const dnsec::ddwaf_obj &obj) {
+  std::size_t n = 1;
+  if (obj.type == DDWAF_OBJ_MAP || obj.type == DDWAF_OBJ_ARRAY) {
+    for (std::size_t i = 0; i < obj.nbEntries; i++) {
+      n += count_objects(static_cast<const dnsec::ddwaf_obj &>(obj.array[i]));
+    }
+  }
+  return n;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *file = argc > 1 ? argv[1] : DEFAULT_INPUT;
+  int const iterations = argc > 2 ? std::atoi(argv[2]) : 200;
+  if (iterations <= 0) {
+    std::fprintf(stderr, "invalid number of iterations\n");
+    return 1;
+  }
+
+  std::ifstream in{file, std::ios::binary};
+  if (!in) {
+    std::fprintf(stderr, "cannot open %s\n", file);
+    return 1;
+  }
+  std::string const json{std::istreambuf_iterator<char>{in}, {}};
+
+  // check that both produce the same number of objects before timing them
+  dnsec::JsonLimits const limits{
+      .max_depth = kMaxDepth,
+      .max_container_size = 0,
+      .max_string_length = 0,
+      .truncate = false,
+  };
+  std::size_t const n_new =
+      count_objects(dnsec::parse_json(json, limits).get());
+  rapidjson::Document check;
+  check.Parse(json.data(), json.size());
+  if (check.HasParseError()) {
+    std::fprintf(stderr, "%s is not valid JSON\n", file);
+    return 1;
+  }
+  std::size_t const n_old =
+      count_objects(dnsec::json_to_object(check, kMaxDepth).get());
+  if (n_new != n_old) {
+    std::fprintf(stderr, "object count mismatch: %zu vs %zu\n", n_new, n_old);
+    return 1;
+  }
+
+  double const old_us = time_per_iteration_us(iterations, [&] {
+    rapidjson::Document doc;
+    doc.Parse(json.data(), json.size());
+    auto obj = dnsec::json_to_object(doc, kMaxDepth);
+    static_cast<void>(obj);
+  });
+
+  double const new_us = time_per_iteration_us(iterations, [&] {
+    auto obj = dnsec::parse_json(json, limits);
+    static_cast<void>(obj);
+  });
+
+  double const mb = static_cast<double>(json.size()) / (1024.0 * 1024.0);
+  std::printf("input: %s (%zu bytes, %zu objects)\n", file, json.size(),
+              n_new);
+  std::printf("rapidjson + json_to_object: %10.1f us/iter  %7.1f MiB/s\n",
+              old_us, mb / (old_us / 1e6));
+  std::printf("parse_json:                 %10.1f us/iter  %7.1f MiB/s\n",
+              new_us, mb / (new_us / 1e6));
+  std::printf("speedup: %.2fx\n", old_us / new_us);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs one scenario of the local nginx benchmark: starts nginx with the
+# scenario's configuration, sends it the request mix of requests.js with k6,
+# and stops it.
+#
+# usage: run.sh <scenario> [path/to/ngx_http_datadog_module.so]
+#
+# Scenarios:
+#   baseline                nginx without the module
+#   only-tracing            every request traced, AppSec disabled
+#   appsec                  AppSec enabled at the http level; the API goes
+#                           through the WAF
+#   appsec-static-location  as appsec, but every request is for a static file,
+#                           served from a location without a WAF thread pool;
+#                           should stay close to only-tracing
+#
+# The nginx binary is taken from $NGINX (default: nginx), and k6 from $K6
+# (default: k6). The rate and duration are set with the
+# K6_OPTIONS_NORMAL_OPERATION_* variables, as in .gitlab/benchmarks.yml.
+
+set -e
+
+usage() {
+  echo "usage: $0 baseline|only-tracing|appsec|appsec-static-location" \
+       "[module.so]" >&2
+  exit 1
+}
+
+[ $# -ge 1 ] || usage
+scenario=$1
+module=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+
+MIX=default
+case "$scenario" in
+  baseline) conf=baseline.conf ;;
+  only-tracing) conf=only-tracing.conf ;;
+  appsec) conf=appsec.conf ;;
+  appsec-static-location) conf=appsec.conf; MIX=static ;;
+  *) usage ;;
+esac
+if [ "$scenario" != baseline ]; then
+  [ -n "$module" ] || usage
+  module=$(cd "$(dirname "$module")" && pwd)/$(basename "$module")
+fi
+
+work=$(mktemp -d)
+sed -e "s|@MODULE@|$module|" -e "s|@WORK@|$work|" -e "s|@DIR@|$dir|" \
+    "$dir/conf/$conf" > "$work/nginx.conf"
+
+nginx=${NGINX:-nginx}
+"$nginx" -p "$work" -c "$work/nginx.conf"
+trap '"$nginx" -p "$work" -c "$work/nginx.conf" -s quit; sleep 1;
+      echo "error log: $work/error.log"' EXIT
+sleep 1
+
+MIX=$MIX "${K6:-k6}" run "$dir/requests.js"
@@ -0,0 +1,309 @@
+// Runs the RUM SDK injection body filter over multi-megabyte HTML pages, cut
+// into buffers the way nginx hands them to the filter, and reports the time
+// and the request pool memory it takes per page.
+//
+// usage: rum_injection_bench [page size in MiB]... [--iterations N]
+//                            [--buffer-size BYTES]
+//
+// Each page size is run with the injection point at the start of the page,
+// at 90% of it, and missing, with recycled and non-recycled buffers. Only
+// the bytes of recycled buffers have to be copied.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <strings.h>
+
+#include "datadog_conf.h"
+#include "rum/injection.h"
+
+extern "C" {
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace rum = datadog::nginx::rum;
+using datadog::nginx::datadog_loc_conf_t;
+
+namespace {
+
+constexpr std::string_view kRumConfig =
+    R"({"majorVersion":5,"rum":{"applicationId":"bench",)"
+    R"("clientToken":"bench","site":"datadoghq.com"}})";
+
+// Request pool: everything allocated while filtering a page, freed after it.
+struct Arena {
+  std::vector<void *> blocks;
+  std::size_t bytes{};
+
+  void *alloc(std::size_t size) {
+    void *p = std::malloc(size);
+    if (p != nullptr) {
+      blocks.push_back(p);
+      bytes += size;
+    }
+    return p;
+  }
+
+  void reset() {
+    for (void *p : blocks) {
+      std::free(p);
+    }
+    blocks.clear();
+    bytes = 0;
+  }
+};
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+Arena arena;
+
+// what the next body filter received
+struct Sent {
+  std::size_t bytes{};
+  std::size_t links{};
+  bool last_buf{};
+};
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+Sent sent;
+
+ngx_int_t next_body_filter(ngx_http_request_t *, ngx_chain_t *in) {
+  for (ngx_chain_t *cl = in; cl != nullptr; cl = cl->next) {
+    sent.bytes += cl->buf->last - cl->buf->pos;
+    sent.links++;
+    sent.last_buf = sent.last_buf || cl->buf->last_buf;
+  }
+  return NGX_OK;
+}
+
+enum class Placement { start, late, missing };
+
+const char *to_string(Placement p) {
+  switch (p) {
+    case Placement::start:
+      return "start";
+    case Placement::late:
+      return "late";
+    case Placement::missing:
+      return "missing";
+  }
+  return "";
+}
+
+std::string make_page(std::size_t size, Placement placement) {
+  constexpr std::string_view kRow =
+      "<div class=\"row\"><span>lorem ipsum dolor sit amet</span></div>\n";
+  std::string page = "<!DOCTYPE html>\n<html>\n";
+  if (placement == Placement::start) {
+    page += "<head><title>bench</title></head>\n";
+  }
+  while (page.size() < size) {
+    if (placement == Placement::late && page.size() >= size / 10 * 9) {
+      page += "<head><title>bench</title></head>\n";
+      placement = Placement::start;
+    }
+    page += kRow;
+  }
+  return page;
+}
+
+struct Result {
+  double ms_per_page;
+  std::size_t pool_bytes;
+  std::size_t links;
+};
+
+// Filters the page once. The buffers are refilled from the page the way an
+// upstream reuses its buffers, so recycled buffers really are overwritten.
+bool filter_page(const std::string &page, const datadog_loc_conf_t &conf,
+                 std::size_t buffer_size, bool recycled, Result &result) {
+  ngx_log_t log{};
+  ngx_connection_t connection{};
+  connection.log = &log;
+  ngx_pool_t pool{};
+  pool.log = &log;
+
+  ngx_http_request_t request{};
+  request.connection = &connection;
+  request.pool = &pool;
+  ngx_str_set(&request.headers_out.content_type, "text/html");
+  request.headers_out.content_length_n = static_cast<off_t>(page.size());
+
+  auto *cfg = const_cast<datadog_loc_conf_t *>(&conf);
+  ngx_http_output_body_filter_pt body_filter = next_body_filter;
+
+  // a recycled buffer is refilled once consumed; the others are allocated
+  // by the upstream for each read
+  std::vector<u_char> memory(recycled ? buffer_size : page.size());
+
+  arena.reset();
+  sent = {};
+  auto const start = std::chrono::steady_clock::now();
+  {
+    rum::InjectionHandler handler;
+    if (handler.on_header_filter(&request, cfg) != NGX_OK) {
+      return false;
+    }
+
+    for (std::size_t off = 0; off < page.size(); off += buffer_size) {
+      std::size_t const n = std::min(buffer_size, page.size() - off);
+      u_char *data = memory.data() + (recycled ? 0 : off);
+      std::memcpy(data, page.data() + off, n);
+
+      ngx_buf_t buf{};
+      buf.start = data;
+      buf.pos = data;
+      buf.last = data + n;
+      buf.end = data + n;
+      buf.memory = 1;
+      buf.recycled = recycled;
+      buf.last_buf = off + n == page.size();
+      ngx_chain_t cl{&buf, nullptr};
+
+      if (handler.on_body_filter(&request, cfg, &cl, body_filter) != NGX_OK) {
+        return false;
+      }
+    }
+  }
+  std::chrono::duration<double, std::milli> const elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  result.ms_per_page += elapsed.count();
+  result.pool_bytes = arena.bytes;
+  result.links = sent.links;
+  return sent.last_buf &&
+         sent.bytes == page.size() + conf.rum_snippet->length;
+}
+
+}  // namespace
+
+// Link seams: the request pool and the few nginx functions the filter calls.
+extern "C" {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+ngx_module_t ngx_http_datadog_module;
+
+void *ngx_palloc(ngx_pool_t *, size_t size) { return arena.alloc(size); }
+
+void *ngx_pnalloc(ngx_pool_t *, size_t size) { return arena.alloc(size); }
+
+void *ngx_pcalloc(ngx_pool_t *, size_t size) {
+  void *p = arena.alloc(size);
+  if (p != nullptr) {
+    std::memset(p, 0, size);
+  }
+  return p;
+}
+
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *) {
+  return static_cast<ngx_chain_t *>(arena.alloc(sizeof(ngx_chain_t)));
+}
+
+void *ngx_list_push(ngx_list_t *) {
+  return arena.alloc(sizeof(ngx_table_elt_t));
+}
+
+ngx_int_t ngx_strcasecmp(u_char *s1, u_char *s2) {
+  return strcasecmp(reinterpret_cast<char *>(s1),
+                    reinterpret_cast<char *>(s2));
+}
+
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n) {
+  return strncasecmp(reinterpret_cast<char *>(s1),
+                     reinterpret_cast<char *>(s2), n);
+}
+
+// only reached for gzip encoded pages, which the benchmark does not make
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *, size_t) { return nullptr; }
+
+void ngx_chain_update_chains(ngx_pool_t *, ngx_chain_t **, ngx_chain_t **,
+                             ngx_chain_t **, ngx_buf_tag_t) {}
+
+void ngx_http_weak_etag(ngx_http_request_t *) {}
+
+// every page of the benchmark is text/html
+void *ngx_http_test_content_type(ngx_http_request_t *r, ngx_hash_t *) {
+  return &r->headers_out.content_type;
+}
+
+void ngx_log_error_core(ngx_uint_t, ngx_log_t *, ngx_err_t, const char *,
+                        ...) {}
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::size_t> sizes_mib;
+  int iterations = 20;
+  std::size_t buffer_size = 32 * 1024;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view const arg{argv[i]};
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = std::atoi(argv[++i]);
+    } else if (arg == "--buffer-size" && i + 1 < argc) {
+      buffer_size = std::strtoul(argv[++i], nullptr, 10);
+    } else if (!arg.starts_with("--")) {
+      sizes_mib.push_back(std::strtoul(argv[i], nullptr, 10));
+    } else {
+      std::fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (sizes_mib.empty()) {
+    sizes_mib = {1, 4, 16};
+  }
+  if (iterations <= 0 || buffer_size == 0) {
+    std::fprintf(stderr, "invalid number of iterations or buffer size\n");
+    return 1;
+  }
+
+  Snippet *snippet = snippet_create_from_json(std::string{kRumConfig}.c_str());
+  if (snippet->error_code) {
+    std::fprintf(stderr, "cannot create the snippet: %s\n",
+                 snippet->error_message);
+    return 1;
+  }
+
+  datadog_loc_conf_t conf;
+  conf.rum_enable = 1;
+  conf.rum_snippet = snippet;
+  conf.rum_snippet_content = rum::InjectionHandler::locate_snippet(snippet);
+  conf.rum_gzip = 0;
+  conf.rum_gzip_comp_level = 1;
+
+  std::printf("%8s %8s %9s %10s %10s %12s %8s\n", "MiB", "point", "recycled",
+              "ms/page", "MB/s", "pool KiB", "links");
+  for (std::size_t mib : sizes_mib) {
+    for (Placement placement :
+         {Placement::start, Placement::late, Placement::missing}) {
+      std::string const page = make_page(mib << 20, placement);
+      for (bool recycled : {false, true}) {
+        Result result{};
+        bool ok = filter_page(page, conf, buffer_size, recycled, result);
+        result.ms_per_page = 0;  // warm up
+        for (int i = 0; ok && i < iterations; i++) {
+          ok = filter_page(page, conf, buffer_size, recycled, result);
+        }
+        arena.reset();
+        if (!ok) {
+          std::fprintf(stderr, "unexpected output for %zu MiB, %s\n", mib,
+                       to_string(placement));
+          return 1;
+        }
+
+        double const ms = result.ms_per_page / iterations;
+        std::printf("%8zu %8s %9s %10.3f %10.1f %12.1f %8zu\n", mib,
+                    to_string(placement), recycled ? "yes" : "no", ms,
+                    static_cast<double>(page.size()) / 1e3 / ms,
+                    static_cast<double>(result.pool_bytes) / 1024,
+                    result.links);
+      }
+    }
+  }
+  return 0;
+}
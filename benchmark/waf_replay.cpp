@@ -0,0 +1,562 @@
+// Replays recorded requests through the WAF outside of nginx, to vet rulesets
+// and custom rules before they are rolled out. Each request is turned into an
+// ngx_http_request_t and serialized by the module's own code
+// (collect_request_data() and RequestBodyCollector), then evaluated with
+// ddwaf_run(), as in the initial and body WAF runs of a request. Serialization
+// and evaluation are timed separately.
+//
+// With --ablate, the cost of each rule of the ruleset is estimated by
+// disabling it (a rules_override applied with ddwaf_update()) and measuring
+// how much less time the corpus takes to evaluate. Each configuration keeps
+// its fastest pass; estimates close to zero are within the noise.
+//
+// The corpus is JSONL, one request per line; only "uri" is required:
+//   {"method": "POST", "uri": "/path?a=b", "client_ip": "1.2.3.4",
+//    "headers": {"content-type": "application/json"},
+//    "body": "{\"a\": 1}"}
+// "headers" can also be a list of [name, value] pairs, for repeated headers.
+//
+// usage: waf_replay [--ruleset file.json] [--iterations n] [--timeout-us n]
+//                   [--ablate top_n] [corpus.jsonl]
+
+#include <arpa/inet.h>
+#include <rapidjson/document.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "body_collector.h"
+#include "client_ip.h"
+#include "collection.h"
+#include "ddwaf_memres.h"
+#include "ddwaf_obj.h"
+#include "json_parser.h"
+#include "library.h"
+#include "util.h"
+
+namespace dnsec = datadog::nginx::security;
+using namespace std::literals;
+
+// Link seams. Neither library.cpp, which needs the whole module, nor the nginx
+// core are linked in; these are the only symbols the replayed code needs from
+// them.
+
+namespace datadog::nginx::security {
+std::optional<HashedStringView> Library::custom_ip_header() {
+  return std::nullopt;
+}
+}  // namespace datadog::nginx::security
+
+extern "C" ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n) {
+  // as in src/core/ngx_string.c
+  while (n-- > 0) {
+    ngx_uint_t c1 = *s1++;
+    ngx_uint_t c2 = *s2++;
+    c1 = (c1 >= 'A' && c1 <= 'Z') ? (c1 | 0x20) : c1;
+    c2 = (c2 >= 'A' && c2 <= 'Z') ? (c2 | 0x20) : c2;
+    if (c1 != c2) {
+      return static_cast<ngx_int_t>(c1) - static_cast<ngx_int_t>(c2);
+    }
+    if (c1 == 0) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// the module's defaults
+constexpr std::uint64_t kDefaultTimeoutUs = 1000000;
+constexpr dnsec::RequestBodyCollector::Limits kBodyLimits{
+    .max_bytes = 64 * 1024,
+    .max_fields = 256,
+};
+
+struct Options {
+  const char *ruleset = DEFAULT_RULESET;
+  const char *corpus = DEFAULT_CORPUS;
+  int iterations = 100;
+  std::uint64_t timeout_us = kDefaultTimeoutUs;
+  std::size_t ablate_top = 0;  // 0: no ablation
+};
+
+std::string read_file(const char *path) {
+  std::ifstream in{path, std::ios::binary};
+  if (!in) {
+    throw std::runtime_error{std::string{"cannot open "} + path};
+  }
+  return {std::istreambuf_iterator<char>{in}, {}};
+}
+
+std::string_view json_str(const rapidjson::Value &v) {
+  if (!v.IsString()) {
+    throw std::invalid_argument{"expected a string"};
+  }
+  return {v.GetString(), v.GetStringLength()};
+}
+
+// nginx 1.23.0+ links the cookie headers together; before, there is no
+// headers_in.cookie, and the serializer looks for them in the list
+template <typename HeadersIn, typename Elt>
+void link_cookie(HeadersIn &headers_in, Elt *&last, Elt &elt) {
+  if constexpr (requires { headers_in.cookie; }) {
+    if (last == nullptr) {
+      headers_in.cookie = &elt;
+    } else {
+      last->next = &elt;
+    }
+  }
+  last = &elt;
+}
+
+// A request as the module sees it: the nginx structures the serializers read,
+// pointing into strings owned by this object, which therefore can't be moved.
+class ReplayRequest {
+ public:
+  explicit ReplayRequest(const rapidjson::Value &line) {
+    if (!line.IsObject() || !line.HasMember("uri")) {
+      throw std::invalid_argument{"not an object with an uri"};
+    }
+    method_ = line.HasMember("method") ? json_str(line["method"]) : "GET"sv;
+    uri_ = json_str(line["uri"]);
+    if (line.HasMember("body")) {
+      body_ = json_str(line["body"]);
+    }
+    if (line.HasMember("headers")) {
+      add_headers(line["headers"]);
+    }
+    set_client_ip(line.HasMember("client_ip") ? json_str(line["client_ip"])
+                                              : "127.0.0.1"sv);
+    build_request();
+  }
+
+  ReplayRequest(const ReplayRequest &) = delete;
+  ReplayRequest &operator=(const ReplayRequest &) = delete;
+
+  const ngx_http_request_t &get() const noexcept { return request_; }
+  std::string_view body() const noexcept { return body_; }
+
+ private:
+  struct Header {
+    std::string key;
+    std::string lc_key;
+    std::string value;
+  };
+
+  void add_headers(const rapidjson::Value &headers) {
+    if (headers.IsObject()) {
+      for (auto &&m : headers.GetObject()) {
+        add_header(json_str(m.name), json_str(m.value));
+      }
+    } else if (headers.IsArray()) {
+      for (auto &&pair : headers.GetArray()) {
+        if (!pair.IsArray() || pair.Size() != 2) {
+          throw std::invalid_argument{"expected a [name, value] pair"};
+        }
+        add_header(json_str(pair[0]), json_str(pair[1]));
+      }
+    } else {
+      throw std::invalid_argument{"headers must be an object or an array"};
+    }
+  }
+
+  void add_header(std::string_view key, std::string_view value) {
+    std::string lc{key};
+    std::transform(lc.begin(), lc.end(), lc.begin(), [](char c) {
+      return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+    });
+    headers_.push_back({std::string{key}, std::move(lc), std::string{value}});
+  }
+
+  void set_client_ip(std::string_view ip) {
+    std::string const ip_str{ip};
+    auto *v4 = reinterpret_cast<sockaddr_in *>(&addr_);  // NOLINT
+    auto *v6 = reinterpret_cast<sockaddr_in6 *>(&addr_);  // NOLINT
+    if (inet_pton(AF_INET, ip_str.c_str(), &v4->sin_addr) == 1) {
+      v4->sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, ip_str.c_str(), &v6->sin6_addr) == 1) {
+      v6->sin6_family = AF_INET6;
+    } else {
+      throw std::invalid_argument{"invalid client_ip"};
+    }
+  }
+
+  // the headers can't be added to once this is called
+  void build_request() {
+    request_.method_name = dnsec::ngx_stringv(method_);
+    request_.unparsed_uri = dnsec::ngx_stringv(uri_);
+    if (auto q = uri_.find('?'); q != std::string::npos) {
+      request_.args = dnsec::ngx_stringv(std::string_view{uri_}.substr(q + 1));
+    }
+
+    elts_.resize(headers_.size());
+    ngx_table_elt_t *last_cookie = nullptr;
+    for (std::size_t i = 0; i < headers_.size(); i++) {
+      Header &h = headers_[i];
+      ngx_table_elt_t &elt = elts_[i];
+      elt.hash = dnsec::ngx_hash_ce(h.lc_key);
+      elt.key = dnsec::ngx_stringv(h.key);
+      elt.value = dnsec::ngx_stringv(h.value);
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      elt.lowcase_key = reinterpret_cast<u_char *>(h.lc_key.data());
+
+      if (h.lc_key == "content-type"sv) {
+        request_.headers_in.content_type = &elt;
+      } else if (h.lc_key == "cookie"sv) {
+        link_cookie(request_.headers_in, last_cookie, elt);
+      }
+    }
+
+    ngx_list_t &list = request_.headers_in.headers;
+    list.part.elts = elts_.data();
+    list.part.nelts = elts_.size();
+    list.part.next = nullptr;
+    list.last = &list.part;
+    list.size = sizeof(ngx_table_elt_t);
+    list.nalloc = elts_.size();
+
+    request_.headers_in.content_length_n =
+        body_.empty() ? -1 : static_cast<off_t>(body_.size());
+
+    connection_.sockaddr = reinterpret_cast<sockaddr *>(&addr_);  // NOLINT
+    connection_.socklen = sizeof(addr_);
+    request_.connection = &connection_;
+  }
+
+  std::string method_;
+  std::string uri_;
+  std::string body_;
+  std::vector<Header> headers_;
+  std::vector<ngx_table_elt_t> elts_;
+  sockaddr_storage addr_{};
+  ngx_connection_t connection_{};
+  ngx_http_request_t request_{};
+};
+
+std::vector<std::unique_ptr<ReplayRequest>> read_corpus(const char *path) {
+  std::ifstream in{path};
+  if (!in) {
+    throw std::runtime_error{std::string{"cannot open "} + path};
+  }
+
+  std::vector<std::unique_ptr<ReplayRequest>> corpus;
+  std::string line;
+  for (std::size_t line_no = 1; std::getline(in, line); line_no++) {
+    if (line.empty()) {
+      continue;
+    }
+    rapidjson::Document doc;
+    doc.Parse(line.data(), line.size());
+    try {
+      if (doc.HasParseError()) {
+        throw std::invalid_argument{"invalid JSON"};
+      }
+      corpus.push_back(std::make_unique<ReplayRequest>(doc));
+    } catch (const std::invalid_argument &e) {
+      throw std::runtime_error{std::string{path} + ":" +
+                               std::to_string(line_no) + ": " + e.what()};
+    }
+  }
+  return corpus;
+}
+
+// the WAF inputs of a request, as given to the initial and body WAF runs
+struct Serialized {
+  dnsec::DdwafMemres memres;
+  ddwaf_object *request_data{};
+  ddwaf_object *body_data{};  // nullptr without an inspectable body
+};
+
+void serialize(const ReplayRequest &req, Serialized &out) {
+  // resolved once per request by the module too
+  auto client_ip =
+      dnsec::ClientIp{dnsec::Library::custom_ip_header(), req.get()}.resolve();
+  out.request_data =
+      dnsec::collect_request_data(req.get(), out.memres, client_ip);
+  auto collector = dnsec::RequestBodyCollector::maybe_create(
+      req.get(), out.memres, kBodyLimits);
+  if (collector) {
+    collector->feed(req.body());
+    collector->finish();
+    if (!collector->empty()) {
+      out.body_data = collector->to_waf_input();
+    }
+  }
+}
+
+struct EvalStats {
+  std::size_t matches{};
+  std::size_t timeouts{};
+  std::map<std::string, std::size_t, std::less<>> rule_hits;
+};
+
+void count_rule_hits(const ddwaf_object &events, EvalStats &stats) {
+  if (events.type != DDWAF_OBJ_ARRAY) {
+    return;
+  }
+  for (auto &&event : dnsec::ddwaf_arr_obj{events}) {
+    if (event.type != DDWAF_OBJ_MAP) {
+      continue;
+    }
+    auto rule = dnsec::ddwaf_map_obj{event}.get_opt("rule"sv);
+    if (!rule || rule->type != DDWAF_OBJ_MAP) {
+      continue;
+    }
+    auto id = dnsec::ddwaf_map_obj{*rule}.get_opt("id"sv);
+    if (id && id->type == DDWAF_OBJ_STRING) {
+      stats.rule_hits[std::string{dnsec::ddwaf_str_obj{*id}.value()}]++;
+    }
+  }
+}
+
+// one request, in a context of its own; stats are optional
+void evaluate(ddwaf_handle handle, const Serialized &s,
+              std::uint64_t timeout_us, EvalStats *stats) {
+  ddwaf_context ctx = ddwaf_context_init(handle);
+  if (ctx == nullptr) {
+    throw std::runtime_error{"ddwaf_context_init failed"};
+  }
+
+  bool matched = false;
+  for (ddwaf_object *data : {s.request_data, s.body_data}) {
+    if (data == nullptr) {
+      continue;
+    }
+    ddwaf_result result;
+    DDWAF_RET_CODE const code =
+        ddwaf_run(ctx, data, nullptr, &result, timeout_us);
+    if (stats != nullptr) {
+      if (result.timeout) {
+        stats->timeouts++;
+      }
+      if (code == DDWAF_MATCH) {
+        matched = true;
+        count_rule_hits(result.events, *stats);
+      }
+    }
+    ddwaf_result_free(&result);
+  }
+  if (stats != nullptr && matched) {
+    stats->matches++;
+  }
+
+  ddwaf_context_destroy(ctx);
+}
+
+// the fastest of `iterations` passes over the corpus
+Clock::duration best_pass(ddwaf_handle handle,
+                          const std::vector<Serialized> &serialized,
+                          const Options &opts) {
+  auto best = Clock::duration::max();
+  for (int i = 0; i < opts.iterations; i++) {
+    auto const start = Clock::now();
+    for (auto &&s : serialized) {
+      evaluate(handle, s, opts.timeout_us, nullptr);
+    }
+    best = std::min(best, Clock::now() - start);
+  }
+  return best;
+}
+
+double to_us(Clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void print_latencies(const char *name, std::vector<double> &us) {
+  std::sort(us.begin(), us.end());
+  auto at = [&](double q) {
+    auto const i = static_cast<std::size_t>(q * static_cast<double>(us.size()));
+    return us[std::min(i, us.size() - 1)];
+  };
+  double total = 0;
+  for (double v : us) {
+    total += v;
+  }
+  std::printf("%-14s %10.1f %10.1f %10.1f %10.1f %12.0f\n", name, at(0.5),
+              at(0.9), at(0.99), us.back(),
+              static_cast<double>(us.size()) / (total / 1e6));
+}
+
+ddwaf_handle init_waf(const dnsec::ddwaf_map_obj &ruleset) {
+  ddwaf_config config = dnsec::kBaseWafConfig;
+  ddwaf_handle handle = ddwaf_init(&ruleset, &config, nullptr);
+  if (handle == nullptr) {
+    throw std::runtime_error{"ddwaf_init failed"};
+  }
+  return handle;
+}
+
+// {"rules_override": [{"rules_target": [{"rule_id": id}], "enabled": false}]}
+ddwaf_handle without_rule(ddwaf_handle base, std::string_view rule_id) {
+  dnsec::DdwafMemres memres;
+  dnsec::ddwaf_obj root;
+  dnsec::ddwaf_map_obj &root_map = root.make_map(1, memres);
+  dnsec::ddwaf_obj &overrides = root_map.at_unchecked(0);
+  overrides.set_key("rules_override"sv);
+  dnsec::ddwaf_obj &ovr = overrides.make_array(1, memres).at_unchecked(0);
+  dnsec::ddwaf_map_obj &ovr_map = ovr.make_map(2, memres);
+
+  dnsec::ddwaf_obj &target = ovr_map.at_unchecked(0);
+  target.set_key("rules_target"sv);
+  dnsec::ddwaf_obj &spec = target.make_array(1, memres).at_unchecked(0);
+  dnsec::ddwaf_obj &id = spec.make_map(1, memres).at_unchecked(0);
+  id.set_key("rule_id"sv).make_string(rule_id);
+  ovr_map.at_unchecked(1).set_key("enabled"sv).make_bool(false);
+
+  ddwaf_handle handle = ddwaf_update(base, &root, nullptr);
+  if (handle == nullptr) {
+    throw std::runtime_error{"ddwaf_update failed for rule " +
+                             std::string{rule_id}};
+  }
+  return handle;
+}
+
+void ablate(ddwaf_handle base, const dnsec::ddwaf_map_obj &ruleset,
+            const std::vector<Serialized> &serialized, const Options &opts) {
+  auto rules = ruleset.get_opt<dnsec::ddwaf_arr_obj>("rules"sv);
+  if (!rules) {
+    std::printf("\nno rules to ablate\n");
+    return;
+  }
+
+  double const base_us = to_us(best_pass(base, serialized, opts));
+  std::vector<std::pair<double, std::string_view>> costs;
+  for (auto &&rule : *rules) {
+    if (rule.type != DDWAF_OBJ_MAP) {
+      continue;
+    }
+    auto id = dnsec::ddwaf_map_obj{rule}.get_opt("id"sv);
+    if (!id || id->type != DDWAF_OBJ_STRING) {
+      continue;
+    }
+    std::string_view const rule_id = dnsec::ddwaf_str_obj{*id}.value();
+    ddwaf_handle handle = without_rule(base, rule_id);
+    double const us = to_us(best_pass(handle, serialized, opts));
+    ddwaf_destroy(handle);
+    costs.emplace_back(base_us - us, rule_id);
+  }
+
+  std::sort(costs.begin(), costs.end(),
+            [](auto &&a, auto &&b) { return a.first > b.first; });
+  auto const per_request = static_cast<double>(serialized.size());
+  std::printf("\nper-rule cost by ablation (us per request; corpus: %.1f)\n",
+              base_us / per_request);
+  std::printf("%-32s %10s %8s\n", "rule", "cost_us", "share");
+  for (std::size_t i = 0; i < costs.size() && i < opts.ablate_top; i++) {
+    auto &&[cost, rule_id] = costs[i];
+    std::printf("%-32.*s %10.2f %7.1f%%\n", static_cast<int>(rule_id.size()),
+                rule_id.data(), cost / per_request, 100.0 * cost / base_us);
+  }
+}
+
+bool parse_args(int argc, char **argv, Options &opts) {
+  for (int i = 1; i < argc; i++) {
+    std::string_view const arg{argv[i]};
+    bool const has_value = i + 1 < argc;
+    if (arg == "--ruleset"sv && has_value) {
+      opts.ruleset = argv[++i];
+    } else if (arg == "--iterations"sv && has_value) {
+      opts.iterations = std::atoi(argv[++i]);
+    } else if (arg == "--timeout-us"sv && has_value) {
+      opts.timeout_us = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--ablate"sv && has_value) {
+      opts.ablate_top = std::strtoul(argv[++i], nullptr, 10);
+    } else if (!arg.starts_with("--"sv)) {
+      opts.corpus = argv[i];
+    } else {
+      return false;
+    }
+  }
+  return opts.iterations > 0 && opts.timeout_us > 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) try {
+  Options opts;
+  if (!parse_args(argc, argv, opts)) {
+    std::fprintf(stderr,
+                 "usage: %s [--ruleset file.json] [--iterations n] "
+                 "[--timeout-us n] [--ablate top_n] [corpus.jsonl]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  // parsed as the module parses rulesets (see Library)
+  auto ruleset_obj =
+      dnsec::parse_json(read_file(opts.ruleset), dnsec::kConfigJsonLimits);
+  if (ruleset_obj.get().type != DDWAF_OBJ_MAP) {
+    throw std::runtime_error{"the ruleset is not a JSON object"};
+  }
+  dnsec::ddwaf_map_obj const ruleset{ruleset_obj.get()};
+  ddwaf_handle handle = init_waf(ruleset);
+
+  auto const corpus = read_corpus(opts.corpus);
+  if (corpus.empty()) {
+    throw std::runtime_error{"empty corpus"};
+  }
+
+  std::vector<double> ser_us;
+  std::vector<double> eval_us;
+  ser_us.reserve(corpus.size() * opts.iterations);
+  eval_us.reserve(corpus.size() * opts.iterations);
+  EvalStats stats;
+  // the inputs of the last pass are kept for the ablation
+  std::vector<Serialized> serialized(corpus.size());
+
+  // the first pass warms up and collects the matches
+  for (int it = 0; it <= opts.iterations; it++) {
+    for (std::size_t i = 0; i < corpus.size(); i++) {
+      serialized[i] = Serialized{};
+      auto const t0 = Clock::now();
+      serialize(*corpus[i], serialized[i]);
+      auto const t1 = Clock::now();
+      evaluate(handle, serialized[i], opts.timeout_us,
+               it == 0 ? &stats : nullptr);
+      auto const t2 = Clock::now();
+      if (it > 0) {
+        ser_us.push_back(to_us(t1 - t0));
+        eval_us.push_back(to_us(t2 - t1));
+      }
+    }
+  }
+
+  std::printf("ruleset %s, %zu requests, %d iterations\n", opts.ruleset,
+              corpus.size(), opts.iterations);
+  std::printf("%-14s %10s %10s %10s %10s %12s\n", "", "p50_us", "p90_us",
+              "p99_us", "max_us", "req/s");
+  print_latencies("serialization", ser_us);
+  print_latencies("evaluation", eval_us);
+  std::printf("\n%zu of %zu requests matched, %zu WAF runs timed out\n",
+              stats.matches, corpus.size(), stats.timeouts);
+  for (auto &&[rule_id, hits] : stats.rule_hits) {
+    std::printf("  %-32s %zu\n", rule_id.c_str(), hits);
+  }
+
+  if (opts.ablate_top > 0) {
+    ablate(handle, ruleset, serialized, opts);
+  }
+
+  ddwaf_destroy(handle);
+  return 0;
+} catch (const std::exception &e) {
+  std::fprintf(stderr, "%s\n", e.what());
+  return 1;
+}
@@ -111,6 +111,17 @@ struct datadog_main_conf_t {
   std::optional<configured_value_t> environment;
   // `agent_url` is set by the `datadog_agent_url` directive.
   std::optional<configured_value_t> agent_url;
+  // Shared memory zone with the trace chunks of all workers. Set by the
+  // `datadog_trace_ring_zone` directive; each worker sends its own traces if
+  // null.
+  ngx_shm_zone_t *trace_ring_zone{nullptr};
+  // Per-worker memory budget of the traces waiting to be sent to the agent.
+  // Set by the `datadog_trace_queue_size` directive; dd-trace-cpp buffers
+  // them without a limit if unset.
+  size_t trace_queue_size{NGX_CONF_UNSET_SIZE};
+  // What is dropped once the budget is reached: oldest or lowest_priority.
+  // See TraceQueue::drop_policy.
+  ngx_uint_t trace_queue_drop{NGX_CONF_UNSET_UINT};
 
 #ifdef WITH_WAF
   // DD_APPSEC_ENABLED
@@ -142,6 +153,60 @@ struct datadog_main_conf_t {
   // DD_APPSEC_OBFUSCATION_PARAMETER_VALUE_REGEXP
   ngx_str_t appsec_obfuscation_value_regex = ngx_null_string;
 
+  // Shared memory zone with the per-client WAF match counters. Set by the
+  // `datadog_appsec_throttle_zone` directive; throttling is disabled if null.
+  ngx_shm_zone_t *appsec_throttle_zone{nullptr};
+
+  // Number of requests with WAF matches in a window after which a client is
+  // throttled (default: 10)
+  ngx_int_t appsec_throttle_threshold{NGX_CONF_UNSET};
+
+  // Length of the counting window, in seconds (default: 60)
+  time_t appsec_throttle_window{NGX_CONF_UNSET};
+
+  // What to do with throttled clients: block (403 with the blocking template)
+  // or rate_limit (429 without body). See ClientThrottle::action.
+  ngx_uint_t appsec_throttle_action{NGX_CONF_UNSET_UINT};
+
+  // Shared memory zone through which the first worker relays the WAF remote
+  // configuration to the others. Set by the `datadog_appsec_remote_config_zone`
+  // directive; each worker polls the agent itself if null.
+  ngx_shm_zone_t *appsec_remote_config_zone{nullptr};
+
+  // Maximum number of "no match" WAF verdicts cached per worker. The cache is
+  // disabled unless this is set to a positive value.
+  ngx_int_t appsec_verdict_cache_size{NGX_CONF_UNSET};
+
+  // Number of bytes of urlencoded, multipart and JSON request bodies given to
+  // the WAF (default: 64k). 0 disables request body inspection.
+  size_t appsec_max_body_size{NGX_CONF_UNSET_SIZE};
+
+  // Maximum number of request body fields given to the WAF (default: 256)
+  ngx_int_t appsec_max_body_fields{NGX_CONF_UNSET};
+
+  // Number of bytes at the start of JSON and HTML response bodies given to
+  // the WAF (default: 0, response bodies are not inspected)
+  size_t appsec_max_response_body_size{NGX_CONF_UNSET_SIZE};
+
+  // Whether the final WAF run is queued to a batch drained by the thread pool
+  // instead of holding the request (default: off)
+  ngx_flag_t appsec_async_final_waf_run{NGX_CONF_UNSET};
+
+  // Maximum size of the _dd.appsec.json span tag (default: 32k). Events that
+  // do not fit are dropped.
+  size_t appsec_max_event_json_size{NGX_CONF_UNSET_SIZE};
+
+  // Maximum number of appsec event lines written to the error log per second
+  // and per worker (default: 100). 0 disables logging the events.
+  ngx_int_t appsec_event_log_rate{NGX_CONF_UNSET};
+
+  // Whether the WAF extracts the API schema of sampled requests (default: off)
+  ngx_flag_t appsec_api_security{NGX_CONF_UNSET};
+
+  // Minimum time between two schema extractions for the same method, route and
+  // status code, in seconds (default: 30)
+  time_t appsec_api_security_sample_delay{NGX_CONF_UNSET};
+
   // TODO: missing settings and their functionality
   // DD_TRACE_CLIENT_IP_RESOLVER_ENABLED (whether to collect headers and run the
   // client ip resolution. Also requires AppSec to be enabled or
@@ -150,6 +215,12 @@ struct datadog_main_conf_t {
   // DD_APPSEC_WAF_METRICS
   // DD_APPSEC_REPORT_TIMEOUT
 #endif
+
+#ifdef WITH_RUM
+  // Maximum number of RUM injection offsets cached per worker. The cache is
+  // disabled unless this is set to a positive value.
+  ngx_int_t rum_offset_cache_size{NGX_CONF_UNSET};
+#endif
 };
 
 struct datadog_sample_rate_condition_t {
@@ -224,11 +295,26 @@ struct datadog_loc_conf_t {
 
 #ifdef WITH_WAF
   ngx_thread_pool_t *waf_pool{nullptr};
+  // WAF time budget of the requests handled in this location, from the start
+  // of the request; unset to give each WAF run datadog_appsec_waf_timeout
+  ngx_msec_t appsec_waf_budget{NGX_CONF_UNSET_MSEC};
 #endif
 
 #ifdef WITH_RUM
   ngx_flag_t rum_enable;
   Snippet *rum_snippet;
+  // where the injector outputs the snippet from; see
+  // InjectionHandler::locate_snippet
+  ngx_str_t rum_snippet_content;
+  // whether to inject in gzip encoded responses, and the level used to
+  // compress them again
+  ngx_flag_t rum_gzip;
+  ngx_int_t rum_gzip_comp_level;
+  // MIME types the SDK is injected in (default: text/html)
+  ngx_hash_t rum_types;
+  ngx_array_t *rum_types_keys;
+  // whether to add a span around each step of the injection
+  ngx_flag_t rum_debug_spans;
 #endif
 };
 
@@ -19,30 +19,10 @@ namespace nginx {
 
 DatadogContext::DatadogContext(ngx_http_request_t *request,
                                ngx_http_core_loc_conf_t *core_loc_conf,
-                               datadog_loc_conf_t *loc_conf)
-#ifdef WITH_WAF
-    : sec_ctx_{security::Context::maybe_create()}
-#endif
-{
+                               datadog_loc_conf_t *loc_conf) {
   if (loc_conf->enable) {
     traces_.emplace_back(request, core_loc_conf, loc_conf);
   }
-
-#ifdef WITH_RUM
-  if (loc_conf->rum_enable) {
-    auto *trace = find_trace(request);
-    if (trace != nullptr) {
-      auto rum_span = trace->active_span().create_child();
-      rum_span.set_name("rum_sdk_injection.on_rewrite_handler");
-      auto status = rum_ctx_.on_rewrite_handler(request);
-      if (status == NGX_ERROR) {
-        rum_span.set_error(true);
-      }
-    } else {
-      rum_ctx_.on_rewrite_handler(request);
-    }
-  }
-#endif
 }
 
 void DatadogContext::on_change_block(ngx_http_request_t *request,
@@ -64,13 +44,41 @@ void DatadogContext::on_change_block(ngx_http_request_t *request,
 #ifdef WITH_WAF
 bool DatadogContext::on_main_req_access(ngx_http_request_t *request) {
   if (!sec_ctx_) {
-    return false;
+    // The security context (and its ddwaf context) is only created once we
+    // know the request ended up in a location where the WAF runs. See
+    // merge_datadog_loc_conf for how waf_pool is decided.
+    auto *loc_conf = static_cast<datadog_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(request, ngx_http_datadog_module));
+    if (loc_conf == nullptr || loc_conf->waf_pool == nullptr) {
+      return false;
+    }
+
+    sec_ctx_ = security::Context::maybe_create();
+    if (!sec_ctx_) {
+      return false;
+    }
   }
 
   // there should only one trace at this point
   dd::Span &span = single_trace().active_span();
   return sec_ctx_->on_request_start(*request, span);
 }
+
+ngx_int_t DatadogContext::on_request_body_filter(ngx_http_request_t *request,
+                                                 ngx_chain_t *chain) {
+  if (!sec_ctx_) {
+    return ngx_http_next_request_body_filter(request, chain);
+  }
+
+  auto *trace = find_trace(request);
+  if (trace == nullptr) {
+    throw std::runtime_error{
+        "on_request_body_filter: could not find request trace"};
+  }
+
+  dd::Span &span = trace->active_span();
+  return sec_ctx_->request_body_filter(*request, chain, span);
+}
 #endif
 
 ngx_int_t DatadogContext::on_header_filter(ngx_http_request_t *request) {
@@ -84,17 +92,20 @@ ngx_int_t DatadogContext::on_header_filter(ngx_http_request_t *request) {
 
 #ifdef WITH_RUM
   if (loc_conf->rum_enable) {
-    auto *trace = find_trace(request);
+    ngx_int_t status;
+    auto *trace = loc_conf->rum_debug_spans ? find_trace(request) : nullptr;
     if (trace != nullptr) {
       auto rum_span = trace->active_span().create_child();
       rum_span.set_name("rum_sdk_injection.on_header");
-      auto status = rum_ctx_.on_header_filter(request, loc_conf,
-                                              ngx_http_next_header_filter);
+      status = rum_ctx_.on_header_filter(request, loc_conf);
       if (status == NGX_ERROR) {
         rum_span.set_error(true);
       }
     } else {
-      rum_ctx_.on_header_filter(request, loc_conf, ngx_http_next_header_filter);
+      status = rum_ctx_.on_header_filter(request, loc_conf);
+    }
+    if (status == NGX_ERROR) {
+      return NGX_ERROR;
     }
   }
 #endif
@@ -129,7 +140,7 @@ ngx_int_t DatadogContext::on_output_body_filter(ngx_http_request_t *request,
 #ifdef WITH_RUM
   // TODO: If WAF is blocking, no need to inject the RUM SDK.
   if (loc_conf->rum_enable) {
-    auto *trace = find_trace(request);
+    auto *trace = loc_conf->rum_debug_spans ? find_trace(request) : nullptr;
     if (trace != nullptr) {
       auto rum_span = trace->active_span().create_child();
       rum_span.set_name("rum_sdk_injection.on_body_filter");
@@ -37,6 +37,9 @@ class DatadogContext {
 
 #ifdef WITH_WAF
   bool on_main_req_access(ngx_http_request_t* request);
+
+  ngx_int_t on_request_body_filter(ngx_http_request_t* request,
+                                   ngx_chain_t* chain);
 #endif
 
   ngx_int_t on_header_filter(ngx_http_request_t* request);
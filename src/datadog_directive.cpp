@@ -16,8 +16,15 @@
 #include "ngx_logger.h"
 #include "ngx_script.h"
 #include "string_util.h"
+#include "trace_ring.h"
 #include "tracing_library.h"
 
+#ifdef WITH_WAF
+#include "security/client_throttle.h"
+#include "security/remote_cfg_relay.h"
+#include "security/waf_telemetry.h"
+#endif
+
 extern "C" {
 #include <ngx_thread_pool.h>
 }
@@ -497,6 +504,38 @@ char *set_datadog_agent_url(ngx_conf_t *cf, ngx_command_t *command,
       });
 }
 
+char *set_trace_ring_zone(ngx_conf_t *cf, ngx_command_t *command,
+                          void *conf) noexcept {
+  auto *main_conf = static_cast<datadog_main_conf_t *>(conf);
+  if (main_conf->trace_ring_zone != nullptr) {
+    return const_cast<char *>("is duplicate");
+  }
+
+  ngx_str_t *value = static_cast<ngx_str_t *>(cf->args->elts);
+  value++;  // 1st is the command name
+
+  ssize_t size = ngx_parse_size(value);
+  if (size == NGX_ERROR || size < static_cast<ssize_t>(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "datadog_trace_ring_zone: invalid size \"%V\"; "
+                       "it must be at least %ui bytes",
+                       value, 8 * ngx_pagesize);
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  ngx_str_t name = ngx_string("datadog_trace_ring");
+  ngx_shm_zone_t *zone =
+      ngx_shared_memory_add(cf, &name, size, &ngx_http_datadog_module);
+  if (zone == nullptr) {
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  zone->init = TraceRing::init_zone;
+  main_conf->trace_ring_zone = zone;
+
+  return NGX_CONF_OK;
+}
+
 char *hijack_auth_request(ngx_conf_t *cf, ngx_command_t *command,
                           void *conf) noexcept try {
   // Call the underlying directive handler, and then insert the following:
@@ -576,6 +615,78 @@ char *waf_thread_pool_name(ngx_conf_t *cf, ngx_command_t *command,
 
   return NGX_CONF_OK;
 }
+
+char *set_appsec_throttle_zone(ngx_conf_t *cf, ngx_command_t *command,
+                               void *conf) noexcept {
+  auto *main_conf = static_cast<datadog_main_conf_t *>(conf);
+  if (main_conf->appsec_throttle_zone != nullptr) {
+    return const_cast<char *>("is duplicate");
+  }
+
+  ngx_str_t *value = static_cast<ngx_str_t *>(cf->args->elts);
+  value++;  // 1st is the command name
+
+  ssize_t size = ngx_parse_size(value);
+  if (size == NGX_ERROR || size < static_cast<ssize_t>(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "datadog_appsec_throttle_zone: invalid size \"%V\"; "
+                       "it must be at least %ui bytes",
+                       value, 8 * ngx_pagesize);
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  ngx_str_t name = ngx_string("datadog_appsec_throttle");
+  ngx_shm_zone_t *zone =
+      ngx_shared_memory_add(cf, &name, size, &ngx_http_datadog_module);
+  if (zone == nullptr) {
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  zone->init = security::ClientThrottle::init_zone;
+  main_conf->appsec_throttle_zone = zone;
+
+  return NGX_CONF_OK;
+}
+
+char *set_appsec_remote_config_zone(ngx_conf_t *cf, ngx_command_t *command,
+                                    void *conf) noexcept {
+  auto *main_conf = static_cast<datadog_main_conf_t *>(conf);
+  if (main_conf->appsec_remote_config_zone != nullptr) {
+    return const_cast<char *>("is duplicate");
+  }
+
+  ngx_str_t *value = static_cast<ngx_str_t *>(cf->args->elts);
+  value++;  // 1st is the command name
+
+  ssize_t size = ngx_parse_size(value);
+  if (size == NGX_ERROR || size < static_cast<ssize_t>(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "datadog_appsec_remote_config_zone: invalid size "
+                       "\"%V\"; it must be at least %ui bytes",
+                       value, 8 * ngx_pagesize);
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  ngx_str_t name = ngx_string("datadog_appsec_remote_config");
+  ngx_shm_zone_t *zone =
+      ngx_shared_memory_add(cf, &name, size, &ngx_http_datadog_module);
+  if (zone == nullptr) {
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  zone->init = security::RemoteConfigRelay::init_zone;
+  main_conf->appsec_remote_config_zone = zone;
+
+  return NGX_CONF_OK;
+}
+
+char *set_appsec_waf_status(ngx_conf_t *cf, ngx_command_t * /*command*/,
+                            void * /*conf*/) noexcept {
+  auto *core_loc_conf = static_cast<ngx_http_core_loc_conf_t *>(
+      ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+  core_loc_conf->handler = security::waf_status_handler;
+  return NGX_CONF_OK;
+}
 #endif
 
 }  // namespace nginx
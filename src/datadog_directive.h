@@ -62,6 +62,9 @@ char *set_datadog_environment(ngx_conf_t *, ngx_command_t *,
 
 char *set_datadog_agent_url(ngx_conf_t *, ngx_command_t *, void *conf) noexcept;
 
+char *set_trace_ring_zone(ngx_conf_t *cf, ngx_command_t *command,
+                          void *conf) noexcept;
+
 char *hijack_auth_request(ngx_conf_t *cf, ngx_command_t *command,
                           void *conf) noexcept;
 
@@ -71,6 +74,15 @@ char *warn_deprecated_command(ngx_conf_t *cf, ngx_command_t * /*command*/,
 #ifdef WITH_WAF
 char *waf_thread_pool_name(ngx_conf_t *cf, ngx_command_t *command,
                            void *conf) noexcept;
+
+char *set_appsec_throttle_zone(ngx_conf_t *cf, ngx_command_t *command,
+                               void *conf) noexcept;
+
+char *set_appsec_remote_config_zone(ngx_conf_t *cf, ngx_command_t *command,
+                                    void *conf) noexcept;
+
+char *set_appsec_waf_status(ngx_conf_t *cf, ngx_command_t *command,
+                            void *conf) noexcept;
 #endif
 
 }  // namespace nginx
@@ -17,6 +17,9 @@ namespace nginx {
 
 ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt ngx_http_next_output_body_filter;
+#ifdef WITH_WAF
+ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
+#endif
 
 static bool is_datadog_tracing_enabled(
     const ngx_http_request_t *request,
@@ -141,5 +144,28 @@ ngx_int_t on_output_body_filter(ngx_http_request_t *request,
   }
 }
 
+#ifdef WITH_WAF
+ngx_int_t on_request_body_filter(ngx_http_request_t *request,
+                                 ngx_chain_t *chain) noexcept {
+  if (request != request->main) {
+    return ngx_http_next_request_body_filter(request, chain);
+  }
+
+  DatadogContext *context = get_datadog_context(request);
+  if (!context) {
+    return ngx_http_next_request_body_filter(request, chain);
+  }
+
+  try {
+    return context->on_request_body_filter(request, chain);
+  } catch (const std::exception &e) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                  "Datadog instrumentation failed for request %p: %s", request,
+                  e.what());
+    return NGX_ERROR;
+  }
+}
+#endif
+
 }  // namespace nginx
 }  // namespace datadog
@@ -12,6 +12,9 @@ namespace nginx {
 
 extern ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 extern ngx_http_output_body_filter_pt ngx_http_next_output_body_filter;
+#ifdef WITH_WAF
+extern ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
+#endif
 
 ngx_int_t on_enter_block(ngx_http_request_t *request) noexcept;
 #ifdef WITH_WAF
@@ -24,5 +27,10 @@ ngx_int_t on_header_filter(ngx_http_request_t *r) noexcept;
 ngx_int_t on_output_body_filter(ngx_http_request_t *r,
                                 ngx_chain_t *chain) noexcept;
 
+#ifdef WITH_WAF
+ngx_int_t on_request_body_filter(ngx_http_request_t *r,
+                                 ngx_chain_t *chain) noexcept;
+#endif
+
 }  // namespace nginx
 }  // namespace datadog
@@ -1,5 +1,6 @@
 #include "ngx_event_scheduler.h"
 
+#include <algorithm>
 #include <chrono>
 
 namespace datadog {
@@ -11,38 +12,122 @@ ngx_msec_t to_milliseconds(std::chrono::steady_clock::duration interval) {
       .count();
 }
 
+// a random point of the interval, for the first run of an event
+ngx_msec_t first_delay(std::chrono::steady_clock::duration interval) {
+  ngx_msec_t const msec = to_milliseconds(interval);
+  if (msec == 0) {
+    return 0;
+  }
+  return 1 + static_cast<ngx_msec_t>(ngx_random()) % msec;
+}
+
 extern "C" void handle_event(ngx_event_t *ev) {
   auto *event = static_cast<NgxEventScheduler::Event *>(ev->data);
-  // Schedule the next round.
-  ngx_add_timer(ev, to_milliseconds(event->interval));
+  event->expedited = false;
+  event->running = true;
+
+  auto const start = std::chrono::steady_clock::now();
+  bool const busy = event->callback();
+  auto const elapsed = std::chrono::steady_clock::now() - start;
+
+  event->running = false;
+  if (event->canceled) {
+    delete event;
+    return;
+  }
+  event->scheduler->record_run(elapsed);
+  ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                 "datadog event scheduler: callback ran for %M ms",
+                 to_milliseconds(elapsed));
 
-  event->callback();
+  // Schedule the next round.
+  event->current_interval =
+      busy ? event->interval
+           : std::min(event->current_interval * 2, event->max_interval);
+  ngx_add_timer(ev, event->expedited
+                        ? 0
+                        : to_milliseconds(event->current_interval));
 }
 
 }  // namespace
 
-NgxEventScheduler::Event::Event(std::function<void()> callback,
-                                std::chrono::steady_clock::duration interval)
-    : interval(interval), callback(callback), event() {
+NgxEventScheduler::Event::Event(
+    NgxEventScheduler *scheduler, std::function<bool()> callback,
+    std::chrono::steady_clock::duration interval,
+    std::chrono::steady_clock::duration max_interval)
+    : interval(interval),
+      max_interval(std::max(interval, max_interval)),
+      current_interval(interval),
+      callback(std::move(callback)),
+      scheduler(scheduler),
+      event(),
+      expedited(false),
+      running(false),
+      canceled(false) {
   event.data = this;
   event.log = ngx_cycle->log;
   event.handler = &handle_event;
   event.cancelable = true;  // otherwise a pending event will prevent shutdown
 }
 
+dd::EventScheduler::Cancel NgxEventScheduler::cancel_function(Event *event) {
+  return [this, event]() {
+    ngx_event_del_timer(&event->event);
+    events_.erase(event);
+    if (event->running) {
+      // deleted by handle_event, once the callback returns
+      event->canceled = true;
+      return;
+    }
+    delete event;
+  };
+}
+
 dd::EventScheduler::Cancel NgxEventScheduler::schedule_recurring_event(
     std::chrono::steady_clock::duration interval,
     std::function<void()> callback) {
-  auto event = std::make_unique<Event>(std::move(callback), interval);
+  auto event = std::make_unique<Event>(
+      this,
+      [callback = std::move(callback)]() {
+        callback();
+        return true;
+      },
+      interval, interval);
   events_.insert(event.get());
-  ngx_add_timer(&event->event, to_milliseconds(event->interval));
+  ngx_add_timer(&event->event, first_delay(event->interval));
 
   // Return a cancellation function.
-  return [this, event = event.release()]() {
-    ngx_event_del_timer(&event->event);
-    events_.erase(event);
-    delete event;
-  };
+  return cancel_function(event.release());
+}
+
+NgxEventScheduler::AdaptiveEvent NgxEventScheduler::schedule_adaptive_event(
+    std::chrono::steady_clock::duration interval,
+    std::chrono::steady_clock::duration max_interval,
+    std::function<bool()> callback) {
+  auto event = std::make_unique<Event>(this, std::move(callback), interval,
+                                       max_interval);
+  events_.insert(event.get());
+  ngx_add_timer(&event->event, first_delay(event->interval));
+
+  Event *const raw = event.release();
+  return {.cancel = cancel_function(raw), .expedite = [raw]() {
+            if (raw->expedited) {
+              return;
+            }
+            raw->expedited = true;
+            // while running, it is rescheduled by handle_event
+            if (raw->event.timer_set) {
+              ngx_del_timer(&raw->event);
+              ngx_add_timer(&raw->event, 0);
+            }
+          }};
+}
+
+void NgxEventScheduler::record_run(
+    std::chrono::steady_clock::duration elapsed) noexcept {
+  stats_.runs++;
+  stats_.total += elapsed;
+  stats_.max = std::max(stats_.max, elapsed);
 }
 
 NgxEventScheduler::~NgxEventScheduler() {
@@ -50,6 +135,12 @@ NgxEventScheduler::~NgxEventScheduler() {
     ngx_event_del_timer(&event->event);
     delete event;
   }
+
+  ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                "datadog event scheduler: %uL callbacks ran for %M ms in "
+                "total, %M ms at most",
+                stats_.runs, to_milliseconds(stats_.total),
+                to_milliseconds(stats_.max));
 }
 
 std::string NgxEventScheduler::config() const {
@@ -2,6 +2,9 @@
 
 #include <datadog/event_scheduler.h>
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <unordered_set>
 
@@ -15,27 +18,69 @@ extern "C" {
 namespace datadog {
 namespace nginx {
 
+// Runs recurring events on nginx timers. The first run of each event is at a
+// random point of its first interval, so that the workers, which start at
+// the same moment, do not all flush to the agent in lockstep.
 class NgxEventScheduler : public dd::EventScheduler {
  public:
   struct Event {
     std::chrono::steady_clock::duration interval;
-    std::function<void()> callback;
+    std::chrono::steady_clock::duration max_interval;
+    // current interval, between `interval` and `max_interval`
+    std::chrono::steady_clock::duration current_interval;
+    // returns whether it had work to do
+    std::function<bool()> callback;
+    NgxEventScheduler* scheduler;
     ngx_event_t event;
+    // set from the start of a run until the next, once expedited
+    bool expedited;
+    bool running;
+    // canceled while running; deleted once the callback returns
+    bool canceled;
 
-    Event(std::function<void()> callback,
-          std::chrono::steady_clock::duration interval);
+    Event(NgxEventScheduler* scheduler, std::function<bool()> callback,
+          std::chrono::steady_clock::duration interval,
+          std::chrono::steady_clock::duration max_interval);
 
     Event(const Event&) = delete;
     Event& operator=(const Event&) = delete;
   };
 
+  struct AdaptiveEvent {
+    Cancel cancel;
+    // Runs the callback on the next iteration of the event loop, e.g. when
+    // enough work is pending, instead of at the end of its interval.
+    std::function<void()> expedite;
+  };
+
+  // time spent in the callbacks of the events, logged when the worker exits
+  struct Stats {
+    std::uint64_t runs;
+    std::chrono::steady_clock::duration total;
+    std::chrono::steady_clock::duration max;
+  };
+
  private:
   std::unordered_set<Event*> events_;
+  Stats stats_{};
+
+  Cancel cancel_function(Event* event);
 
  public:
   Cancel schedule_recurring_event(std::chrono::steady_clock::duration interval,
                                   std::function<void()> callback) override;
 
+  // Like schedule_recurring_event, but the interval adapts to the traffic:
+  // `callback` returns whether it had work to do, each idle run doubles the
+  // interval, up to `max_interval`, and a busy run brings it back to
+  // `interval`.
+  AdaptiveEvent schedule_adaptive_event(
+      std::chrono::steady_clock::duration interval,
+      std::chrono::steady_clock::duration max_interval,
+      std::function<bool()> callback);
+
+  void record_run(std::chrono::steady_clock::duration elapsed) noexcept;
+
   std::string config() const override;
 
   ~NgxEventScheduler();
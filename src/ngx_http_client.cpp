@@ -0,0 +1,1026 @@
+#include "ngx_http_client.h"
+
+#include <datadog/dict_reader.h>
+#include <datadog/dict_writer.h>
+#include <datadog/error.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <ngx_http.h>
+#include <poll.h>
+}
+
+namespace datadog {
+namespace nginx {
+
+struct NgxHTTPClient::Peer {
+  // as given to ngx_parse_url(), whose result can point into it
+  std::string url;
+  // value of the Host header
+  std::string host;
+  // empty if the agent is given by address or unix socket; otherwise
+  // resolved again once `expires` is reached
+  std::string hostname;
+  in_port_t port = 0;
+  // nullptr if the http block has no `resolver`, in which case a hostname is
+  // resolved with a blocking ngx_parse_url() until an address is found, and
+  // that address is kept
+  ngx_resolver_t *resolver = nullptr;
+  ngx_msec_t resolver_timeout = 0;
+  // resolution in progress
+  ngx_resolver_ctx_t *resolving = nullptr;
+  // in ngx_resolve_name(), which can call its handler right away
+  bool starting_resolution = false;
+  time_t expires = 0;
+  // the address to connect to, if any; points into `sockaddr` and `name`,
+  // which are overwritten in place since connections refer to them
+  bool has_addr = false;
+  ngx_addr_t addr{};
+  ngx_sockaddr_t sockaddr{};
+  u_char name[NGX_SOCKADDR_STRLEN]{};
+  // requests waiting for a connection
+  std::deque<std::unique_ptr<Request>> queue;
+  std::vector<std::unique_ptr<Connection>> connections;
+
+  ~Peer() {
+    if (resolving != nullptr) {
+      ngx_resolve_name_done(resolving);
+    }
+  }
+};
+
+struct NgxHTTPClient::Request {
+  Peer *peer = nullptr;
+  // nullptr while the request is queued
+  Connection *connection = nullptr;
+  // whether the request was already sent once on a connection that turned
+  // out to be closed
+  bool retried = false;
+  std::string head;
+  std::string body;
+  ResponseHandler on_response;
+  ErrorHandler on_error;
+  ngx_event_t deadline{};
+
+  ~Request() {
+    if (deadline.timer_set) {
+      ngx_event_del_timer(&deadline);
+    }
+  }
+};
+
+struct NgxHTTPClient::Connection {
+  Peer *peer = nullptr;
+  ngx_connection_t *connection = nullptr;
+  bool connecting = false;
+  // whether a response was received on the connection before
+  bool reused = false;
+  // nullptr while the connection is idle
+  std::unique_ptr<Request> request;
+  // head and body of the request, and what is left to send of them
+  ngx_buf_t buffers[2]{};
+  ngx_chain_t chain[2]{};
+  ngx_chain_t *out = nullptr;
+  // the response received so far, and its whole length once known
+  std::string in;
+  std::size_t expected = 0;
+  // for a chunked response, where the first chunk not decoded yet starts in
+  // the body, and the data of the chunks before it
+  std::size_t chunk_pos = 0;
+  std::string chunks;
+
+  ~Connection() {
+    if (connection != nullptr) {
+      ngx_close_connection(connection);
+    }
+  }
+};
+
+struct NgxHTTPClient::Answer {
+  NgxHTTPClient *client = nullptr;
+  std::string body;
+  ResponseHandler on_response;
+  // of 0 ms, so that the handler is not called from post()
+  ngx_event_t event{};
+
+  ~Answer() {
+    if (event.timer_set) {
+      ngx_event_del_timer(&event);
+    }
+  }
+
+  // Calls the handler with the body and destroys the answer.
+  void deliver();
+};
+
+namespace {
+
+using Peer = NgxHTTPClient::Peer;
+using Request = NgxHTTPClient::Request;
+using Connection = NgxHTTPClient::Connection;
+using Answer = NgxHTTPClient::Answer;
+
+// connections to the same agent that carry requests at the same time
+constexpr std::size_t kMaxConnections = 2;
+// how long the address of an agent given by hostname is used before the
+// resolver of the http block is asked again, unless a connection to it fails
+// first
+constexpr time_t kResolveValidSecs = 30;
+// before a failed resolution is tried again
+constexpr time_t kResolveRetrySecs = 5;
+// bytes read from a connection at a time
+constexpr std::size_t kReadSize = 16 * 1024;
+// the length of a response, head included, beyond which it is not read any
+// further
+constexpr std::size_t kMaxResponseSize = 64 * 1024 * 1024;
+
+class RequestHeaders : public dd::DictWriter {
+  std::string &head_;
+
+ public:
+  explicit RequestHeaders(std::string &head) : head_(head) {}
+
+  void set(std::string_view key, std::string_view value) override {
+    head_.append(key);
+    head_.append(": ");
+    head_.append(value);
+    head_.append("\r\n");
+  }
+};
+
+std::string lowercase(std::string_view text) {
+  std::string result;
+  result.reserve(text.size());
+  std::transform(text.begin(), text.end(), std::back_inserter(result),
+                 [](unsigned char ch) { return std::tolower(ch); });
+  return result;
+}
+
+class ResponseHeaders : public dd::DictReader {
+  std::unordered_map<std::string, std::string> headers_;
+
+ public:
+  void add(std::string_view key, std::string_view value) {
+    headers_.insert_or_assign(lowercase(key), std::string(value));
+  }
+
+  std::optional<std::string_view> lookup(std::string_view key) const override {
+    const auto found = headers_.find(lowercase(key));
+    if (found != headers_.end()) {
+      return found->second;
+    }
+    return std::nullopt;
+  }
+
+  void visit(
+      const std::function<void(std::string_view key, std::string_view value)>
+          &visitor) const override {
+    for (const auto &[key, value] : headers_) {
+      visitor(key, value);
+    }
+  }
+};
+
+struct Response {
+  int status = 0;
+  ResponseHeaders headers;
+  std::string body;
+  bool keep_alive = true;
+};
+
+enum class Parsed { incomplete, complete, invalid };
+
+std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+bool contains_token(std::string_view value, std::string_view token) {
+  return lowercase(value).find(token) != std::string::npos;
+}
+
+// Decodes the chunks of `body` from `pos` on, and appends their data to
+// `out`. `pos` is left where the first chunk not received in full starts, so
+// that decoding resumes there once more of the body is received.
+Parsed dechunk(std::string_view body, std::size_t &pos, std::string &out) {
+  for (;;) {
+    auto const eol = body.find("\r\n", pos);
+    if (eol == std::string_view::npos) {
+      return Parsed::incomplete;
+    }
+
+    // chunk extensions are ignored
+    std::string_view line = body.substr(pos, eol - pos);
+    line = trim(line.substr(0, line.find(';')));
+    std::size_t size = 0;
+    auto const [end, ec] =
+        std::from_chars(line.data(), line.data() + line.size(), size, 16);
+    if (ec != std::errc{} || end != line.data() + line.size()) {
+      return Parsed::invalid;
+    }
+    std::size_t const data = eol + 2;
+
+    if (size == 0) {
+      // the trailer, if any, ends with an empty line
+      if (body.substr(data, 2) == "\r\n" ||
+          body.find("\r\n\r\n", data) != std::string_view::npos) {
+        return Parsed::complete;
+      }
+      return Parsed::incomplete;
+    }
+
+    if (size > kMaxResponseSize - out.size()) {
+      return Parsed::invalid;
+    }
+    std::size_t const available = body.size() - data;
+    if (available < 2 || available - 2 < size) {
+      return Parsed::incomplete;
+    }
+    if (body.substr(data + size, 2) != "\r\n") {
+      return Parsed::invalid;
+    }
+    out.append(body.substr(data, size));
+    pos = data + size + 2;
+  }
+}
+
+// Parses the HTTP/1.x response received so far on `conn`. Its `expected`
+// length is set once known from the headers, and the chunks of a chunked
+// body are only decoded once.
+Parsed parse_response(Connection &conn, bool eof, Response &response) {
+  std::string_view const in = conn.in;
+  auto const head_end = in.find("\r\n\r\n");
+  if (head_end == std::string_view::npos) {
+    return Parsed::incomplete;
+  }
+  std::string_view const head = in.substr(0, head_end);
+
+  // HTTP/1.1 200 OK
+  auto line_end = head.find("\r\n");
+  std::string_view const status_line = head.substr(0, line_end);
+  if (status_line.size() < 12 || status_line.substr(0, 7) != "HTTP/1." ||
+      status_line[8] != ' ') {
+    return Parsed::invalid;
+  }
+  auto const [status_end, status_ec] = std::from_chars(
+      status_line.data() + 9, status_line.data() + 12, response.status);
+  if (status_ec != std::errc{} || status_end != status_line.data() + 12) {
+    return Parsed::invalid;
+  }
+  response.keep_alive = status_line[7] != '0';
+
+  std::optional<std::size_t> content_length;
+  bool chunked = false;
+  while (line_end != std::string_view::npos) {
+    std::size_t const begin = line_end + 2;
+    line_end = head.find("\r\n", begin);
+    std::string_view const line = head.substr(begin, line_end - begin);
+    auto const colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      return Parsed::invalid;
+    }
+    std::string_view const key = trim(line.substr(0, colon));
+    std::string_view const value = trim(line.substr(colon + 1));
+    response.headers.add(key, value);
+
+    std::string const name = lowercase(key);
+    if (name == "content-length") {
+      std::size_t length = 0;
+      auto const [end, ec] =
+          std::from_chars(value.data(), value.data() + value.size(), length);
+      if (ec != std::errc{} || end != value.data() + value.size()) {
+        return Parsed::invalid;
+      }
+      content_length = length;
+    } else if (name == "transfer-encoding") {
+      chunked = contains_token(value, "chunked");
+    } else if (name == "connection") {
+      if (contains_token(value, "close")) {
+        response.keep_alive = false;
+      } else if (contains_token(value, "keep-alive")) {
+        response.keep_alive = true;
+      }
+    }
+  }
+
+  std::string_view const body = in.substr(head_end + 4);
+  if (response.status == 204 || response.status == 304) {
+    return Parsed::complete;
+  }
+  if (chunked) {
+    Parsed const parsed = dechunk(body, conn.chunk_pos, conn.chunks);
+    if (parsed == Parsed::complete) {
+      response.body = std::move(conn.chunks);
+    }
+    return parsed;
+  }
+  if (content_length) {
+    // receive() fails before the response outgrows the limit
+    if (*content_length > kMaxResponseSize - (head_end + 4)) {
+      return Parsed::invalid;
+    }
+    conn.expected = head_end + 4 + *content_length;
+    if (body.size() < *content_length) {
+      return Parsed::incomplete;
+    }
+    response.body.assign(body.substr(0, *content_length));
+    return Parsed::complete;
+  }
+
+  // without a length, the body ends with the connection
+  if (!eof) {
+    return Parsed::incomplete;
+  }
+  response.keep_alive = false;
+  response.body.assign(body);
+  return Parsed::complete;
+}
+
+void dispatch(Peer &peer);
+void send(Connection &conn);
+void receive(Connection &conn);
+extern "C" void on_read(ngx_event_t *ev);
+extern "C" void on_write(ngx_event_t *ev);
+
+// the resolver of the http block, if it has one
+ngx_resolver_t *http_resolver(ngx_msec_t &timeout) {
+  auto *ctx = static_cast<ngx_http_conf_ctx_t *>(
+      ngx_get_conf(ngx_cycle->conf_ctx, ngx_http_module));
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+  auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+      ctx->loc_conf[ngx_http_core_module.ctx_index]);
+  // without addresses, nginx creates one that cannot resolve anything
+  if (clcf->resolver == nullptr || clcf->resolver->connections.nelts == 0) {
+    return nullptr;
+  }
+  timeout = clcf->resolver_timeout;
+  return clcf->resolver;
+}
+
+// IPv6 addresses are the only hosts in brackets
+bool is_address(const ngx_str_t &host) {
+  return (host.len != 0 && host.data[0] == '[') ||
+         ngx_inet_addr(host.data, host.len) != INADDR_NONE;
+}
+
+// `port` replaces the one of `address`, unless it is 0
+void set_address(Peer &peer, const sockaddr *address, socklen_t socklen,
+                 in_port_t port = 0) {
+  std::memcpy(&peer.sockaddr, address, socklen);
+  if (port != 0) {
+    ngx_inet_set_port(&peer.sockaddr.sockaddr, port);
+  }
+  peer.addr.sockaddr = &peer.sockaddr.sockaddr;
+  peer.addr.socklen = socklen;
+  peer.addr.name.data = peer.name;
+  peer.addr.name.len = ngx_sock_ntop(&peer.sockaddr.sockaddr, socklen,
+                                     peer.name, sizeof(peer.name), 1);
+  peer.has_addr = true;
+}
+
+void resolve_blocking(Peer &peer) {
+  ngx_url_t u{};
+  u.url.data = reinterpret_cast<u_char *>(peer.url.data());
+  u.url.len = peer.url.size();
+  // the port of the agent, as documented for `datadog_agent_url`
+  u.default_port = 8126;
+
+  // a pool of its own, so that resolving again does not grow the cycle's
+  ngx_pool_t *pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+  if (pool != nullptr && ngx_parse_url(pool, &u) == NGX_OK && u.naddrs != 0) {
+    set_address(peer, u.addrs[0].sockaddr, u.addrs[0].socklen);
+    peer.expires = ngx_time() + kResolveValidSecs;
+  } else {
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "datadog: could not resolve the Datadog Agent at %s: %s",
+                  peer.url.c_str(), u.err != nullptr ? u.err : "no address");
+    peer.expires = ngx_time() + kResolveRetrySecs;
+  }
+  if (pool != nullptr) {
+    ngx_destroy_pool(pool);
+  }
+}
+
+extern "C" void on_resolved(ngx_resolver_ctx_t *ctx) {
+  auto &peer = *static_cast<Peer *>(ctx->data);
+  if (ctx->state == NGX_OK && ctx->naddrs != 0) {
+    // the resolver leaves the port out
+    set_address(peer, ctx->addrs[0].sockaddr, ctx->addrs[0].socklen,
+                peer.port);
+    peer.expires = ngx_time() + kResolveValidSecs;
+  } else {
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "datadog: could not resolve the Datadog Agent at %V: %s",
+                  &ctx->name, ngx_resolver_strerror(ctx->state));
+    peer.expires = ngx_time() + kResolveRetrySecs;
+  }
+  ngx_resolve_name_done(ctx);
+  peer.resolving = nullptr;
+
+  if (!peer.starting_resolution) {
+    dispatch(peer);
+  }
+}
+
+// Starts resolving the hostname of the agent with the resolver of the http
+// block. The current address, if any, is used until it is done.
+void resolve(Peer &peer) {
+  ngx_resolver_ctx_t temp{};
+  temp.name.data = reinterpret_cast<u_char *>(peer.hostname.data());
+  temp.name.len = peer.hostname.size();
+  ngx_resolver_ctx_t *ctx = ngx_resolve_start(peer.resolver, &temp);
+  if (ctx == nullptr || ctx == NGX_NO_RESOLVER) {
+    peer.expires = ngx_time() + kResolveRetrySecs;
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "datadog: could not resolve the Datadog Agent at %s",
+                  peer.hostname.c_str());
+    return;
+  }
+
+  ctx->name = temp.name;
+  ctx->handler = &on_resolved;
+  ctx->data = &peer;
+  ctx->timeout = peer.resolver_timeout;
+  peer.resolving = ctx;
+  peer.starting_resolution = true;
+  ngx_int_t const rc = ngx_resolve_name(ctx);
+  peer.starting_resolution = false;
+  if (rc != NGX_OK) {
+    // the resolver freed `ctx`
+    peer.resolving = nullptr;
+    peer.expires = ngx_time() + kResolveRetrySecs;
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "datadog: could not resolve the Datadog Agent at %s",
+                  peer.hostname.c_str());
+  }
+}
+
+// Starts resolving the hostname of the agent again if its address expired.
+// Returns whether there is an address to connect to meanwhile.
+bool ensure_address(Peer &peer) {
+  if (peer.hostname.empty() || peer.resolving != nullptr ||
+      ngx_time() < peer.expires) {
+    return peer.has_addr;
+  }
+  if (peer.resolver != nullptr) {
+    resolve(peer);
+  } else if (!peer.has_addr) {
+    // A blocking lookup stalls the worker, so it is only tried again after
+    // kResolveRetrySecs, however many requests fail meanwhile, and never
+    // once an address was found.
+    resolve_blocking(peer);
+  }
+  return peer.has_addr;
+}
+
+void report(std::unique_ptr<Request> request, std::string_view message) {
+  std::string text = "request to the Datadog Agent at ";
+  text += request->peer->url;
+  text += " failed: ";
+  text += message;
+  try {
+    request->on_error(dd::Error{dd::Error::OTHER, std::move(text)});
+  } catch (const std::exception &error) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "datadog: error handler of agent request failed: %s",
+                  error.what());
+  }
+}
+
+void respond(std::unique_ptr<Request> request, Response &response) {
+  try {
+    request->on_response(response.status, response.headers,
+                         std::move(response.body));
+  } catch (const std::exception &error) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "datadog: response handler of agent request failed: %s",
+                  error.what());
+  }
+}
+
+// Closes the connection and destroys `conn`.
+void close(Connection &conn) {
+  auto &connections = conn.peer->connections;
+  auto it = std::find_if(
+      connections.begin(), connections.end(),
+      [&](const auto &other) { return other.get() == &conn; });
+  connections.erase(it);
+}
+
+void fail(Connection &conn, std::string_view message) {
+  Peer &peer = *conn.peer;
+  std::unique_ptr<Request> request = std::move(conn.request);
+  // Nothing ever came back on the connection: the agent may have moved, and
+  // the resolver, if any, is asked again.
+  if (!conn.reused && conn.in.empty()) {
+    peer.expires = 0;
+  }
+  // The agent can close an idle connection just as it is reused, in which
+  // case the request is sent again on a new connection. The other idle
+  // connections are likely closed as well, by the same restart or timeout of
+  // the agent, so they are not reused.
+  bool const retry = request != nullptr && conn.reused && conn.in.empty() &&
+                     !request->retried;
+  close(conn);
+
+  if (retry) {
+    auto &connections = peer.connections;
+    auto const idle = [](const auto &other) {
+      return other->request == nullptr;
+    };
+    connections.erase(
+        std::remove_if(connections.begin(), connections.end(), idle),
+        connections.end());
+    request->retried = true;
+    request->connection = nullptr;
+    peer.queue.push_front(std::move(request));
+  }
+  dispatch(peer);
+  if (request != nullptr) {
+    report(std::move(request), message);
+  }
+}
+
+void finish(Connection &conn, Response &response) {
+  Peer &peer = *conn.peer;
+  std::unique_ptr<Request> request = std::move(conn.request);
+  request->connection = nullptr;
+
+  if (response.keep_alive && !ngx_exiting && !ngx_terminate) {
+    ngx_connection_t *c = conn.connection;
+    conn.reused = true;
+    conn.out = nullptr;
+    conn.in.clear();
+    conn.expected = 0;
+    conn.chunk_pos = 0;
+    conn.chunks.clear();
+    // nginx closes idle connections when it runs out of connections or exits
+    c->idle = 1;
+    ngx_reusable_connection(c, 1);
+  } else {
+    close(conn);
+  }
+
+  dispatch(peer);
+  respond(std::move(request), response);
+}
+
+Connection *connect(Peer &peer) {
+  ngx_peer_connection_t pc{};
+  pc.sockaddr = peer.addr.sockaddr;
+  pc.socklen = peer.addr.socklen;
+  pc.name = &peer.addr.name;
+  pc.get = ngx_event_get_peer;
+  pc.log = ngx_cycle->log;
+  // errors are reported to the tracer, which logs them
+  pc.log_error = NGX_ERROR_INFO;
+
+  // on failure, the connection is already closed
+  ngx_int_t const rc = ngx_event_connect_peer(&pc);
+  if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    return nullptr;
+  }
+
+  auto conn = std::make_unique<Connection>();
+  conn->peer = &peer;
+  conn->connection = pc.connection;
+  conn->connecting = rc == NGX_AGAIN;
+  peer.connections.push_back(std::move(conn));
+
+  ngx_connection_t *c = pc.connection;
+  c->data = peer.connections.back().get();
+  c->read->handler = on_read;
+  c->write->handler = on_write;
+  return peer.connections.back().get();
+}
+
+void start(Connection &conn, std::unique_ptr<Request> request) {
+  ngx_connection_t *c = conn.connection;
+  if (c->idle) {
+    c->idle = 0;
+    ngx_reusable_connection(c, 0);
+  }
+
+  conn.request = std::move(request);
+  conn.request->connection = &conn;
+  conn.in.clear();
+  conn.expected = 0;
+  conn.chunk_pos = 0;
+  conn.chunks.clear();
+
+  auto set = [](ngx_buf_t &buffer, std::string &data) {
+    auto *begin = reinterpret_cast<u_char *>(data.data());
+    buffer = ngx_buf_t{};
+    buffer.start = begin;
+    buffer.pos = begin;
+    buffer.last = begin + data.size();
+    buffer.end = begin + data.size();
+    buffer.memory = 1;
+  };
+  set(conn.buffers[0], conn.request->head);
+  set(conn.buffers[1], conn.request->body);
+  conn.chain[0].buf = &conn.buffers[0];
+  conn.chain[0].next = conn.request->body.empty() ? nullptr : &conn.chain[1];
+  conn.chain[1].buf = &conn.buffers[1];
+  conn.chain[1].next = nullptr;
+  conn.out = &conn.chain[0];
+
+  // otherwise the request is sent once connected
+  if (!conn.connecting) {
+    send(conn);
+  }
+}
+
+void dispatch(Peer &peer) {
+  if (peer.queue.empty()) {
+    return;
+  }
+  if (!ensure_address(peer)) {
+    // otherwise the requests are dispatched once the hostname is resolved
+    if (peer.resolving == nullptr) {
+      while (!peer.queue.empty()) {
+        std::unique_ptr<Request> request = std::move(peer.queue.front());
+        peer.queue.pop_front();
+        report(std::move(request), "could not resolve the agent's hostname");
+      }
+    }
+    return;
+  }
+
+  while (!peer.queue.empty()) {
+    Connection *conn = nullptr;
+    for (const auto &candidate : peer.connections) {
+      if (candidate->request == nullptr) {
+        conn = candidate.get();
+        break;
+      }
+    }
+
+    if (conn == nullptr) {
+      if (peer.connections.size() >= kMaxConnections) {
+        return;
+      }
+      conn = connect(peer);
+    }
+
+    std::unique_ptr<Request> request = std::move(peer.queue.front());
+    peer.queue.pop_front();
+    if (conn == nullptr) {
+      peer.expires = 0;
+      report(std::move(request), "could not connect");
+      continue;
+    }
+    start(*conn, std::move(request));
+  }
+}
+
+void send(Connection &conn) {
+  ngx_connection_t *c = conn.connection;
+  // head and body in a single writev(), unless the socket buffer is full
+  ngx_chain_t *rest = c->send_chain(c, conn.out, 0);
+  if (rest == NGX_CHAIN_ERROR) {
+    fail(conn, "could not send the request");
+    return;
+  }
+
+  conn.out = rest;
+  if (rest != nullptr) {
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+      fail(conn, "could not wait for the connection to be writable");
+    }
+    return;
+  }
+
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    fail(conn, "could not wait for the response");
+    return;
+  }
+  if (c->read->ready) {
+    receive(conn);
+  }
+}
+
+void receive(Connection &conn) {
+  ngx_connection_t *c = conn.connection;
+  bool eof = false;
+  for (;;) {
+    std::size_t const size = conn.in.size();
+    conn.in.resize(size + kReadSize);
+    ssize_t const n =
+        c->recv(c, reinterpret_cast<u_char *>(conn.in.data()) + size,
+                kReadSize);
+    conn.in.resize(size + (n > 0 ? n : 0));
+
+    if (n == NGX_AGAIN) {
+      break;
+    }
+    if (n == NGX_ERROR) {
+      fail(conn, "could not read the response");
+      return;
+    }
+    if (n == 0) {
+      eof = true;
+      break;
+    }
+    if (conn.in.size() > kMaxResponseSize) {
+      fail(conn, "response too large");
+      return;
+    }
+  }
+
+  Response response;
+  Parsed parsed = Parsed::incomplete;
+  if (eof || conn.expected == 0 || conn.in.size() >= conn.expected) {
+    parsed = parse_response(conn, eof, response);
+  }
+
+  switch (parsed) {
+    case Parsed::complete:
+      finish(conn, response);
+      return;
+    case Parsed::invalid:
+      fail(conn, "invalid response");
+      return;
+    case Parsed::incomplete:
+      break;
+  }
+
+  if (eof) {
+    fail(conn, "connection closed before the end of the response");
+  } else if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    fail(conn, "could not wait for the response");
+  }
+}
+
+extern "C" void on_read(ngx_event_t *ev) {
+  auto *c = static_cast<ngx_connection_t *>(ev->data);
+  auto &conn = *static_cast<Connection *>(c->data);
+  if (conn.request == nullptr) {
+    // closed by the agent, or by nginx
+    close(conn);
+    return;
+  }
+  receive(conn);
+}
+
+extern "C" void on_write(ngx_event_t *ev) {
+  auto *c = static_cast<ngx_connection_t *>(ev->data);
+  auto &conn = *static_cast<Connection *>(c->data);
+  conn.connecting = false;
+  if (conn.out != nullptr) {
+    send(conn);
+  }
+}
+
+extern "C" void on_deadline(ngx_event_t *ev) {
+  auto *request = static_cast<Request *>(ev->data);
+  if (request->connection != nullptr) {
+    // not worth sending again
+    request->retried = true;
+    fail(*request->connection, "timed out");
+    return;
+  }
+
+  auto &queue = request->peer->queue;
+  auto it = std::find_if(queue.begin(), queue.end(), [&](const auto &queued) {
+    return queued.get() == request;
+  });
+  std::unique_ptr<Request> owned = std::move(*it);
+  queue.erase(it);
+  report(std::move(owned), "timed out waiting for a connection");
+}
+
+extern "C" void on_answer(ngx_event_t *ev) {
+  static_cast<Answer *>(ev->data)->deliver();
+}
+
+}  // namespace
+
+void NgxHTTPClient::Answer::deliver() {
+  auto &answers = client->answers_;
+  auto it = std::find_if(
+      answers.begin(), answers.end(),
+      [&](const auto &other) { return other.get() == this; });
+  std::unique_ptr<Answer> owned = std::move(*it);
+  answers.erase(it);
+
+  ResponseHeaders headers;
+  try {
+    on_response(200, headers, std::move(body));
+  } catch (const std::exception &error) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "datadog: response handler of agent request failed: %s",
+                  error.what());
+  }
+}
+
+NgxHTTPClient::NgxHTTPClient() = default;
+
+// Connections are closed and requests dropped, without calling their
+// handlers.
+NgxHTTPClient::~NgxHTTPClient() = default;
+
+dd::Expected<NgxHTTPClient::Peer *> NgxHTTPClient::peer(const URL &url) {
+  std::string key = url.scheme + "://" + url.authority;
+  if (auto it = peers_.find(key); it != peers_.end()) {
+    return it->second.get();
+  }
+
+  auto entry = std::make_unique<Peer>();
+  if (url.scheme == "http") {
+    entry->url = url.authority;
+    entry->host = url.authority;
+  } else if (url.scheme == "unix" || url.scheme == "http+unix") {
+    entry->url = "unix:" + url.authority;
+    entry->host = "localhost";
+  } else {
+    return dd::Error{dd::Error::URL_UNSUPPORTED_SCHEME,
+                     "the nginx HTTP client does not support the scheme " +
+                         url.scheme};
+  }
+
+  ngx_url_t u{};
+  u.url.data = reinterpret_cast<u_char *>(entry->url.data());
+  u.url.len = entry->url.size();
+  u.default_port = 8126;
+  u.no_resolve = 1;
+  if (ngx_parse_url(ngx_cycle->pool, &u) != NGX_OK) {
+    std::string message = "invalid Datadog Agent URL ";
+    message += url.authority;
+    if (u.err != nullptr) {
+      message += ": ";
+      message += u.err;
+    }
+    return dd::Error{dd::Error::OTHER, std::move(message)};
+  }
+
+  if (u.naddrs != 0) {
+    // unix domain socket
+    set_address(*entry, u.addrs[0].sockaddr, u.addrs[0].socklen);
+  } else if (is_address(u.host)) {
+    // no name to look up, so this does not block
+    resolve_blocking(*entry);
+    if (!entry->has_addr) {
+      return dd::Error{dd::Error::OTHER,
+                       "invalid Datadog Agent address " + url.authority};
+    }
+  } else {
+    entry->hostname.assign(reinterpret_cast<char *>(u.host.data), u.host.len);
+    entry->port = u.port;
+    entry->resolver = http_resolver(entry->resolver_timeout);
+    // Without a resolver, this is the only lookup unless it fails. With one,
+    // the lookup starts when the first request is dispatched.
+    if (entry->resolver == nullptr) {
+      resolve_blocking(*entry);
+    }
+  }
+
+  auto *result = entry.get();
+  peers_.emplace(std::move(key), std::move(entry));
+  return result;
+}
+
+dd::Expected<void> NgxHTTPClient::post(
+    const URL &url, HeadersSetter set_headers, std::string body,
+    ResponseHandler on_response, ErrorHandler on_error,
+    std::chrono::steady_clock::time_point deadline) {
+  if (shortcut_) {
+    if (std::optional<std::string> answered = shortcut_(url, body)) {
+      auto answer = std::make_unique<Answer>();
+      answer->client = this;
+      answer->body = std::move(*answered);
+      answer->on_response = std::move(on_response);
+      ngx_event_t &event = answer->event;
+      event.data = answer.get();
+      event.log = ngx_cycle->log;
+      event.handler = &on_answer;
+      event.cancelable = 1;
+      ngx_add_timer(&event, 0);
+      answers_.push_back(std::move(answer));
+      return std::nullopt;
+    }
+  }
+  if (tap_) {
+    on_response = [tap = tap_, url, on_response = std::move(on_response)](
+                      int status, const dd::DictReader &headers,
+                      std::string body) {
+      tap(url, status, body);
+      on_response(status, headers, std::move(body));
+    };
+  }
+
+  auto found = peer(url);
+  if (!found) {
+    return found.error();
+  }
+  Peer &destination = **found;
+
+  auto request = std::make_unique<Request>();
+  request->peer = &destination;
+
+  std::string &head = request->head;
+  head += "POST ";
+  head += url.path.empty() ? "/" : url.path;
+  head += " HTTP/1.1\r\nHost: ";
+  head += destination.host;
+  head += "\r\nContent-Length: ";
+  head += std::to_string(body.size());
+  head += "\r\n";
+  RequestHeaders headers{head};
+  set_headers(headers);
+  head += "\r\n";
+
+  request->body = std::move(body);
+  request->on_response = std::move(on_response);
+  request->on_error = std::move(on_error);
+
+  ngx_event_t &timer = request->deadline;
+  timer.data = request.get();
+  timer.log = ngx_cycle->log;
+  timer.handler = &on_deadline;
+  timer.cancelable = 1;  // otherwise a pending request will prevent shutdown
+  auto const remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             deadline - std::chrono::steady_clock::now())
+                             .count();
+  ngx_add_timer(&timer, static_cast<ngx_msec_t>(std::max<decltype(remaining)>(
+                            remaining, 0)));
+
+  destination.queue.push_back(std::move(request));
+  dispatch(destination);
+  return std::nullopt;
+}
+
+void NgxHTTPClient::drain(std::chrono::steady_clock::time_point deadline) {
+  std::vector<pollfd> fds;
+  std::vector<ngx_connection_t *> connections;
+  for (;;) {
+    fds.clear();
+    connections.clear();
+    for (const auto &[_, entry] : peers_) {
+      for (const auto &conn : entry->connections) {
+        if (conn->request == nullptr) {
+          continue;
+        }
+        short const events = conn->out != nullptr ? POLLOUT : POLLIN;
+        fds.push_back(pollfd{conn->connection->fd, events, 0});
+        connections.push_back(conn->connection);
+      }
+    }
+    // Requests are only queued while all connections are busy.
+    if (fds.empty()) {
+      return;
+    }
+
+    auto const now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return;
+    }
+    auto const timeout =
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)
+            .count() +
+        1;
+    int const rc = ::poll(fds.data(), fds.size(),
+                          static_cast<int>(std::min<decltype(timeout)>(
+                              timeout, INT_MAX)));
+    if (rc == -1 && errno != EINTR) {
+      return;
+    }
+
+    // A handler only closes its own connection and idle ones, and only starts
+    // requests on connections that are not polled here.
+    for (std::size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      ngx_event_t *ev = fds[i].events == POLLOUT ? connections[i]->write
+                                                 : connections[i]->read;
+      ev->ready = 1;
+      ev->handler(ev);
+    }
+  }
+}
+
+std::string NgxHTTPClient::config() const {
+  return R"({"type": "datadog::nginx::NgxHTTPClient"})";
+}
+
+}  // namespace nginx
+}  // namespace datadog
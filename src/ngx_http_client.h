@@ -0,0 +1,95 @@
+#pragma once
+
+#include <datadog/http_client.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dd.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+}
+
+namespace datadog {
+namespace nginx {
+
+// Sends the requests of the tracer (traces, remote configuration polls,
+// telemetry) to the Datadog Agent from the event loop of the worker, instead
+// of from a libcurl thread.
+//
+// Requests to the same agent share a few keep-alive connections, over TCP or
+// a unix domain socket. A request waits in a queue while all of them are
+// busy. Request and body are sent with a single writev() when the socket
+// allows it, and the deadline of a request is an nginx timer. Only accessed
+// from the event loop thread.
+class NgxHTTPClient : public dd::HTTPClient {
+ public:
+  // defined in ngx_http_client.cpp
+  struct Peer;
+  struct Request;
+  struct Connection;
+  struct Answer;
+
+  // Called with the URL and body of each request before it is sent. If it
+  // returns a body, the request is not sent, and is answered with that body
+  // and a status of 200 from the event loop instead.
+  using Shortcut = std::function<std::optional<std::string>(
+      const URL &url, std::string_view body)>;
+  // Called with each response from the agent, before the handler of its
+  // request.
+  using Tap =
+      std::function<void(const URL &url, int status, std::string_view body)>;
+
+ private:
+  // by authority of the URL
+  std::unordered_map<std::string, std::unique_ptr<Peer>> peers_;
+  Shortcut shortcut_;
+  Tap tap_;
+  // requests answered by `shortcut_`, until their handler is called
+  std::vector<std::unique_ptr<Answer>> answers_;
+
+  dd::Expected<Peer *> peer(const URL &url);
+
+ public:
+  NgxHTTPClient();
+  ~NgxHTTPClient() override;
+
+  NgxHTTPClient(const NgxHTTPClient &) = delete;
+  NgxHTTPClient &operator=(const NgxHTTPClient &) = delete;
+
+  // Both are set before the first request, if at all.
+  void set_shortcut(Shortcut shortcut) { shortcut_ = std::move(shortcut); }
+  void set_tap(Tap tap) { tap_ = std::move(tap); }
+
+  // The hostname of an agent is resolved with the `resolver` of the http
+  // block when the first request is sent to it, and again after its address
+  // has been used for a while, or once a connection to it failed. Without a
+  // resolver, it is looked up once when the first request is sent, with a
+  // blocking lookup that is only repeated, at most every few seconds, until
+  // it finds an address.
+  dd::Expected<void> post(const URL &url, HeadersSetter set_headers,
+                          std::string body, ResponseHandler on_response,
+                          ErrorHandler on_error,
+                          std::chrono::steady_clock::time_point deadline)
+      override;
+
+  // The event loop does not run anymore when the tracer is destroyed, so the
+  // connections with a request in progress are polled here until they are
+  // done or `deadline` is reached.
+  void drain(std::chrono::steady_clock::time_point deadline) override;
+
+  std::string config() const override;
+};
+
+}  // namespace nginx
+}  // namespace datadog
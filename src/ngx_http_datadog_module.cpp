@@ -1,5 +1,7 @@
 #include "ngx_http_datadog_module.h"
 
+#include <datadog/environment.h>
+
 #include <cassert>
 #include <cstdlib>
 #include <exception>
@@ -19,13 +21,20 @@
 #include "global_tracer.h"
 #include "ngx_logger.h"
 #if defined(WITH_WAF)
+#include "security/api_security.h"
+#include "security/client_throttle.h"
 #include "security/library.h"
+#include "security/remote_cfg_relay.h"
+#include "security/verdict_cache.h"
 #include "security/waf_remote_cfg.h"
 #endif
 #if defined(WITH_RUM)
 #include "rum/config.h"
+#include "rum/offset_cache.h"
 #endif
 #include "string_util.h"
+#include "trace_queue.h"
+#include "trace_ring.h"
 #include "tracing_library.h"
 #include "version.h"
 
@@ -50,6 +59,39 @@ static char *merge_datadog_loc_conf(ngx_conf_t *, void *parent, void *child) noe
 
 using namespace datadog::nginx;
 
+static ngx_conf_enum_t datadog_trace_queue_drop_policies[] = {
+    {ngx_string("oldest"),
+     static_cast<ngx_uint_t>(TraceQueue::drop_policy::OLDEST)},
+    {ngx_string("lowest_priority"),
+     static_cast<ngx_uint_t>(TraceQueue::drop_policy::LOWEST_PRIORITY)},
+    {ngx_null_string, 0},
+};
+
+#ifdef WITH_WAF
+static ngx_conf_enum_t datadog_appsec_throttle_actions[] = {
+    {ngx_string("block"),
+     static_cast<ngx_uint_t>(security::ClientThrottle::action::BLOCK)},
+    {ngx_string("rate_limit"),
+     static_cast<ngx_uint_t>(security::ClientThrottle::action::RATE_LIMIT)},
+    {ngx_null_string, 0},
+};
+
+// a zero window would divide by zero, and a zero threshold throttle everyone
+static ngx_conf_num_bounds_t datadog_appsec_throttle_threshold_bounds = {
+    ngx_conf_check_num_bounds, 1, -1};
+
+static char *check_appsec_throttle_window(ngx_conf_t *, void *,
+                                          void *data) noexcept {
+  if (*static_cast<time_t *>(data) < 1) {
+    return const_cast<char *>("must be at least 1s");
+  }
+  return NGX_CONF_OK;
+}
+
+static ngx_conf_post_t datadog_appsec_throttle_window_post = {
+    check_appsec_throttle_window};
+#endif
+
 #ifndef DATADOG_RUM_DIRECTIVES
 #define DATADOG_RUM_DIRECTIVES
 #endif
@@ -256,6 +298,27 @@ static ngx_command_t datadog_commands[] = {
       0,
       nullptr},
 
+    { ngx_string("datadog_trace_ring_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      set_trace_ring_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      nullptr},
+
+    { ngx_string("datadog_trace_queue_size"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, trace_queue_size),
+      nullptr},
+
+    { ngx_string("datadog_trace_queue_drop"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, trace_queue_drop),
+      datadog_trace_queue_drop_policies},
+
     { ngx_string("datadog_delegate_sampling"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1 | NGX_CONF_NOARGS,
       ngx_conf_set_flag_slot,
@@ -342,6 +405,15 @@ static ngx_command_t datadog_commands[] = {
       nullptr,
     },
 
+    {
+      ngx_string("datadog_appsec_waf_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(datadog_loc_conf_t, appsec_waf_budget),
+      nullptr,
+    },
+
     {
       ngx_string("datadog_appsec_obfuscation_key_regex"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
@@ -359,6 +431,141 @@ static ngx_command_t datadog_commands[] = {
       offsetof(datadog_main_conf_t, appsec_obfuscation_value_regex),
       nullptr,
     },
+
+    {
+      ngx_string("datadog_appsec_throttle_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      set_appsec_throttle_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_throttle_threshold"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_throttle_threshold),
+      &datadog_appsec_throttle_threshold_bounds,
+    },
+
+    {
+      ngx_string("datadog_appsec_throttle_window"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_throttle_window),
+      &datadog_appsec_throttle_window_post,
+    },
+
+    {
+      ngx_string("datadog_appsec_throttle_action"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_throttle_action),
+      datadog_appsec_throttle_actions,
+    },
+
+    {
+      ngx_string("datadog_appsec_remote_config_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      set_appsec_remote_config_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_verdict_cache_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_verdict_cache_size),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_max_body_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_max_body_size),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_max_body_fields"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_max_body_fields),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_max_response_body_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_max_response_body_size),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_async_final_waf_run"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_async_final_waf_run),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_max_event_json_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_max_event_json_size),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_event_log_rate"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_event_log_rate),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_api_security"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_api_security),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_api_security_sample_delay"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(datadog_main_conf_t, appsec_api_security_sample_delay),
+      nullptr,
+    },
+
+    {
+      ngx_string("datadog_appsec_waf_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      set_appsec_waf_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      nullptr,
+    },
 #endif
     DATADOG_RUM_DIRECTIVES
     ngx_null_command
@@ -539,6 +746,38 @@ static ngx_int_t datadog_master_process_post_config(
   return NGX_OK;
 }
 
+// The trace ring and the trace queue replace dd-trace-cpp's agent collector,
+// which is also what polls remote configuration: ASM_DD rules, ASM_DATA and
+// AppSec activation would silently stop being applied. Require remote
+// configuration to be turned off explicitly instead; AppSec then has to be
+// enabled by datadog_appsec_enabled or DD_APPSEC_ENABLED.
+static ngx_int_t check_trace_collector(
+    ngx_conf_t *cf, const datadog_main_conf_t &main_conf) noexcept {
+  const char *directive = nullptr;
+  if (main_conf.trace_ring_zone != nullptr) {
+    directive = "datadog_trace_ring_zone";
+  } else if (main_conf.trace_queue_size != NGX_CONF_UNSET_SIZE) {
+    directive = "datadog_trace_queue_size";
+  } else {
+    return NGX_OK;
+  }
+
+  const auto env_value =
+      dd::environment::lookup(dd::environment::DD_REMOTE_CONFIGURATION_ENABLED);
+  const std::string_view value = env_value.value_or("");
+  const bool remote_config_disabled = value == "0" || value == "false" ||
+                                      value == "no" || value == "off";
+  if (!remote_config_disabled) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "%s does not support remote configuration; set "
+                       "DD_REMOTE_CONFIGURATION_ENABLED=false",
+                       directive);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
 static ngx_int_t datadog_module_init(ngx_conf_t *cf) noexcept {
   ngx_http_next_header_filter = ngx_http_top_header_filter;
   ngx_http_top_header_filter = on_header_filter;
@@ -546,6 +785,11 @@ static ngx_int_t datadog_module_init(ngx_conf_t *cf) noexcept {
   ngx_http_next_output_body_filter = ngx_http_top_body_filter;
   ngx_http_top_body_filter = on_output_body_filter;
 
+#ifdef WITH_WAF
+  ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+  ngx_http_top_request_body_filter = on_request_body_filter;
+#endif
+
   auto core_main_config = static_cast<ngx_http_core_main_conf_t *>(
       ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module));
   auto main_conf = static_cast<datadog_main_conf_t *>(
@@ -556,6 +800,10 @@ static ngx_int_t datadog_module_init(ngx_conf_t *cf) noexcept {
     return NGX_OK;
   }
 
+  if (check_trace_collector(cf, *main_conf) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
   // Add handlers to create tracing data.
   if (set_handler(cf->log, core_main_config, NGX_HTTP_REWRITE_PHASE,
                   on_enter_block) != NGX_OK) {
@@ -607,6 +855,10 @@ static ngx_int_t datadog_init_worker(ngx_cycle_t *cycle) noexcept try {
     if (initial_waf_cfg) {
       security::register_default_config(std::move(*initial_waf_cfg), logger);
     }
+    security::ClientThrottle::initialize(*main_conf);
+    security::RemoteConfigRelay::initialize(*main_conf);
+    security::VerdictCache::initialize(*main_conf);
+    security::ApiSecuritySampler::initialize(*main_conf);
   } catch (const std::exception &e) {
     ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                   "Initialising security library failed: %s", e.what());
@@ -614,6 +866,12 @@ static ngx_int_t datadog_init_worker(ngx_cycle_t *cycle) noexcept try {
   }
 #endif
 
+#ifdef WITH_RUM
+  rum::OffsetCache::initialize(*main_conf);
+#endif
+
+  TraceRing::initialize(*main_conf);
+
   auto maybe_tracer = TracingLibrary::make_tracer(*main_conf, logger);
   if (auto *error = maybe_tracer.if_error()) {
     ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
@@ -631,6 +889,12 @@ static ngx_int_t datadog_init_worker(ngx_cycle_t *cycle) noexcept try {
 }
 
 static void datadog_exit_worker(ngx_cycle_t *cycle) noexcept {
+#ifdef WITH_WAF
+  if (auto *cache = security::VerdictCache::get_instance()) {
+    cache->log_stats(*cycle->log);
+  }
+#endif
+
   // If the `dd::Tracer` singleton has been set (in `datadog_init_worker`),
   // destroy it.
   reset_global_tracer();
@@ -693,6 +957,10 @@ static void *create_datadog_loc_conf(ngx_conf_t *conf) noexcept {
 #ifdef WITH_RUM
   loc_conf->rum_enable = NGX_CONF_UNSET;
   loc_conf->rum_snippet = nullptr;
+  loc_conf->rum_snippet_content = ngx_null_string;
+  loc_conf->rum_gzip = NGX_CONF_UNSET;
+  loc_conf->rum_gzip_comp_level = NGX_CONF_UNSET;
+  loc_conf->rum_debug_spans = NGX_CONF_UNSET;
 #endif
 
   return loc_conf;
@@ -820,10 +1088,24 @@ static char *merge_datadog_loc_conf(ngx_conf_t *cf, void *parent,
   if (conf->waf_pool == nullptr) {
     conf->waf_pool = prev->waf_pool;
   }
+  ngx_conf_merge_msec_value(conf->appsec_waf_budget, prev->appsec_waf_budget,
+                            NGX_CONF_UNSET_MSEC);
+
+  // waf_pool is what decides whether the WAF runs in a location. If AppSec is
+  // explicitly disabled, it can't be enabled later via remote config, so no
+  // location needs it.
+  auto *main_conf = static_cast<datadog_main_conf_t *>(
+      ngx_http_conf_get_module_main_conf(cf, ngx_http_datadog_module));
+  if (main_conf != nullptr && main_conf->appsec_enabled == 0) {
+    conf->waf_pool = nullptr;
+  }
 #endif
 
 #ifdef WITH_RUM
-  datadog_rum_merge_loc_config(cf, prev, conf);
+  if (auto rc = datadog_rum_merge_loc_config(cf, prev, conf);
+      rc != NGX_CONF_OK) {
+    return rc;
+  }
 #endif
 
   return NGX_CONF_OK;
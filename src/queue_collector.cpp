@@ -0,0 +1,274 @@
+#include "queue_collector.h"
+
+#include <datadog/dict_writer.h>
+#include <datadog/error.h>
+#include <datadog/span_data.h>
+#include <datadog/tags.h>
+#include <datadog/trace_sampler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+
+#include "trace_batch.h"
+
+namespace datadog {
+namespace nginx {
+namespace {
+
+// as dd-trace-cpp flushes by default
+constexpr auto kFlushInterval = std::chrono::seconds(2);
+// when there is nothing to send
+constexpr auto kMaxFlushInterval = 4 * kFlushInterval;
+constexpr auto kRequestTimeout = std::chrono::seconds(2);
+// batches sent at each flush; the rest waits for the next one
+constexpr int kMaxBatchesPerFlush = 8;
+
+// failed batches in a row after which the agent is considered down
+constexpr int kBreakerThreshold = 3;
+// how long the breaker stays open, doubled each time the probe fails
+constexpr time_t kMinBackoffSecs = 5;
+constexpr time_t kMaxBackoffSecs = 60;
+
+int sampling_priority(const std::vector<std::unique_ptr<dd::SpanData>> &spans) {
+  // set on the local root span
+  for (const auto &span : spans) {
+    auto found = span->numeric_tags.find(dd::tags::internal::sampling_priority);
+    if (found != span->numeric_tags.end()) {
+      return static_cast<int>(found->second);
+    }
+  }
+  return 1;
+}
+
+}  // namespace
+
+struct QueueCollector::State {
+  enum class breaker {
+    CLOSED,
+    OPEN,
+    // a batch was sent to find out whether the agent is back
+    PROBING,
+  };
+
+  State(std::size_t budget, TraceQueue::drop_policy policy,
+        std::shared_ptr<dd::Logger> logger)
+      : queue(budget, policy), logger(std::move(logger)) {}
+
+  TraceQueue queue;
+  std::shared_ptr<dd::Logger> logger;
+  // last sampler given to `send`, which takes the agent's sample rates
+  std::shared_ptr<dd::TraceSampler> sampler;
+  Stats stats{};
+  std::size_t in_flight_bytes{0};
+
+  breaker breaker_state{breaker::CLOSED};
+  // batches in a row that failed
+  int failures{0};
+  time_t backoff{0};
+  // end of the current backoff
+  time_t retry_at{0};
+
+  void on_batch_done(std::size_t count, std::size_t size, bool sent);
+  void open_breaker();
+};
+
+void QueueCollector::State::on_batch_done(std::size_t count, std::size_t size,
+                                          bool sent) {
+  in_flight_bytes -= size;
+  stats.batches++;
+
+  if (sent) {
+    stats.sent += count;
+    failures = 0;
+    if (breaker_state != breaker::CLOSED) {
+      breaker_state = breaker::CLOSED;
+      backoff = 0;
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "trace queue: the agent is reachable again");
+    }
+    return;
+  }
+
+  stats.dropped_unsent += count;
+  failures++;
+  if (breaker_state == breaker::PROBING ||
+      (breaker_state == breaker::CLOSED && failures >= kBreakerThreshold)) {
+    open_breaker();
+  }
+}
+
+void QueueCollector::State::open_breaker() {
+  backoff = backoff == 0 ? kMinBackoffSecs
+                         : std::min(2 * backoff, kMaxBackoffSecs);
+  retry_at = ngx_time() + backoff;
+  breaker_state = breaker::OPEN;
+  stats.breaker_trips++;
+  ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                "trace queue: the agent is unreachable, traces are dropped "
+                "for the next %T seconds",
+                backoff);
+}
+
+QueueCollector::QueueCollector(
+    const dd::HTTPClient::URL &agent_url, std::size_t budget,
+    TraceQueue::drop_policy policy, std::shared_ptr<NgxHTTPClient> http_client,
+    std::shared_ptr<NgxEventScheduler> event_scheduler,
+    std::shared_ptr<dd::Logger> logger)
+    : traces_url_(agent_url),
+      http_client_(std::move(http_client)),
+      event_scheduler_(std::move(event_scheduler)),
+      logger_(logger),
+      state_(std::make_shared<State>(budget, policy, std::move(logger))),
+      // before the queue drops anything
+      early_flush_bytes_(std::min(kMaxBatchSize, budget / 2)),
+      dropped_(0) {
+  traces_url_.path += "/v0.4/traces";
+  flush_event_ = event_scheduler_->schedule_adaptive_event(
+      kFlushInterval, kMaxFlushInterval, [this]() { return flush(); });
+}
+
+QueueCollector::~QueueCollector() {
+  flush_event_.cancel();
+  // The worker exits: what is left is sent, unless the agent is down.
+  if (state_->breaker_state == State::breaker::CLOSED) {
+    while (state_->queue.bytes() != 0) {
+      post_batch(kMaxBatchSize);
+    }
+    http_client_->drain(std::chrono::steady_clock::now() + kRequestTimeout);
+  }
+  log_stats(*ngx_cycle->log);
+}
+
+dd::Expected<void> QueueCollector::send(
+    std::vector<std::unique_ptr<dd::SpanData>> &&spans,
+    const std::shared_ptr<dd::TraceSampler> &response_handler) {
+  State &state = *state_;
+  state.sampler = response_handler;
+
+  if (state.breaker_state != State::breaker::CLOSED) {
+    // not even serialized
+    state.stats.dropped_agent_down++;
+    return std::nullopt;
+  }
+
+  std::string chunk;
+  auto encoded = dd::msgpack_encode(chunk, spans);
+  if (auto *error = encoded.if_error()) {
+    return *error;
+  }
+
+  // A dropped chunk is counted by the queue, and reported at the next flush.
+  // The batches in flight take their part of the budget.
+  state.queue.push(std::move(chunk),
+                   TraceQueue::priority_of(sampling_priority(spans)),
+                   state.in_flight_bytes);
+  // unless the batches in flight hold the budget, the flush would not send
+  if (state.queue.bytes() >= early_flush_bytes_ &&
+      state.in_flight_bytes < state.queue.budget()) {
+    flush_event_.expedite();
+  }
+  return std::nullopt;
+}
+
+bool QueueCollector::flush() {
+  State &state = *state_;
+  bool const busy = state.queue.bytes() != 0;
+  switch (state.breaker_state) {
+    case State::breaker::CLOSED:
+      for (int i = 0; i < kMaxBatchesPerFlush && state.queue.bytes() != 0;
+           ++i) {
+        // The agent is slow: batches in flight hold the budget, and the
+        // queue drops what does not fit until they complete.
+        if (state.in_flight_bytes >= state.queue.budget()) {
+          break;
+        }
+        post_batch(kMaxBatchSize);
+      }
+      break;
+    case State::breaker::OPEN:
+      if (ngx_time() >= state.retry_at) {
+        state.breaker_state = State::breaker::PROBING;
+        post_batch(kMaxBatchSize);
+      }
+      break;
+    case State::breaker::PROBING:
+      break;
+  }
+
+  // reports drops once per flush, rather than once per trace
+  const TraceQueue::Stats &queued = state.queue.stats();
+  std::uint64_t const dropped =
+      queued.dropped_oldest + queued.dropped_lower_priority +
+      queued.dropped_rejected + state.stats.dropped_unsent +
+      state.stats.dropped_agent_down;
+  if (dropped != dropped_) {
+    dropped_ = dropped;
+    log_stats(*ngx_cycle->log);
+  }
+  return busy;
+}
+
+void QueueCollector::post_batch(std::size_t max_bytes) {
+  std::string batch(kBatchHeaderSize, '\0');
+  std::size_t const count = state_->queue.drain(batch, max_bytes);
+  write_batch_header(batch, static_cast<std::uint32_t>(count));
+  std::size_t const size = batch.size();
+  state_->in_flight_bytes += size;
+
+  auto set_headers = [count](dd::DictWriter &headers) {
+    set_batch_headers(headers, count);
+  };
+  auto on_response = [count, size, state = state_](int status,
+                                                   const dd::DictReader &,
+                                                   std::string body) {
+    bool const sent = status >= 200 && status < 300;
+    if (!sent) {
+      state->logger->log_error([&](std::ostream &log) {
+        log << "trace queue: the agent answered a batch of " << count
+            << " traces with status " << status << ": " << body;
+      });
+    }
+    state->on_batch_done(count, size, sent);
+    if (!sent || state->sampler == nullptr) {
+      return;
+    }
+    if (auto response = parse_agent_response(body)) {
+      state->sampler->handle_collector_response(*response);
+    }
+  };
+  auto on_error = [count, size, state = state_](dd::Error error) {
+    state->logger->log_error(error);
+    state->on_batch_done(count, size, false);
+  };
+
+  auto posted = http_client_->post(
+      traces_url_, std::move(set_headers), std::move(batch),
+      std::move(on_response), std::move(on_error),
+      std::chrono::steady_clock::now() + kRequestTimeout);
+  if (auto *error = posted.if_error()) {
+    logger_->log_error(*error);
+    state_->on_batch_done(count, size, false);
+  }
+}
+
+void QueueCollector::log_stats(ngx_log_t &log) const {
+  const TraceQueue::Stats &queued = state_->queue.stats();
+  const Stats &s = state_->stats;
+  ngx_log_error(NGX_LOG_NOTICE, &log, 0,
+                "trace queue: %uL queued, %uL sent in %uL batches, "
+                "%uz/%uz bytes pending, dropped: %uL oldest, "
+                "%uL lower priority, %uL rejected, %uL agent down, "
+                "%uL unsent, agent down %uL times",
+                queued.queued, s.sent, s.batches, state_->queue.bytes(),
+                state_->queue.budget(), queued.dropped_oldest,
+                queued.dropped_lower_priority, queued.dropped_rejected,
+                s.dropped_agent_down, s.dropped_unsent, s.breaker_trips);
+}
+
+std::string QueueCollector::config() const {
+  return R"({"type": "datadog::nginx::QueueCollector"})";
+}
+
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <datadog/collector.h>
+#include <datadog/event_scheduler.h>
+#include <datadog/http_client.h>
+#include <datadog/logger.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dd.h"
+#include "ngx_event_scheduler.h"
+#include "ngx_http_client.h"
+#include "trace_queue.h"
+
+extern "C" {
+#include <ngx_core.h>
+}
+
+namespace datadog {
+namespace nginx {
+
+// Collector of the tracer when the traces of a worker are given a memory
+// budget (datadog_trace_queue_size). Finished trace chunks are serialized
+// into a TraceQueue, which drops chunks according to its policy once the
+// budget is reached, and are sent to the agent at each flush interval. The
+// interval grows while there is nothing to send, and a flush starts early
+// once half the budget, or a full batch, is waiting.
+//
+// Batches in flight count against the budget too: while the agent is slow,
+// no more batches are sent, and the queue absorbs the traffic.
+//
+// A circuit breaker stops the serialization of traces while the agent is
+// down. It opens after a few batches in a row fail, and stays open for a
+// backoff that doubles each time it opens again. Then a single batch (maybe
+// empty) probes the agent, and the breaker closes if it succeeds.
+class QueueCollector : public dd::Collector {
+ public:
+  struct Stats {
+    std::uint64_t batches;
+    std::uint64_t sent;
+    // lost in batches the agent did not accept
+    std::uint64_t dropped_unsent;
+    // not serialized while the breaker was open
+    std::uint64_t dropped_agent_down;
+    // times the breaker opened
+    std::uint64_t breaker_trips;
+  };
+
+  // the state used by the handlers of the requests in flight, which may
+  // complete after the collector is destroyed
+  struct State;
+
+  QueueCollector(const dd::HTTPClient::URL &agent_url, std::size_t budget,
+                 TraceQueue::drop_policy policy,
+                 std::shared_ptr<NgxHTTPClient> http_client,
+                 std::shared_ptr<NgxEventScheduler> event_scheduler,
+                 std::shared_ptr<dd::Logger> logger);
+  ~QueueCollector() override;
+
+  QueueCollector(const QueueCollector &) = delete;
+  QueueCollector &operator=(const QueueCollector &) = delete;
+
+  dd::Expected<void> send(
+      std::vector<std::unique_ptr<dd::SpanData>> &&spans,
+      const std::shared_ptr<dd::TraceSampler> &response_handler) override;
+
+  std::string config() const override;
+
+ private:
+  // @return bool - whether there was anything to send.
+  bool flush();
+  // posts a batch of up to `max_bytes`, which may have no chunks
+  void post_batch(std::size_t max_bytes);
+  void log_stats(ngx_log_t &log) const;
+
+  dd::HTTPClient::URL traces_url_;
+  std::shared_ptr<NgxHTTPClient> http_client_;
+  std::shared_ptr<NgxEventScheduler> event_scheduler_;
+  std::shared_ptr<dd::Logger> logger_;
+  NgxEventScheduler::AdaptiveEvent flush_event_;
+  std::shared_ptr<State> state_;
+  // queued bytes from which a flush starts early
+  std::size_t early_flush_bytes_;
+  // sum of the drop counters at the last flush
+  std::uint64_t dropped_;
+};
+
+}  // namespace nginx
+}  // namespace datadog
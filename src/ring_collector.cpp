@@ -0,0 +1,157 @@
+#include "ring_collector.h"
+
+#include <datadog/dict_writer.h>
+#include <datadog/error.h>
+#include <datadog/span_data.h>
+#include <datadog/trace_sampler.h>
+
+#include <chrono>
+#include <ostream>
+
+#include "trace_batch.h"
+#include "trace_ring.h"
+
+extern "C" {
+#include <ngx_core.h>
+}
+
+namespace datadog {
+namespace nginx {
+namespace {
+
+// as dd-trace-cpp flushes by default
+constexpr auto kFlushInterval = std::chrono::seconds(2);
+// a flusher that stops renewing its lease is replaced after this long
+constexpr time_t kLeaseSecs = 3 * 2;
+constexpr auto kRequestTimeout = std::chrono::seconds(2);
+// batches sent at each flush; the rest waits for the next one
+constexpr int kMaxBatchesPerFlush = 8;
+
+std::uint64_t dropped(const TraceRing::Stats &stats) {
+  return stats.dropped_oldest + stats.dropped_oversized +
+         stats.dropped_contended + stats.dropped_unsent;
+}
+
+}  // namespace
+
+RingCollector::RingCollector(
+    const dd::HTTPClient::URL &agent_url,
+    std::shared_ptr<NgxHTTPClient> http_client,
+    std::shared_ptr<dd::EventScheduler> event_scheduler,
+    std::shared_ptr<dd::Logger> logger)
+    : traces_url_(agent_url),
+      http_client_(std::move(http_client)),
+      event_scheduler_(std::move(event_scheduler)),
+      logger_(std::move(logger)),
+      rates_generation_(0),
+      dropped_(0) {
+  traces_url_.path += "/v0.4/traces";
+  cancel_flush_ = event_scheduler_->schedule_recurring_event(
+      kFlushInterval, [this]() { flush(); });
+}
+
+RingCollector::~RingCollector() {
+  cancel_flush_();
+  // The worker exits: the flusher sends what is left, and another worker
+  // takes over.
+  if (TraceRing::lead(kLeaseSecs)) {
+    flush();
+    http_client_->drain(std::chrono::steady_clock::now() + kRequestTimeout);
+    TraceRing::log_stats(*ngx_cycle->log);
+    TraceRing::resign();
+  }
+}
+
+dd::Expected<void> RingCollector::send(
+    std::vector<std::unique_ptr<dd::SpanData>> &&spans,
+    const std::shared_ptr<dd::TraceSampler> &response_handler) {
+  sampler_ = response_handler;
+
+  std::string chunk;
+  auto encoded = dd::msgpack_encode(chunk, spans);
+  if (auto *error = encoded.if_error()) {
+    return *error;
+  }
+
+  // a dropped chunk is counted by the ring, and reported by the flusher
+  TraceRing::push(chunk);
+  return std::nullopt;
+}
+
+void RingCollector::flush() {
+  apply_rates();
+  if (!TraceRing::lead(kLeaseSecs)) {
+    return;
+  }
+
+  for (int i = 0; i < kMaxBatchesPerFlush; ++i) {
+    std::string batch(kBatchHeaderSize, '\0');
+    std::size_t const count = TraceRing::drain(batch, kMaxBatchSize);
+    if (count == 0) {
+      break;
+    }
+    write_batch_header(batch, static_cast<std::uint32_t>(count));
+
+    auto set_headers = [count](dd::DictWriter &headers) {
+      set_batch_headers(headers, count);
+    };
+    // The handlers may run after the collector is destroyed, so they only
+    // use the ring.
+    auto on_response = [count, logger = logger_](int status,
+                                                 const dd::DictReader &,
+                                                 std::string body) {
+      bool const sent = status >= 200 && status < 300;
+      TraceRing::record_batch(count, sent);
+      if (!sent) {
+        logger->log_error([&](std::ostream &log) {
+          log << "trace ring: the agent answered a batch of " << count
+              << " traces with status " << status << ": " << body;
+        });
+        return;
+      }
+      TraceRing::publish_rates(body);
+    };
+    auto on_error = [count, logger = logger_](dd::Error error) {
+      TraceRing::record_batch(count, false);
+      logger->log_error(error);
+    };
+
+    auto posted =
+        http_client_->post(traces_url_, std::move(set_headers),
+                           std::move(batch), std::move(on_response),
+                           std::move(on_error),
+                           std::chrono::steady_clock::now() + kRequestTimeout);
+    if (auto *error = posted.if_error()) {
+      TraceRing::record_batch(count, false);
+      logger_->log_error(*error);
+    }
+  }
+
+  // reports drops once per flush, rather than once per trace
+  auto const stats = TraceRing::stats();
+  if (dropped(stats) != dropped_) {
+    dropped_ = dropped(stats);
+    TraceRing::log_stats(*ngx_cycle->log);
+  }
+}
+
+void RingCollector::apply_rates() {
+  if (sampler_ == nullptr) {
+    return;
+  }
+  std::string const body = TraceRing::rates_since(rates_generation_);
+  if (body.empty()) {
+    return;
+  }
+
+  if (auto response = parse_agent_response(body)) {
+    sampler_->handle_collector_response(*response);
+  }
+}
+
+std::string RingCollector::config() const {
+  return R"({"type": "datadog::nginx::RingCollector"})";
+}
+
+}  // namespace nginx
+}  // namespace datadog
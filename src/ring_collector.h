@@ -0,0 +1,60 @@
+#pragma once
+
+#include <datadog/collector.h>
+#include <datadog/event_scheduler.h>
+#include <datadog/http_client.h>
+#include <datadog/logger.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dd.h"
+#include "ngx_http_client.h"
+
+namespace datadog {
+namespace nginx {
+
+// Collector of the tracer when the trace ring is enabled
+// (datadog_trace_ring_zone). Finished trace chunks are serialized into the
+// ring instead of being buffered in the worker. At each flush interval, the
+// worker holding the flusher lease drains the ring into batches for the
+// agent, and publishes the sample rates of the agent response, which every
+// worker then gives to its trace sampler.
+class RingCollector : public dd::Collector {
+  dd::HTTPClient::URL traces_url_;
+  std::shared_ptr<NgxHTTPClient> http_client_;
+  std::shared_ptr<dd::EventScheduler> event_scheduler_;
+  std::shared_ptr<dd::Logger> logger_;
+  dd::EventScheduler::Cancel cancel_flush_;
+
+  // last sampler given to `send`, which takes the agent's sample rates
+  std::shared_ptr<dd::TraceSampler> sampler_;
+  // of the last agent response given to `sampler_`
+  std::uint64_t rates_generation_;
+  // sum of the drop counters of the ring at the last flush
+  std::uint64_t dropped_;
+
+  void flush();
+  void apply_rates();
+
+ public:
+  RingCollector(const dd::HTTPClient::URL &agent_url,
+                std::shared_ptr<NgxHTTPClient> http_client,
+                std::shared_ptr<dd::EventScheduler> event_scheduler,
+                std::shared_ptr<dd::Logger> logger);
+  ~RingCollector() override;
+
+  RingCollector(const RingCollector &) = delete;
+  RingCollector &operator=(const RingCollector &) = delete;
+
+  dd::Expected<void> send(
+      std::vector<std::unique_ptr<dd::SpanData>> &&spans,
+      const std::shared_ptr<dd::TraceSampler> &response_handler) override;
+
+  std::string config() const override;
+};
+
+}  // namespace nginx
+}  // namespace datadog
@@ -6,6 +6,7 @@
 
 #include <charconv>
 
+#include "injection.h"
 #include "string_util.h"
 
 namespace {
@@ -157,6 +158,13 @@ char *on_datadog_rum_config(ngx_conf_t *cf, ngx_command_t *command,
   }
 
   loc_conf->rum_snippet = snippet;
+  loc_conf->rum_snippet_content =
+      datadog::nginx::rum::InjectionHandler::locate_snippet(snippet);
+  if (loc_conf->rum_snippet_content.len == 0) {
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "could not locate the RUM SDK script in the memory of "
+                       "the injector, it will be copied in each response");
+  }
   return NGX_CONF_OK;
 }
 
@@ -166,8 +174,26 @@ char *datadog_rum_merge_loc_config(ngx_conf_t *cf,
   ngx_conf_merge_value(child->rum_enable, parent->rum_enable, 0);
   if (child->rum_snippet == nullptr) {
     child->rum_snippet = parent->rum_snippet;
+    child->rum_snippet_content = parent->rum_snippet_content;
+  }
+
+  ngx_conf_merge_value(child->rum_gzip, parent->rum_gzip, 0);
+  ngx_conf_merge_value(child->rum_gzip_comp_level,
+                       parent->rum_gzip_comp_level, 1);
+  if (child->rum_gzip_comp_level < 1 || child->rum_gzip_comp_level > 9) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "datadog_rum_gzip_comp_level must be between 1 and 9");
+    return static_cast<char *>(NGX_CONF_ERROR);
   }
 
-  return NGX_OK;
+  if (ngx_http_merge_types(cf, &child->rum_types_keys, &child->rum_types,
+                           &parent->rum_types_keys, &parent->rum_types,
+                           ngx_http_html_default_types) != NGX_CONF_OK) {
+    return static_cast<char *>(NGX_CONF_ERROR);
+  }
+
+  ngx_conf_merge_value(child->rum_debug_spans, parent->rum_debug_spans, 0);
+
+  return NGX_CONF_OK;
 }
 }
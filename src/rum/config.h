@@ -33,6 +33,31 @@ char *datadog_rum_merge_loc_config(ngx_conf_t *cf,
       ngx_string("datadog_rum_config"), \
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_BLOCK | NGX_CONF_TAKE1, \
       on_datadog_rum_config, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL \
+    }, \
+    { \
+      ngx_string("datadog_rum_gzip"), \
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG, \
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(datadog_loc_conf_t, rum_gzip), NULL \
+    }, \
+    { \
+      ngx_string("datadog_rum_gzip_comp_level"), \
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1, \
+      ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(datadog_loc_conf_t, rum_gzip_comp_level), NULL \
+    }, \
+    { \
+      ngx_string("datadog_rum_offset_cache_size"), \
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1, \
+      ngx_conf_set_num_slot, NGX_HTTP_MAIN_CONF_OFFSET, offsetof(datadog_main_conf_t, rum_offset_cache_size), NULL \
+    }, \
+    { \
+      ngx_string("datadog_rum_types"), \
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE, \
+      ngx_http_types_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(datadog_loc_conf_t, rum_types_keys), &ngx_http_html_default_types[0] \
+    }, \
+    { \
+      ngx_string("datadog_rum_debug_spans"), \
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG, \
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(datadog_loc_conf_t, rum_debug_spans), NULL \
     },
 // clang-format on
 }
@@ -0,0 +1,231 @@
+#include "gzip_stream.h"
+
+#include <cstddef>
+
+#include "ngx_http_datadog_module.h"
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+namespace {
+
+// decompressed bytes handed to the injector at a time
+constexpr std::size_t kWindowSize = 32 * 1024;
+// size of the compressed buffers sent to the next filters
+constexpr std::size_t kBufferSize = 8 * 1024;
+
+// The window of the upstream compressor is unknown, so the largest one is
+// used to decompress. Adding 16 to the window bits selects the gzip format.
+constexpr int kMaxWindowBits = 15;
+constexpr int kMinWindowBits = 9;
+constexpr int kMaxMemLevel = 8;
+constexpr int kGzipFormat = 16;
+
+void *zalloc(void *opaque, uInt items, uInt size) {
+  return ngx_palloc(static_cast<ngx_pool_t *>(opaque),
+                    static_cast<std::size_t>(items) * size);
+}
+
+// released along with the request pool
+void zfree(void *, void *) {}
+
+ngx_buf_tag_t tag() { return (ngx_buf_tag_t)&ngx_http_datadog_module; }
+
+}  // namespace
+
+GzipStream::GzipStream()
+    : pool_(nullptr),
+      inflate_{},
+      deflate_{},
+      pending_(false),
+      window_{},
+      out_(nullptr),
+      free_(nullptr),
+      busy_(nullptr) {}
+
+bool GzipStream::init(ngx_pool_t *pool, int level, off_t content_length) {
+  pool_ = pool;
+
+  auto *window = static_cast<u_char *>(ngx_palloc(pool, kWindowSize));
+  if (window == nullptr) {
+    return false;
+  }
+  window_.start = window;
+  window_.pos = window;
+  window_.last = window;
+  window_.end = window + kWindowSize;
+  window_.temporary = 1;
+  window_.tag = tag();
+
+  inflate_.zalloc = zalloc;
+  inflate_.zfree = zfree;
+  inflate_.opaque = pool;
+  if (inflateInit2(&inflate_, kMaxWindowBits + kGzipFormat) != Z_OK) {
+    return false;
+  }
+
+  // As nginx's gzip module does, the window and the hash table are made
+  // smaller for small bodies.
+  int window_bits = kMaxWindowBits;
+  int mem_level = kMaxMemLevel;
+  if (content_length > 0) {
+    while (window_bits > kMinWindowBits &&
+           content_length < (off_t{1} << (window_bits - 1))) {
+      window_bits--;
+      mem_level--;
+    }
+    if (mem_level < 1) {
+      mem_level = 1;
+    }
+  }
+
+  deflate_.zalloc = zalloc;
+  deflate_.zfree = zfree;
+  deflate_.opaque = pool;
+  return deflateInit2(&deflate_, level, Z_DEFLATED, window_bits + kGzipFormat,
+                      mem_level, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+ngx_buf_t *GzipStream::inflate(ngx_buf_t *in) {
+  window_.pos = window_.start;
+  window_.last = window_.start;
+  window_.flush = 0;
+  window_.sync = 0;
+  window_.last_buf = 0;
+  window_.last_in_chain = 0;
+
+  inflate_.next_in = in->pos;
+  inflate_.avail_in = in->last - in->pos;
+  inflate_.next_out = window_.start;
+  inflate_.avail_out = kWindowSize;
+
+  while (inflate_.avail_out != 0 && (inflate_.avail_in != 0 || pending_)) {
+    pending_ = false;
+    int const rc = ::inflate(&inflate_, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+      // a gzip file can have several members
+      if (inflateReset(&inflate_) != Z_OK) {
+        return nullptr;
+      }
+      continue;
+    }
+    if (rc == Z_BUF_ERROR) {
+      break;
+    }
+    if (rc != Z_OK) {
+      return nullptr;
+    }
+  }
+  pending_ = inflate_.avail_out == 0;
+
+  in->pos = inflate_.next_in;
+  window_.last = inflate_.next_out;
+
+  if (in->pos == in->last && !pending_) {
+    window_.flush = in->flush;
+    window_.sync = in->sync;
+    window_.last_buf = in->last_buf;
+    window_.last_in_chain = in->last_in_chain;
+  }
+  return &window_;
+}
+
+bool GzipStream::deflate(ngx_chain_t *in, ngx_chain_t ***out) {
+  // appends the buffer being filled to the output
+  auto emit = [&]() {
+    ngx_chain_t *cl = ngx_alloc_chain_link(pool_);
+    if (cl == nullptr) {
+      return false;
+    }
+    cl->buf = out_;
+    cl->next = nullptr;
+    **out = cl;
+    *out = &cl->next;
+    out_ = nullptr;
+    return true;
+  };
+
+  for (ngx_chain_t *cl = in; cl != nullptr; cl = cl->next) {
+    ngx_buf_t *buf = cl->buf;
+    int const flush = buf->last_buf                ? Z_FINISH
+                      : (buf->flush || buf->sync) ? Z_SYNC_FLUSH
+                                                   : Z_NO_FLUSH;
+
+    deflate_.next_in = buf->pos;
+    deflate_.avail_in = buf->last - buf->pos;
+    buf->pos = buf->last;
+    if (deflate_.avail_in == 0 && flush == Z_NO_FLUSH) {
+      continue;
+    }
+
+    for (;;) {
+      if (out_ == nullptr) {
+        if (free_ != nullptr) {
+          ngx_chain_t *link = free_;
+          free_ = link->next;
+          out_ = link->buf;
+          ngx_free_chain(pool_, link);
+        } else {
+          out_ = ngx_create_temp_buf(pool_, kBufferSize);
+          if (out_ == nullptr) {
+            return false;
+          }
+        }
+        out_->tag = tag();
+        out_->temporary = 1;
+        out_->recycled = 1;
+        out_->flush = 0;
+        out_->sync = 0;
+        out_->last_buf = 0;
+        out_->last_in_chain = 0;
+      }
+
+      deflate_.next_out = out_->last;
+      deflate_.avail_out = out_->end - out_->last;
+      int const rc = ::deflate(&deflate_, flush);
+      out_->last = deflate_.next_out;
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+        return false;
+      }
+
+      if (out_->last == out_->end) {
+        if (!emit()) {
+          return false;
+        }
+        continue;
+      }
+      if (flush == Z_FINISH ? rc == Z_STREAM_END : deflate_.avail_in == 0) {
+        break;
+      }
+    }
+
+    // the loop above leaves a buffer to fill
+    if (flush != Z_NO_FLUSH) {
+      if (out_->pos == out_->last) {
+        // an empty buffer in memory is not expected by the next filters
+        out_->temporary = 0;
+      }
+      out_->flush = buf->flush;
+      out_->sync = buf->sync;
+      out_->last_buf = buf->last_buf;
+      out_->last_in_chain = buf->last_in_chain;
+      if (!emit()) {
+        return false;
+      }
+    }
+  }
+
+  // a buffer is not filled any further once sent
+  if (out_ != nullptr && out_->pos != out_->last) {
+    return emit();
+  }
+  return true;
+}
+
+void GzipStream::update_chains(ngx_chain_t **out) {
+  ngx_chain_update_chains(pool_, &free_, &busy_, out, tag());
+}
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,67 @@
+#pragma once
+
+extern "C" {
+#include <ngx_core.h>
+}
+
+#include <zlib.h>
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+
+// Decompresses a gzip response body and compresses it again, so that the RUM
+// Browser SDK can be injected in between.
+//
+// The decompressed bytes go through a single window of fixed size, which is
+// reused once its content is compressed again. zlib allocates from the
+// request pool, and its memory is released along with the request.
+class GzipStream final {
+  ngx_pool_t *pool_;
+  z_stream inflate_;
+  z_stream deflate_;
+  // whether the last call to `inflate()` filled the window, in which case
+  // zlib may have more output for the same input
+  bool pending_;
+
+  // decompressed bytes
+  ngx_buf_t window_;
+
+  // compressed bytes: the buffer being filled, the buffers free to reuse,
+  // and the buffers not sent yet
+  ngx_buf_t *out_;
+  ngx_chain_t *free_;
+  ngx_chain_t *busy_;
+
+ public:
+  GzipStream();
+
+  // Initializes both streams. The compression window is reduced for small
+  // bodies, using `content_length` (the compressed length, -1 if unknown) as
+  // a lower bound of the decompressed length.
+  // @return bool - false if zlib could not be initialized.
+  bool init(ngx_pool_t *pool, int level, off_t content_length);
+
+  // Decompresses bytes of `in` into the window, until the window is full or
+  // `in` is consumed, and moves `in->pos` past the bytes consumed. The window
+  // gets the flags of `in` once it is consumed and there is no more output.
+  // @return ngx_buf_t* - The window, or nullptr if the data is not valid
+  // gzip.
+  ngx_buf_t *inflate(ngx_buf_t *in);
+
+  // Whether `inflate()` has to be called again, even if `in` is consumed.
+  bool pending() const noexcept { return pending_; }
+
+  // Compresses the bytes of `in`, flushing on flush and sync buffers and
+  // finishing the stream on the last buffer, and appends the compressed
+  // buffers to the chain ending at `*out`.
+  // @return bool - false if memory could not be allocated.
+  bool deflate(ngx_chain_t *in, ngx_chain_t ***out);
+
+  // Makes the buffers sent by the next filters available again.
+  void update_chains(ngx_chain_t **out);
+};
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
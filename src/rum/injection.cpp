@@ -4,7 +4,9 @@ extern "C" {
 #include <ngx_core.h>
 }
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "datadog_conf.h"
 #include "ngx_http_datadog_module.h"
@@ -15,9 +17,16 @@ namespace nginx {
 namespace rum {
 namespace {
 
-ngx_table_elt_t *search_header(ngx_http_request_t *request,
-                               std::string_view key) {
-  ngx_list_part_t *part = &request->headers_in.headers.part;
+// Whether an upstream already injected the SDK: an nginx in front of another
+// one would inject it twice otherwise.
+bool injected_by_upstream(const ngx_http_request_t &request) {
+  // only proxied responses can have the header
+  if (request.upstream == nullptr) {
+    return false;
+  }
+
+  constexpr std::string_view key = "x-datadog-rum-injected";
+  const ngx_list_part_t *part = &request.headers_out.headers.part;
   auto *h = static_cast<ngx_table_elt_t *>(part->elts);
 
   for (std::size_t i = 0;; i++) {
@@ -31,27 +40,46 @@ ngx_table_elt_t *search_header(ngx_http_request_t *request,
       i = 0;
     }
 
-    if (key.size() != h[i].key.len ||
-        ngx_strcasecmp((u_char *)key.data(), h[i].key.data) != 0) {
+    if (h[i].hash == 0 || key.size() != h[i].key.len ||
+        ngx_strncasecmp((u_char *)key.data(), h[i].key.data, key.size()) !=
+            0) {
       continue;
     }
 
-    return &h[i];
+    return nginx::to_string_view(h[i].value) == "1";
   }
 
-  return nullptr;
+  return false;
 }
 
-bool is_html_content(ngx_str_t *content_type) {
-  assert(content_type != nullptr);
-  std::string_view content_type_sv = to_string_view(*content_type);
-  return content_type_sv.find("text/html") != content_type_sv.npos;
+// Links the buffer at the end of the output chain and returns the new end,
+// or nullptr if memory could not be allocated.
+ngx_chain_t **append(ngx_pool_t *pool, ngx_chain_t **out, ngx_buf_t *buf) {
+  ngx_chain_t *cl = ngx_alloc_chain_link(pool);
+  if (cl == nullptr) {
+    return nullptr;
+  }
+  cl->buf = buf;
+  cl->next = nullptr;
+  *out = cl;
+  return &cl->next;
+}
+
+bool is_gzip(const ngx_str_t &content_encoding) {
+  return content_encoding.len == 4 &&
+         ngx_strncasecmp(content_encoding.data, (u_char *)"gzip", 4) == 0;
 }
 
 }  // namespace
 
 InjectionHandler::InjectionHandler()
-    : output_padding_(false), injector_(nullptr) {}
+    : output_padding_(false),
+      snippet_(ngx_null_string),
+      snippet_length_(0),
+      injector_(nullptr),
+      held_(0),
+      cached_{},
+      seen_{} {}
 
 InjectionHandler::~InjectionHandler() {
   if (injector_ != nullptr) {
@@ -59,64 +87,76 @@ InjectionHandler::~InjectionHandler() {
   }
 }
 
-ngx_int_t InjectionHandler::on_rewrite_handler(ngx_http_request_t *r) {
-  ngx_table_elt_t *h =
-      static_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_in.headers));
-  if (h == nullptr) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "RUM SDK injection failed: unable to add "
-                  "x-datadog-rum-injection-pending HTTP header");
-    return NGX_ERROR;
-  }
-
-  ngx_str_set(&h->key, "x-datadog-rum-injection-pending");
-  ngx_str_set(&h->value, "1");
-  h->lowcase_key = h->key.data;
-  h->hash = 1;
-
-  return NGX_DECLINED;
-}
-
-ngx_int_t InjectionHandler::on_header_filter(
-    ngx_http_request_t *r, datadog_loc_conf_t *cfg,
-    ngx_http_output_header_filter_pt &next_header_filter) {
+ngx_int_t InjectionHandler::on_header_filter(ngx_http_request_t *r,
+                                            datadog_loc_conf_t *cfg) {
   assert(cfg->rum_snippet != nullptr);
 
   if (!cfg->rum_enable) {
-    return next_header_filter(r);
-  }
-
-  if (auto injected_header = search_header(r, "x-datadog-rum-injected");
-      injected_header != nullptr) {
-    if (nginx::to_string_view(injected_header->value) == "1") {
-      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                    "RUM SDK injection skipped: resource may already have RUM "
-                    "SDK injected.");
-      return next_header_filter(r);
-    }
+    return NGX_OK;
   }
 
   if (r->header_only || r->headers_out.content_length_n == 0) {
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection skipped: empty content");
-    return next_header_filter(r);
+    return NGX_OK;
   }
 
-  if (!is_html_content(&r->headers_out.content_type)) {
+  if (ngx_http_test_content_type(r, &cfg->rum_types) == nullptr) {
     ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "RUM SDK injection skipped: not an HTML page");
-    return next_header_filter(r);
+    return NGX_OK;
+  }
+
+  if (injected_by_upstream(*r)) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "RUM SDK injection skipped: resource may already have RUM "
+                  "SDK injected.");
+    return NGX_OK;
   }
 
   if (auto content_encoding = r->headers_out.content_encoding;
       content_encoding != nullptr && content_encoding->value.len != 0) {
-    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                  "RUM SDK injection skipped: compressed html content");
-    return next_header_filter(r);
+    if (!cfg->rum_gzip || !is_gzip(content_encoding->value)) {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "RUM SDK injection skipped: compressed html content");
+      return NGX_OK;
+    }
+
+    gzip_ = std::make_unique<GzipStream>();
+    if (!gzip_->init(r->pool, cfg->rum_gzip_comp_level,
+                     r->headers_out.content_length_n)) {
+      gzip_.reset();
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "RUM SDK injection skipped: unable to initialize zlib");
+      return NGX_OK;
+    }
+
+    // The length of the body is only known once it is compressed again.
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
   }
 
   state_ = state::searching;
-  injector_ = injector_create(cfg->rum_snippet);
+  snippet_ = cfg->rum_snippet_content;
+  snippet_length_ = cfg->rum_snippet->length;
+
+  // A response seen before is split where the SDK was injected in it, without
+  // going through the injector.
+  if (auto *cache = OffsetCache::get_instance();
+      cache != nullptr && gzip_ == nullptr && snippet_.len != 0) {
+    cache_key_ = OffsetCache::key(*r);
+    if (!cache_key_.empty()) {
+      if (auto entry = cache->lookup(cache_key_)) {
+        cached_ = *entry;
+        state_ = state::cached;
+      }
+    }
+  }
+
+  if (state_ == state::searching) {
+    injector_ = injector_create(cfg->rum_snippet);
+  }
 
   // In case `Transfer-Encoding: chunk` is enabled no need to update the
   // content length.
@@ -152,49 +192,257 @@ ngx_int_t InjectionHandler::on_header_filter(
 ngx_int_t InjectionHandler::on_body_filter(
     ngx_http_request_t *r, datadog_loc_conf_t *cfg, ngx_chain_t *in,
     ngx_http_output_body_filter_pt &next_body_filter) {
-  if (!cfg->rum_enable || in == nullptr || state_ != state::searching) {
+  if (!cfg->rum_enable || in == nullptr) {
     return next_body_filter(r, in);
   }
 
-  ngx_chain_t *output_chain;
-  ngx_chain_t *previous_chain = nullptr;
-  ngx_chain_t **current_chain = &output_chain;
+  if (gzip_ != nullptr) {
+    return recompress(r, in, next_body_filter);
+  }
+
+  if (state_ != state::searching && state_ != state::cached) {
+    return next_body_filter(r, in);
+  }
+
+  ngx_chain_t *out;
+  if (!filter(r, in, &out)) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "RUM SDK injection failed: insufficient memory available");
+    return NGX_ERROR;
+  }
+  return output(r, out, next_body_filter);
+}
+
+ngx_int_t InjectionHandler::recompress(
+    ngx_http_request_t *r, ngx_chain_t *in,
+    ngx_http_output_body_filter_pt &next_body_filter) {
+  ngx_chain_t *out = nullptr;
+  ngx_chain_t **last = &out;
 
+  // The whole body is decompressed and compressed again, even once the SDK
+  // is injected, one window at a time.
   for (ngx_chain_t *cl = in; cl; cl = cl->next) {
-    uint32_t buffer_size = cl->buf->last - cl->buf->pos;
-    auto result = injector_write(
-        injector_, static_cast<uint8_t *>(cl->buf->pos), buffer_size);
+    ngx_buf_t *buf = cl->buf;
+    do {
+      ngx_buf_t *window = gzip_->inflate(buf);
+      if (window == nullptr) {
+        state_ = state::error;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "RUM SDK injection failed: invalid gzip data");
+        return NGX_ERROR;
+      }
 
-    ngx_chain_t *injected_cl =
-        inject(r->pool, cl, std::span(result.slices, result.slices_length));
+      ngx_chain_t link{window, nullptr};
+      ngx_chain_t *injected;
+      if (!filter(r, &link, &injected) || !gzip_->deflate(injected, &last)) {
+        state_ = state::error;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "RUM SDK injection failed: insufficient memory "
+                      "available");
+        return NGX_ERROR;
+      }
+    } while (buf->pos != buf->last || gzip_->pending());
+  }
+
+  *last = nullptr;
+  ngx_int_t rc = output(r, out, next_body_filter);
+  gzip_->update_chains(&out);
+  return rc;
+}
 
-    previous_chain = cl;
-    *current_chain = injected_cl;
-    current_chain = &injected_cl->next;
+bool InjectionHandler::filter(ngx_http_request_t *r, ngx_chain_t *in,
+                              ngx_chain_t **result) {
+  if (state_ == state::cached) {
+    return split(r, in, result);
+  }
+  if (state_ != state::searching) {
+    *result = in;
+    return true;
+  }
+
+  ngx_chain_t *output_chain = nullptr;
+  Output out{&output_chain, nullptr};
+  bool ok = true;
+
+  for (ngx_chain_t *cl = in; cl && ok; cl = cl->next) {
+    ngx_buf_t *buf = cl->buf;
+    bool const end = buf->last_buf && output_padding_;
+    bool injected = false;
+
+    // Most buffers have nothing the injector has to see, and are passed on
+    // as is.
+    u_char *p = buf->pos;
+    if (held_ == 0 && !prefilter_.in_part()) {
+      p = const_cast<u_char *>(prefilter_.find(p, buf->last));
+      if (p == buf->last && !end) {
+        record(buf->pos, buf->last - buf->pos);
+        out.next = append(r->pool, out.next, buf);
+        out.buf = nullptr;
+        ok = out.next != nullptr;
+        continue;
+      }
+      ok = pass(r->pool, buf, buf->pos, p, out);
+    }
+
+    while (ok && p < buf->last) {
+      auto *next = const_cast<u_char *>(prefilter_.part_end(p, buf->last));
+      uint32_t size = next - p;
+      auto result = injector_write(injector_, static_cast<uint8_t *>(p), size);
+      auto slices = std::span(result.slices, result.slices_length);
+      ok = inject(r->pool, buf, slices, out);
+      p = next;
+
+      if (result.injected) {
+        injected = true;
+        ok = ok && pass(r->pool, buf, p, buf->last, out);
+        break;
+      }
+
+      held_ += size;
+      for (const auto &slice : slices) {
+        held_ -= slice.length;
+      }
+
+      if (held_ == 0 && !prefilter_.in_part()) {
+        next = const_cast<u_char *>(prefilter_.find(p, buf->last));
+        ok = ok && pass(r->pool, buf, p, next, out);
+        p = next;
+      }
+    }
+
+    if (ok && end && !injected) {
+      state_ = state::failed;
+      auto result = injector_end(injector_);
+      ok = inject(r->pool, buf, std::span(result.slices, result.slices_length),
+                  out);
+
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "RUM SDK injection failed: no injection point found");
+    }
 
-    if (result.injected) {
+    ok = ok && copy_flags(r->pool, buf, out);
+
+    // NOTE(@dmehala): When a buffer is marked as recycled, it MUST be consumed
+    // by the filter otherwise, it could not be reused. A consumed buffer has
+    // its `pos` move towards `last`.
+    if (buf->recycled) {
+      buf->pos = buf->last;
+    }
+
+    if (ok && injected) {
       state_ = state::injected;
       ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                     "RUM SDK injected successfully injected");
-      return output(r, output_chain, next_body_filter);
+      *out.next = cl->next;
+      *result = output_chain;
+      return true;
     }
   }
 
-  if (previous_chain->buf->last_buf && output_padding_) {
-    state_ = state::failed;
-    auto result = injector_end(injector_);
-    ngx_chain_t *injected_cl =
-        inject(r->pool, previous_chain,
-               std::span(result.slices, result.slices_length));
+  if (!ok) {
+    state_ = state::error;
+    return false;
+  }
 
-    *current_chain = injected_cl;
-    current_chain = &injected_cl->next;
+  *out.next = nullptr;
+  *result = output_chain;
+  return true;
+}
 
-    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                  "RUM SDK injection failed: no injection point found");
+bool InjectionHandler::split(ngx_http_request_t *r, ngx_chain_t *in,
+                             ngx_chain_t **result) {
+  ngx_chain_t *output_chain = nullptr;
+  Output out{&output_chain, nullptr};
+  bool ok = true;
+
+  for (ngx_chain_t *cl = in; cl && ok; cl = cl->next) {
+    ngx_buf_t *buf = cl->buf;
+    off_t const size = buf->last - buf->pos;
+    bool const at_offset = cached_.offset - seen_.offset <= size;
+    bool injected = false;
+
+    if (!at_offset && !buf->last_buf) {
+      record(buf->pos, size);
+      out.next = append(r->pool, out.next, buf);
+      out.buf = nullptr;
+      ok = out.next != nullptr;
+      continue;
+    }
+
+    u_char *p = at_offset ? buf->pos + (cached_.offset - seen_.offset)
+                          : buf->last;
+    // passing the bytes before the offset records the window they end with
+    ok = pass(r->pool, buf, buf->pos, p, out);
+
+    if (at_offset) {
+      if (seen_.window_length == cached_.window_length &&
+          std::memcmp(seen_.window, cached_.window, seen_.window_length) ==
+              0) {
+        BytesSlice slice;
+        slice.start = snippet_.data;
+        slice.length = snippet_.len;
+        ok = ok && inject(r->pool, buf, std::span(&slice, 1), out);
+        injected = true;
+      } else {
+        // The response changed, but not its validator.
+        OffsetCache::get_instance()->remove(cache_key_);
+        cached_.offset = NGX_MAX_OFF_T_VALUE;
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "RUM SDK injection failed: cached injection point does "
+                      "not match the response");
+      }
+    }
+
+    ok = ok && pass(r->pool, buf, p, buf->last, out);
+
+    if (ok && !injected && buf->last_buf) {
+      state_ = state::failed;
+      ok = pad(r->pool, buf, out);
+    }
+
+    ok = ok && copy_flags(r->pool, buf, out);
+
+    if (buf->recycled) {
+      buf->pos = buf->last;
+    }
+
+    if (ok && injected) {
+      state_ = state::injected;
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "RUM SDK injected at the cached injection point");
+      *out.next = cl->next;
+      *result = output_chain;
+      return true;
+    }
   }
 
-  return output(r, output_chain, next_body_filter);
+  if (!ok) {
+    state_ = state::error;
+    return false;
+  }
+
+  *out.next = nullptr;
+  *result = output_chain;
+  return true;
+}
+
+void InjectionHandler::record(const u_char *data, std::size_t size) {
+  if (cache_key_.empty()) {
+    return;
+  }
+
+  constexpr std::size_t kWindowSize = OffsetCache::kWindowSize;
+  seen_.offset += size;
+  if (size >= kWindowSize) {
+    std::memcpy(seen_.window, data + size - kWindowSize, kWindowSize);
+    seen_.window_length = kWindowSize;
+    return;
+  }
+
+  std::size_t const kept = std::min(seen_.window_length, kWindowSize - size);
+  std::memmove(seen_.window, seen_.window + seen_.window_length - kept, kept);
+  std::memcpy(seen_.window + kept, data, size);
+  seen_.window_length = kept + size;
 }
 
 // NOTE(@dmehala): this function is not necessary for now, however,
@@ -205,58 +453,170 @@ ngx_int_t InjectionHandler::output(
   return next_body_filter(r, out);
 }
 
-// NOTE(@dmehala): Ideally for v2 the buffer should be reused to avoid
-// unnecessary allocation.
-ngx_chain_t *InjectionHandler::inject(ngx_pool_t *pool, ngx_chain_t *in,
-                                      std::span<const BytesSlice> slices) {
+ngx_str_t InjectionHandler::locate_snippet(Snippet *snippet) {
+  static const char kDocument[] = "<html><head></head><body></body></html>";
+  std::size_t const size = sizeof(kDocument) - 1;
+
+  // the injector takes the bytes as mutable, one copy each
+  u_char documents[2][sizeof(kDocument)];
+  Injector *injectors[2] = {injector_create(snippet),
+                            injector_create(snippet)};
+  const uint8_t *found[2] = {nullptr, nullptr};
+  for (int i = 0; i < 2; i++) {
+    std::memcpy(documents[i], kDocument, size);
+    auto result = injector_write(injectors[i], documents[i], size);
+    for (const auto &slice : std::span(result.slices, result.slices_length)) {
+      bool const in_document = slice.start >= documents[i] &&
+                               slice.start < documents[i] + size;
+      if (!in_document && slice.length == snippet->length) {
+        found[i] = slice.start;
+      }
+    }
+  }
+  injector_cleanup(injectors[0]);
+  injector_cleanup(injectors[1]);
+
+  if (found[0] == nullptr || found[0] != found[1]) {
+    return ngx_null_string;
+  }
+  return {snippet->length, const_cast<u_char *>(found[0])};
+}
+
+bool InjectionHandler::inject(ngx_pool_t *pool, ngx_buf_t *in,
+                              std::span<const BytesSlice> slices,
+                              Output &out) {
   assert(pool != nullptr);
   assert(in != nullptr);
-  if (slices.empty()) {
-    return in;
+
+  auto is_snippet = [&](const BytesSlice &slice) {
+    return snippet_.len != 0 && slice.start == snippet_.data &&
+           slice.length == snippet_.len;
+  };
+
+  // The bytes of a recycled buffer can be overwritten as soon as the buffer
+  // is consumed, which happens before they are sent. Bytes the injector
+  // outputs from its own memory are either the snippet, which lives as long
+  // as the configuration, or the few bytes of a partial match it held back
+  // from a previous buffer, which it reuses on the next call.
+  auto borrowed = [&](const BytesSlice &slice) {
+    if (slice.start >= in->pos && slice.start + slice.length <= in->last) {
+      return !in->recycled;
+    }
+    return is_snippet(slice);
+  };
+
+  std::size_t needed = 0;
+  for (const auto &slice : slices) {
+    if (!borrowed(slice)) {
+      needed += slice.length;
+    }
   }
 
-  size_t needed = 0;
-  for (uint32_t i = 0; i < slices.size(); ++i) {
-    needed += slices[i].length;
+  u_char *copy = nullptr;
+  if (needed != 0) {
+    copy = static_cast<u_char *>(ngx_pnalloc(pool, needed));
+    if (copy == nullptr) {
+      return false;
+    }
   }
 
-  ngx_chain_t *cl = ngx_alloc_chain_link(pool);
-  if (cl == nullptr) {
-    // NOTE(@dmehala): This might explain why we couldn't inject the SDK.
-    // It should stop looking for an injection point and report the injection
-    // as failed.
-    ngx_log_error(NGX_LOG_ERR, pool->log, 0,
-                  "RUM SDK injection failed: insufficient memory available");
-    return in;
+  for (const auto &slice : slices) {
+    if (slice.length == 0) {
+      continue;
+    }
+
+    if (!cache_key_.empty()) {
+      if (!is_snippet(slice)) {
+        record(slice.start, slice.length);
+      } else if (state_ == state::searching) {
+        // injected where the response is at: remember it for the next time
+        OffsetCache::get_instance()->store(cache_key_, seen_);
+      }
+    }
+
+    auto *data = const_cast<u_char *>(slice.start);
+    if (!borrowed(slice)) {
+      data = copy;
+      copy = ngx_cpymem(copy, slice.start, slice.length);
+    }
+
+    // contiguous slices share a buffer
+    if (out.buf != nullptr && out.buf->last == data) {
+      out.buf->last += slice.length;
+      out.buf->end = out.buf->last;
+      continue;
+    }
+
+    auto *buf = static_cast<ngx_buf_t *>(ngx_calloc_buf(pool));
+    if (buf == nullptr) {
+      return false;
+    }
+    buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
+    buf->memory = 1;
+    buf->start = data;
+    buf->pos = data;
+    buf->last = data + slice.length;
+    buf->end = buf->last;
+
+    out.next = append(pool, out.next, buf);
+    if (out.next == nullptr) {
+      return false;
+    }
+    out.buf = buf;
   }
 
-  ngx_buf_t *buf = (ngx_buf_t *)ngx_calloc_buf(pool);
+  return true;
+}
 
-  buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
-  buf->memory = 1;
-  buf->start = (u_char *)ngx_pnalloc(pool, needed);
-  buf->end = buf->start + needed;
-  buf->pos = buf->start;
-  buf->last = buf->pos;
-  buf->flush = in->buf->flush;
-  buf->sync = in->buf->sync;
-  buf->last_buf = in->buf->last_buf;
-  buf->last_in_chain = in->buf->last_in_chain;
+bool InjectionHandler::pass(ngx_pool_t *pool, ngx_buf_t *in,
+                            const u_char *begin, const u_char *end,
+                            Output &out) {
+  BytesSlice slice;
+  slice.start = begin;
+  slice.length = end - begin;
+  return inject(pool, in, std::span(&slice, 1), out);
+}
 
-  for (uint32_t i = 0; i < slices.size(); ++i) {
-    buf->last = ngx_cpymem(buf->last, slices[i].start, slices[i].length);
+bool InjectionHandler::copy_flags(ngx_pool_t *pool, ngx_buf_t *in,
+                                  Output &out) {
+  if (!in->flush && !in->sync && !in->last_buf && !in->last_in_chain) {
+    return true;
   }
 
-  cl->buf = buf;
-  cl->next = in->next;
+  if (out.buf == nullptr) {
+    out.buf = static_cast<ngx_buf_t *>(ngx_calloc_buf(pool));
+    if (out.buf == nullptr) {
+      return false;
+    }
+    out.buf->tag = (ngx_buf_tag_t)&ngx_http_datadog_module;
+
+    out.next = append(pool, out.next, out.buf);
+    if (out.next == nullptr) {
+      return false;
+    }
+  }
 
-  // NOTE(@dmehala): When a buffer is marked as recycled, it MUST be consumed by
-  // the filter otherwise, it could not be reused. A consumed buffer has its
-  // `pos` move towards `last`.
-  if (in->buf->recycled) {
-    in->buf->pos = in->buf->last;
+  out.buf->flush = in->flush;
+  out.buf->sync = in->sync;
+  out.buf->last_buf = in->last_buf;
+  out.buf->last_in_chain = in->last_in_chain;
+
+  // later bytes go in a new buffer
+  out.buf = nullptr;
+  return true;
+}
+
+bool InjectionHandler::pad(ngx_pool_t *pool, ngx_buf_t *in, Output &out) {
+  auto *spaces = static_cast<u_char *>(ngx_pnalloc(pool, snippet_length_));
+  if (spaces == nullptr) {
+    return false;
   }
-  return cl;
+  std::memset(spaces, ' ', snippet_length_);
+
+  BytesSlice slice;
+  slice.start = spaces;
+  slice.length = snippet_length_;
+  return inject(pool, in, std::span(&slice, 1), out);
 }
 
 }  // namespace rum
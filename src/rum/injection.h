@@ -6,9 +6,15 @@ extern "C" {
 
 #include <injectbrowsersdk.h>
 
+#include <cstddef>
+#include <memory>
 #include <span>
+#include <string>
 
 #include "datadog_conf.h"
+#include "gzip_stream.h"
+#include "offset_cache.h"
+#include "prefilter.h"
 
 namespace datadog {
 namespace nginx {
@@ -25,6 +31,7 @@ class InjectionHandler final {
   enum state : char {
     init,
     searching,
+    cached,  ///< splitting the response at a cached injection point
     injected,
     error,
     failed,  ///< no injection point found
@@ -33,28 +40,54 @@ class InjectionHandler final {
   // A flag indicating whether padding should be added to the HTML responses.
   bool output_padding_;
 
+  // Bytes of the snippet of the location, as the injector outputs them (see
+  // `locate_snippet`): a slice is the snippet if it starts at `data`. Empty
+  // if they could not be located, in which case the snippet is copied like
+  // the other bytes of the injector, and the offset cache is not used.
+  ngx_str_t snippet_;
+  std::size_t snippet_length_;
+
   // Pointer to an Injector instance, used to scan and locate where the RUM
   // Browser SDK needs to be injected.
   Injector *injector_;
 
+  // Finds the bytes the injector has to see; the others skip it.
+  Prefilter prefilter_;
+
+  // Number of bytes the injector was given but did not output yet, as they
+  // may be part of the injection point. Bytes can only skip the injector
+  // when there are none, or they would be output out of order.
+  std::size_t held_;
+
+  // Set when the response is gzip encoded: the body is decompressed before
+  // going through the injector, and compressed again after.
+  std::unique_ptr<GzipStream> gzip_;
+
+  // Key of the response in the offset cache; empty if it is not cached.
+  std::string cache_key_;
+  // Offset and window of the response in the cache, when `state_` is cached.
+  OffsetCache::Entry cached_;
+  // Number of bytes of the response output so far, and the last of them.
+  OffsetCache::Entry seen_;
+
  public:
   InjectionHandler();
   ~InjectionHandler();
 
-  // Handles the rewrite phase of an HTTP request (NGX_HTTP_REWRITE_PHASE)
-  // @param r - HTTP request being processed.
-  // @return ngx_int_t - Status code indicating success or failure.
-  ngx_int_t on_rewrite_handler(ngx_http_request_t *r);
+  // Finds where the bytes of `snippet` are, by injecting it in a small
+  // document with two injectors at once: the injector references the bytes
+  // of the snippet rather than copying them, so the only slice outside the
+  // document is at the same address for both. Returns an empty string if it
+  // is not.
+  static ngx_str_t locate_snippet(Snippet *snippet);
 
-  // Handles the header filtering phase of an HTTP request.
+  // Decides whether to inject the SDK in the response, and updates its
+  // headers accordingly. The next header filter is left to the caller.
   // @param r - HTTP request being processed.
   // @param cfg - Location configuration of the module.
-  // @param next_header_filter - Reference to the next header filter in the
-  // NGINX filter chain.
-  // @return ngx_int_t - Status code indicating success or failure.
-  ngx_int_t on_header_filter(
-      ngx_http_request_t *r, datadog_loc_conf_t *cfg,
-      ngx_http_output_header_filter_pt &next_header_filter);
+  // @return ngx_int_t - NGX_OK, or NGX_ERROR if the headers could not be
+  // updated.
+  ngx_int_t on_header_filter(ngx_http_request_t *r, datadog_loc_conf_t *cfg);
 
   // Handles the body modification of an HTTP request.
   // @param r - HTTP request being processed.
@@ -68,6 +101,24 @@ class InjectionHandler final {
                            ngx_http_output_body_filter_pt &next_body_filter);
 
  private:
+  // Injects the RUM Browser SDK in the decompressed body, one window at a
+  // time, and sends the body compressed again to the next body filter.
+  ngx_int_t recompress(ngx_http_request_t *r, ngx_chain_t *in,
+                       ngx_http_output_body_filter_pt &next_body_filter);
+
+  // Runs the buffers of `in` through the injector, and sets `*out` to the
+  // resulting chain. Once the SDK is injected, `*out` is `in`.
+  // @return bool - false if memory could not be allocated.
+  bool filter(ngx_http_request_t *r, ngx_chain_t *in, ngx_chain_t **out);
+
+  // Same as `filter()`, for a response split at the offset found in the
+  // cache. If the bytes before the offset are not the ones cached, the entry
+  // is dropped and the response is padded with spaces instead.
+  bool split(ngx_http_request_t *r, ngx_chain_t *in, ngx_chain_t **out);
+
+  // Keeps track of the bytes of the response output, for the offset cache.
+  void record(const u_char *data, std::size_t size);
+
   // Sends the output to the next body filter.
   // @param r - HTTP request being processed.
   // @param out - Chain of buffers containing the response to send.
@@ -76,15 +127,38 @@ class InjectionHandler final {
   ngx_int_t output(ngx_http_request_t *r, ngx_chain_t *out,
                    ngx_http_output_body_filter_pt &next_body_filter);
 
-  // Injects the RUM Browser SDK into a chain of buffers at the appropriate
-  // location.
+  // End of the output chain built by the body filter.
+  struct Output {
+    ngx_chain_t **next;
+    // Last buffer allocated by the filter, which contiguous bytes extend.
+    ngx_buf_t *buf;
+  };
+
+  // Appends the bytes of `slices` to the output chain, without copying them
+  // when possible: slices of `in` become buffers pointing into its memory,
+  // and the snippet is referenced from the memory of the Snippet.
+  // Bytes are only copied when `in` is recycled (its memory is reused once it
+  // is consumed) or when they are held by the injector across calls.
   // @param pool - Memory pool used for allocation.
-  // @param in - Incoming chain of buffers containing the response body.
-  // @param slices - Pointer to an array of `BytesSlice`.
-  // @param slices_length - Number of elements in the `slices` array.
-  // @return ngx_chain_t* - Chain of buffers with the injected data.
-  ngx_chain_t *inject(ngx_pool_t *pool, ngx_chain_t *in,
-                      std::span<const BytesSlice> slices);
+  // @param in - Buffer the slices were produced from.
+  // @param slices - Slices returned by the injector for `in`, or parts of
+  // `in` passed on without the injector.
+  // @param out - Output chain.
+  // @return bool - false if memory could not be allocated.
+  bool inject(ngx_pool_t *pool, ngx_buf_t *in,
+              std::span<const BytesSlice> slices, Output &out);
+
+  // Appends [begin, end) of `in` to the output chain.
+  bool pass(ngx_pool_t *pool, ngx_buf_t *in, const u_char *begin,
+            const u_char *end, Output &out);
+
+  // Sets the flags of `in` (flush, sync, last_buf) on the last buffer of the
+  // output chain, once all of its bytes are in it.
+  bool copy_flags(ngx_pool_t *pool, ngx_buf_t *in, Output &out);
+
+  // Appends as many spaces as there are bytes in the snippet, which the
+  // Content-Length accounts for.
+  bool pad(ngx_pool_t *pool, ngx_buf_t *in, Output &out);
 };
 
 }  // namespace rum
@@ -0,0 +1,109 @@
+#include "offset_cache.h"
+
+#include <cstring>
+
+#include "string_util.h"
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+namespace {
+
+// appends the length first, so that field boundaries are part of the key
+void append(std::string &key, std::string_view field) {
+  std::size_t const size = field.size();
+  key.append(reinterpret_cast<const char *>(&size), sizeof size);
+  key.append(field);
+}
+
+template <typename T>
+void append_value(std::string &key, const T &value) {
+  append(key, std::string_view{reinterpret_cast<const char *>(&value),
+                               sizeof value});
+}
+
+}  // namespace
+
+// NOLINTNEXTLINE
+std::unique_ptr<OffsetCache> OffsetCache::instance;
+
+void OffsetCache::initialize(const datadog_main_conf_t &conf) {
+  if (conf.rum_offset_cache_size == NGX_CONF_UNSET ||
+      conf.rum_offset_cache_size <= 0) {
+    instance.reset();
+    return;
+  }
+
+  instance = std::unique_ptr<OffsetCache>(
+      new OffsetCache(static_cast<std::size_t>(conf.rum_offset_cache_size)));
+}
+
+OffsetCache::OffsetCache(std::size_t max_entries) : max_entries_{max_entries} {
+  index_.reserve(max_entries);
+}
+
+std::string OffsetCache::key(const ngx_http_request_t &request) {
+  const auto &headers = request.headers_out;
+  if (headers.status != NGX_HTTP_OK || headers.content_length_n <= 0) {
+    return {};
+  }
+
+  std::string key;
+  if (headers.etag != nullptr && headers.etag->value.len != 0) {
+    append(key, to_string_view(headers.etag->value));
+  } else if (headers.last_modified_time != -1) {
+    append_value(key, headers.last_modified_time);
+  } else {
+    return {};
+  }
+
+  append_value(key, headers.content_length_n);
+  append(key, to_string_view(request.headers_in.server));
+  append(key, to_string_view(request.uri));
+#if (NGX_HTTP_CACHE)
+  if (request.cache != nullptr) {
+    append(key, std::string_view{
+                    reinterpret_cast<const char *>(request.cache->key),
+                    NGX_HTTP_CACHE_KEY_LEN});
+  }
+#endif
+  return key;
+}
+
+std::optional<OffsetCache::Entry> OffsetCache::lookup(const std::string &key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return std::nullopt;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void OffsetCache::store(const std::string &key, const Entry &entry) {
+  if (auto it = index_.find(key); it != index_.end()) {
+    it->second->second = entry;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  if (lru_.size() >= max_entries_) {
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+
+  lru_.emplace_front(key, entry);
+  index_.emplace(lru_.front().first, lru_.begin());
+}
+
+void OffsetCache::remove(const std::string &key) {
+  if (auto it = index_.find(key); it != index_.end()) {
+    auto node = it->second;
+    index_.erase(it);
+    lru_.erase(node);
+  }
+}
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "datadog_conf.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+
+// Per-worker LRU of the offsets where the RUM Browser SDK was injected in
+// HTML responses. A response with the same validator (ETag or Last-Modified),
+// length and cache key as one seen before is split at the same offset without
+// going through the injector.
+//
+// The bytes right before the offset are kept with it, and compared to the
+// bytes of the response before it is split there. Only accessed from the
+// event loop thread.
+class OffsetCache {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static std::unique_ptr<OffsetCache> instance;
+
+ public:
+  // number of bytes before the offset that are compared
+  static constexpr std::size_t kWindowSize = 32;
+
+  struct Entry {
+    // number of bytes of the response before the snippet
+    off_t offset;
+    std::size_t window_length;
+    u_char window[kWindowSize];
+  };
+
+  // no-op if the cache is not enabled in the configuration
+  static void initialize(const datadog_main_conf_t &conf);
+
+  // nullptr if the cache is disabled
+  static OffsetCache *get_instance() { return instance.get(); }
+
+  // Key of the response, or an empty string if it cannot be cached: it has
+  // no validator, its length is unknown or it is not a 200 response.
+  static std::string key(const ngx_http_request_t &request);
+
+  // The entry for `key`, if any.
+  std::optional<Entry> lookup(const std::string &key);
+
+  void store(const std::string &key, const Entry &entry);
+
+  // drops the entry for `key`, whose window did not match
+  void remove(const std::string &key);
+
+ private:
+  explicit OffsetCache(std::size_t max_entries);
+
+  std::size_t max_entries_;
+  // most recently used first
+  std::list<std::pair<std::string, Entry>> lru_;
+  std::unordered_map<std::string_view,
+                     std::list<std::pair<std::string, Entry>>::iterator>
+      index_;
+};
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
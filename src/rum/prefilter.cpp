@@ -0,0 +1,157 @@
+#include "prefilter.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+namespace {
+
+constexpr char kCommentOpening[] = "<!--";
+constexpr std::size_t kCommentOpeningLength = sizeof(kCommentOpening) - 1;
+
+u_char lower(u_char c) { return c | 0x20; }
+
+// Whether the `<` at p can start a part: "<!", "</h", "</b", "<he", "<ht" or
+// "<bo", in any case. A few other tags match as well (`</h1>`, `</b>`), which
+// only costs going through the injector.
+bool starts_part(const u_char *p, const u_char *end) noexcept {
+  if (end - p < 2) {
+    return true;
+  }
+
+  bool const can_tell = end - p > 2;
+  switch (p[1]) {
+    case '!':
+      return true;
+    case '/':
+      return !can_tell || lower(p[2]) == 'h' || lower(p[2]) == 'b';
+  }
+
+  switch (lower(p[1])) {
+    case 'h':
+      return !can_tell || lower(p[2]) == 'e' || lower(p[2]) == 't';
+    case 'b':
+      return !can_tell || lower(p[2]) == 'o';
+  }
+  return false;
+}
+
+}  // namespace
+
+const u_char *Prefilter::find(const u_char *begin,
+                              const u_char *end) const noexcept {
+  const u_char *p = begin;
+
+#if defined(__SSE2__)
+  // Looks at 16 bytes at a time for a `<` followed by a byte that can start
+  // a part. Elsewhere, memchr() is vectorized by the C library.
+  __m128i const lt = _mm_set1_epi8('<');
+  __m128i const case_bit = _mm_set1_epi8(0x20);
+  __m128i const h = _mm_set1_epi8('h');
+  __m128i const b = _mm_set1_epi8('b');
+  __m128i const bang = _mm_set1_epi8('!');
+  __m128i const slash = _mm_set1_epi8('/');
+
+  while (end - p > 16) {
+    __m128i const cur =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i const next =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+    __m128i const next_lower = _mm_or_si128(next, case_bit);
+    __m128i const can_follow = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(next_lower, h),
+                     _mm_cmpeq_epi8(next_lower, b)),
+        _mm_or_si128(_mm_cmpeq_epi8(next, bang),
+                     _mm_cmpeq_epi8(next, slash)));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(cur, lt), can_follow)));
+
+    while (mask != 0) {
+      const u_char *candidate = p + std::countr_zero(mask);
+      if (starts_part(candidate, end)) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+
+  while ((p = static_cast<const u_char *>(
+              std::memchr(p, '<', end - p))) != nullptr) {
+    if (starts_part(p, end)) {
+      return p;
+    }
+    ++p;
+  }
+  return end;
+}
+
+const u_char *Prefilter::part_end(const u_char *begin,
+                                  const u_char *end) noexcept {
+  const u_char *p = begin;
+  if (part_ == Part::none) {
+    part_ = Part::tag;
+    opening_length_ = 0;
+    dashes_ = 0;
+  }
+
+  // a '>' does not close a comment
+  while (part_ == Part::tag && opening_length_ < kCommentOpeningLength &&
+         p != end) {
+    if (*p != kCommentOpening[opening_length_]) {
+      opening_length_ = kCommentOpeningLength;
+      break;
+    }
+    if (++opening_length_ == kCommentOpeningLength) {
+      part_ = Part::comment;
+    }
+    ++p;
+  }
+
+  if (part_ == Part::tag) {
+    const auto *gt = static_cast<const u_char *>(
+        std::memchr(p, '>', end - p));
+    if (gt == nullptr) {
+      return end;
+    }
+    part_ = Part::none;
+    return gt + 1;
+  }
+
+  while (p != end) {
+    const auto *gt = static_cast<const u_char *>(
+        std::memchr(p, '>', end - p));
+    const u_char *stop = gt != nullptr ? gt : end;
+
+    // the dashes before the '>', which can be in previous buffers
+    std::size_t const n = stop - p;
+    std::size_t dashes = 0;
+    while (dashes < 2 && dashes < n && stop[-1 - dashes] == '-') {
+      dashes++;
+    }
+    dashes_ = dashes == n ? std::min<std::size_t>(dashes_ + n, 2) : dashes;
+
+    if (gt == nullptr) {
+      return end;
+    }
+    if (dashes_ == 2) {
+      part_ = Part::none;
+      return gt + 1;
+    }
+    dashes_ = 0;
+    p = gt + 1;
+  }
+  return end;
+}
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,43 @@
+#pragma once
+
+extern "C" {
+#include <ngx_core.h>
+}
+
+#include <cstddef>
+
+namespace datadog {
+namespace nginx {
+namespace rum {
+
+// Finds the parts of an HTML document the injector has to see to find the
+// injection point: the html, head and body tags, opening or closing, and the
+// comments, which can contain such tags. The other bytes can be passed on
+// without going through the injector.
+//
+// A part starts at a `<` and ends after the `>` closing the tag, or the `-->`
+// closing the comment. Parts can span several buffers.
+class Prefilter final {
+  enum class Part : char { none, tag, comment };
+  Part part_ = Part::none;
+  // number of bytes of the part compared to "<!--", up to 4
+  std::size_t opening_length_ = 0;
+  // number of consecutive '-' last seen in the comment, up to 2
+  std::size_t dashes_ = 0;
+
+ public:
+  // Whether the last call to `part_end()` ended in a part.
+  bool in_part() const noexcept { return part_ != Part::none; }
+
+  // Returns the first `<` in [begin, end) that can start a part, or `end`.
+  // A `<` too close to `end` to tell is returned.
+  const u_char *find(const u_char *begin, const u_char *end) const noexcept;
+
+  // Returns the end of the part containing `begin`, which starts a new part
+  // if not in one, or `end` if it goes past it.
+  const u_char *part_end(const u_char *begin, const u_char *end) noexcept;
+};
+
+}  // namespace rum
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,87 @@
+#include "api_security.h"
+
+#include <functional>
+#include <string_view>
+
+#include "util.h"
+
+extern "C" {
+#include <ngx_http_core_module.h>
+}
+
+namespace {
+
+// endpoints tracked per worker; the least recently sampled ones are dropped
+constexpr std::size_t kMaxEndpoints = 4096;
+constexpr std::time_t kDefaultSampleDelay = 30;
+
+std::uint64_t mix(std::uint64_t h, std::uint64_t v) noexcept {
+  // boost::hash_combine, 64-bit variant
+  return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 12) + (h >> 4));
+}
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+// NOLINTNEXTLINE
+std::unique_ptr<ApiSecuritySampler> ApiSecuritySampler::instance;
+
+void ApiSecuritySampler::initialize(const datadog_main_conf_t &conf) {
+  if (conf.appsec_api_security != 1) {
+    instance.reset();
+    return;
+  }
+
+  std::time_t const window = conf.appsec_api_security_sample_delay ==
+                                     NGX_CONF_UNSET
+                                 ? kDefaultSampleDelay
+                                 : conf.appsec_api_security_sample_delay;
+  instance = std::unique_ptr<ApiSecuritySampler>(
+      new ApiSecuritySampler(window, kMaxEndpoints));
+}
+
+ApiSecuritySampler::ApiSecuritySampler(std::time_t window,
+                                       std::size_t max_entries)
+    : window_{window}, max_entries_{max_entries} {
+  index_.reserve(max_entries);
+}
+
+std::uint64_t ApiSecuritySampler::endpoint_key(
+    const ngx_http_request_t &request) {
+  auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(&request, ngx_http_core_module));
+
+  std::hash<std::string_view> const hash;
+  std::uint64_t h = hash(to_string_view(request.method_name));
+  if (clcf != nullptr) {
+    h = mix(h, hash(to_string_view(clcf->name)));
+  }
+  return mix(h, static_cast<std::uint64_t>(request.headers_out.status));
+}
+
+bool ApiSecuritySampler::sample(const ngx_http_request_t &request,
+                                std::time_t now) {
+  std::uint64_t const key = endpoint_key(request);
+
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    if (now - it->second->sampled_at < window_) {
+      return false;
+    }
+    it->second->sampled_at = now;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return true;
+  }
+
+  if (lru_.size() >= max_entries_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+  }
+
+  lru_.push_front(Entry{key, now});
+  index_.emplace(key, lru_.begin());
+  return true;
+}
+
+}  // namespace datadog::nginx::security
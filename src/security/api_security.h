@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "../datadog_conf.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// Per-worker sampler of the requests whose API schema is extracted by the
+// WAF: at most one per (method, route, status code) and per window. The route
+// is the location the request was handled in. Only accessed from the event
+// loop thread.
+class ApiSecuritySampler {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static std::unique_ptr<ApiSecuritySampler> instance;
+
+ public:
+  // no-op if API security is not enabled in the configuration
+  static void initialize(const datadog_main_conf_t &conf);
+
+  // nullptr if API security is disabled
+  static ApiSecuritySampler *get_instance() { return instance.get(); }
+
+  // whether to extract the schema of the request, whose response status must
+  // be known; if so, the endpoint is not sampled again for a window
+  bool sample(const ngx_http_request_t &request, std::time_t now);
+
+ private:
+  ApiSecuritySampler(std::time_t window, std::size_t max_entries);
+
+  static std::uint64_t endpoint_key(const ngx_http_request_t &request);
+
+  struct Entry {
+    std::uint64_t key;
+    std::time_t sampled_at;
+  };
+
+  std::time_t window_;
+  std::size_t max_entries_;
+  std::list<Entry> lru_;  // most recently sampled first
+  std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+};
+
+}  // namespace datadog::nginx::security
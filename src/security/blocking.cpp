@@ -3,6 +3,7 @@
 #include <cmath>
 #include <fstream>
 #include <sstream>
+#include <string>
 #include <string_view>
 
 #include "util.h"
@@ -20,45 +21,9 @@ namespace {
 namespace dnsec = datadog::nginx::security;
 
 struct BlockResponse {
-  enum class ContentType {
-    HTML,
-    JSON,
-    NONE,
-  };
-
-  int status;
-  ContentType ct;
-  std::string_view location;
-
-  BlockResponse(int status, enum ContentType ct,
-                std::string_view location) noexcept
-      : status{status}, ct{ct}, location{location} {}
-
-  static BlockResponse resolve_content_type(
-      const dnsec::BlockSpecification &spec,
-      const ngx_http_request_t &req) noexcept {
-    enum ContentType ct;
-
-    switch (spec.ct) {
-      case dnsec::BlockSpecification::ContentType::AUTO:
-        ct = determine_ct(req);
-        break;
-      case dnsec::BlockSpecification::ContentType::HTML:
-        ct = ContentType::HTML;
-        break;
-      case dnsec::BlockSpecification::ContentType::NONE:
-        ct = ContentType::NONE;
-        break;
-      case dnsec::BlockSpecification::ContentType::JSON:
-      default:
-        ct = ContentType::JSON;
-        break;
-    }
+  using ContentType = dnsec::BlockSpecification::ContentType;
 
-    return {spec.status, ct, spec.location};
-  }
-
-  static ngx_str_t content_type_header(enum BlockResponse::ContentType ct) {
+  static ngx_str_t content_type_header(ContentType ct) {
     switch (ct) {
       case ContentType::HTML:
         return ngx_string("text/html;charset=utf-8");
@@ -187,12 +152,8 @@ struct BlockResponse {
     }
   };
 
-  static enum ContentType determine_ct(const ngx_http_request_t &req) {
-    if (req.headers_in.accept == nullptr) {
-      return ContentType::JSON;
-    }
-
-    AcceptEntryIter it{req.headers_in.accept->value};
+  static ContentType determine_ct(const ngx_str_t &accept) {
+    AcceptEntryIter it{accept};
 
     using Specif = AcceptEntry::Specificity;
     Specif json_spec{};
@@ -287,6 +248,12 @@ const std::string_view kDefaultTemplateJson{
     "{\"errors\":[{\"title\":\"You've been blocked\",\"detail\":\"Sorry, you "
     "cannot access this page. Please contact the customer service team. "
     "Security provided by Datadog.\"}]}"sv};
+
+// bounds for the per-worker cache; past them, the Accept header is parsed on
+// every block
+constexpr std::size_t kMaxAcceptCacheEntries = 256;
+constexpr std::size_t kMaxCachedAcceptLen = 256;
+
 }  // namespace
 
 namespace datadog::nginx::security {
@@ -304,26 +271,67 @@ void BlockingService::initialize(std::optional<std::string_view> templ_html,
 }
 
 void BlockingService::block(BlockSpecification spec, ngx_http_request_t &req) {
-  BlockResponse const resp = BlockResponse::resolve_content_type(spec, req);
-  ngx_str_t *templ{};
-  if (resp.ct == BlockResponse::ContentType::HTML) {
-    templ = &templ_html_;
-  } else if (resp.ct == BlockResponse::ContentType::JSON) {
-    templ = &templ_json_;
-  } else {
-    req.header_only = 1;
-  }
+  BlockSpecification::ContentType const ct = resolve_content_type(spec, req);
 
   ngx_http_discard_request_body(&req);
 
+  send_through_filters(spec.status, ct, spec.location, req);
+}
+
+BlockSpecification::ContentType BlockingService::resolve_content_type(
+    const BlockSpecification &spec, const ngx_http_request_t &req) {
+  if (spec.ct != BlockSpecification::ContentType::AUTO) {
+    return spec.ct;
+  }
+  if (req.headers_in.accept == nullptr) {
+    return BlockSpecification::ContentType::JSON;
+  }
+
+  const ngx_str_t &accept = req.headers_in.accept->value;
+  std::string_view const accept_sv = to_string_view(accept);
+  if (auto it = accept_cache_.find(accept_sv); it != accept_cache_.end()) {
+    return it->second;
+  }
+
+  BlockSpecification::ContentType const ct =
+      BlockResponse::determine_ct(accept);
+  if (accept_sv.size() <= kMaxCachedAcceptLen) {
+    if (accept_cache_.size() >= kMaxAcceptCacheEntries) {
+      accept_cache_.clear();
+    }
+    accept_cache_.emplace(accept_sv, ct);
+  }
+  return ct;
+}
+
+const ngx_str_t *BlockingService::template_for(
+    BlockSpecification::ContentType ct) const {
+  if (ct == BlockSpecification::ContentType::HTML) {
+    return &templ_html_;
+  }
+  if (ct == BlockSpecification::ContentType::JSON) {
+    return &templ_json_;
+  }
+  return nullptr;
+}
+
+void BlockingService::send_through_filters(int status,
+                                           BlockSpecification::ContentType ct,
+                                           std::string_view location,
+                                           ngx_http_request_t &req) {
+  const ngx_str_t *templ = template_for(ct);
+  if (templ == nullptr) {
+    req.header_only = 1;
+  }
+
   // TODO: clear all current headers?
 
-  req.headers_out.status = resp.status;
-  req.headers_out.content_type = BlockResponse::content_type_header(resp.ct);
+  req.headers_out.status = status;
+  req.headers_out.content_type = BlockResponse::content_type_header(ct);
   req.headers_out.content_type_len = req.headers_out.content_type.len;
 
-  if (!resp.location.empty()) {
-    push_header(req, "Location"sv, resp.location);
+  if (!location.empty()) {
+    push_header(req, "Location"sv, location);
   }
   if (templ) {
     req.headers_out.content_length_n = static_cast<off_t>(templ->len);
@@ -331,7 +339,6 @@ void BlockingService::block(BlockSpecification spec, ngx_http_request_t &req) {
     req.headers_out.content_length_n = 0;
   }
 
-  // TODO: bypass header filters?
   auto res = ngx_http_send_header(&req);
   if (res == NGX_ERROR || res > NGX_OK || req.header_only) {
     ngx_http_finalize_request(&req, res);
@@ -352,9 +359,10 @@ void BlockingService::block(BlockSpecification spec, ngx_http_request_t &req) {
   ngx_chain_t out{};
   out.buf = b;
 
-  // TODO: bypass and call ngx_http_write_filter?
-  ngx_http_output_filter(&req, &out);
-  ngx_http_finalize_request(&req, NGX_DONE);
+  // on NGX_AGAIN, the rest is written by ngx_http_writer once the client
+  // reads; finalizing with NGX_DONE would drop it
+  res = ngx_http_output_filter(&req, &out);
+  ngx_http_finalize_request(&req, res);
 }
 
 BlockingService::BlockingService(
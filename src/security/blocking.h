@@ -1,11 +1,15 @@
 #pragma once
 
+#include <cstddef>
 #include <fstream>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
+#include <string>
 #include <string_view>
+#include <unordered_map>
 
 extern "C" {
 #include <ngx_http.h>
@@ -48,10 +52,32 @@ class BlockingService {
   static void push_header(ngx_http_request_t &req, std::string_view name,
                           std::string_view value);
 
+  // AUTO is resolved from the Accept header
+  BlockSpecification::ContentType resolve_content_type(
+      const BlockSpecification &spec, const ngx_http_request_t &req);
+  // goes through the header and body filter chains
+  void send_through_filters(int status, BlockSpecification::ContentType ct,
+                            std::string_view location,
+                            ngx_http_request_t &req);
+
+  const ngx_str_t *template_for(BlockSpecification::ContentType ct) const;
+
+  struct StringViewHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view sv) const noexcept {
+      return std::hash<std::string_view>{}(sv);
+    }
+  };
+
   ngx_str_t templ_html_{};
   ngx_str_t templ_json_{};
   std::string custom_templ_html_;
   std::string custom_templ_json_;
+
+  // per worker; block() only runs on the main thread
+  std::unordered_map<std::string, BlockSpecification::ContentType,
+                     StringViewHash, std::equal_to<>>
+      accept_cache_;
 };
 
 }  // namespace datadog::nginx::security
@@ -0,0 +1,1025 @@
+#include "body_collector.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../string_util.h"
+#include "ddwaf_obj.h"
+#include "json_parser.h"
+#include "util.h"
+
+extern "C" {
+#include <ngx_string.h>
+}
+
+using namespace std::literals;
+
+namespace {
+
+namespace dnsec = datadog::nginx::security;
+
+// bound on the size of a single key or value; the rest is dropped
+constexpr std::size_t kMaxScratchSize = 4096;
+constexpr std::size_t kMaxHeaderLineSize = 1024;
+// RFC 2046, section 5.1.1
+constexpr std::size_t kMaxBoundarySize = 70;
+
+bool starts_with_ci(std::string_view sv, std::string_view prefix) {
+  if (sv.size() < prefix.size()) {
+    return false;
+  }
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  return ngx_strncasecmp(
+             reinterpret_cast<u_char *>(const_cast<char *>(sv.data())),
+             reinterpret_cast<u_char *>(const_cast<char *>(prefix.data())),
+             prefix.size()) == 0;
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+}
+
+std::string_view trim(std::string_view sv) {
+  while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) {
+    sv.remove_prefix(1);
+  }
+  while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t')) {
+    sv.remove_suffix(1);
+  }
+  return sv;
+}
+
+std::string_view unquote(std::string_view sv) {
+  if (sv.size() >= 2 && sv.front() == '"' && sv.back() == '"') {
+    return sv.substr(1, sv.size() - 2);
+  }
+  return sv;
+}
+
+// looks up `name` in a list of `; name=value` parameters, as found in the
+// Content-Type and Content-Disposition headers
+std::optional<std::string_view> find_param(std::string_view params,
+                                           std::string_view name) {
+  while (!params.empty()) {
+    auto semi = params.find(';');
+    std::string_view param = trim(params.substr(0, semi));
+    params = semi == std::string_view::npos ? ""sv : params.substr(semi + 1);
+
+    auto eq = param.find('=');
+    if (eq == std::string_view::npos) {
+      continue;
+    }
+    std::string_view const key = trim(param.substr(0, eq));
+    if (key.size() == name.size() && starts_with_ci(key, name)) {
+      return unquote(trim(param.substr(eq + 1)));
+    }
+  }
+  return std::nullopt;
+}
+
+bool ends_with_ci(std::string_view sv, std::string_view suffix) {
+  return sv.size() >= suffix.size() &&
+         starts_with_ci(sv.substr(sv.size() - suffix.size()), suffix);
+}
+
+int hex_value(char c) noexcept {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// application/grpc and application/grpc+proto; the other codecs are not
+// protobuf
+bool is_grpc_media_type(std::string_view content_type) {
+  std::string_view const media_type =
+      trim(content_type.substr(0, content_type.find(';')));
+  return (media_type.size() == "application/grpc"sv.size() &&
+          starts_with_ci(media_type, "application/grpc"sv)) ||
+         (media_type.size() == "application/grpc+proto"sv.size() &&
+          starts_with_ci(media_type, "application/grpc+proto"sv));
+}
+
+class UrlencodedCollector : public dnsec::RequestBodyCollector {
+ public:
+  UrlencodedCollector(dnsec::DdwafMemres &memres, Limits limits)
+      : RequestBodyCollector{memres, limits} {}
+
+ protected:
+  bool do_feed(std::string_view data) override {
+    const char *p = data.data();
+    const char *const end = p + data.size();
+
+    while (p < end) {
+      if (pct_state_ != pct_state::NONE) {
+        if (!feed_pct(*p++)) {
+          return false;
+        }
+        continue;
+      }
+
+      // copy the run of ordinary characters in one go
+      const char *run_end = std::find_if(p, end, [](char c) {
+        return c == '&' || c == '=' || c == '+' || c == '%';
+      });
+      if (run_end != p) {
+        append_bounded(cur(), {p, static_cast<std::size_t>(run_end - p)});
+        p = run_end;
+        continue;
+      }
+
+      switch (*p++) {
+        case '&':
+          if (!flush()) {
+            return false;
+          }
+          break;
+        case '=':
+          if (in_key_) {
+            in_key_ = false;
+          } else {
+            append_bounded(cur(), "="sv);
+          }
+          break;
+        case '+':
+          append_bounded(cur(), " "sv);
+          break;
+        case '%':
+          pct_state_ = pct_state::AFTER_PCT;
+          break;
+        default:
+          break;
+      }
+    }
+    return true;
+  }
+
+  void do_finish() override {
+    if (pct_state_ == pct_state::AFTER_PCT) {
+      append_bounded(cur(), "%"sv);
+    } else if (pct_state_ == pct_state::AFTER_1ST_DIGIT) {
+      append_bounded(cur(), "%"sv);
+      append_bounded(cur(), {&pct_hi_, 1});
+    }
+    pct_state_ = pct_state::NONE;
+    flush();
+  }
+
+ private:
+  enum class pct_state : unsigned char { NONE, AFTER_PCT, AFTER_1ST_DIGIT };
+
+  std::string &cur() noexcept { return in_key_ ? key_ : value_; }
+
+  bool feed_pct(char c) {
+    if (pct_state_ == pct_state::AFTER_PCT) {
+      if (hex_value(c) < 0) {
+        // invalid escape; keep it literally
+        append_bounded(cur(), "%"sv);
+        pct_state_ = pct_state::NONE;
+        return do_feed({&c, 1});
+      }
+      pct_hi_ = c;
+      pct_state_ = pct_state::AFTER_1ST_DIGIT;
+      return true;
+    }
+
+    pct_state_ = pct_state::NONE;
+    int const lo = hex_value(c);
+    if (lo < 0) {
+      append_bounded(cur(), "%"sv);
+      append_bounded(cur(), {&pct_hi_, 1});
+      return do_feed({&c, 1});
+    }
+    char const decoded = static_cast<char>((hex_value(pct_hi_) << 4) | lo);
+    append_bounded(cur(), {&decoded, 1});
+    return true;
+  }
+
+  bool flush() {
+    bool ret = true;
+    if (!key_.empty() || !value_.empty()) {
+      ret = add_field(key_, value_);
+    }
+    key_.clear();
+    value_.clear();
+    in_key_ = true;
+    return ret;
+  }
+
+  std::string key_;
+  std::string value_;
+  bool in_key_{true};
+  pct_state pct_state_{pct_state::NONE};
+  char pct_hi_{};
+};
+
+class MultipartCollector : public dnsec::RequestBodyCollector {
+ public:
+  MultipartCollector(dnsec::DdwafMemres &memres, Limits limits,
+                     std::string_view boundary)
+      : RequestBodyCollector{memres, limits} {
+    delimiter_.reserve(4 + boundary.size());
+    delimiter_.append("\r\n--"sv);
+    delimiter_.append(boundary);
+  }
+
+ protected:
+  bool do_feed(std::string_view data) override {
+    const char *p = data.data();
+    const char *const end = p + data.size();
+
+    while (p < end) {
+      switch (state_) {
+        case state::PREAMBLE:
+        case state::BODY:
+          p = feed_body(p, end);
+          break;
+        case state::AFTER_DELIMITER:
+          after_delim_[after_delim_len_++] = *p++;
+          if (after_delim_len_ < 2) {
+            break;
+          }
+          after_delim_len_ = 0;
+          if (after_delim_[0] == '-' && after_delim_[1] == '-') {
+            state_ = state::END;
+          } else if (after_delim_[0] == '\r' && after_delim_[1] == '\n') {
+            start_part();
+          } else {
+            // malformed
+            state_ = state::END;
+          }
+          break;
+        case state::HEADERS:
+          p = feed_headers(p, end);
+          break;
+        case state::END:
+          return false;
+      }
+    }
+
+    return state_ != state::END;
+  }
+
+  void do_finish() override {
+    // truncated body: keep the partial value of the current part
+    if (state_ == state::BODY) {
+      flush_part();
+    }
+  }
+
+ private:
+  enum class state : unsigned char {
+    PREAMBLE,
+    AFTER_DELIMITER,
+    HEADERS,
+    BODY,
+    END,
+  };
+
+  // Looks for the delimiter, handing the data before it to the current part.
+  // The delimiter's first character ('\r') doesn't occur elsewhere in it, so
+  // on a mismatch the search can restart at the current character.
+  const char *feed_body(const char *p, const char *const end) {
+    while (p < end) {
+      if (match_len_ == 0) {
+        const auto *cr = static_cast<const char *>(
+            std::memchr(p, '\r', static_cast<std::size_t>(end - p)));
+        const char *run_end = cr != nullptr ? cr : end;
+        part_data({p, static_cast<std::size_t>(run_end - p)});
+        p = run_end;
+        if (p == end) {
+          break;
+        }
+      }
+
+      char const c = *p++;
+      if (c == delimiter_[match_len_]) {
+        if (++match_len_ == delimiter_.size()) {
+          match_len_ = 0;
+          flush_part();
+          state_ = state::AFTER_DELIMITER;
+          return p;
+        }
+        continue;
+      }
+
+      part_data({delimiter_.data(), match_len_});
+      match_len_ = c == '\r' ? 1 : 0;
+      if (match_len_ == 0) {
+        part_data({&c, 1});
+      }
+    }
+    return p;
+  }
+
+  const char *feed_headers(const char *p, const char *const end) {
+    while (p < end) {
+      char const c = *p++;
+      if (c != '\n') {
+        if (header_line_.size() < kMaxHeaderLineSize) {
+          header_line_.push_back(c);
+        }
+        continue;
+      }
+
+      std::string_view line{header_line_};
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+      }
+      if (line.empty()) {
+        state_ = state::BODY;
+        header_line_.clear();
+        return p;
+      }
+      part_header(line);
+      header_line_.clear();
+    }
+    return p;
+  }
+
+  void part_header(std::string_view line) {
+    static constexpr auto kContentDisposition = "content-disposition:"sv;
+    if (!starts_with_ci(line, kContentDisposition)) {
+      return;
+    }
+    line.remove_prefix(kContentDisposition.size());
+
+    auto name = find_param(line, "name"sv);
+    if (name) {
+      append_bounded(name_, *name);
+    }
+    // file contents are not inspected, nor copied
+    is_file_ = find_param(line, "filename"sv).has_value();
+  }
+
+  void part_data(std::string_view data) {
+    if (state_ != state::BODY || is_file_ || data.empty()) {
+      return;
+    }
+    append_bounded(value_, data);
+  }
+
+  void start_part() {
+    state_ = state::HEADERS;
+    name_.clear();
+    value_.clear();
+    is_file_ = false;
+  }
+
+  void flush_part() {
+    if (state_ != state::BODY || is_file_ || name_.empty()) {
+      return;
+    }
+    if (!add_field(name_, value_)) {
+      state_ = state::END;
+    }
+  }
+
+  std::string delimiter_;  // CRLF "--" boundary
+  state state_{state::PREAMBLE};
+  // the body may start with the delimiter without the leading CRLF
+  std::size_t match_len_{2};
+  std::array<char, 2> after_delim_{};
+  std::size_t after_delim_len_{};
+  std::string header_line_;
+  std::string name_;
+  std::string value_;
+  bool is_file_{false};
+};
+
+// The JSON grammar doesn't lend itself to resumable parsing as nicely as the
+// form encodings, so the body is accumulated and parsed in one pass, directly
+// into the request's memres, when it's complete. A body cut short by
+// max_bytes still yields the values before the cut.
+class JsonCollector : public dnsec::RequestBodyCollector {
+ public:
+  JsonCollector(dnsec::DdwafMemres &memres, Limits limits,
+                std::size_t expected_size)
+      : RequestBodyCollector{memres, limits} {
+    buffer_.reserve(std::min(expected_size, limits.max_bytes));
+  }
+
+  bool empty() const noexcept override {
+    return value_.type == DDWAF_OBJ_INVALID;
+  }
+
+  // {"server.request.body": <json value>}
+  ddwaf_object *to_waf_input() override {
+    auto *root = memres().allocate_objects<dnsec::ddwaf_obj>(1);
+    dnsec::ddwaf_map_obj &root_map = root->make_map(1, memres());
+    dnsec::ddwaf_obj &body = root_map.at_unchecked(0);
+    body.set_key("server.request.body"sv);
+    body.shallow_copy_val_from(value_);
+    return root;
+  }
+
+ protected:
+  bool do_feed(std::string_view data) override {
+    buffer_.append(data);
+    return true;
+  }
+
+  void do_finish() override {
+    try {
+      dnsec::parse_json(buffer_, dnsec::kWafInputJsonLimits, memres(), value_);
+    } catch (const std::invalid_argument &) {
+      // not JSON after all; the body is not inspected
+      value_ = dnsec::ddwaf_obj{};
+    }
+    buffer_.clear();
+    buffer_.shrink_to_fit();
+  }
+
+ private:
+  std::string buffer_;
+  dnsec::ddwaf_obj value_;
+};
+
+// gRPC request messages: a 5-byte prefix (compressed flag and big-endian
+// length) followed by a protobuf message. Without the schema, the wire format
+// is decoded into maps from field numbers (as decimal strings) to values; a
+// repeated field gives repeated keys. The top-level fields are decoded as the
+// buffers come in. Length-delimited fields are copied, up to kMaxScratchSize,
+// and then taken to be text, a nested message (up to kMaxGrpcDepth levels) or
+// bytes, in that order. Nested messages keep their first
+// kMaxGrpcMessageFields fields, and fields at any level count towards
+// max_fields.
+// Compressed messages are skipped, as are the rest of malformed ones.
+class GrpcCollector : public dnsec::RequestBodyCollector {
+ public:
+  GrpcCollector(dnsec::DdwafMemres &memres, Limits limits)
+      : RequestBodyCollector{memres, limits} {}
+
+  bool empty() const noexcept override { return messages_.empty(); }
+
+  // {"grpc.server.request.message": <message> | [<messages>...]}
+  ddwaf_object *to_waf_input() override {
+    auto *root = memres().allocate_objects<dnsec::ddwaf_obj>(1);
+    dnsec::ddwaf_map_obj &root_map = root->make_map(1, memres());
+    dnsec::ddwaf_obj &msg = root_map.at_unchecked(0);
+    msg.set_key("grpc.server.request.message"sv);
+    if (messages_.size() == 1) {
+      msg.shallow_copy_val_from(messages_.front());
+      return root;
+    }
+
+    dnsec::ddwaf_arr_obj &arr = msg.make_array(messages_.size(), memres());
+    for (std::size_t i = 0; i < messages_.size(); i++) {
+      arr.at_unchecked(i).shallow_copy_val_from(messages_[i]);
+    }
+    return root;
+  }
+
+ protected:
+  bool do_feed(std::string_view data) override {
+    const char *p = data.data();
+    const char *const end = p + data.size();
+
+    while (p < end && !full_) {
+      if (state_ == state::PREFIX) {
+        prefix_[prefix_len_++] = static_cast<unsigned char>(*p++);
+        if (prefix_len_ == prefix_.size()) {
+          start_message();
+        }
+        continue;
+      }
+
+      std::size_t const n =
+          std::min(static_cast<std::size_t>(end - p), msg_left_);
+      const char *const q = feed_message(p, p + n);
+      msg_left_ -= static_cast<std::size_t>(q - p);
+      p = q;
+      if (msg_left_ == 0) {
+        end_message();
+      }
+    }
+    return !full_;
+  }
+
+  void do_finish() override {
+    // truncated body: keep what was decoded of the current message
+    if (state_ == state::BYTES) {
+      add_bytes_field();
+    }
+    state_ = state::TAG;
+    end_message();
+  }
+
+ private:
+  enum class state : unsigned char {
+    PREFIX,
+    TAG,
+    VARINT,
+    FIXED,
+    LENGTH,
+    BYTES,
+    SKIP,  // the rest of the message
+  };
+
+  static constexpr int kMaxGrpcDepth = 8;
+  // as for the containers of JSON bodies
+  static constexpr std::size_t kMaxGrpcMessageFields =
+      dnsec::kWafInputJsonLimits.max_container_size;
+  enum wire_type : unsigned char {
+    VARINT = 0,
+    I64 = 1,
+    LEN = 2,
+    I32 = 5,
+  };
+
+  void start_message() {
+    prefix_len_ = 0;
+    msg_left_ = (std::size_t{prefix_[1]} << 24) |
+                (std::size_t{prefix_[2]} << 16) |
+                (std::size_t{prefix_[3]} << 8) | std::size_t{prefix_[4]};
+    state_ = (prefix_[0] & 1) != 0 ? state::SKIP : state::TAG;
+    if (msg_left_ == 0) {
+      end_message();
+    }
+  }
+
+  void end_message() {
+    // a field cut short by the end of the message is dropped
+    if (!fields_.empty()) {
+      dnsec::ddwaf_obj &msg = messages_.emplace_back();
+      dnsec::ddwaf_map_obj &map = msg.make_map(fields_.size(), memres());
+      std::copy(fields_.begin(), fields_.end(), map.array);
+      fields_.clear();
+    }
+    state_ = state::PREFIX;
+    reset_varint();
+  }
+
+  // consumes [p, end), which doesn't go past the end of the message, unless
+  // max_fields is reached
+  const char *feed_message(const char *p, const char *const end) {
+    const char *const begin = p;
+    while (p < end && !full_) {
+      switch (state_) {
+        case state::TAG:
+          if (varint_byte(*p++)) {
+            start_field(take_varint());
+          }
+          break;
+        case state::VARINT:
+          if (varint_byte(*p++)) {
+            dnsec::ddwaf_obj value;
+            value.make_number(take_varint());
+            add_field_value(value);
+            state_ = state::TAG;
+          }
+          break;
+        case state::FIXED:
+          fixed_ |= std::uint64_t{static_cast<unsigned char>(*p++)}
+                    << (8 * fixed_read_++);
+          if (fixed_read_ == fixed_size_) {
+            dnsec::ddwaf_obj value;
+            value.make_number(fixed_);
+            add_field_value(value);
+            state_ = state::TAG;
+          }
+          break;
+        case state::LENGTH:
+          if (varint_byte(*p++)) {
+            bytes_left_ = take_varint();
+            std::size_t const msg_rest =
+                msg_left_ - static_cast<std::size_t>(p - begin);
+            if (bytes_left_ > msg_rest) {
+              state_ = state::SKIP;
+            } else if (bytes_left_ == 0) {
+              add_bytes_field();
+            } else {
+              state_ = state::BYTES;
+            }
+          }
+          break;
+        case state::BYTES: {
+          auto const n =
+              std::min(static_cast<std::uint64_t>(end - p), bytes_left_);
+          append_bounded(scratch_, {p, static_cast<std::size_t>(n)});
+          p += n;
+          bytes_left_ -= n;
+          if (bytes_left_ == 0) {
+            add_bytes_field();
+          }
+          break;
+        }
+        case state::SKIP:
+          p = end;
+          break;
+        case state::PREFIX:
+          // not reached: the message has ended
+          return p;
+      }
+    }
+    return p;
+  }
+
+  void start_field(std::uint64_t tag) {
+    field_ = tag >> 3;
+    if (field_ == 0) {
+      state_ = state::SKIP;
+      return;
+    }
+    switch (tag & 7) {
+      case VARINT:
+        state_ = state::VARINT;
+        break;
+      case I64:
+      case I32:
+        fixed_ = 0;
+        fixed_read_ = 0;
+        fixed_size_ = (tag & 7) == I64 ? 8 : 4;
+        state_ = state::FIXED;
+        break;
+      case LEN:
+        scratch_.clear();
+        state_ = state::LENGTH;
+        break;
+      default:
+        // groups are deprecated and not worth the trouble
+        state_ = state::SKIP;
+        break;
+    }
+  }
+
+  void add_bytes_field() {
+    // counted before the fields nested in it
+    if (reserve_field()) {
+      dnsec::ddwaf_obj value;
+      if (bytes_left_ > 0 || scratch_.size() == kMaxScratchSize) {
+        // a prefix of the value; not parseable as a message
+        value.make_string(scratch_, memres());
+      } else {
+        decode_bytes(scratch_, 1, value);
+      }
+      push_field(value);
+    }
+    scratch_.clear();
+    state_ = state::TAG;
+  }
+
+  void add_field_value(dnsec::ddwaf_obj value) {
+    if (reserve_field()) {
+      push_field(value);
+    }
+  }
+
+  // counts a field towards max_fields; false once it is reached
+  bool reserve_field() {
+    if (num_fields_ >= limits().max_fields) {
+      set_truncated();
+      full_ = true;
+      return false;
+    }
+    num_fields_++;
+    return true;
+  }
+
+  void push_field(dnsec::ddwaf_obj value) {
+    value.set_key(field_key(field_), memres());
+    fields_.push_back(value);
+  }
+
+  void decode_bytes(std::string_view data, int depth, dnsec::ddwaf_obj &out) {
+    if (!is_text(data) && depth < kMaxGrpcDepth) {
+      if (auto num_fields = count_fields(data)) {
+        decode_message(data, *num_fields, depth, out);
+        return;
+      }
+    }
+    out.make_string(data, memres());
+  }
+
+  // data was validated with count_fields(); the fields past the limits are
+  // dropped
+  void decode_message(std::string_view data, std::size_t num_fields,
+                      int depth, dnsec::ddwaf_obj &out) {
+    std::size_t const kept =
+        std::min({num_fields, kMaxGrpcMessageFields,
+                  limits().max_fields - num_fields_});
+    if (kept < num_fields) {
+      set_truncated();
+    }
+    num_fields_ += kept;
+
+    dnsec::ddwaf_map_obj &map = out.make_map(kept, memres());
+    for (std::size_t i = 0; i < kept; i++) {
+      dnsec::ddwaf_obj &entry = map.at_unchecked(i);
+      std::uint64_t tag{};
+      read_varint(data, tag);
+      entry.set_key(field_key(tag >> 3), memres());
+
+      std::uint64_t value{};
+      switch (tag & 7) {
+        case VARINT:
+          read_varint(data, value);
+          entry.make_number(value);
+          break;
+        case I64:
+        case I32:
+          read_fixed(data, (tag & 7) == I64 ? 8 : 4, value);
+          entry.make_number(value);
+          break;
+        default: {  // LEN
+          read_varint(data, value);
+          auto const len = static_cast<std::size_t>(value);
+          decode_bytes(data.substr(0, len), depth + 1, entry);
+          data.remove_prefix(len);
+          break;
+        }
+      }
+    }
+  }
+
+  // the number of fields in the message, if it looks like one
+  static std::optional<std::size_t> count_fields(std::string_view data) {
+    std::size_t count = 0;
+    while (!data.empty()) {
+      std::uint64_t tag{};
+      std::uint64_t value{};
+      if (!read_varint(data, tag) || (tag >> 3) == 0) {
+        return std::nullopt;
+      }
+      switch (tag & 7) {
+        case VARINT:
+          if (!read_varint(data, value)) {
+            return std::nullopt;
+          }
+          break;
+        case I64:
+        case I32:
+          if (!read_fixed(data, (tag & 7) == I64 ? 8 : 4, value)) {
+            return std::nullopt;
+          }
+          break;
+        case LEN:
+          if (!read_varint(data, value) || value > data.size()) {
+            return std::nullopt;
+          }
+          data.remove_prefix(static_cast<std::size_t>(value));
+          break;
+        default:
+          return std::nullopt;
+      }
+      count++;
+    }
+    return count;
+  }
+
+  static bool read_varint(std::string_view &data, std::uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && !data.empty(); shift += 7) {
+      auto const c = static_cast<unsigned char>(data.front());
+      data.remove_prefix(1);
+      value |= std::uint64_t{c & 0x7fU} << shift;
+      if ((c & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool read_fixed(std::string_view &data, std::size_t size,
+                         std::uint64_t &value) {
+    if (data.size() < size) {
+      return false;
+    }
+    value = 0;
+    for (std::size_t i = 0; i < size; i++) {
+      value |= std::uint64_t{static_cast<unsigned char>(data[i])} << (8 * i);
+    }
+    data.remove_prefix(size);
+    return true;
+  }
+
+  // no control characters other than whitespace; UTF-8 is not validated
+  static bool is_text(std::string_view data) noexcept {
+    return std::all_of(data.begin(), data.end(), [](char c) {
+      auto const u = static_cast<unsigned char>(c);
+      return u >= 0x20 || u == '\t' || u == '\n' || u == '\r';
+    });
+  }
+
+  std::string_view field_key(std::uint64_t field) {
+    // 20 digits are enough for any 64-bit value
+    char *end =
+        std::to_chars(key_buf_.data(), key_buf_.data() + key_buf_.size(), field)
+            .ptr;
+    return {key_buf_.data(), static_cast<std::size_t>(end - key_buf_.data())};
+  }
+
+  bool varint_byte(char c) noexcept {
+    auto const u = static_cast<unsigned char>(c);
+    if (varint_shift_ < 64) {
+      varint_ |= std::uint64_t{u & 0x7fU} << varint_shift_;
+      varint_shift_ += 7;
+    }
+    // longer varints are malformed; their extra bytes are ignored
+    return (u & 0x80) == 0;
+  }
+
+  std::uint64_t take_varint() noexcept {
+    std::uint64_t const value = varint_;
+    reset_varint();
+    return value;
+  }
+
+  void reset_varint() noexcept {
+    varint_ = 0;
+    varint_shift_ = 0;
+  }
+
+  state state_{state::PREFIX};
+  std::array<unsigned char, 5> prefix_{};
+  std::size_t prefix_len_{};
+  std::size_t msg_left_{};
+  std::uint64_t field_{};
+  std::uint64_t varint_{};
+  unsigned varint_shift_{};
+  std::uint64_t fixed_{};
+  unsigned fixed_read_{};
+  unsigned fixed_size_{};
+  std::uint64_t bytes_left_{};
+  std::string scratch_;
+  std::array<char, 20> key_buf_{};
+  // fields of the current message; keys and values in memres()
+  std::vector<dnsec::ddwaf_obj> fields_;
+  std::vector<dnsec::ddwaf_obj> messages_;
+  std::size_t num_fields_{};
+  bool full_{false};
+};
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+bool is_json_media_type(std::string_view content_type) {
+  std::string_view const media_type =
+      trim(content_type.substr(0, content_type.find(';')));
+  if (media_type.size() == "application/json"sv.size() &&
+      starts_with_ci(media_type, "application/json"sv)) {
+    return true;
+  }
+  if (media_type.size() == "text/json"sv.size() &&
+      starts_with_ci(media_type, "text/json"sv)) {
+    return true;
+  }
+  return starts_with_ci(media_type, "application/"sv) &&
+         ends_with_ci(media_type, "+json"sv);
+}
+
+std::unique_ptr<RequestBodyCollector> RequestBodyCollector::maybe_create(
+    const ngx_http_request_t &request, DdwafMemres &memres, Limits limits) {
+  if (request.headers_in.content_type == nullptr ||
+      request.headers_in.content_length_n == 0 || limits.max_bytes == 0 ||
+      limits.max_fields == 0) {
+    return nullptr;
+  }
+
+  std::string_view const ct =
+      to_string_view(request.headers_in.content_type->value);
+
+  if (starts_with_ci(ct, "application/x-www-form-urlencoded"sv)) {
+    return std::make_unique<UrlencodedCollector>(memres, limits);
+  }
+
+  if (starts_with_ci(ct, "multipart/form-data"sv)) {
+    auto boundary = find_param(ct.substr("multipart/form-data"sv.size()),
+                               "boundary"sv);
+    if (!boundary || boundary->empty() ||
+        boundary->size() > kMaxBoundarySize) {
+      return nullptr;
+    }
+    return std::make_unique<MultipartCollector>(memres, limits, *boundary);
+  }
+
+  if (is_grpc_media_type(ct)) {
+    return std::make_unique<GrpcCollector>(memres, limits);
+  }
+
+  if (is_json_media_type(ct)) {
+    std::size_t const expected_size =
+        request.headers_in.content_length_n > 0
+            ? static_cast<std::size_t>(request.headers_in.content_length_n)
+            : 0;
+    return std::make_unique<JsonCollector>(memres, limits, expected_size);
+  }
+
+  return nullptr;
+}
+
+void RequestBodyCollector::feed(std::string_view data) {
+  if (data.empty()) {
+    return;
+  }
+  if (done_) {
+    if (fields_.size() >= limits_.max_fields) {
+      truncated_ = true;
+    }
+    return;
+  }
+
+  bool last = false;
+  if (data.size() > limits_.max_bytes - bytes_seen_) {
+    data = data.substr(0, limits_.max_bytes - bytes_seen_);
+    truncated_ = true;
+    last = true;
+  }
+  bytes_seen_ += data.size();
+
+  if (!do_feed(data) || last) {
+    done_ = true;
+  }
+}
+
+void RequestBodyCollector::finish() {
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+  if (fields_.size() < limits_.max_fields) {
+    do_finish();
+  }
+}
+
+bool RequestBodyCollector::add_field(std::string_view key,
+                                     std::string_view value) {
+  if (fields_.size() >= limits_.max_fields) {
+    truncated_ = true;
+    return false;
+  }
+
+  char *k = memres_.allocate_string(key.size());
+  std::memcpy(k, key.data(), key.size());
+  char *v = memres_.allocate_string(value.size());
+  std::memcpy(v, value.data(), value.size());
+  fields_.emplace_back(std::string_view{k, key.size()},
+                       std::string_view{v, value.size()});
+
+  if (fields_.size() == limits_.max_fields) {
+    done_ = true;
+    return false;
+  }
+  return true;
+}
+
+void RequestBodyCollector::append_bounded(std::string &str,
+                                          std::string_view data) {
+  if (str.size() >= kMaxScratchSize) {
+    return;
+  }
+  str.append(data.substr(0, kMaxScratchSize - str.size()));
+}
+
+ddwaf_object *RequestBodyCollector::to_waf_input() {
+  // group the values of repeated keys in arrays, as done for the query string
+  std::unordered_map<std::string_view, std::size_t> keys_bag;
+  std::vector<std::string_view> keys;  // in order of first occurrence
+  for (auto &&[key, value] : fields_) {
+    if (keys_bag[key]++ == 0) {
+      keys.push_back(key);
+    }
+  }
+
+  ddwaf_obj *root = memres_.allocate_objects<ddwaf_obj>(1);
+  ddwaf_map_obj &root_map = root->make_map(1, memres_);
+  ddwaf_obj &body = root_map.at_unchecked(0);
+  body.set_key("server.request.body"sv);
+  ddwaf_map_obj &body_map = body.make_map(keys.size(), memres_);
+
+  std::unordered_map<std::string_view, ddwaf_obj *> entries;
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    ddwaf_obj &entry = body_map.at_unchecked(i);
+    entry.set_key(keys[i]);
+    if (keys_bag[keys[i]] > 1) {
+      // filled below, and then resized to the number of values
+      entry.make_array(keys_bag[keys[i]], memres_).nbEntries = 0;
+    }
+    entries.emplace(keys[i], &entry);
+  }
+
+  for (auto &&[key, value] : fields_) {
+    ddwaf_obj &entry = *entries[key];
+    if (entry.type == DDWAF_OBJ_ARRAY) {
+      auto &arr = static_cast<ddwaf_arr_obj &>(entry);
+      arr.at_unchecked(arr.nbEntries++).make_string(value);
+    } else {
+      entry.make_string(value);
+    }
+  }
+
+  return root;
+}
+
+}  // namespace datadog::nginx::security
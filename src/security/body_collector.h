@@ -0,0 +1,92 @@
+#pragma once
+
+#include <ddwaf.h>
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ddwaf_memres.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// application/json, text/json and application/<something>+json, with or
+// without parameters
+bool is_json_media_type(std::string_view content_type);
+
+// Incremental parser for application/x-www-form-urlencoded and
+// multipart/form-data request bodies. It's fed the buffers as they go through
+// the request body filter and copies completed keys and values into the
+// request's DdwafMemres, so the buffers themselves are never retained or
+// duplicated. File parts of multipart bodies are skipped.
+//
+// JSON bodies are the exception: they're accumulated (up to `max_bytes`) and
+// converted with parse_json() once the body is complete.
+//
+// gRPC bodies (application/grpc) are decoded as they come in, too, into the
+// messages given to the WAF as grpc.server.request.message.
+//
+// Parsing stops once `max_bytes` have been seen or `max_fields` fields have
+// been collected; what was collected so far is still given to the WAF.
+class RequestBodyCollector {
+ public:
+  struct Limits {
+    std::size_t max_bytes;
+    std::size_t max_fields;
+  };
+
+  // returns nullptr if the request has no body of a supported content type
+  static std::unique_ptr<RequestBodyCollector> maybe_create(
+      const ngx_http_request_t &request, DdwafMemres &memres, Limits limits);
+
+  virtual ~RequestBodyCollector() = default;
+  RequestBodyCollector(const RequestBodyCollector &) = delete;
+  RequestBodyCollector &operator=(const RequestBodyCollector &) = delete;
+
+  void feed(std::string_view data);
+  // called after the last buffer; flushes the field being parsed, if any
+  void finish();
+
+  virtual bool empty() const noexcept { return fields_.empty(); }
+  bool truncated() const noexcept { return truncated_; }
+
+  // {"server.request.body": {key: value | [values...]}}
+  virtual ddwaf_object *to_waf_input();
+
+ protected:
+  RequestBodyCollector(DdwafMemres &memres, Limits limits)
+      : memres_{memres}, limits_{limits} {}
+
+  // returns false when no more data is wanted
+  virtual bool do_feed(std::string_view data) = 0;
+  virtual void do_finish() {}
+
+  bool add_field(std::string_view key, std::string_view value);
+  static void append_bounded(std::string &str, std::string_view data);
+  DdwafMemres &memres() noexcept { return memres_; }
+  const Limits &limits() const noexcept { return limits_; }
+  // for subclasses that keep their own fields
+  void set_truncated() noexcept { truncated_ = true; }
+
+ private:
+  DdwafMemres &memres_;
+  Limits limits_;
+  std::size_t bytes_seen_{};
+  bool done_{false};
+  bool truncated_{false};
+  bool finished_{false};
+  // views into memres_
+  std::vector<std::pair<std::string_view, std::string_view>> fields_;
+};
+
+}  // namespace datadog::nginx::security
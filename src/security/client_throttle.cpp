@@ -0,0 +1,197 @@
+#include "client_throttle.h"
+
+#include <new>
+
+extern "C" {
+#include <ngx_cycle.h>
+#include <ngx_log.h>
+#include <ngx_slab.h>
+#include <ngx_times.h>
+}
+
+namespace datadog::nginx::security {
+
+namespace {
+constexpr ngx_uint_t kDefaultThreshold = 10;
+constexpr time_t kDefaultWindowSecs = 60;
+}  // namespace
+
+ClientThrottle::Table *ClientThrottle::table_{nullptr};
+ngx_uint_t ClientThrottle::threshold_{kDefaultThreshold};
+time_t ClientThrottle::window_secs_{kDefaultWindowSecs};
+enum ClientThrottle::action ClientThrottle::action_{action::BLOCK};
+
+ngx_int_t ClientThrottle::init_zone(ngx_shm_zone_t *zone, void *data) noexcept {
+  if (data != nullptr) {
+    // configuration reload with an unchanged zone: keep the counters
+    zone->data = data;
+    return NGX_OK;
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto *shpool = reinterpret_cast<ngx_slab_pool_t *>(zone->shm.addr);
+  if (zone->shm.exists) {
+    zone->data = shpool->data;
+    return NGX_OK;
+  }
+
+  // power of two so that we can mask the hash; the table takes at most half
+  // of the zone, the rest is left for the slab allocator bookkeeping
+  std::size_t num_slots = 1;
+  while (num_slots * 2 * sizeof(Slot) <= zone->shm.size / 2) {
+    num_slots *= 2;
+  }
+
+  auto *table = static_cast<Table *>(ngx_slab_calloc(shpool, sizeof(Table)));
+  void *slots_mem = ngx_slab_calloc(shpool, num_slots * sizeof(Slot));
+  if (table == nullptr || slots_mem == nullptr) {
+    ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0,
+                  "could not allocate the appsec throttle table in zone %V",
+                  &zone->shm.name);
+    return NGX_ERROR;
+  }
+
+  auto *slots = static_cast<Slot *>(slots_mem);
+  for (std::size_t i = 0; i < num_slots; i++) {
+    new (&slots[i]) Slot{};
+  }
+  table->mask = num_slots - 1;
+  table->slots = slots;
+
+  shpool->data = table;
+  zone->data = table;
+
+  ngx_log_error(NGX_LOG_INFO, zone->shm.log, 0,
+                "appsec throttle zone %V tracks up to %uz clients",
+                &zone->shm.name, num_slots);
+
+  return NGX_OK;
+}
+
+void ClientThrottle::initialize(const datadog_main_conf_t &conf) {
+  if (conf.appsec_throttle_zone == nullptr) {
+    table_ = nullptr;
+    return;
+  }
+
+  table_ = static_cast<Table *>(conf.appsec_throttle_zone->data);
+
+  threshold_ = conf.appsec_throttle_threshold == NGX_CONF_UNSET
+                   ? kDefaultThreshold
+                   : static_cast<ngx_uint_t>(conf.appsec_throttle_threshold);
+  window_secs_ = conf.appsec_throttle_window == NGX_CONF_UNSET
+                     ? kDefaultWindowSecs
+                     : conf.appsec_throttle_window;
+  action_ = conf.appsec_throttle_action == NGX_CONF_UNSET_UINT
+                ? action::BLOCK
+                : static_cast<enum action>(conf.appsec_throttle_action);
+}
+
+std::uint64_t ClientThrottle::key_for(std::string_view client_ip) noexcept {
+  // FNV-1a; must be stable across worker processes
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+  for (char c : client_ip) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+std::uint32_t ClientThrottle::current_window() noexcept {
+  return static_cast<std::uint32_t>(ngx_time() / window_secs_);
+}
+
+ClientThrottle::Slot *ClientThrottle::find(std::uint64_t key) noexcept {
+  std::size_t const idx = key & table_->mask;
+  for (std::size_t i = 0; i < kMaxProbes; i++) {
+    Slot &slot = table_->slots[(idx + i) & table_->mask];
+    std::uint64_t const cur = slot.key.load(std::memory_order_acquire);
+    if (cur == key) {
+      return &slot;
+    }
+    if (cur == 0) {
+      // slots are never emptied, so the key can't be further ahead
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+ClientThrottle::Slot *ClientThrottle::find_or_claim(
+    std::uint64_t key, std::uint32_t window) noexcept {
+  std::size_t const idx = key & table_->mask;
+  Slot *victim = nullptr;
+  for (std::size_t i = 0; i < kMaxProbes; i++) {
+    Slot &slot = table_->slots[(idx + i) & table_->mask];
+    std::uint64_t cur = slot.key.load(std::memory_order_acquire);
+    if (cur == key) {
+      return &slot;
+    }
+    if (cur == 0) {
+      if (slot.key.compare_exchange_strong(cur, key,
+                                           std::memory_order_acq_rel)) {
+        return &slot;
+      }
+      if (cur == key) {  // claimed concurrently for the same client
+        return &slot;
+      }
+      continue;
+    }
+    if (victim == nullptr &&
+        slot.window.load(std::memory_order_relaxed) != window) {
+      victim = &slot;
+    }
+  }
+
+  if (victim == nullptr) {
+    // every probed slot belongs to a client active in this window
+    return nullptr;
+  }
+
+  // take over a slot whose counters are stale; record_match() will see the
+  // old window and reset the count
+  std::uint64_t old_key = victim->key.load(std::memory_order_relaxed);
+  if (!victim->key.compare_exchange_strong(old_key, key,
+                                           std::memory_order_acq_rel)) {
+    return old_key == key ? victim : nullptr;
+  }
+  return victim;
+}
+
+bool ClientThrottle::is_throttled(std::uint64_t key) noexcept {
+  if (table_ == nullptr) {
+    return false;
+  }
+
+  Slot *slot = find(key);
+  if (slot == nullptr) {
+    return false;
+  }
+
+  return slot->window.load(std::memory_order_acquire) == current_window() &&
+         slot->matches.load(std::memory_order_relaxed) >= threshold_;
+}
+
+void ClientThrottle::record_match(std::uint64_t key) noexcept {
+  if (table_ == nullptr) {
+    return;
+  }
+
+  std::uint32_t const window = current_window();
+  Slot *slot = find_or_claim(key, window);
+  if (slot == nullptr) {
+    return;
+  }
+
+  std::uint32_t slot_window = slot->window.load(std::memory_order_acquire);
+  if (slot_window != window &&
+      slot->window.compare_exchange_strong(slot_window, window,
+                                           std::memory_order_acq_rel)) {
+    slot->matches.store(1, std::memory_order_release);
+    return;
+  }
+
+  slot->matches.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "../datadog_conf.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// Cross-worker table of WAF match counters keyed by client IP. It lives in a
+// shared memory zone (datadog_appsec_throttle_zone) and is updated without
+// locks. Once a client accumulates `threshold` requests with WAF matches
+// within the current window, its further requests are answered directly from
+// the access phase, without running the WAF, until the window ends.
+//
+// The counters are approximate: concurrent window rollovers may drop a few
+// increments and, when all the probed slots are taken by active clients, new
+// clients are not tracked.
+class ClientThrottle {
+ public:
+  enum class action : ngx_uint_t {
+    BLOCK,
+    RATE_LIMIT,
+  };
+
+  // shared memory zone initializer (ngx_shm_zone_t::init)
+  static ngx_int_t init_zone(ngx_shm_zone_t *zone, void *data) noexcept;
+
+  // called in each worker after the zone has been mapped
+  static void initialize(const datadog_main_conf_t &conf);
+
+  static bool enabled() noexcept { return table_ != nullptr; }
+
+  static std::uint64_t key_for(std::string_view client_ip) noexcept;
+
+  // whether requests from this client should skip the WAF and be rejected
+  static bool is_throttled(std::uint64_t key) noexcept;
+
+  // count a request from this client that had WAF matches
+  static void record_match(std::uint64_t key) noexcept;
+
+  static enum action action() noexcept { return action_; }
+
+ private:
+  struct Slot {
+    std::atomic<std::uint64_t> key;  // 0 means empty
+    std::atomic<std::uint32_t> window;
+    std::atomic<std::uint32_t> matches;
+  };
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+  // the zone sizing in doc/API.md assumes 16 bytes per client
+  static_assert(sizeof(Slot) == 16);
+
+  // allocated in the zone; the mapping is inherited by the workers, so the
+  // pointer is valid in all of them
+  struct Table {
+    std::size_t mask;
+    Slot *slots;
+  };
+
+  static constexpr std::size_t kMaxProbes = 8;
+
+  static std::uint32_t current_window() noexcept;
+  static Slot *find(std::uint64_t key) noexcept;
+  static Slot *find_or_claim(std::uint64_t key, std::uint32_t window) noexcept;
+
+  static Table *table_;            // NOLINT
+  static ngx_uint_t threshold_;    // NOLINT
+  static time_t window_secs_;      // NOLINT
+  static enum action action_;      // NOLINT
+};
+
+}  // namespace datadog::nginx::security
@@ -11,7 +11,6 @@
 #include <unordered_map>
 
 #include "../string_util.h"
-#include "client_ip.h"
 #include "ddwaf_obj.h"
 #include "decode.h"
 #include "library.h"
@@ -50,11 +49,14 @@ class ReqSerializer {
   static constexpr std::string_view kClientIp{"http.client_ip"};
   static constexpr std::string_view kRespHeadersNoCookies{
       "server.response.headers.no_cookies"};
+  static constexpr std::string_view kRespBody{"server.response.body"};
+  static constexpr std::string_view kContextProcessor{"waf.context.processor"};
 
  public:
   explicit ReqSerializer(dnsec::DdwafMemres &memres) : memres_{memres} {}
 
-  ddwaf_object *serialize(const ngx_http_request_t &request) {
+  ddwaf_object *serialize(const ngx_http_request_t &request,
+                          const std::optional<std::string> &client_ip) {
     dnsec::ddwaf_obj *root = memres_.allocate_objects<dnsec::ddwaf_obj>(1);
     dnsec::ddwaf_map_obj &root_map = root->make_map(6, memres_);
 
@@ -63,17 +65,33 @@ class ReqSerializer {
     set_request_method(request, root_map.at_unchecked(2));
     set_request_headers_nocookies(request, root_map.at_unchecked(3));
     set_request_cookie(request, root_map.at_unchecked(4));
-    set_client_ip(request, root_map.at_unchecked(5));
+    set_client_ip(client_ip, root_map.at_unchecked(5));
 
     return root;
   }
 
-  ddwaf_object *serialize_end(const ngx_http_request_t &request) {
+  ddwaf_object *serialize_end(const ngx_http_request_t &request,
+                              const dnsec::ddwaf_obj *response_body,
+                              bool extract_schema) {
     dnsec::ddwaf_obj *root = memres_.allocate_objects<dnsec::ddwaf_obj>(1);
-    dnsec::ddwaf_map_obj &root_map = root->make_map(2, memres_);
+    dnsec::ddwaf_map_obj &root_map = root->make_map(
+        2 + (response_body ? 1 : 0) + (extract_schema ? 1 : 0), memres_);
 
     set_response_status(request, root_map.at_unchecked(0));
     set_response_headers_no_cookies(request, root_map.at_unchecked(1));
+    std::size_t i = 2;
+    if (response_body) {
+      dnsec::ddwaf_obj &slot = root_map.at_unchecked(i++);
+      slot.shallow_copy_val_from(*response_body);
+      slot.set_key(kRespBody);
+    }
+    if (extract_schema) {
+      // enables the extract_schema processors of the ruleset
+      dnsec::ddwaf_obj &slot = root_map.at_unchecked(i++);
+      slot.set_key(kContextProcessor);
+      dnsec::ddwaf_map_obj &processors = slot.make_map(1, memres_);
+      processors.at_unchecked(0).set_key("extract-schema"sv).make_bool(true);
+    }
 
     return root;
   }
@@ -312,16 +330,14 @@ class ReqSerializer {
     set_value_from_iter(iter, slot);
   }
 
-  void set_client_ip(const ngx_http_request_t &request,
+  void set_client_ip(const std::optional<std::string> &client_ip,
                      dnsec::ddwaf_obj &slot) {
-    dnsec::ClientIp client_ip{dnsec::Library::custom_ip_header(), request};
-    std::optional<std::string> cl_ip = client_ip.resolve();
-
     slot.set_key(kClientIp);
-    if (!cl_ip) {
+    if (!client_ip) {
       slot.make_null();
+      return;
     }
-    slot.make_string(*cl_ip, memres_);  // copy
+    slot.make_string(*client_ip, memres_);  // copy
   }
 
   void set_response_status(const ngx_http_request_t &request,
@@ -380,16 +396,19 @@ class ReqSerializer {
 
 namespace datadog::nginx::security {
 
-ddwaf_object *collect_request_data(const ngx_http_request_t &request,
-                                   DdwafMemres &memres) {
+ddwaf_object *collect_request_data(
+    const ngx_http_request_t &request, DdwafMemres &memres,
+    const std::optional<std::string> &client_ip) {
   ReqSerializer rs{memres};
-  return rs.serialize(request);
+  return rs.serialize(request, client_ip);
 }
 
 ddwaf_object *collect_response_data(const ngx_http_request_t &request,
-                                    DdwafMemres &memres) {
+                                    DdwafMemres &memres,
+                                    const ddwaf_obj *response_body,
+                                    bool extract_schema) {
   ReqSerializer rs{memres};
-  return rs.serialize_end(request);
+  return rs.serialize_end(request, response_body, extract_schema);
 }
 }  // namespace datadog::nginx::security
 
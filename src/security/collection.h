@@ -2,7 +2,11 @@
 
 #include <ddwaf.h>
 
+#include <optional>
+#include <string>
+
 #include "ddwaf_memres.h"
+#include "ddwaf_obj.h"
 
 extern "C" {
 #include <ngx_http.h>
@@ -10,8 +14,15 @@ extern "C" {
 
 namespace datadog::nginx::security {
 
-ddwaf_object *collect_request_data(const ngx_http_request_t &request,
-                                   DdwafMemres &memres);
+// `client_ip` becomes http.client_ip (null if unresolved)
+ddwaf_object *collect_request_data(
+    const ngx_http_request_t &request, DdwafMemres &memres,
+    const std::optional<std::string> &client_ip);
+// `response_body`, if given, becomes server.response.body (shallow copy).
+// With `extract_schema`, the WAF is asked to extract the API schema of the
+// request and response.
 ddwaf_object *collect_response_data(const ngx_http_request_t &request,
-                                    DdwafMemres &memres);
+                                    DdwafMemres &memres,
+                                    const ddwaf_obj *response_body = nullptr,
+                                    bool extract_schema = false);
 }  // namespace datadog::nginx::security
@@ -4,8 +4,10 @@
 #include <ngx_http_core_module.h>
 #include <ngx_log.h>
 
+#include <algorithm>
 #include <atomic>
 #include <charconv>
+#include <chrono>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
@@ -20,12 +22,20 @@
 #include "../datadog_handler.h"
 #include "../ngx_http_datadog_module.h"
 #include "../tracing_library.h"
+#include "api_security.h"
 #include "blocking.h"
+#include "body_collector.h"
+#include "client_ip.h"
+#include "client_throttle.h"
 #include "collection.h"
 #include "ddwaf_obj.h"
+#include "event_json.h"
+#include "final_run_batch.h"
 #include "header_tags.h"
 #include "library.h"
 #include "util.h"
+#include "verdict_cache.h"
+#include "waf_telemetry.h"
 
 extern "C" {
 #include <ngx_hash.h>
@@ -38,9 +48,6 @@ extern "C" {
 #include <datadog/span.h>
 #include <datadog/trace_segment.h>
 #include <ddwaf.h>
-#include <rapidjson/document.h>
-#include <rapidjson/encodings.h>
-#include <rapidjson/prettywriter.h>
 
 using namespace std::literals;
 
@@ -48,96 +55,39 @@ namespace {
 
 namespace dnsec = datadog::nginx::security;
 
-class JsonWriter : public rapidjson::Writer<rapidjson::StringBuffer> {
-  using rapidjson::Writer<rapidjson::StringBuffer>::Writer;
-
- public:
-  // NOLINTNEXTLINE(readability-identifier-naming)
-  bool ConstLiteralKey(std::string_view sv) {
-    return String(sv.data(), sv.length(), false);
-  }
-};
-
-void ddwaf_object_to_json(JsonWriter &w, const ddwaf_object &dobj);
+// API schemas whose JSON is larger than this are not set on the span
+constexpr std::size_t kMaxSchemaJsonSize = 25 * 1024;
 
 void report_match(const ngx_http_request_t &req, dd::TraceSegment &seg,
-                  dd::Span &span,
-                  std::vector<dnsec::OwnedDdwafResult> &results) {
-  if (results.empty()) {
-    return;
-  }
-
+                  dd::Span &span, dnsec::EventsJson &events) {
   seg.override_sampling_priority(2);  // USER-KEEP
   span.set_tag("appsec.event"sv, "true");
 
-  rapidjson::StringBuffer buffer;
-  JsonWriter w(buffer);
-  w.StartObject();
-  w.ConstLiteralKey("triggers"sv);
+  if (events.dropped_events() > 0) {
+    span.set_metric("_dd.appsec.json.dropped_events"sv,
+                    static_cast<double>(events.dropped_events()));
+  }
 
-  w.StartArray();
-  for (auto &&result : results) {
-    auto events = dnsec::ddwaf_arr_obj{(*result).events};
-    for (auto &&evt : events) {
-      ddwaf_object_to_json(w, evt);
+  std::string_view const json = events.finish();
+
+  std::size_t const log_rate = dnsec::Library::event_log_rate();
+  std::size_t suppressed = 0;
+  if (log_rate > 0 && dnsec::EventLogLimiter::instance().allow(
+                          ngx_time(), log_rate, suppressed)) {
+    ngx_str_t json_ns{dnsec::ngx_stringv(json)};
+    if (suppressed > 0) {
+      ngx_log_error(NGX_LOG_INFO, req.connection->log, 0,
+                    "appsec event (%uz previous lines not logged): %V",
+                    suppressed, &json_ns);
+    } else {
+      ngx_log_error(NGX_LOG_INFO, req.connection->log, 0, "appsec event: %V",
+                    &json_ns);
     }
   }
-  w.EndArray(results.size());
-
-  w.EndObject(1);
-  w.Flush();
-
-  std::string_view const json{buffer.GetString(), buffer.GetLength()};
-
-  ngx_str_t json_ns{dnsec::ngx_stringv(json)};
-  ngx_log_error(NGX_LOG_INFO, req.connection->log, 0, "appsec event: %V",
-                &json_ns);
 
   span.set_tag("_dd.appsec.json"sv, json);
 }
 
-// NOLINTNEXTLINE(misc-no-recursion)
-void ddwaf_object_to_json(JsonWriter &w, const ddwaf_object &dobj) {
-  switch (dobj.type) {
-    case DDWAF_OBJ_MAP:
-      w.StartObject();
-      for (std::size_t i = 0; i < dobj.nbEntries; i++) {
-        auto &&e = dobj.array[i];
-        w.Key(e.parameterName, e.parameterNameLength, false);
-        ddwaf_object_to_json(w, e);
-      }
-      w.EndObject(dobj.nbEntries);
-      break;
-    case DDWAF_OBJ_ARRAY:
-      w.StartArray();
-      for (std::size_t i = 0; i < dobj.nbEntries; i++) {
-        auto &&e = dobj.array[i];
-        ddwaf_object_to_json(w, e);
-      }
-      w.EndArray(dobj.nbEntries);
-      break;
-    case DDWAF_OBJ_STRING:
-      w.String(dobj.stringValue, dobj.nbEntries, false);
-      break;
-    case DDWAF_OBJ_SIGNED:
-      w.Int64(dobj.intValue);
-      break;
-    case DDWAF_OBJ_UNSIGNED:
-      w.Uint64(dobj.uintValue);
-      break;
-    case DDWAF_OBJ_FLOAT:
-      w.Double(dobj.f64);
-      break;
-    case DDWAF_OBJ_BOOL:
-      w.Bool(dobj.boolean);
-      break;
-    case DDWAF_OBJ_INVALID:
-    case DDWAF_OBJ_NULL:
-      w.Null();
-      break;
-  }
-}
-
 template <
     typename Callable, typename Ret = decltype(std::declval<Callable>()()),
     typename DefType =  // can't have void arguments. Have a dummy parameter for
@@ -165,7 +115,10 @@ auto catch_exceptions(std::string_view name, const ngx_http_request_t &req,
 namespace datadog::nginx::security {
 
 Context::Context(std::shared_ptr<OwnedDdwafHandle> handle)
-    : waf_handle_{std::move(handle)}, stage_{new std::atomic<stage>{}} {
+    : waf_handle_{std::move(handle)},
+      events_json_{Library::max_event_json_size()},
+      generation_{Library::generation()},
+      stage_{new std::atomic<stage>{}} {
   if (!waf_handle_) {
     return;
   }
@@ -214,17 +167,27 @@ class PolTaskCtx {
     return *task_ctx;
   }
 
+  // Tasks that run while the request is waiting on them swap out the request
+  // event handlers for the duration of the task; others leave the request
+  // alone. Subclasses can shadow this.
+  static constexpr bool kSuspendsRequest = true;
+
   bool submit(ngx_thread_pool_t *pool) noexcept {
-    replace_handlers();
+    if constexpr (Self::kSuspendsRequest) {
+      replace_handlers();
+    }
 
     req_.main->count++;
+    submitted_at_ = std::chrono::steady_clock::now();
 
     if (ngx_thread_task_post(pool, &get_task()) != NGX_OK) {
       ngx_log_error(NGX_LOG_ERR, req_.connection->log, 0,
                     "failed to post task");
 
       req_.main->count--;
-      restore_handlers();
+      if constexpr (Self::kSuspendsRequest) {
+        restore_handlers();
+      }
 
       static_cast<Self *>(this)->~Self();
       return false;
@@ -252,6 +215,7 @@ class PolTaskCtx {
 
   // runs on the thread pool
   void handle(ngx_log_t *log) noexcept {
+    ctx_.add_queue_wait(std::chrono::steady_clock::now() - submitted_at_);
     try {
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, req_.connection->log, 0,
                     "before task main: %p", &req_);
@@ -276,7 +240,9 @@ class PolTaskCtx {
   }
 
   void completion_handler_impl() noexcept {
-    restore_handlers();
+    if constexpr (Self::kSuspendsRequest) {
+      restore_handlers();
+    }
 
     auto count = req_.main->count;
     if (count > 1) {
@@ -334,6 +300,7 @@ class PolTaskCtx {
   ngx_http_event_handler_pt prev_read_evt_handler_;
   ngx_http_event_handler_pt prev_write_evt_handler_;
   std::atomic<bool> ran_on_thread_{false};
+  std::chrono::steady_clock::time_point submitted_at_;
 };
 
 class Pol1stWafCtx : public PolTaskCtx<Pol1stWafCtx> {
@@ -405,6 +372,29 @@ bool Context::do_on_request_start(ngx_http_request_t &request, dd::Span &span) {
     return false;
   }
 
+  if (conf->appsec_waf_budget != NGX_CONF_UNSET_MSEC) {
+    waf_budget_ = std::chrono::milliseconds{conf->appsec_waf_budget};
+  }
+
+  if (ClientThrottle::enabled() && maybe_throttle(request, span)) {
+    return true;
+  }
+
+  if (auto *cache = VerdictCache::get_instance()) {
+    verdict_key_ = cache->request_key(request);
+    if (cache->lookup(*verdict_key_, generation_)) {
+      // an identical request had no matches with this ruleset; skip the WAF
+      // run and the round trip to the thread pool
+      ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                     "appsec: verdict cache hit for request");
+      request_verdict_cached_ = true;
+      set_waf_span_tags(span);
+      span.set_metric("_dd.appsec.waf.cache_hit"sv, 1.0);
+      stage_->store(stage::AFTER_BEGIN_WAF, std::memory_order_release);
+      return false;
+    }
+  }
+
   auto &task_ctx = Pol1stWafCtx::create(request, *this, span);
 
   if (task_ctx.submit(conf->waf_pool)) {
@@ -415,6 +405,58 @@ bool Context::do_on_request_start(ngx_http_request_t &request, dd::Span &span) {
   return false;
 }
 
+void Context::set_waf_span_tags(dd::Span &span) {
+  span.set_metric("_dd.appsec.enabled"sv, 1.0);
+  span.set_tag("_dd.runtime_family", "cpp"sv);
+  static const std::string_view libddwaf_version{ddwaf_get_version()};
+  span.set_tag("_dd.appsec.waf.version", libddwaf_version);
+}
+
+const std::optional<std::string> &Context::client_ip(
+    const ngx_http_request_t &request) {
+  if (!client_ip_resolved_) {
+    client_ip_ = ClientIp{Library::custom_ip_header(), request}.resolve();
+    client_ip_resolved_ = true;
+  }
+  return client_ip_;
+}
+
+bool Context::maybe_throttle(ngx_http_request_t &request, dd::Span &span) {
+  const std::optional<std::string> &ip = client_ip(request);
+  if (!ip) {
+    return false;
+  }
+
+  throttle_key_ = ClientThrottle::key_for(*ip);
+  if (!ClientThrottle::is_throttled(*throttle_key_)) {
+    return false;
+  }
+
+  auto *service = BlockingService::get_instance();
+  if (service == nullptr) {
+    return false;
+  }
+
+  BlockSpecification spec{403, BlockSpecification::ContentType::AUTO};
+  if (ClientThrottle::action() == ClientThrottle::action::RATE_LIMIT) {
+    spec = {429, BlockSpecification::ContentType::NONE};
+  }
+
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                "appsec: throttling client %s with status %d",
+                ip->c_str(), spec.status);
+
+  span.set_metric("_dd.appsec.enabled"sv, 1.0);
+  span.set_tag("appsec.blocked"sv, "true"sv);
+  span.set_tag("appsec.throttled"sv, "true"sv);
+
+  // the log phase may run during block() (the request can be finalized right
+  // away), so don't touch *this afterwards
+  stage_->store(stage::AFTER_BEGIN_WAF_BLOCK, std::memory_order_release);
+  service->block(spec, request);
+  return true;
+}
+
 namespace {
 
 class Action {
@@ -562,8 +604,12 @@ std::optional<BlockSpecification> resolve_block_spec(
       continue;
     }
 
-    if (type == Action::type::GENERATE_STACK ||
-        type == Action::type::GENERATE_SCHEMA) {
+    if (type == Action::type::GENERATE_SCHEMA) {
+      // schemas are extracted for the requests ApiSecuritySampler picks
+      continue;
+    }
+
+    if (type == Action::type::GENERATE_STACK) {
       std::string_view raw_type = act.raw_type();
       ngx_str_t raw_type_ns{dnsec::ngx_stringv(raw_type)};
       ngx_log_error(NGX_LOG_NOTICE, &log, 0,
@@ -593,18 +639,15 @@ std::optional<BlockSpecification> Context::run_waf_start(
     return std::nullopt;
   }
 
-  span.set_metric("_dd.appsec.enabled"sv, 1.0);
-  span.set_tag("_dd.runtime_family", "cpp"sv);
-  static const std::string_view libddwaf_version{ddwaf_get_version()};
-  span.set_tag("_dd.appsec.waf.version", libddwaf_version);
+  set_waf_span_tags(span);
 
-  ddwaf_object *data = collect_request_data(req, memres_);
+  ddwaf_object *data = timed_serialization(
+      [&] { return collect_request_data(req, memres_, client_ip(req)); });
 
   ddwaf_result result;
-  auto code =
-      ddwaf_run(ctx_.resource, data, nullptr, &result, Library::waf_timeout());
+  auto code = timed_waf_run(data, result);
   if (code == DDWAF_MATCH) {
-    results_.emplace_back(result);
+    add_match(result);
   } else {
     ddwaf_result_free(&result);
   }
@@ -625,6 +668,228 @@ std::optional<BlockSpecification> Context::run_waf_start(
   return block_spec;
 }
 
+ngx_int_t Context::request_body_filter(ngx_http_request_t &request,
+                                       ngx_chain_t *chain,
+                                       dd::Span &span) noexcept {
+  return catch_exceptions(
+      "request_body_filter"sv, request,
+      [&]() { return Context::do_request_body_filter(request, chain, span); },
+      static_cast<ngx_int_t>(NGX_ERROR));
+}
+
+// Runs the WAF on the request body. The request keeps going while the task
+// runs (its body may still be being read or already be forwarded upstream),
+// so the request handlers are left untouched.
+class PolBodyWafCtx : public PolTaskCtx<PolBodyWafCtx> {
+  using PolTaskCtx::PolTaskCtx;
+
+  static constexpr bool kSuspendsRequest = false;
+
+  std::optional<BlockSpecification> do_handle(ngx_log_t &log) {
+    return ctx_.run_waf_body(req_, span_);
+  }
+
+  void complete() noexcept {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, req_.connection->log, 0,
+                   "completion handler of waf body task");
+    bool const ran = ran_on_thread_.load(std::memory_order_acquire);
+    ctx_.on_body_waf_complete(req_, span_, ran ? block_spec_ : std::nullopt);
+  }
+
+  friend PolTaskCtx;
+};
+
+bool Context::can_hold_request_body(
+    const ngx_http_request_t &request) noexcept {
+#if nginx_version >= 1021002
+  // Since 1.21.2, request body filters can keep buffers and pass them on
+  // later: reading only completes once the last buffer has been saved
+  // (rb->last_saved). HTTP/2 and HTTP/3 read bodies differently; leave them
+  // alone.
+  return request.request_body != nullptr &&
+         !request.request_body_no_buffering &&
+         request.http_version < NGX_HTTP_VERSION_20;
+#else
+  return false;
+#endif
+}
+
+ngx_int_t Context::do_request_body_filter(ngx_http_request_t &request,
+                                          ngx_chain_t *chain, dd::Span &span) {
+  auto st = stage_->load(std::memory_order_acquire);
+  if (st != stage::AFTER_BEGIN_WAF || body_done_ || response_started_) {
+    return ngx_http_next_request_body_filter(&request, chain);
+  }
+
+  if (!body_collector_) {
+    body_collector_ = RequestBodyCollector::maybe_create(
+        request, memres_,
+        {.max_bytes = Library::max_body_size(),
+         .max_fields = Library::max_body_fields()});
+    if (!body_collector_) {
+      body_done_ = true;
+      return ngx_http_next_request_body_filter(&request, chain);
+    }
+  }
+
+  // Only the buffers in memory are looked at. They are not copied; the
+  // collector keeps just the (bounded) keys and values. Nothing here makes
+  // nginx buffer more of the body than it would otherwise.
+  bool last = false;
+  for (ngx_chain_t *cl = chain; cl != nullptr; cl = cl->next) {
+    ngx_buf_t *b = cl->buf;
+    if (ngx_buf_in_memory(b) && b->last > b->pos) {
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      body_collector_->feed({reinterpret_cast<char *>(b->pos),
+                             static_cast<std::size_t>(b->last - b->pos)});
+    }
+    if (b->last_buf) {
+      last = true;
+    }
+  }
+
+  if (!last) {
+    return ngx_http_next_request_body_filter(&request, chain);
+  }
+
+  body_done_ = true;
+  body_collector_->finish();
+  if (body_collector_->truncated()) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                   "appsec: request body inspection limits reached");
+  }
+  if (body_collector_->empty()) {
+    return ngx_http_next_request_body_filter(&request, chain);
+  }
+
+  if (can_hold_request_body(request)) {
+    if (ngx_chain_add_copy(request.pool, &held_body_, chain) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    body_held_ = true;
+  }
+
+  auto *conf = static_cast<datadog_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(&request, ngx_http_datadog_module));
+
+  stage_->store(stage::BEFORE_RUN_WAF_BODY, std::memory_order_release);
+
+  auto &task_ctx = PolBodyWafCtx::create(request, *this, span);
+  if (!task_ctx.submit(conf->waf_pool)) {
+    stage_->store(stage::AFTER_BEGIN_WAF, std::memory_order_release);
+    held_body_ = nullptr;
+    body_held_ = false;
+    return ngx_http_next_request_body_filter(&request, chain);
+  }
+
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                "posted waf body task");
+
+  if (!body_held_) {
+    // report only
+    return ngx_http_next_request_body_filter(&request, chain);
+  }
+
+  // reading the body completes once we pass these on
+  return NGX_OK;
+}
+
+std::optional<BlockSpecification> Context::run_waf_body(
+    ngx_http_request_t &request, dd::Span &span) {
+  auto st = stage_->load(std::memory_order_acquire);
+  if (st != stage::BEFORE_RUN_WAF_BODY) {
+    return std::nullopt;
+  }
+
+  feed_skipped_request_data(request);
+
+  ddwaf_object *data =
+      timed_serialization([&] { return body_collector_->to_waf_input(); });
+
+  ddwaf_result result;
+  auto code = timed_waf_run(data, result);
+  if (code == DDWAF_MATCH) {
+    add_match(result);
+  } else {
+    ddwaf_result_free(&result);
+  }
+
+  std::optional<BlockSpecification> block_spec;
+  ddwaf_map_obj actions_arr{result.actions};
+  if (code == DDWAF_MATCH && !actions_arr.empty() && body_held_) {
+    block_spec = resolve_block_spec(actions_arr, *request.connection->log);
+  }
+
+  if (block_spec) {
+    stage_->store(stage::AFTER_BEGIN_WAF_BLOCK, std::memory_order_release);
+  } else {
+    stage_->store(stage::AFTER_RUN_WAF_BODY, std::memory_order_release);
+  }
+
+  return block_spec;
+}
+
+void Context::on_body_waf_complete(
+    ngx_http_request_t &request, dd::Span &span,
+    const std::optional<BlockSpecification> &block_spec) noexcept {
+  catch_exceptions("on_body_waf_complete"sv, request, [&]() {
+    return Context::do_on_body_waf_complete(request, span, block_spec);
+  });
+}
+
+void Context::do_on_body_waf_complete(
+    ngx_http_request_t &request, dd::Span &span,
+    const std::optional<BlockSpecification> &block_spec) {
+  // the task may not have run (or may have failed)
+  stage expected = stage::BEFORE_RUN_WAF_BODY;
+  stage_->compare_exchange_strong(expected, stage::AFTER_RUN_WAF_BODY,
+                                  std::memory_order_acq_rel);
+
+  ngx_chain_t *held = std::exchange(held_body_, nullptr);
+  ngx_connection_t *conn = request.connection;
+
+  auto *service = BlockingService::get_instance();
+  if (block_spec && held != nullptr && !request.header_sent &&
+      service != nullptr) {
+    span.set_tag("appsec.blocked"sv, "true"sv);
+
+    // The held buffers are dropped, so reading the body never completes and
+    // the content handler's post handler doesn't run. The finalization in
+    // block() releases the reference taken by
+    // ngx_http_read_client_request_body() in its stead.
+    request.read_event_handler = ngx_http_block_reading;
+    if (conn->read->timer_set) {
+      ngx_del_timer(conn->read);
+    }
+
+    // the log phase may run during block(); don't touch *this afterwards
+    service->block(*block_spec, request);
+    ngx_http_run_posted_requests(conn);
+    return;
+  }
+
+  if (final_run_deferred_) {
+    final_run_deferred_ = false;
+    post_final_waf_run(request, span);
+  }
+
+  if (held == nullptr) {
+    return;
+  }
+
+  ngx_int_t const rc = ngx_http_next_request_body_filter(&request, held);
+  if (rc == NGX_ERROR) {
+    ngx_http_finalize_request(&request, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ngx_http_run_posted_requests(conn);
+    return;
+  }
+
+  // the body is now complete; let the reading code notice and call the
+  // content handler's post handler
+  request.read_event_handler(&request);
+  ngx_http_run_posted_requests(conn);
+}
+
 ngx_int_t Context::output_body_filter(ngx_http_request_t &request,
                                       ngx_chain_t *chain,
                                       dd::Span &span) noexcept {
@@ -652,22 +917,30 @@ class PolFinalWafCtx : public PolTaskCtx<PolFinalWafCtx> {
 ngx_int_t Context::do_output_body_filter(ngx_http_request_t &request,
                                          ngx_chain_t *chain, dd::Span &span) {
   auto st = stage_->load(std::memory_order_acquire);
-  if (st != stage::AFTER_BEGIN_WAF) {
+  if (st == stage::BEFORE_RUN_WAF_BODY) {
+    // the WAF context is busy with the request body; the final run is
+    // submitted when that one completes
+    final_run_deferred_ = true;
+    return ngx_http_next_output_body_filter(&request, chain);
+  }
+  if (st != stage::AFTER_BEGIN_WAF && st != stage::AFTER_RUN_WAF_BODY) {
     return ngx_http_next_output_body_filter(&request, chain);
   }
 
-  PolFinalWafCtx &task_ctx = PolFinalWafCtx::create(request, *this, span);
-
-  auto *conf = static_cast<datadog_loc_conf_t *>(
-      ngx_http_get_module_loc_conf(&request, ngx_http_datadog_module));
-
-  stage_->store(stage::BEFORE_RUN_WAF_END, std::memory_order_release);
+  if (!response_started_) {
+    response_started_ = true;
+    response_body_ = ResponseBodyWindow::maybe_create(
+        request, memres_, Library::max_response_body_size());
+  }
 
-  if (task_ctx.submit(conf->waf_pool)) {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
-                  "posted waf end task");
+  // The final run waits until the start of the response body is in the
+  // window. The buffers are passed on meanwhile: the final run cannot block.
+  if (response_body_ && !response_body_->feed(chain)) {
+    return ngx_http_next_output_body_filter(&request, chain);
   }
 
+  post_final_waf_run(request, span);
+
   // blocking not supported
   // I think supporting this would involve registering a body filter that
   // buffers the original request output while awaiting a response from the WAF
@@ -688,29 +961,228 @@ ngx_int_t Context::do_output_body_filter(ngx_http_request_t &request,
   return ngx_http_next_output_body_filter(&request, chain);
 }
 
-std::optional<BlockSpecification> Context::run_waf_end(
-    ngx_http_request_t &request, dd::Span &span) {
-  auto st = stage_->load(std::memory_order_acquire);
-  if (st != stage::BEFORE_RUN_WAF_END) {
-    return std::nullopt;
+void Context::post_final_waf_run(ngx_http_request_t &request, dd::Span &span) {
+  if (auto *sampler = ApiSecuritySampler::get_instance()) {
+    extract_schema_ = sampler->sample(request, ngx_time());
+  }
+
+  auto *cache = VerdictCache::get_instance();
+  // a cached verdict doesn't cover the response body nor yield a schema
+  if (cache != nullptr && verdict_key_ && !response_body_ && !extract_schema_) {
+    final_verdict_key_ = cache->response_key(*verdict_key_, request);
+    if (request_verdict_cached_ &&
+        cache->lookup(*final_verdict_key_, generation_)) {
+      stage_->store(stage::AFTER_RUN_WAF_END, std::memory_order_release);
+      return;
+    }
+  }
+
+  auto *conf = static_cast<datadog_loc_conf_t *>(
+      ngx_http_get_module_loc_conf(&request, ngx_http_datadog_module));
+
+  // The final run cannot block, so the request need not wait for it: the
+  // data is collected here and the run is batched with those of other
+  // requests. The job's reference to the request delays the log phase until
+  // the run is over. Response bodies are parsed on the pool thread, so they
+  // still go through PolFinalWafCtx.
+  if (Library::async_final_waf_run() && !response_body_) {
+    ddwaf_object *req_data = collect_skipped_request_data(request);
+    ddwaf_object *resp_data = timed_serialization([&] {
+      return collect_response_data(request, memres_, nullptr, extract_schema_);
+    });
+    stage_->store(stage::BEFORE_RUN_WAF_END, std::memory_order_release);
+    final_run_job_.emplace(*this, request, req_data, resp_data);
+    request.main->count++;
+    FinalRunBatch::for_pool(conf->waf_pool).enqueue(*final_run_job_);
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "queued waf end run");
+    return;
   }
 
-  ddwaf_object *resp_data = collect_response_data(request, memres_);
+  PolFinalWafCtx &task_ctx = PolFinalWafCtx::create(request, *this, span);
+
+  stage_->store(stage::BEFORE_RUN_WAF_END, std::memory_order_release);
 
+  if (task_ctx.submit(conf->waf_pool)) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, request.connection->log, 0,
+                  "posted waf end task");
+  }
+}
+
+void Context::feed_skipped_request_data(ngx_http_request_t &request) {
+  if (ddwaf_object *req_data = collect_skipped_request_data(request)) {
+    run_waf_report_only(req_data);
+  }
+}
+
+ddwaf_object *Context::collect_skipped_request_data(
+    ngx_http_request_t &request) {
+  if (!request_verdict_cached_ || request_data_fed_) {
+    return nullptr;
+  }
+  request_data_fed_ = true;
+
+  // the first run was skipped, but rules may combine request and response
+  // addresses, so the request data must still be given to the context
+  return timed_serialization([&] {
+    return collect_request_data(request, memres_, client_ip(request));
+  });
+}
+
+void Context::run_waf_report_only(ddwaf_object *data) {
   ddwaf_result result;
-  DDWAF_RET_CODE const code = ddwaf_run(ctx_.resource, resp_data, nullptr,
-                                        &result, Library::waf_timeout());
+  DDWAF_RET_CODE const code = timed_waf_run(data, result);
+  if (extract_schema_) {
+    take_schemas(result);
+  }
   if (code == DDWAF_MATCH) {
-    results_.emplace_back(result);
+    add_match(result);
   } else {
     ddwaf_result_free(&result);
   }
+}
+
+std::optional<BlockSpecification> Context::run_waf_end(
+    ngx_http_request_t &request, dd::Span &span) {
+  auto st = stage_->load(std::memory_order_acquire);
+  if (st != stage::BEFORE_RUN_WAF_END) {
+    return std::nullopt;
+  }
+
+  feed_skipped_request_data(request);
+
+  // parses the response body, if any
+  ddwaf_object *resp_data = timed_serialization([&] {
+    ddwaf_obj body;
+    bool const has_body =
+        response_body_ && response_body_->to_waf_input(body);
+    return collect_response_data(request, memres_, has_body ? &body : nullptr,
+                                 extract_schema_);
+  });
+  run_waf_report_only(resp_data);
 
   stage_->store(stage::AFTER_RUN_WAF_END, std::memory_order_release);
 
   return std::nullopt;  // we don't support blocking in the final waf run
 }
 
+DDWAF_RET_CODE Context::timed_waf_run(ddwaf_object *data,
+                                      ddwaf_result &result) {
+  auto const start = std::chrono::steady_clock::now();
+  std::uint64_t timeout_us = Library::waf_timeout();
+  if (waf_budget_) {
+    // only the time spent on the WAF counts, not the time the request spends
+    // uploading its body or waiting for the upstream
+    auto const consumed = metrics_.queue_wait + metrics_.serialization +
+                          metrics_.duration_ext;
+    auto const left = std::chrono::duration_cast<std::chrono::microseconds>(
+        *waf_budget_ - consumed);
+    if (left.count() <= 0) {
+      // not worth a run that would time out right away; like a timeout, this
+      // keeps the verdict from being cached
+      result = ddwaf_result{};
+      ddwaf_object_array(&result.events);
+      ddwaf_object_map(&result.actions);
+      ddwaf_object_map(&result.derivatives);
+      metrics_.runs++;
+      metrics_.timeouts++;
+      waf_budget_exhausted_ = true;
+      waf_timed_out_ = true;
+      return DDWAF_OK;
+    }
+    timeout_us =
+        std::min(timeout_us, static_cast<std::uint64_t>(left.count()));
+  }
+
+  DDWAF_RET_CODE const code =
+      ddwaf_run(ctx_.resource, data, nullptr, &result, timeout_us);
+  metrics_.duration_ext += std::chrono::steady_clock::now() - start;
+  metrics_.duration += std::chrono::nanoseconds{result.total_runtime};
+  metrics_.runs++;
+  if (result.timeout) {
+    metrics_.timeouts++;
+    waf_timed_out_ = true;
+    if (waf_budget_) {
+      waf_budget_exhausted_ = true;
+    }
+  }
+  return code;
+}
+
+void Context::take_schemas(const ddwaf_result &result) {
+  if (result.derivatives.type != DDWAF_OBJ_MAP) {
+    return;
+  }
+
+  ddwaf_map_obj const derivatives{result.derivatives};
+  for (auto &&derivative : derivatives) {
+    std::string_view const key = derivative.key();
+    if (!key.starts_with("_dd.appsec.s."sv)) {
+      continue;
+    }
+    rapidjson::StringBuffer buffer;
+    if (!write_json(buffer, derivative, kMaxSchemaJsonSize)) {
+      continue;  // not worth the span size
+    }
+    schemas_.emplace_back(std::string{key},
+                          std::string{buffer.GetString(), buffer.GetSize()});
+  }
+}
+
+void Context::report_schemas(dd::Span &span) {
+  for (auto &&[key, schema] : schemas_) {
+    span.set_tag(key, schema);
+  }
+  schemas_.clear();
+}
+
+void Context::report_waf_metrics(dd::Span &span) {
+  if (waf_budget_exhausted_) {
+    span.set_metric("_dd.appsec.waf.budget_exhausted"sv, 1.0);
+  }
+  if (metrics_.runs == 0) {
+    return;
+  }
+  WafTelemetry::instance().record(metrics_);
+
+  using us = std::chrono::duration<double, std::micro>;
+  span.set_metric("_dd.appsec.waf.duration"sv, us{metrics_.duration}.count());
+  span.set_metric("_dd.appsec.waf.duration_ext"sv,
+                  us{metrics_.duration_ext}.count());
+  span.set_metric("_dd.appsec.waf.serialization"sv,
+                  us{metrics_.serialization}.count());
+  span.set_metric("_dd.appsec.waf.queue_wait"sv,
+                  us{metrics_.queue_wait}.count());
+  span.set_metric("_dd.appsec.waf.timeouts"sv,
+                  static_cast<double>(metrics_.timeouts));
+  metrics_ = {};
+}
+
+void Context::FinalRunJob::run(ngx_log_t &log,
+                               std::chrono::nanoseconds queue_wait) noexcept {
+  ctx_.add_queue_wait(queue_wait);
+  try {
+    if (req_data_ != nullptr) {
+      ctx_.run_waf_report_only(req_data_);
+    }
+    ctx_.run_waf_report_only(resp_data_);
+    ctx_.stage_->store(stage::AFTER_RUN_WAF_END, std::memory_order_release);
+  } catch (const std::exception &e) {
+    ngx_log_error(NGX_LOG_ERR, &log, 0, "final waf run failed: %s", e.what());
+  }
+}
+
+void Context::FinalRunJob::complete(bool ran) noexcept {
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, req_.connection->log, 0,
+                 "completion of batched waf end run (ran: %d)", ran);
+  // as PolTaskCtx does; the log phase runs once the last reference is gone
+  if (req_.main->count > 1) {
+    req_.main->count--;
+  } else {
+    ngx_http_finalize_request(&req_, NGX_DONE);
+  }
+}
+
 void Context::on_main_log_request(ngx_http_request_t &request,
                                   dd::Span &span) noexcept {
   catch_exceptions("on_log_request"sv, request, [&]() {
@@ -721,22 +1193,52 @@ void Context::on_main_log_request(ngx_http_request_t &request,
 void Context::do_on_main_log_request(ngx_http_request_t &request,
                                      dd::Span &span) {
   auto st = stage_->load(std::memory_order_acquire);
-  if (st != stage::AFTER_RUN_WAF_END && st != stage::AFTER_BEGIN_WAF_BLOCK) {
+  // tasks and batched runs hold a reference to the request, so none is
+  // running anymore
+  report_waf_metrics(span);
+  report_schemas(span);
+
+  // AFTER_BEGIN_WAF with a response body window: the response ended (or was
+  // cut short) before the window was complete; report the request matches
+  if (st != stage::AFTER_RUN_WAF_END && st != stage::AFTER_BEGIN_WAF_BLOCK &&
+      st != stage::AFTER_RUN_WAF_BODY &&
+      !(st == stage::AFTER_BEGIN_WAF && response_body_)) {
     return;
   }
 
+  if (throttle_key_ && has_matches()) {
+    ClientThrottle::record_match(*throttle_key_);
+  }
+
+  auto *cache = VerdictCache::get_instance();
+  if (cache != nullptr && st == stage::AFTER_RUN_WAF_END && !has_matches() &&
+      !waf_timed_out_) {
+    if (verdict_key_ && !request_verdict_cached_) {
+      cache->store_no_match(*verdict_key_, generation_);
+    }
+    if (final_verdict_key_) {
+      cache->store_no_match(*final_verdict_key_, generation_);
+    }
+  }
+
   set_header_tags(has_matches(), request, span);
   report_matches(request, span);
 }
 
 bool Context::has_matches() const noexcept { return !results_.empty(); }
 
+void Context::add_match(ddwaf_result &result) {
+  results_.emplace_back(result);
+  // serialized right away, while on the thread that ran the WAF
+  events_json_.append(result);
+}
+
 void Context::report_matches(ngx_http_request_t &request, dd::Span &span) {
   if (results_.empty()) {
     return;
   }
 
-  report_match(request, span.trace_segment(), span, results_);
+  report_match(request, span.trace_segment(), span, events_json_);
   results_.clear();
 }
 
@@ -4,16 +4,25 @@
 #include <ddwaf.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <memory>
 #include <optional>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "../dd.h"
 #include "blocking.h"
+#include "body_collector.h"
 #include "collection.h"
+#include "event_json.h"
+#include "final_run_batch.h"
 #include "library.h"
+#include "response_body.h"
 #include "util.h"
+#include "waf_telemetry.h"
 
 extern "C" {
 #include <nginx.h>
@@ -55,7 +64,12 @@ class Context {
   // returns a new context or an empty unique_ptr if the waf is not active
   static std::unique_ptr<Context> maybe_create();
 
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
   bool on_request_start(ngx_http_request_t &request, dd::Span &span) noexcept;
+  ngx_int_t request_body_filter(ngx_http_request_t &request, ngx_chain_t *chain,
+                                dd::Span &span) noexcept;
   ngx_int_t output_body_filter(ngx_http_request_t &request, ngx_chain_t *chain,
                                dd::Span &span) noexcept;
   void on_main_log_request(ngx_http_request_t &request,
@@ -64,22 +78,136 @@ class Context {
   // runs on a separate thread; returns whether it blocked
   std::optional<BlockSpecification> run_waf_start(ngx_http_request_t &request,
                                                   dd::Span &span);
+  std::optional<BlockSpecification> run_waf_body(ngx_http_request_t &request,
+                                                 dd::Span &span);
   std::optional<BlockSpecification> run_waf_end(ngx_http_request_t &request,
                                                 dd::Span &span);
 
+  // runs on a separate thread; time the task spent in the thread pool queue
+  void add_queue_wait(std::chrono::nanoseconds wait) noexcept {
+    metrics_.queue_wait += wait;
+  }
+
+  // runs on the main thread once the request body WAF run is over
+  void on_body_waf_complete(
+      ngx_http_request_t &request, dd::Span &span,
+      const std::optional<BlockSpecification> &block_spec) noexcept;
+
  private:
   bool do_on_request_start(ngx_http_request_t &request, dd::Span &span);
+  ngx_int_t do_request_body_filter(ngx_http_request_t &request,
+                                   ngx_chain_t *chain, dd::Span &span);
+  void do_on_body_waf_complete(
+      ngx_http_request_t &request, dd::Span &span,
+      const std::optional<BlockSpecification> &block_spec);
   ngx_int_t do_output_body_filter(ngx_http_request_t &request,
                                   ngx_chain_t *chain, dd::Span &span);
+  // submits the final WAF run to the thread pool
+  void post_final_waf_run(ngx_http_request_t &request, dd::Span &span);
   void do_on_main_log_request(ngx_http_request_t &request, dd::Span &span);
 
+  // blocks the request without running the WAF if the client went over the
+  // match threshold; returns whether it did
+  bool maybe_throttle(ngx_http_request_t &request, dd::Span &span);
+  // resolved on first use, for the throttle key and for the WAF
+  const std::optional<std::string> &client_ip(
+      const ngx_http_request_t &request);
+
+  static void set_waf_span_tags(dd::Span &span);
+
+  // whether the last request body buffers can be held back while the WAF
+  // looks at the body, so that the request can still be blocked
+  static bool can_hold_request_body(const ngx_http_request_t &request) noexcept;
+
+  // gives the WAF the request data if the first run was skipped
+  void feed_skipped_request_data(ngx_http_request_t &request);
+  // the request data to give the WAF if the first run was skipped, or nullptr
+  ddwaf_object *collect_skipped_request_data(ngx_http_request_t &request);
+  // runs the WAF on data whose matches are reported but cannot block
+  void run_waf_report_only(ddwaf_object *data);
+  // ddwaf_run, accounted for in metrics_; given what is left of the request's
+  // budget, if it has one, and skipped (with an empty result, counted as a
+  // timeout) once it's spent
+  DDWAF_RET_CODE timed_waf_run(ddwaf_object *data, ddwaf_result &result);
+  template <typename F>
+  auto timed_serialization(F &&f) {
+    auto const start = std::chrono::steady_clock::now();
+    auto ret = std::forward<F>(f)();
+    metrics_.serialization += std::chrono::steady_clock::now() - start;
+    return ret;
+  }
+  // sets the span metrics and adds them to the worker's histograms
+  void report_waf_metrics(dd::Span &span);
+  // serializes the API schemas the WAF extracted (_dd.appsec.s.* derivatives)
+  void take_schemas(const ddwaf_result &result);
+  void report_schemas(dd::Span &span);
+
+  // final WAF run on data collected on the event loop thread; see
+  // FinalRunBatch. It holds a reference to the request until it completes.
+  class FinalRunJob : public FinalRunBatch::Job {
+   public:
+    FinalRunJob(Context &ctx, ngx_http_request_t &req, ddwaf_object *req_data,
+                ddwaf_object *resp_data)
+        : ctx_{ctx}, req_{req}, req_data_{req_data}, resp_data_{resp_data} {}
+
+    void run(ngx_log_t &log,
+             std::chrono::nanoseconds queue_wait) noexcept override;
+    void complete(bool ran) noexcept override;
+
+   private:
+    Context &ctx_;
+    ngx_http_request_t &req_;
+    ddwaf_object *req_data_;  // nullptr unless the first run was skipped
+    ddwaf_object *resp_data_;
+  };
+
   bool has_matches() const noexcept;
+  // takes ownership of the result and serializes its events
+  void add_match(ddwaf_result &result);
   void report_matches(ngx_http_request_t &request, dd::Span &span);
 
   std::shared_ptr<OwnedDdwafHandle> waf_handle_;
   std::vector<OwnedDdwafResult> results_;
+  // the events of results_, as reported in _dd.appsec.json
+  EventsJson events_json_;
   OwnedDdwafContext ctx_{nullptr};
   DdwafMemres memres_;
+  std::optional<std::string> client_ip_;
+  bool client_ip_resolved_{false};
+  // hash of the client ip, if throttling is enabled
+  std::optional<std::uint64_t> throttle_key_;
+  // ruleset generation of waf_handle_
+  std::uint64_t generation_;
+  // keys in the verdict cache, if it's enabled
+  std::optional<std::uint64_t> verdict_key_;
+  std::optional<std::uint64_t> final_verdict_key_;
+  // the first WAF run was skipped because of a cached no-match verdict
+  bool request_verdict_cached_{false};
+  bool waf_timed_out_{false};
+  // WAF time allowed for the request (datadog_appsec_waf_budget), if any;
+  // what metrics_ accounts for is taken from it
+  std::optional<std::chrono::nanoseconds> waf_budget_;
+  bool waf_budget_exhausted_{false};
+  // the final WAF run extracts the API schema (see ApiSecuritySampler)
+  bool extract_schema_{false};
+  // JSON-encoded schemas, by span tag
+  std::vector<std::pair<std::string, std::string>> schemas_;
+  WafRunMetrics metrics_;
+  bool request_data_fed_{false};
+  // the request body, while it's being read
+  std::unique_ptr<RequestBodyCollector> body_collector_;
+  bool body_done_{false};
+  // last request body buffers, held until the body WAF run completes
+  ngx_chain_t *held_body_{nullptr};
+  bool body_held_{false};
+  // the response started while the body WAF run was in progress
+  bool final_run_deferred_{false};
+  // the output body filter was called for the first time
+  bool response_started_{false};
+  // start of the response body; the final WAF run waits for it to complete
+  std::unique_ptr<ResponseBodyWindow> response_body_;
+  // the final WAF run, if it was batched
+  std::optional<FinalRunJob> final_run_job_;
 
   enum class stage {
     DISABLED,
@@ -87,6 +215,8 @@ class Context {
     ENTERED_ON_START,
     AFTER_BEGIN_WAF,
     AFTER_BEGIN_WAF_BLOCK,  // in this case we won't run the waf at the end
+    BEFORE_RUN_WAF_BODY,
+    AFTER_RUN_WAF_BODY,
     BEFORE_RUN_WAF_END,
     AFTER_RUN_WAF_END,
   };
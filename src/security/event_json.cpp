@@ -0,0 +1,173 @@
+#include "event_json.h"
+
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+constexpr auto kPrefix = R"({"triggers":[)"sv;
+constexpr auto kSuffix = "]}"sv;
+
+using Writer = rapidjson::Writer<rapidjson::StringBuffer>;
+
+void put(rapidjson::StringBuffer &buffer, std::string_view sv) {
+  char *p = buffer.Push(sv.size());
+  std::copy(sv.begin(), sv.end(), p);
+}
+
+rapidjson::SizeType json_len(std::uint64_t len) {
+  return static_cast<rapidjson::SizeType>(len);
+}
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+bool write_json(rapidjson::StringBuffer &buffer, const ddwaf_object &obj,
+                std::size_t limit) {
+  struct Frame {
+    const ddwaf_object *obj;
+    std::uint64_t next;
+  };
+  std::vector<Frame> stack;
+  Writer w{buffer};
+
+  const ddwaf_object *cur = &obj;
+  while (cur != nullptr) {
+    switch (cur->type) {
+      case DDWAF_OBJ_MAP:
+        w.StartObject();
+        stack.push_back({cur, 0});
+        break;
+      case DDWAF_OBJ_ARRAY:
+        w.StartArray();
+        stack.push_back({cur, 0});
+        break;
+      case DDWAF_OBJ_STRING:
+        w.String(cur->stringValue != nullptr ? cur->stringValue : "",
+                 json_len(cur->nbEntries), false);
+        break;
+      case DDWAF_OBJ_SIGNED:
+        w.Int64(cur->intValue);
+        break;
+      case DDWAF_OBJ_UNSIGNED:
+        w.Uint64(cur->uintValue);
+        break;
+      case DDWAF_OBJ_FLOAT:
+        // the writer outputs nothing for NaN and infinities
+        if (std::isfinite(cur->f64)) {
+          w.Double(cur->f64);
+        } else {
+          w.Null();
+        }
+        break;
+      case DDWAF_OBJ_BOOL:
+        w.Bool(cur->boolean);
+        break;
+      case DDWAF_OBJ_INVALID:
+      case DDWAF_OBJ_NULL:
+        w.Null();
+        break;
+    }
+
+    if (buffer.GetSize() > limit) {
+      return false;
+    }
+
+    // next value: the next child of the innermost unfinished container
+    cur = nullptr;
+    while (!stack.empty()) {
+      Frame &frame = stack.back();
+      if (frame.next < frame.obj->nbEntries) {
+        const ddwaf_object &child = frame.obj->array[frame.next++];
+        if (frame.obj->type == DDWAF_OBJ_MAP) {
+          w.Key(child.parameterName != nullptr ? child.parameterName : "",
+                json_len(child.parameterNameLength), false);
+        }
+        cur = &child;
+        break;
+      }
+
+      if (frame.obj->type == DDWAF_OBJ_MAP) {
+        w.EndObject(json_len(frame.obj->nbEntries));
+      } else {
+        w.EndArray(json_len(frame.obj->nbEntries));
+      }
+      stack.pop_back();
+    }
+  }
+
+  return buffer.GetSize() <= limit;
+}
+
+// the buffer is only allocated once there are events, which most requests
+// don't have
+EventsJson::EventsJson(std::size_t max_size)
+    : max_size_{std::max(max_size, kPrefix.size() + kSuffix.size())} {}
+
+void EventsJson::append(const ddwaf_result &result) {
+  const ddwaf_object &events = result.events;
+  if (events.type != DDWAF_OBJ_ARRAY) {
+    return;
+  }
+  if (buffer_.GetSize() == 0) {
+    put(buffer_, kPrefix);
+  } else if (finished_) {
+    buffer_.Pop(kSuffix.size());
+  }
+  finished_ = false;
+
+  for (std::uint64_t i = 0; i < events.nbEntries; i++) {
+    std::size_t const start = buffer_.GetSize();
+    if (num_events_ > 0) {
+      buffer_.Put(',');
+    }
+    if (write_json(buffer_, events.array[i], max_size_ - kSuffix.size())) {
+      num_events_++;
+    } else {
+      buffer_.Pop(buffer_.GetSize() - start);
+      dropped_events_++;
+    }
+  }
+}
+
+std::string_view EventsJson::finish() {
+  if (!finished_) {
+    if (buffer_.GetSize() == 0) {
+      put(buffer_, kPrefix);
+    }
+    put(buffer_, kSuffix);
+    finished_ = true;
+  }
+  return {buffer_.GetString(), buffer_.GetSize()};
+}
+
+EventLogLimiter &EventLogLimiter::instance() {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static EventLogLimiter limiter;
+  return limiter;
+}
+
+bool EventLogLimiter::allow(std::time_t now, std::size_t max_per_sec,
+                            std::size_t &suppressed) noexcept {
+  if (now != window_) {
+    window_ = now;
+    logged_ = 0;
+  }
+  if (logged_ >= max_per_sec) {
+    suppressed_++;
+    return false;
+  }
+
+  logged_++;
+  suppressed = suppressed_;
+  suppressed_ = 0;
+  return true;
+}
+
+}  // namespace datadog::nginx::security
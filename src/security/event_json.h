@@ -0,0 +1,64 @@
+#pragma once
+
+#include <ddwaf.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string_view>
+
+namespace datadog::nginx::security {
+
+// Writes the object as JSON to the buffer, without recursing. Returns false
+// as soon as the buffer holds more than limit bytes, with a partial value in
+// it.
+bool write_json(rapidjson::StringBuffer &buffer, const ddwaf_object &obj,
+                std::size_t limit);
+
+// The _dd.appsec.json document of a request, {"triggers":[...]}, built from
+// the events of its WAF results as they come in, on the thread that ran the
+// WAF. Events that would take the document over the size limit are dropped
+// whole, so the document stays valid JSON.
+class EventsJson {
+ public:
+  explicit EventsJson(std::size_t max_size);
+
+  // adds the events of the result
+  void append(const ddwaf_result &result);
+
+  std::size_t dropped_events() const noexcept { return dropped_events_; }
+
+  // the complete document; valid until the next call to append()
+  std::string_view finish();
+
+ private:
+  std::size_t max_size_;
+  rapidjson::StringBuffer buffer_;
+  std::size_t num_events_{};
+  std::size_t dropped_events_{};
+  // the buffer ends with the suffix
+  bool finished_{false};
+};
+
+// Per-worker limit on the number of appsec event lines written to the error
+// log per second (one line per request with matches). Only accessed from the
+// event loop thread.
+class EventLogLimiter {
+ public:
+  static EventLogLimiter &instance();
+
+  // whether a line can be logged now; when it can, suppressed is set to the
+  // number of lines that were not logged since the last one that was
+  bool allow(std::time_t now, std::size_t max_per_sec,
+             std::size_t &suppressed) noexcept;
+
+ private:
+  EventLogLimiter() = default;
+
+  std::time_t window_{};
+  std::size_t logged_{};
+  std::size_t suppressed_{};
+};
+
+}  // namespace datadog::nginx::security
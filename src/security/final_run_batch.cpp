@@ -0,0 +1,136 @@
+#include "final_run_batch.h"
+
+#include <vector>
+
+namespace datadog::nginx::security {
+
+FinalRunBatch &FinalRunBatch::for_pool(ngx_thread_pool_t *pool) {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static std::vector<std::unique_ptr<FinalRunBatch>> batches;
+  for (auto &batch : batches) {
+    if (batch->pool_ == pool) {
+      return *batch;
+    }
+  }
+  batches.emplace_back(new FinalRunBatch{pool});
+  return *batches.back();
+}
+
+FinalRunBatch::FinalRunBatch(ngx_thread_pool_t *pool) : pool_{pool} {
+  abandon_event_.handler = &FinalRunBatch::abandon_handler;
+  abandon_event_.data = this;
+  abandon_event_.log = ngx_cycle->log;
+}
+
+void FinalRunBatch::enqueue(Job &job) noexcept {
+  {
+    std::lock_guard const lock{mutex_};
+    job.enqueued_at_ = std::chrono::steady_clock::now();
+    job.next_ = nullptr;
+    if (tail_ != nullptr) {
+      tail_->next_ = &job;
+    } else {
+      head_ = &job;
+    }
+    tail_ = &job;
+  }
+
+  post_drain();
+}
+
+void FinalRunBatch::post_drain() noexcept {
+  if (drain_posted_) {
+    return;
+  }
+
+  if (task_ == nullptr) {
+    task_ = ngx_thread_task_alloc(ngx_cycle->pool, sizeof(FinalRunBatch *));
+    if (task_ != nullptr) {
+      *static_cast<FinalRunBatch **>(task_->ctx) = this;
+      task_->handler = &FinalRunBatch::drain_handler;
+      task_->event.handler = &FinalRunBatch::drain_completion_handler;
+      task_->event.data = this;
+    }
+  }
+
+  if (task_ != nullptr && ngx_thread_task_post(pool_, task_) == NGX_OK) {
+    drain_posted_ = true;
+    return;
+  }
+
+  // As when a PolTaskCtx cannot be posted, the runs are skipped. This is done
+  // from a posted event, because completing a job may finalize its request.
+  ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "failed to post the final waf run task; queued runs are "
+                "skipped");
+  if (!abandon_event_.posted) {
+    ngx_post_event(&abandon_event_, &ngx_posted_events);
+  }
+}
+
+void FinalRunBatch::drain_handler(void *data, ngx_log_t *log) noexcept {
+  (*static_cast<FinalRunBatch **>(data))->drain(*log);
+}
+
+void FinalRunBatch::drain(ngx_log_t &log) noexcept {
+  std::size_t n = 0;
+  {
+    std::lock_guard const lock{mutex_};
+    while (head_ != nullptr && n < group_.size()) {
+      group_[n++] = head_;
+      head_ = head_->next_;
+    }
+    if (head_ == nullptr) {
+      tail_ = nullptr;
+    }
+  }
+  group_size_ = n;
+
+  for (std::size_t i = 0; i < n; i++) {
+    group_[i]->run(log,
+                   std::chrono::steady_clock::now() - group_[i]->enqueued_at_);
+  }
+}
+
+void FinalRunBatch::drain_completion_handler(ngx_event_t *ev) noexcept {
+  auto *batch = static_cast<FinalRunBatch *>(ev->data);
+  batch->drain_posted_ = false;
+
+  std::size_t const n = batch->group_size_;
+  batch->group_size_ = 0;
+  for (std::size_t i = 0; i < n; i++) {
+    batch->group_[i]->complete(true);
+  }
+
+  bool more;
+  {
+    std::lock_guard const lock{batch->mutex_};
+    more = batch->head_ != nullptr;
+  }
+  if (more) {
+    batch->post_drain();
+  }
+}
+
+void FinalRunBatch::abandon_handler(ngx_event_t *ev) noexcept {
+  auto *batch = static_cast<FinalRunBatch *>(ev->data);
+  if (batch->drain_posted_) {
+    // a later enqueue managed to post one; it takes the queued jobs too
+    return;
+  }
+
+  Job *job;
+  {
+    std::lock_guard const lock{batch->mutex_};
+    job = batch->head_;
+    batch->head_ = nullptr;
+    batch->tail_ = nullptr;
+  }
+  while (job != nullptr) {
+    Job *next = job->next_;
+    job->complete(false);
+    job = next;
+  }
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_thread_pool.h>
+}
+
+namespace datadog::nginx::security {
+
+// Queue of report-only final WAF runs, drained in groups by a single thread
+// pool task at a time rather than one task per request.
+//
+// The event loop never waits on a job. Whoever enqueues a job keeps its data
+// alive until complete() is called for it (e.g. by holding a reference to the
+// request), which happens on the event loop thread once the job has run, or
+// without it having run if it could not be handed to the thread pool.
+//
+// One instance per thread pool and per worker. Jobs are enqueued and
+// completed on the event loop thread.
+class FinalRunBatch {
+ public:
+  class Job {
+   public:
+    Job() = default;
+    Job(const Job &) = delete;
+    Job &operator=(const Job &) = delete;
+    virtual ~Job() = default;
+
+    // runs on a pool thread
+    virtual void run(ngx_log_t &log,
+                     std::chrono::nanoseconds queue_wait) noexcept = 0;
+
+    // Runs on the event loop thread, after run() or instead of it. The job is
+    // no longer referenced by the batch.
+    virtual void complete(bool ran) noexcept = 0;
+
+   private:
+    friend FinalRunBatch;
+
+    Job *next_{nullptr};
+    std::chrono::steady_clock::time_point enqueued_at_;
+  };
+
+  static FinalRunBatch &for_pool(ngx_thread_pool_t *pool);
+
+  FinalRunBatch(const FinalRunBatch &) = delete;
+  FinalRunBatch &operator=(const FinalRunBatch &) = delete;
+
+  void enqueue(Job &job) noexcept;
+
+ private:
+  explicit FinalRunBatch(ngx_thread_pool_t *pool);
+
+  // number of jobs run by a drain task
+  static constexpr std::size_t kGroupSize = 32;
+
+  void post_drain() noexcept;
+  static void drain_handler(void *data, ngx_log_t *log) noexcept;
+  static void drain_completion_handler(ngx_event_t *ev) noexcept;
+  static void abandon_handler(ngx_event_t *ev) noexcept;
+  void drain(ngx_log_t &log) noexcept;
+
+  ngx_thread_pool_t *pool_;
+  ngx_thread_task_t *task_{nullptr};
+  // event loop thread only
+  bool drain_posted_{false};
+  // completes the queued jobs without running them, when no drain task could
+  // be posted
+  ngx_event_t abandon_event_{};
+
+  // taken off the queue by the drain task, and completed by its completion
+  // handler; the task's completion orders the accesses
+  std::array<Job *, kGroupSize> group_{};
+  std::size_t group_size_{0};
+
+  std::mutex mutex_;
+  Job *head_{nullptr};
+  Job *tail_{nullptr};
+};
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,620 @@
+#include "json_parser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+namespace dnsec = datadog::nginx::security;
+
+// Returns the first '"', '\\' or control character in [p, end), or end.
+// Strings are the bulk of rulesets and request bodies, so this is the loop
+// worth vectorizing: 16 bytes are classified per iteration.
+const char *find_string_special(const char *p, const char *end) noexcept {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i ctrl_max = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    __m128i const v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i const special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        // unsigned v <= 0x1f
+        _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v));
+    int const mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return p + __builtin_ctz(static_cast<unsigned>(mask));
+    }
+    p += 16;
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  const uint8x16_t ctrl_end = vdupq_n_u8(0x20);
+  while (end - p >= 16) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    uint8x16_t const v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+    uint8x16_t const special =
+        vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)),
+                 vcltq_u8(v, ctrl_end));
+    // narrow each byte of the mask to a nibble
+    std::uint64_t const mask = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+    if (mask != 0) {
+      return p + (__builtin_ctzll(mask) >> 2);
+    }
+    p += 16;
+  }
+#endif
+  for (; p < end; p++) {
+    auto const c = static_cast<unsigned char>(*p);
+    if (c == '"' || c == '\\' || c < 0x20) {
+      return p;
+    }
+  }
+  return end;
+}
+
+bool is_digit(char c) noexcept { return c >= '0' && c <= '9'; }
+
+int hex_value(char c) noexcept {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+std::optional<std::uint32_t> read_hex4(std::string_view sv,
+                                       std::size_t pos) noexcept {
+  if (pos + 4 > sv.size()) {
+    return std::nullopt;
+  }
+  std::uint32_t cp = 0;
+  for (std::size_t i = pos; i < pos + 4; i++) {
+    int const v = hex_value(sv[i]);
+    if (v < 0) {
+      return std::nullopt;
+    }
+    cp = (cp << 4) | static_cast<std::uint32_t>(v);
+  }
+  return cp;
+}
+
+char *encode_utf8(std::uint32_t cp, char *w) noexcept {
+  if (cp < 0x80) {
+    *w++ = static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    *w++ = static_cast<char>(0xC0 | (cp >> 6));
+    *w++ = static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    *w++ = static_cast<char>(0xE0 | (cp >> 12));
+    *w++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    *w++ = static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    *w++ = static_cast<char>(0xF0 | (cp >> 18));
+    *w++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    *w++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    *w++ = static_cast<char>(0x80 | (cp & 0x3F));
+  }
+  return w;
+}
+
+class JsonParser {
+  static constexpr std::uint32_t kReplacementChar = 0xFFFD;
+
+ public:
+  JsonParser(std::string_view json, const dnsec::JsonLimits &limits,
+             dnsec::DdwafMemres &memres)
+      : begin_{json.data()},
+        p_{json.data()},
+        end_{json.data() + json.size()},
+        limits_{limits},
+        memres_{memres},
+        // one scratch vector per depth, so the references into them stay
+        // valid while nested containers are parsed
+        scratch_(limits.max_depth + 1) {}
+
+  void parse(dnsec::ddwaf_obj &out) {
+    skip_ws();
+    if (p_ == end_) {
+      if (limits_.truncate) {
+        out.make_null();
+        return;
+      }
+      error("document is empty");
+    }
+
+    parse_value(out, 1);
+    if (eof_) {
+      return;
+    }
+
+    skip_ws();
+    if (p_ != end_) {
+      error("the root value is followed by other data");
+    }
+  }
+
+ private:
+  [[noreturn]] void error(const char *what) const {
+    throw std::invalid_argument{"malformed json: " + std::string{what} +
+                                " at offset " + std::to_string(p_ - begin_)};
+  }
+
+  // Whether the input ran out. This is only acceptable (and then final) for
+  // truncated inputs.
+  bool at_end() {
+    if (p_ < end_) {
+      return false;
+    }
+    if (!limits_.truncate) {
+      error("unexpected end of document");
+    }
+    eof_ = true;
+    return true;
+  }
+
+  void skip_ws() noexcept {
+    while (p_ < end_ &&
+           (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) {
+      ++p_;
+    }
+  }
+
+  // NOLINTNEXTLINE(misc-no-recursion)
+  void parse_value(dnsec::ddwaf_obj &out, std::size_t depth) {
+    switch (*p_) {
+      case '{':
+        ++p_;
+        parse_container<true>(out, depth);
+        break;
+      case '[':
+        ++p_;
+        parse_container<false>(out, depth);
+        break;
+      case '"':
+        ++p_;
+        out.make_string(parse_string());
+        break;
+      case 't':
+        if (parse_literal("true"sv)) {
+          out.make_bool(true);
+        } else {
+          out.make_null();
+        }
+        break;
+      case 'f':
+        if (parse_literal("false"sv)) {
+          out.make_bool(false);
+        } else {
+          out.make_null();
+        }
+        break;
+      case 'n':
+        parse_literal("null"sv);
+        out.make_null();
+        break;
+      default:
+        parse_number(out);
+        break;
+    }
+  }
+
+  // The children are accumulated in the scratch vector for this depth and
+  // copied to memres once their number is known.
+  template <bool IsMap>
+  // NOLINTNEXTLINE(misc-no-recursion)
+  void parse_container(dnsec::ddwaf_obj &out, std::size_t depth) {
+    constexpr char kClose = IsMap ? '}' : ']';
+
+    std::vector<dnsec::ddwaf_obj> &items = scratch_[depth];
+    items.clear();
+
+    bool const too_deep = depth + 1 > limits_.max_depth;
+
+    skip_ws();
+    if (!at_end() && *p_ == kClose) {
+      ++p_;
+    } else {
+      if (too_deep && !limits_.truncate) {
+        error("maximum depth exceeded");
+      }
+      while (!eof_) {
+        bool const keep =
+            !too_deep && (limits_.max_container_size == 0 ||
+                          items.size() < limits_.max_container_size);
+
+        std::string_view key;
+        if constexpr (IsMap) {
+          if (*p_ != '"') {
+            error("expected a string key");
+          }
+          ++p_;
+          if (keep) {
+            key = parse_string();
+          } else {
+            skip_string();
+          }
+          skip_ws();
+          if (at_end()) {
+            break;
+          }
+          if (*p_ != ':') {
+            error("expected ':'");
+          }
+          ++p_;
+          skip_ws();
+          if (at_end()) {
+            break;
+          }
+        }
+
+        if (keep) {
+          dnsec::ddwaf_obj &elem = items.emplace_back();
+          parse_value(elem, depth + 1);
+          if constexpr (IsMap) {
+            elem.set_key(key);
+          }
+        } else {
+          skip_value();
+        }
+
+        skip_ws();
+        if (at_end()) {
+          break;
+        }
+        if (*p_ == ',') {
+          ++p_;
+          skip_ws();
+          if (at_end()) {
+            break;
+          }
+          continue;
+        }
+        if (*p_ == kClose) {
+          ++p_;
+          break;
+        }
+        error(IsMap ? "expected ',' or '}'" : "expected ',' or ']'");
+      }
+    }
+
+    auto const n = static_cast<dnsec::ddwaf_obj::nb_entries_t>(items.size());
+    dnsec::ddwaf_obj *entries = memres_.allocate_objects<dnsec::ddwaf_obj>(n);
+    if (n > 0) {
+      std::memcpy(static_cast<void *>(entries), items.data(),
+                  n * sizeof(dnsec::ddwaf_obj));
+    }
+    if constexpr (IsMap) {
+      out.make_map(entries, n);
+    } else {
+      out.make_array(entries, n);
+    }
+    items.clear();
+  }
+
+  // called after the opening quote; leaves p_ after the closing quote
+  std::string_view parse_string() {
+    const char *start = p_;
+    bool has_escapes = false;
+    while (true) {
+      p_ = find_string_special(p_, end_);
+      if (p_ == end_) {
+        if (!limits_.truncate) {
+          error("unterminated string");
+        }
+        eof_ = true;
+        break;
+      }
+      if (*p_ == '"') {
+        break;
+      }
+      if (*p_ == '\\') {
+        has_escapes = true;
+        p_ = std::min(p_ + 2, end_);
+        continue;
+      }
+      error("control character in string");
+    }
+
+    std::string_view const raw{start, static_cast<std::size_t>(p_ - start)};
+    if (!eof_) {
+      ++p_;
+    }
+
+    return has_escapes ? unescape(raw) : copy_string(raw);
+  }
+
+  // like parse_string(), but nothing is copied
+  void skip_string() {
+    while (true) {
+      p_ = find_string_special(p_, end_);
+      if (p_ == end_) {
+        at_end();
+        return;
+      }
+      if (*p_ == '"') {
+        ++p_;
+        return;
+      }
+      if (*p_ == '\\') {
+        p_ = std::min(p_ + 2, end_);
+        continue;
+      }
+      error("control character in string");
+    }
+  }
+
+  std::size_t string_limit(std::size_t len) const noexcept {
+    if (limits_.max_string_length == 0) {
+      return len;
+    }
+    return std::min(len, limits_.max_string_length);
+  }
+
+  std::string_view copy_string(std::string_view raw) {
+    std::size_t const len = string_limit(raw.size());
+    char *s = memres_.allocate_string(len);
+    std::memcpy(s, raw.data(), len);
+    return {s, len};
+  }
+
+  // the unescaped string is never longer than the escaped one
+  std::string_view unescape(std::string_view raw) {
+    char *const out = memres_.allocate_string(raw.size());
+    char *w = out;
+
+    for (std::size_t i = 0; i < raw.size(); i++) {
+      char const c = raw[i];
+      if (c != '\\') {
+        *w++ = c;
+        continue;
+      }
+
+      if (++i == raw.size()) {
+        break;  // truncated input
+      }
+      switch (raw[i]) {
+        case '"':
+        case '\\':
+        case '/':
+          *w++ = raw[i];
+          break;
+        case 'b':
+          *w++ = '\b';
+          break;
+        case 'f':
+          *w++ = '\f';
+          break;
+        case 'n':
+          *w++ = '\n';
+          break;
+        case 'r':
+          *w++ = '\r';
+          break;
+        case 't':
+          *w++ = '\t';
+          break;
+        case 'u': {
+          std::optional<std::uint32_t> cp = read_hex4(raw, i + 1);
+          if (!cp) {
+            if (eof_ && i + 5 > raw.size()) {
+              i = raw.size();  // truncated input
+              break;
+            }
+            error("invalid unicode escape");
+          }
+          i += 4;
+          if (*cp >= 0xD800 && *cp <= 0xDBFF) {
+            std::optional<std::uint32_t> lo;
+            if (i + 2 < raw.size() && raw[i + 1] == '\\' &&
+                raw[i + 2] == 'u') {
+              lo = read_hex4(raw, i + 3);
+            }
+            if (lo && *lo >= 0xDC00 && *lo <= 0xDFFF) {
+              cp = 0x10000 + ((*cp - 0xD800) << 10) + (*lo - 0xDC00);
+              i += 6;
+            } else if (limits_.truncate) {
+              cp = kReplacementChar;
+            } else {
+              error("invalid surrogate pair");
+            }
+          } else if (*cp >= 0xDC00 && *cp <= 0xDFFF) {
+            if (!limits_.truncate) {
+              error("invalid surrogate pair");
+            }
+            cp = kReplacementChar;
+          }
+          w = encode_utf8(*cp, w);
+          break;
+        }
+        default:
+          error("invalid escape sequence");
+      }
+    }
+
+    return {out, string_limit(static_cast<std::size_t>(w - out))};
+  }
+
+  // returns false if the input ended in the middle of the literal
+  bool parse_literal(std::string_view lit) {
+    auto const avail = static_cast<std::size_t>(end_ - p_);
+    std::size_t const n = std::min(avail, lit.size());
+    if (std::string_view{p_, n} != lit.substr(0, n)) {
+      error("invalid literal");
+    }
+    p_ += n;
+    if (n < lit.size()) {
+      at_end();
+      return false;
+    }
+    return true;
+  }
+
+  void parse_number(dnsec::ddwaf_obj &out) {
+    const char *start = p_;
+    bool is_int = true;
+
+    auto digits = [this]() {
+      const char *d = p_;
+      while (p_ < end_ && is_digit(*p_)) {
+        ++p_;
+      }
+      return p_ != d;
+    };
+
+    if (p_ < end_ && *p_ == '-') {
+      ++p_;
+    }
+    if (p_ < end_ && *p_ == '0') {
+      ++p_;
+    } else if (!digits()) {
+      return partial_number(out);
+    }
+    if (p_ < end_ && *p_ == '.') {
+      is_int = false;
+      ++p_;
+      if (!digits()) {
+        return partial_number(out);
+      }
+    }
+    if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+      is_int = false;
+      ++p_;
+      if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+        ++p_;
+      }
+      if (!digits()) {
+        return partial_number(out);
+      }
+    }
+
+    if (is_int) {
+      std::int64_t i;
+      auto [ptr, ec] = std::from_chars(start, p_, i);
+      if (ec == std::errc{}) {
+        out.make_number(i);
+        return;
+      }
+      if (*start != '-') {
+        std::uint64_t u;
+        auto [ptr2, ec2] = std::from_chars(start, p_, u);
+        if (ec2 == std::errc{}) {
+          out.make_number(u);
+          return;
+        }
+      }
+    }
+
+    double d;
+    auto [ptr, ec] = std::from_chars(start, p_, d);
+    if (ec != std::errc{}) {
+      error("number too big to be stored in a double");
+    }
+    out.make_number(d);
+  }
+
+  void partial_number(dnsec::ddwaf_obj &out) {
+    if (p_ == end_ && limits_.truncate) {
+      eof_ = true;
+      out.make_null();
+      return;
+    }
+    error("invalid value");
+  }
+
+  // Skips a value that is dropped because of the limits, without validating
+  // it in depth. Only used for truncated inputs.
+  void skip_value() {
+    std::size_t nesting = 0;
+    while (!at_end()) {
+      char const c = *p_;
+      if (c == '{' || c == '[') {
+        ++nesting;
+        ++p_;
+      } else if (c == '}' || c == ']') {
+        if (nesting == 0) {
+          return;  // not ours
+        }
+        ++p_;
+        if (--nesting == 0) {
+          return;
+        }
+      } else if (c == ',' || c == ':') {
+        if (nesting == 0) {
+          return;
+        }
+        ++p_;
+      } else if (c == '"') {
+        ++p_;
+        skip_string();
+        if (nesting == 0) {
+          return;
+        }
+      } else if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        skip_ws();
+      } else {
+        const char *s = p_;
+        while (p_ < end_ && (std::isalnum(static_cast<unsigned char>(*p_)) ||
+                             *p_ == '-' || *p_ == '+' || *p_ == '.')) {
+          ++p_;
+        }
+        if (p_ == s) {
+          error("invalid value");
+        }
+        if (nesting == 0) {
+          return;
+        }
+      }
+    }
+  }
+
+  const char *begin_;
+  const char *p_;
+  const char *end_;
+  const dnsec::JsonLimits &limits_;
+  dnsec::DdwafMemres &memres_;
+  std::vector<std::vector<dnsec::ddwaf_obj>> scratch_;
+  bool eof_{false};
+};
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+void parse_json(std::string_view json, const JsonLimits &limits,
+                DdwafMemres &memres, ddwaf_obj &out) {
+  JsonParser{json, limits, memres}.parse(out);
+}
+
+ddwaf_owned_obj<ddwaf_obj> parse_json(std::string_view json,
+                                      const JsonLimits &limits) {
+  ddwaf_owned_obj<ddwaf_obj> ret;
+  parse_json(json, limits, ret.memres(), ret.get());
+  return ret;
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+#include "ddwaf_memres.h"
+#include "ddwaf_obj.h"
+
+namespace datadog::nginx::security {
+
+struct JsonLimits {
+  // Values nested deeper than this are an error, unless `truncate` is set, in
+  // which case they are dropped. The root value is at depth 1.
+  std::size_t max_depth;
+  // 0 means unbounded
+  std::size_t max_container_size;
+  std::size_t max_string_length;
+  // For WAF inputs: values past the limits are dropped and a document that is
+  // cut short (e.g. by the body size limit) yields what could be parsed.
+  bool truncate;
+};
+
+// the limits libddwaf applies to its inputs (see kBaseWafConfig)
+inline constexpr JsonLimits kWafInputJsonLimits{
+    .max_depth = 20,
+    .max_container_size = 256,
+    .max_string_length = 4096,
+    .truncate = true,
+};
+
+// Single-pass JSON parser that writes the ddwaf_obj tree directly into
+// `memres`, without building an intermediate DOM. Strings are copied (and
+// unescaped) into `memres` too, so `json` need not outlive the result.
+// Numbers are converted like json_to_object does: integers that fit in an
+// int64 are signed, larger ones unsigned, everything else a double.
+//
+// Throws std::invalid_argument on malformed JSON.
+void parse_json(std::string_view json, const JsonLimits &limits,
+                DdwafMemres &memres, ddwaf_obj &out);
+
+ddwaf_owned_obj<ddwaf_obj> parse_json(std::string_view json,
+                                      const JsonLimits &limits);
+
+}  // namespace datadog::nginx::security
@@ -10,7 +10,6 @@ extern "C" {
 }
 
 #include <ddwaf.h>
-#include <rapidjson/schema.h>
 
 #include <fstream>
 #include <numeric>
@@ -22,7 +21,9 @@ extern "C" {
 #include "blocking.h"
 #include "context.h"
 #include "ddwaf_obj.h"
+#include "json_parser.h"
 #include "util.h"
+#include "verdict_cache.h"
 
 extern "C" {
 #define INCBIN_SILENCE_BITCODE_WARNING
@@ -38,30 +39,14 @@ namespace dnsec = datadog::nginx::security;
 
 namespace {
 
-static constexpr ddwaf_config kBaseWafConfig{
-    .limits =
-        {
-            .max_container_size = 256,
-            .max_container_depth = 20,
-            .max_string_length = 4096,
-        },
-    .free_fn = nullptr,
-};
-
 auto parse_rule_json(std::string_view json) -> dnsec::ddwaf_owned_map {
-  rapidjson::Document document;
-  rapidjson::ParseResult const result =
-      document.Parse(json.data(), json.size());
-  if (!result) {
-    std::string_view error_msg{rapidjson::GetParseError_En(result.Code())};
-    throw std::invalid_argument{"malformed json: " + std::string{error_msg}};
-  }
-  if (!document.IsObject()) {
+  dnsec::ddwaf_owned_obj<dnsec::ddwaf_obj> obj =
+      dnsec::parse_json(json, dnsec::kConfigJsonLimits);
+  if (obj.get().type != DDWAF_OBJ_MAP) {
     throw std::invalid_argument("invalid json rule (not a json object)");
   }
 
-  return dnsec::ddwaf_owned_map{
-      dnsec::json_to_object(document, dnsec::kConfigMaxDepth)};
+  return dnsec::ddwaf_owned_map{std::move(obj)};
 }
 
 auto read_rule_file(std::string_view filename) -> dnsec::ddwaf_owned_map {
@@ -229,6 +214,10 @@ namespace datadog::nginx::security {
 
 class FinalizedConfigSettings {
   static constexpr ngx_uint_t kDefaultWafTimeoutUsec = 1000000;  // 100 ms
+  static constexpr std::size_t kDefaultMaxBodySize = 64 * 1024;
+  static constexpr std::size_t kDefaultMaxBodyFields = 256;
+  static constexpr std::size_t kDefaultMaxEventJsonSize = 32 * 1024;
+  static constexpr std::size_t kDefaultEventLogRate = 100;
   static constexpr std::string_view kDefaultObfuscationKeyRegex =
       "(?i)(?:p(?:ass)?w(?:or)?d|pass(?:_?phrase)?|secret|(?:api_?|private_?|"
       "public_?)key)|token|consumer_?(?:id|key|secret)|sign(?:ed|ature)|bearer|"
@@ -277,6 +266,18 @@ class FinalizedConfigSettings {
 
   auto waf_timeout() const { return waf_timeout_usec_; }
 
+  auto max_body_size() const { return max_body_size_; }
+
+  auto max_body_fields() const { return max_body_fields_; }
+
+  auto max_response_body_size() const { return max_response_body_size_; }
+
+  auto async_final_waf_run() const { return async_final_waf_run_; }
+
+  auto max_event_json_size() const { return max_event_json_size_; }
+
+  auto event_log_rate() const { return event_log_rate_; }
+
   const std::string &obfuscation_key_regex() const {
     return obfuscation_key_regex_;
   };
@@ -322,6 +323,12 @@ class FinalizedConfigSettings {
   std::string blocked_template_json_;
   std::string blocked_template_html_;
   ngx_uint_t waf_timeout_usec_;
+  std::size_t max_body_size_;
+  std::size_t max_body_fields_;
+  std::size_t max_response_body_size_;
+  bool async_final_waf_run_;
+  std::size_t max_event_json_size_;
+  std::size_t event_log_rate_;
   std::string obfuscation_key_regex_;
   std::string obfuscation_value_regex_;
 };
@@ -382,6 +389,29 @@ FinalizedConfigSettings::FinalizedConfigSettings(
     waf_timeout_usec_ = ngx_conf.appsec_waf_timeout_ms * 1000;
   }
 
+  max_body_size_ = ngx_conf.appsec_max_body_size == NGX_CONF_UNSET_SIZE
+                       ? kDefaultMaxBodySize
+                       : ngx_conf.appsec_max_body_size;
+  max_body_fields_ =
+      ngx_conf.appsec_max_body_fields == NGX_CONF_UNSET ||
+              ngx_conf.appsec_max_body_fields < 0
+          ? kDefaultMaxBodyFields
+          : static_cast<std::size_t>(ngx_conf.appsec_max_body_fields);
+  max_response_body_size_ =
+      ngx_conf.appsec_max_response_body_size == NGX_CONF_UNSET_SIZE
+          ? 0
+          : ngx_conf.appsec_max_response_body_size;
+  async_final_waf_run_ = ngx_conf.appsec_async_final_waf_run == 1;
+  max_event_json_size_ =
+      ngx_conf.appsec_max_event_json_size == NGX_CONF_UNSET_SIZE
+          ? kDefaultMaxEventJsonSize
+          : ngx_conf.appsec_max_event_json_size;
+  event_log_rate_ =
+      ngx_conf.appsec_event_log_rate == NGX_CONF_UNSET ||
+              ngx_conf.appsec_event_log_rate < 0
+          ? kDefaultEventLogRate
+          : static_cast<std::size_t>(ngx_conf.appsec_event_log_rate);
+
   if (ngx_conf.appsec_obfuscation_key_regex.data != nullptr) {
     obfuscation_key_regex_ =
         to_string_view(ngx_conf.appsec_obfuscation_key_regex);
@@ -471,6 +501,7 @@ std::string FinalizedConfigSettings::normalize_configured_header(
 
 std::shared_ptr<OwnedDdwafHandle> Library::handle_{nullptr};
 std::atomic<bool> Library::active_{true};
+std::atomic<std::uint64_t> Library::generation_{0};
 std::unique_ptr<FinalizedConfigSettings> Library::config_settings_;
 
 std::optional<ddwaf_owned_map> Library::initialize_security_library(
@@ -523,6 +554,7 @@ std::optional<ddwaf_owned_map> Library::initialize_security_library(
   }
 
   Library::handle_ = std::make_shared<OwnedDdwafHandle>(std::move(h));
+  generation_.fetch_add(1, std::memory_order_relaxed);
 
   BlockingService::initialize(conf.blocked_template_html(),
                               conf.blocked_template_json());
@@ -548,6 +580,10 @@ void Library::set_handle(OwnedDdwafHandle &&handle) {
   std::shared_ptr<OwnedDdwafHandle> handle_sp{
       std::make_shared<OwnedDdwafHandle>(std::move(handle))};
   std::atomic_store_explicit(&handle_, handle_sp, std::memory_order_release);
+  generation_.fetch_add(1, std::memory_order_relaxed);
+  if (auto *cache = VerdictCache::get_instance()) {
+    cache->invalidate();
+  }
   ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0, "WAF configuration updated");
 }
 
@@ -596,6 +632,34 @@ std::uint64_t Library::waf_timeout() {
   return static_cast<std::uint64_t>(config_settings_->waf_timeout());
 }
 
+std::size_t Library::max_body_size() {
+  return config_settings_->max_body_size();
+}
+
+std::size_t Library::max_body_fields() {
+  return config_settings_->max_body_fields();
+}
+
+std::size_t Library::max_response_body_size() {
+  return config_settings_->max_response_body_size();
+}
+
+bool Library::async_final_waf_run() {
+  return config_settings_->async_final_waf_run();
+}
+
+std::size_t Library::max_event_json_size() {
+  return config_settings_->max_event_json_size();
+}
+
+std::size_t Library::event_log_rate() {
+  return config_settings_->event_log_rate();
+}
+
+std::uint64_t Library::generation() noexcept {
+  return generation_.load(std::memory_order_relaxed);
+}
+
 std::vector<std::string_view> Library::environment_variable_names() {
   return {"DD_APPSEC_ENABLED"sv,
           "DD_APPSEC_RULES"sv,
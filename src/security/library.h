@@ -9,11 +9,31 @@
 
 #include "../datadog_conf.h"
 #include "ddwaf_obj.h"
+#include "json_parser.h"
 
 namespace datadog::nginx::security {
 
 inline constexpr auto kConfigMaxDepth = 25;
 
+// rulesets and remote configs are converted as a whole, without truncation
+inline constexpr JsonLimits kConfigJsonLimits{
+    .max_depth = kConfigMaxDepth,
+    .max_container_size = 0,
+    .max_string_length = 0,
+    .truncate = false,
+};
+
+// WAF limits, without the obfuscator regexes, which are configurable
+inline constexpr ddwaf_config kBaseWafConfig{
+    .limits =
+        {
+            .max_container_size = 256,
+            .max_container_depth = 20,
+            .max_string_length = 4096,
+        },
+    .free_fn = nullptr,
+};
+
 class OwnedDdwafHandle;
 class FinalizedConfigSettings;
 
@@ -40,6 +60,20 @@ class Library {
 
   static std::optional<HashedStringView> custom_ip_header();
   static std::uint64_t waf_timeout();
+  // limits on the request body given to the WAF
+  static std::size_t max_body_size();
+  static std::size_t max_body_fields();
+  // number of bytes of the response body given to the WAF; 0 if disabled
+  static std::size_t max_response_body_size();
+  // whether the final WAF run is batched instead of holding the request
+  static bool async_final_waf_run();
+  // size limit of _dd.appsec.json
+  static std::size_t max_event_json_size();
+  // appsec event lines logged per second and per worker; 0 if disabled
+  static std::size_t event_log_rate();
+
+  // incremented every time a new WAF handle is published
+  static std::uint64_t generation() noexcept;
 
   static std::vector<std::string_view> environment_variable_names();
 
@@ -49,6 +83,7 @@ class Library {
   // must be handled atomically!
   static std::shared_ptr<OwnedDdwafHandle> handle_;                  // NOLINT
   static std::atomic<bool> active_;                                  // NOLINT
+  static std::atomic<std::uint64_t> generation_;                     // NOLINT
   static std::unique_ptr<FinalizedConfigSettings> config_settings_;  // NOLINT
 };
 
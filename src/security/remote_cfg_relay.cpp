@@ -0,0 +1,441 @@
+#include "remote_cfg_relay.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <array>
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "event_json.h"
+#include "json_parser.h"
+#include "library.h"
+
+extern "C" {
+#include <ngx_cycle.h>
+#include <ngx_log.h>
+#include <ngx_process_cycle.h>
+#include <ngx_slab.h>
+}
+
+namespace {
+
+// a worker that is exiting after a reload shares the zone with the new ones
+bool exiting() noexcept { return ngx_exiting || ngx_terminate; }
+
+// APM_TRACING for datadog/2/APM_TRACING/<id>/config, or for
+// employee/APM_TRACING/<id>/config
+std::string_view product_of(std::string_view path) {
+  std::size_t skip = 0;
+  if (path.substr(0, 8) == "datadog/") {
+    skip = 2;
+  } else if (path.substr(0, 9) == "employee/") {
+    skip = 1;
+  } else {
+    return {};
+  }
+  std::size_t begin = 0;
+  for (std::size_t i = 0; i < skip; i++) {
+    begin = path.find('/', begin);
+    if (begin == std::string_view::npos) {
+      return {};
+    }
+    begin++;
+  }
+  return path.substr(begin, path.find('/', begin) - begin);
+}
+
+std::string serialize(const rapidjson::Value &value) {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer{buffer};
+  value.Accept(writer);
+  return {buffer.GetString(), buffer.GetSize()};
+}
+
+// In the poller: the target files of the configurations of the last
+// response, by path, and that response as published.
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+std::map<std::string, std::string, std::less<>> target_files;
+std::string published;
+
+// In the other workers: the last answer, for the response generation and
+// the products of the request it was made for.
+std::uint64_t answered_generation;
+std::string answered_products;
+std::string last_answer;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+RemoteConfigRelay::Relay *RemoteConfigRelay::relay_{nullptr};
+ngx_slab_pool_t *RemoteConfigRelay::shpool_{nullptr};
+
+ngx_int_t RemoteConfigRelay::init_zone(ngx_shm_zone_t *zone,
+                                       void *data) noexcept {
+  if (data != nullptr) {
+    // configuration reload with an unchanged zone: the new workers start
+    // from the configuration of the current poller
+    zone->data = data;
+    return NGX_OK;
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto *shpool = reinterpret_cast<ngx_slab_pool_t *>(zone->shm.addr);
+  if (zone->shm.exists) {
+    zone->data = shpool->data;
+    return NGX_OK;
+  }
+
+  auto *relay = static_cast<Relay *>(ngx_slab_calloc(shpool, sizeof(Relay)));
+  if (relay == nullptr) {
+    ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0,
+                  "could not allocate the appsec remote config relay in "
+                  "zone %V",
+                  &zone->shm.name);
+    return NGX_ERROR;
+  }
+  new (relay) Relay{};
+  relay->active.store(-1, std::memory_order_relaxed);
+
+  shpool->data = relay;
+  zone->data = relay;
+
+  return NGX_OK;
+}
+
+void RemoteConfigRelay::initialize(const datadog_main_conf_t &conf) {
+  if (conf.appsec_remote_config_zone == nullptr) {
+    relay_ = nullptr;
+    shpool_ = nullptr;
+    return;
+  }
+
+  relay_ = static_cast<Relay *>(conf.appsec_remote_config_zone->data);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  shpool_ = reinterpret_cast<ngx_slab_pool_t *>(
+      conf.appsec_remote_config_zone->shm.addr);
+}
+
+bool RemoteConfigRelay::is_poller() noexcept { return ngx_worker == 0; }
+
+bool RemoteConfigRelay::publish_update(const ddwaf_map_obj &update) {
+  if (exiting()) {
+    return false;
+  }
+
+  // no section can be larger than the zone
+  auto const zone_size =
+      static_cast<std::size_t>(shpool_->end - shpool_->start);
+
+  std::vector<std::pair<std::string_view, std::string>> sections;
+  sections.reserve(update.size());
+  for (const ddwaf_obj &entry : update) {
+    std::string_view const name = entry.key();
+    rapidjson::StringBuffer buffer;
+    if (name.size() > kMaxSectionName || sections.size() == kMaxSections ||
+        !write_json(buffer, entry, zone_size)) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "appsec remote config: the section \"%*s\" cannot be "
+                    "relayed to the other workers",
+                    name.size(), name.data());
+      return false;
+    }
+    sections.emplace_back(name, std::string{buffer.GetString(),
+                                            buffer.GetSize()});
+  }
+
+  ngx_shmtx_lock(&shpool_->mutex);
+
+  // The slots and the memory of all the sections are found first, so that
+  // the relay is left untouched if the zone cannot hold the update.
+  std::vector<std::pair<Section *, u_char *>> targets;
+  targets.reserve(sections.size());
+  std::array<bool, kMaxSections> taken{};
+  bool fits = true;
+  for (auto &&[name, json] : sections) {
+    std::size_t index = kMaxSections;
+    for (std::size_t i = 0; i < kMaxSections; i++) {
+      const Section &section = relay_->sections[i];
+      if (section.generation != 0 &&
+          std::string_view{section.name, section.name_len} == name) {
+        index = i;
+        break;
+      }
+      if (section.generation == 0 && !taken[i] && index == kMaxSections) {
+        index = i;
+      }
+    }
+    if (index == kMaxSections) {
+      fits = false;
+      break;
+    }
+    auto *mem =
+        static_cast<u_char *>(ngx_slab_alloc_locked(shpool_, json.size()));
+    if (mem == nullptr) {
+      fits = false;
+      break;
+    }
+    taken[index] = true;
+    targets.emplace_back(&relay_->sections[index], mem);
+  }
+
+  if (!fits) {
+    for (auto &&[slot, mem] : targets) {
+      ngx_slab_free_locked(shpool_, mem);
+    }
+    ngx_shmtx_unlock(&shpool_->mutex);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "appsec remote config: the zone is too small to relay the "
+                  "update to the other workers");
+    return false;
+  }
+
+  std::uint64_t const generation =
+      relay_->generation.load(std::memory_order_relaxed) + 1;
+  for (std::size_t i = 0; i < sections.size(); i++) {
+    auto &&[name, json] = sections[i];
+    auto &&[slot, mem] = targets[i];
+    if (slot->generation != 0) {
+      ngx_slab_free_locked(shpool_, slot->json);
+    }
+    std::memcpy(slot->name, name.data(), name.size());
+    slot->name_len = name.size();
+    std::memcpy(mem, json.data(), json.size());
+    slot->json = mem;
+    slot->json_len = json.size();
+    slot->generation = generation;
+  }
+  relay_->generation.store(generation, std::memory_order_release);
+
+  ngx_shmtx_unlock(&shpool_->mutex);
+
+  ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                "appsec remote config: relayed %uz sections at generation "
+                "%uL",
+                sections.size(), generation);
+  return true;
+}
+
+void RemoteConfigRelay::publish_active(bool active) noexcept {
+  if (exiting()) {
+    return;
+  }
+  relay_->active.store(active ? 1 : 0, std::memory_order_release);
+}
+
+std::optional<ddwaf_owned_map> RemoteConfigRelay::update_since(
+    std::uint64_t &generation) {
+  if (relay_->generation.load(std::memory_order_acquire) == generation) {
+    return std::nullopt;
+  }
+
+  std::vector<std::pair<std::string, std::string>> changed;
+  ngx_shmtx_lock(&shpool_->mutex);
+  std::uint64_t const current =
+      relay_->generation.load(std::memory_order_relaxed);
+  for (const Section &section : relay_->sections) {
+    if (section.generation > generation) {
+      changed.emplace_back(
+          std::string{section.name, section.name_len},
+          std::string{reinterpret_cast<const char *>(section.json),
+                      section.json_len});
+    }
+  }
+  ngx_shmtx_unlock(&shpool_->mutex);
+  generation = current;
+
+  if (changed.empty()) {
+    return std::nullopt;
+  }
+
+  ddwaf_owned_map ret;
+  ddwaf_map_obj &map = ret.get().make_map(changed.size(), ret.memres());
+  for (std::size_t i = 0; i < changed.size(); i++) {
+    auto &&[name, json] = changed[i];
+    ddwaf_obj &entry = map.at_unchecked(i);
+    parse_json(json, kConfigJsonLimits, ret.memres(), entry);
+    entry.set_key(name, ret.memres());
+  }
+  return std::move(ret);
+}
+
+std::optional<bool> RemoteConfigRelay::active() noexcept {
+  std::int32_t const active = relay_->active.load(std::memory_order_acquire);
+  if (active < 0) {
+    return std::nullopt;
+  }
+  return active != 0;
+}
+
+void RemoteConfigRelay::publish_response(std::string_view body) {
+  if (exiting()) {
+    return;
+  }
+
+  rapidjson::Document doc;
+  doc.Parse(body.data(), body.size());
+  // without targets, the response only says that nothing changed
+  if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("targets")) {
+    return;
+  }
+  auto &alloc = doc.GetAllocator();
+
+  auto files = doc.FindMember("target_files");
+  if (files != doc.MemberEnd() && files->value.IsArray()) {
+    for (const rapidjson::Value &file : files->value.GetArray()) {
+      if (!file.IsObject()) {
+        continue;
+      }
+      auto path = file.FindMember("path");
+      if (path != file.MemberEnd() && path->value.IsString()) {
+        target_files.insert_or_assign(
+            std::string{path->value.GetString(), path->value.GetStringLength()},
+            serialize(file));
+      }
+    }
+  }
+
+  // The files of the configurations that are gone are forgotten.
+  std::map<std::string, std::string, std::less<>> kept;
+  rapidjson::Value complete{rapidjson::kArrayType};
+  auto configs = doc.FindMember("client_configs");
+  if (configs != doc.MemberEnd() && configs->value.IsArray()) {
+    for (const rapidjson::Value &config : configs->value.GetArray()) {
+      if (!config.IsString()) {
+        continue;
+      }
+      auto found = target_files.find(
+          std::string_view{config.GetString(), config.GetStringLength()});
+      if (found == target_files.end()) {
+        continue;
+      }
+      rapidjson::Document file{&alloc};
+      file.Parse(found->second.data(), found->second.size());
+      complete.PushBack(rapidjson::Value{file, alloc}, alloc);
+      kept.insert(target_files.extract(found));
+    }
+  }
+  target_files.swap(kept);
+  if (files != doc.MemberEnd()) {
+    files->value = complete;
+  } else {
+    doc.AddMember("target_files", complete, alloc);
+  }
+
+  std::string json = serialize(doc);
+  if (json == published) {
+    return;
+  }
+
+  ngx_shmtx_lock(&shpool_->mutex);
+  auto *mem =
+      static_cast<u_char *>(ngx_slab_alloc_locked(shpool_, json.size()));
+  if (mem == nullptr) {
+    ngx_shmtx_unlock(&shpool_->mutex);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "remote config: the zone is too small to relay the "
+                  "response of the agent to the other workers");
+    return;
+  }
+  if (relay_->response != nullptr) {
+    ngx_slab_free_locked(shpool_, relay_->response);
+  }
+  std::memcpy(mem, json.data(), json.size());
+  relay_->response = mem;
+  relay_->response_len = json.size();
+  relay_->response_generation.store(
+      relay_->response_generation.load(std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+  ngx_shmtx_unlock(&shpool_->mutex);
+
+  published = std::move(json);
+}
+
+std::string RemoteConfigRelay::answer(std::string_view request) {
+  std::set<std::string, std::less<>> products;
+  rapidjson::Document req;
+  req.Parse(request.data(), request.size());
+  if (!req.HasParseError() && req.IsObject()) {
+    auto client = req.FindMember("client");
+    if (client != req.MemberEnd() && client->value.IsObject()) {
+      auto requested = client->value.FindMember("products");
+      if (requested != client->value.MemberEnd() &&
+          requested->value.IsArray()) {
+        for (const rapidjson::Value &product : requested->value.GetArray()) {
+          if (product.IsString()) {
+            products.emplace(product.GetString(), product.GetStringLength());
+          }
+        }
+      }
+    }
+  }
+  std::string products_key;
+  for (const std::string &product : products) {
+    products_key += product;
+    products_key += ',';
+  }
+
+  std::uint64_t const generation =
+      relay_->response_generation.load(std::memory_order_acquire);
+  // as the agent does when nothing changed
+  if (generation == 0) {
+    return "{}";
+  }
+  if (generation == answered_generation && products_key == answered_products) {
+    return last_answer;
+  }
+
+  std::string response;
+  ngx_shmtx_lock(&shpool_->mutex);
+  std::uint64_t const current =
+      relay_->response_generation.load(std::memory_order_relaxed);
+  response.assign(reinterpret_cast<const char *>(relay_->response),
+                  relay_->response_len);
+  ngx_shmtx_unlock(&shpool_->mutex);
+
+  rapidjson::Document doc;
+  doc.Parse(response.data(), response.size());
+  if (doc.HasParseError() || !doc.IsObject()) {
+    return "{}";
+  }
+  auto requested = [&](const rapidjson::Value &path) {
+    return path.IsString() &&
+           products.count(product_of(std::string_view{
+               path.GetString(), path.GetStringLength()})) != 0;
+  };
+  auto configs = doc.FindMember("client_configs");
+  if (configs != doc.MemberEnd() && configs->value.IsArray()) {
+    auto &array = configs->value;
+    for (auto it = array.Begin(); it != array.End();) {
+      it = requested(*it) ? it + 1 : array.Erase(it);
+    }
+  }
+  auto files = doc.FindMember("target_files");
+  if (files != doc.MemberEnd() && files->value.IsArray()) {
+    auto &array = files->value;
+    for (auto it = array.Begin(); it != array.End();) {
+      bool keep = false;
+      if (it->IsObject()) {
+        auto path = it->FindMember("path");
+        keep = path != it->MemberEnd() && requested(path->value);
+      }
+      it = keep ? it + 1 : array.Erase(it);
+    }
+  }
+
+  answered_generation = current;
+  answered_products = std::move(products_key);
+  last_answer = serialize(doc);
+  return last_answer;
+}
+
+}  // namespace datadog::nginx::security
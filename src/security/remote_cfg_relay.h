@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "../datadog_conf.h"
+#include "ddwaf_obj.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+namespace datadog::nginx::security {
+
+// Relays the WAF remote configuration from a single worker to the others,
+// through a shared memory zone (datadog_appsec_remote_config_zone).
+//
+// Only the first worker (ngx_worker 0, which keeps its number when it is
+// respawned) polls the agent. Each time it updates its WAF, it publishes the
+// sections of the update (rules, rules_data, exclusions, ...) as JSON, each
+// with the generation at which it changed. The other workers compare the
+// generation of the zone with the last one they applied, which costs one
+// atomic load, and only when it moved do they copy the sections that changed
+// since then and give them to ddwaf_update. Sections are always complete, so
+// a worker that skips generations, or that just started, still ends up with
+// the configuration of the poller.
+//
+// The remote activation of appsec (ASM_FEATURES) is relayed the same way.
+//
+// The other workers do not poll the agent at all: the responses the poller
+// gets are relayed too, and the polls of the tracers of the other workers,
+// for the products of the tracer itself (APM_TRACING), are answered with the
+// last one instead of being sent (see NgxHTTPClient::set_shortcut).
+//
+// Once a worker is exiting, after a reload, it stops publishing, so that the
+// new poller is the only one to write to a zone that is reused.
+class RemoteConfigRelay {
+ public:
+  // shared memory zone initializer (ngx_shm_zone_t::init)
+  static ngx_int_t init_zone(ngx_shm_zone_t *zone, void *data) noexcept;
+
+  // called in each worker after the zone has been mapped
+  static void initialize(const datadog_main_conf_t &conf);
+
+  static bool enabled() noexcept { return relay_ != nullptr; }
+
+  // whether this worker polls the agent for the remote configuration
+  static bool is_poller() noexcept;
+
+  // Publishes the sections of an update given to ddwaf_update by the poller.
+  // @return bool - false if the zone could not hold it; the other workers
+  // then keep their configuration.
+  static bool publish_update(const ddwaf_map_obj &update);
+
+  // publishes the remote activation state of appsec
+  static void publish_active(bool active) noexcept;
+
+  // The sections published after `generation`, which is then updated, as a
+  // map for ddwaf_update. Nothing if no section changed.
+  static std::optional<ddwaf_owned_map> update_since(std::uint64_t &generation);
+
+  // the last published activation state, if any
+  static std::optional<bool> active() noexcept;
+
+  // Publishes the body of a response of the agent to a remote configuration
+  // poll of the poller. It is completed with the target files of all of its
+  // configurations, which the agent only sends when they change, so that any
+  // worker can apply it whatever it applied before.
+  static void publish_response(std::string_view body);
+
+  // The body of the response to a remote configuration poll of another
+  // worker, given the body of its `request`: the last published response,
+  // with only the configurations of the products requested.
+  static std::string answer(std::string_view request);
+
+ private:
+  static constexpr std::size_t kMaxSections = 16;
+  static constexpr std::size_t kMaxSectionName = 24;
+
+  struct Section {
+    char name[kMaxSectionName];
+    std::size_t name_len;
+    // generation of the relay when the section last changed; 0 if unused
+    std::uint64_t generation;
+    // JSON of the section, allocated in the zone
+    u_char *json;
+    std::size_t json_len;
+  };
+
+  // allocated in the zone; the mapping is inherited by the workers, so the
+  // pointer is valid in all of them. The sections are only accessed with
+  // the mutex of the slab pool held
+  struct Relay {
+    std::atomic<std::uint64_t> generation;
+    // -1 until the poller gets an activation state, then 0 or 1
+    std::atomic<std::int32_t> active;
+    Section sections[kMaxSections];
+    // the last response published; 0 and nullptr until there is one
+    std::atomic<std::uint64_t> response_generation;
+    u_char *response;
+    std::size_t response_len;
+  };
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<std::int32_t>::is_always_lock_free);
+
+  static Relay *relay_;             // NOLINT
+  static ngx_slab_pool_t *shpool_;  // NOLINT
+};
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,176 @@
+#include "response_body.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+#include "../string_util.h"
+#include "body_collector.h"
+#include "json_parser.h"
+
+extern "C" {
+#include <ngx_string.h>
+}
+
+using namespace std::literals;
+
+namespace {
+
+namespace dnsec = datadog::nginx::security;
+
+// HTML is given to the WAF as an array of strings no longer than the WAF's
+// string length limit (longer strings would be truncated). Consecutive chunks
+// overlap, so that short matches across chunk boundaries are not missed.
+constexpr std::size_t kHtmlChunkSize =
+    dnsec::kWafInputJsonLimits.max_string_length;
+constexpr std::size_t kHtmlChunkOverlap = 256;
+
+bool media_type_is(std::string_view content_type, std::string_view type) {
+  if (content_type.size() < type.size()) {
+    return false;
+  }
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  if (ngx_strncasecmp(
+          reinterpret_cast<u_char *>(const_cast<char *>(content_type.data())),
+          reinterpret_cast<u_char *>(const_cast<char *>(type.data())),
+          type.size()) != 0) {
+    return false;
+  }
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+  return content_type.size() == type.size() ||
+         content_type[type.size()] == ';' || content_type[type.size()] == ' ';
+}
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+std::unique_ptr<ResponseBodyWindow> ResponseBodyWindow::maybe_create(
+    const ngx_http_request_t &request, DdwafMemres &memres,
+    std::size_t max_bytes) {
+  if (max_bytes == 0 || request.header_only ||
+      request.headers_out.content_length_n == 0) {
+    return nullptr;
+  }
+
+  // compressed bodies are not inspected
+  const ngx_table_elt_t *encoding = request.headers_out.content_encoding;
+  if (encoding != nullptr && encoding->hash != 0 && encoding->value.len > 0) {
+    return nullptr;
+  }
+
+  std::string_view const ct = to_string_view(request.headers_out.content_type);
+  enum kind body_kind;
+  if (is_json_media_type(ct)) {
+    body_kind = kind::JSON;
+  } else if (media_type_is(ct, "text/html"sv) ||
+             media_type_is(ct, "application/xhtml+xml"sv)) {
+    body_kind = kind::HTML;
+  } else {
+    return nullptr;
+  }
+
+  std::size_t capacity = max_bytes;
+  if (request.headers_out.content_length_n > 0) {
+    capacity = std::min(
+        capacity,
+        static_cast<std::size_t>(request.headers_out.content_length_n));
+  }
+
+  return std::unique_ptr<ResponseBodyWindow>{
+      new ResponseBodyWindow{memres, body_kind, capacity}};
+}
+
+bool ResponseBodyWindow::feed(const ngx_chain_t *chain) {
+  for (const ngx_chain_t *cl = chain; cl != nullptr && !complete_;
+       cl = cl->next) {
+    const ngx_buf_t &b = *cl->buf;
+    std::size_t const room = capacity_ - size_;
+
+    if (ngx_buf_in_memory(&b)) {
+      auto const n =
+          std::min(room, static_cast<std::size_t>(b.last - b.pos));
+      if (n > 0) {
+        std::memcpy(data() + size_, b.pos, n);
+        size_ += n;
+      }
+    } else if (b.in_file && b.file != nullptr) {
+      auto const n =
+          std::min(room, static_cast<std::size_t>(b.file_last - b.file_pos));
+      if (n > 0) {
+        file_segments_.push_back({size_, n, b.file->fd, b.file_pos});
+        size_ += n;
+      }
+    }
+
+    if (b.last_buf || size_ == capacity_) {
+      complete_ = true;
+    }
+  }
+
+  return complete_;
+}
+
+char *ResponseBodyWindow::data() {
+  if (data_ == nullptr) {
+    data_ = memres_.allocate_string(capacity_);
+  }
+  return data_;
+}
+
+std::size_t ResponseBodyWindow::read_file_segments() {
+  for (const FileSegment &seg : file_segments_) {
+    std::size_t done = 0;
+    while (done < seg.len) {
+      ssize_t const n = ::pread(seg.fd, data() + seg.offset + done,
+                                seg.len - done,
+                                seg.file_pos + static_cast<off_t>(done));
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        // what follows is not there; inspect what precedes
+        return seg.offset + done;
+      }
+      done += static_cast<std::size_t>(n);
+    }
+  }
+  return size_;
+}
+
+bool ResponseBodyWindow::to_waf_input(ddwaf_obj &slot) {
+  if (size_ == 0) {
+    return false;
+  }
+  std::size_t const len = read_file_segments();
+  if (len == 0) {
+    return false;
+  }
+  std::string_view const text{data(), len};
+
+  if (kind_ == kind::JSON) {
+    try {
+      parse_json(text, kWafInputJsonLimits, memres_, slot);
+    } catch (const std::invalid_argument &) {
+      // not JSON after all
+      return false;
+    }
+    return true;
+  }
+
+  // the chunks are views into the window
+  constexpr std::size_t step = kHtmlChunkSize - kHtmlChunkOverlap;
+  std::size_t const n_chunks =
+      len <= kHtmlChunkSize ? 1 : 1 + (len - kHtmlChunkOverlap - 1) / step;
+  ddwaf_arr_obj &arr = slot.make_array(n_chunks, memres_);
+  for (std::size_t i = 0; i < n_chunks; i++) {
+    arr.at_unchecked(i).make_string(text.substr(i * step, kHtmlChunkSize));
+  }
+  return true;
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "ddwaf_memres.h"
+#include "ddwaf_obj.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// The first `max_bytes` of a JSON or HTML response body, given to the final
+// WAF run as server.response.body.
+//
+// The window is filled as the response goes through the output body filter;
+// no buffer is held back, so delivery is never delayed. File buffers (static
+// files, cached or disk-buffered upstream responses) are only referenced and
+// read on the WAF thread: the files stay open for as long as the request
+// lives. Memory buffers are copied on the spot, straight into the window,
+// because their producers reuse them as soon as they've been written.
+//
+// Parsing (JSON) happens on the WAF thread too, in to_waf_input().
+class ResponseBodyWindow {
+ public:
+  // returns nullptr if the response body is not to be inspected
+  static std::unique_ptr<ResponseBodyWindow> maybe_create(
+      const ngx_http_request_t &request, DdwafMemres &memres,
+      std::size_t max_bytes);
+
+  ResponseBodyWindow(const ResponseBodyWindow &) = delete;
+  ResponseBodyWindow &operator=(const ResponseBodyWindow &) = delete;
+
+  // returns true once the window is complete: either full or the last buffer
+  // of the response was seen
+  bool feed(const ngx_chain_t *chain);
+
+  bool complete() const noexcept { return complete_; }
+
+  // Runs on the WAF thread. Sets `slot` to the parsed document (JSON) or to
+  // the text (HTML). Returns false if there is nothing to inspect.
+  bool to_waf_input(ddwaf_obj &slot);
+
+ private:
+  enum class kind : unsigned char { JSON, HTML };
+
+  ResponseBodyWindow(DdwafMemres &memres, enum kind body_kind,
+                     std::size_t capacity)
+      : memres_{memres}, kind_{body_kind}, capacity_{capacity} {}
+
+  char *data();
+  // reads the file segments into the window; returns the number of bytes
+  // that are actually available (a file may be shorter than expected)
+  std::size_t read_file_segments();
+
+  struct FileSegment {
+    std::size_t offset;  // in the window
+    std::size_t len;
+    ngx_fd_t fd;
+    off_t file_pos;
+  };
+
+  DdwafMemres &memres_;
+  enum kind kind_;
+  std::size_t capacity_;
+  std::size_t size_{};
+  char *data_{nullptr};  // allocated in memres_ on first use
+  std::vector<FileSegment> file_segments_;
+  bool complete_{false};
+};
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,185 @@
+#include "verdict_cache.h"
+
+#include <cstring>
+#include <random>
+#include <string_view>
+
+#include "util.h"
+
+extern "C" {
+#include <ngx_log.h>
+}
+
+using namespace std::literals;
+
+namespace {
+
+namespace dnsec = datadog::nginx::security;
+
+// Multiply-fold hash in the style of wyhash. It's seeded per worker so that
+// collisions with a cached benign request can't be precomputed by a client.
+class RequestHasher {
+  static constexpr std::uint64_t kP0 = 0xa0761d6478bd642fULL;
+  static constexpr std::uint64_t kP1 = 0xe7037ed1a0b428dbULL;
+
+ public:
+  explicit RequestHasher(std::uint64_t seed) : h_{seed} {}
+
+  void update(std::string_view sv) noexcept {
+    // length first, so that field boundaries are part of the hash
+    mix(sv.size());
+
+    const char *p = sv.data();
+    std::size_t n = sv.size();
+    while (n >= sizeof(std::uint64_t)) {
+      std::uint64_t w;
+      std::memcpy(&w, p, sizeof w);
+      mix(w);
+      p += sizeof w;
+      n -= sizeof w;
+    }
+    if (n > 0) {
+      std::uint64_t w{};
+      std::memcpy(&w, p, n);
+      mix(w);
+    }
+  }
+
+  void update(const ngx_str_t &str) noexcept {
+    update(datadog::nginx::to_string_view(str));
+  }
+
+  void update(std::uint64_t v) noexcept { mix(v); }
+
+  std::uint64_t digest() const noexcept { return h_; }
+
+ private:
+  void mix(std::uint64_t w) noexcept {
+    __uint128_t const r =
+        static_cast<__uint128_t>(h_ ^ w ^ kP0) * static_cast<__uint128_t>(kP1);
+    h_ = static_cast<std::uint64_t>(r) ^ static_cast<std::uint64_t>(r >> 64);
+  }
+
+  std::uint64_t h_;
+};
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+// NOLINTNEXTLINE
+std::unique_ptr<VerdictCache> VerdictCache::instance;
+
+void VerdictCache::initialize(const datadog_main_conf_t &conf) {
+  if (conf.appsec_verdict_cache_size == NGX_CONF_UNSET ||
+      conf.appsec_verdict_cache_size <= 0) {
+    instance.reset();
+    return;
+  }
+
+  std::random_device rd;
+  std::uint64_t seed = (static_cast<std::uint64_t>(rd()) << 32) | rd();
+
+  instance = std::unique_ptr<VerdictCache>(new VerdictCache(
+      static_cast<std::size_t>(conf.appsec_verdict_cache_size), seed));
+}
+
+VerdictCache::VerdictCache(std::size_t max_entries, std::uint64_t seed)
+    : max_entries_{max_entries}, seed_{seed} {
+  index_.reserve(max_entries);
+}
+
+std::uint64_t VerdictCache::request_key(
+    const ngx_http_request_t &request) const {
+  RequestHasher h{seed_};
+
+  h.update(request.method_name);
+  h.update(request.unparsed_uri);  // includes the query string
+  for (auto &&header : NgnixHeaderIterable{request.headers_in.headers}) {
+    h.update(lc_key(header));
+    h.update(header.value);
+  }
+  // the client ip is resolved from the headers and the peer address
+  if (request.connection != nullptr) {
+    h.update(request.connection->addr_text);
+  }
+
+  return h.digest();
+}
+
+std::uint64_t VerdictCache::response_key(
+    std::uint64_t request_key, const ngx_http_request_t &request) const {
+  RequestHasher h{seed_ ^ request_key};
+
+  h.update(static_cast<std::uint64_t>(request.headers_out.status));
+  for (auto &&header : NgnixHeaderIterable{request.headers_out.headers}) {
+    if (header.hash == 0) {  // deleted
+      continue;
+    }
+    // changes on every response
+    if (resp_key_equals_ci(header, "date"sv)) {
+      continue;
+    }
+    h.update(header.key);
+    h.update(header.value);
+  }
+
+  return h.digest();
+}
+
+bool VerdictCache::lookup(std::uint64_t key, std::uint64_t generation) {
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    stats_.misses++;
+    return false;
+  }
+
+  if (it->second->generation != generation) {
+    // verdict for an older ruleset
+    lru_.erase(it->second);
+    index_.erase(it);
+    stats_.misses++;
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second);
+  stats_.hits++;
+  return true;
+}
+
+void VerdictCache::store_no_match(std::uint64_t key, std::uint64_t generation) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    it->second->generation = generation;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  if (lru_.size() >= max_entries_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+    stats_.evictions++;
+  }
+
+  lru_.push_front(Entry{key, generation});
+  index_.emplace(key, lru_.begin());
+}
+
+void VerdictCache::invalidate() noexcept {
+  if (lru_.empty()) {
+    return;
+  }
+  lru_.clear();
+  index_.clear();
+  stats_.invalidations++;
+}
+
+void VerdictCache::log_stats(ngx_log_t &log) const {
+  ngx_log_error(NGX_LOG_NOTICE, &log, 0,
+                "appsec verdict cache: %uL hits, %uL misses, %uL evictions, "
+                "%uL invalidations, %uz entries",
+                stats_.hits, stats_.misses, stats_.evictions,
+                stats_.invalidations, lru_.size());
+}
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "../datadog_conf.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// Per-worker LRU of "no match" WAF verdicts. Entries are keyed by a seeded
+// hash of everything the WAF is given for a request (method, raw URI, headers
+// and peer address), so a byte-identical request seen again with the same
+// ruleset generation can skip the WAF. Only accessed from the event loop
+// thread.
+class VerdictCache {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static std::unique_ptr<VerdictCache> instance;
+
+ public:
+  struct Stats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+    std::uint64_t invalidations;
+  };
+
+  // no-op if the cache is not enabled in the configuration
+  static void initialize(const datadog_main_conf_t &conf);
+
+  // nullptr if the cache is disabled
+  static VerdictCache *get_instance() { return instance.get(); }
+
+  std::uint64_t request_key(const ngx_http_request_t &request) const;
+  // key for the final WAF run: the request key plus the response status and
+  // headers
+  std::uint64_t response_key(std::uint64_t request_key,
+                             const ngx_http_request_t &request) const;
+
+  // whether a no-match verdict is cached for this key and generation
+  bool lookup(std::uint64_t key, std::uint64_t generation);
+  void store_no_match(std::uint64_t key, std::uint64_t generation);
+
+  // drops all entries; called when a new ruleset is published
+  void invalidate() noexcept;
+
+  const Stats &stats() const noexcept { return stats_; }
+  void log_stats(ngx_log_t &log) const;
+
+ private:
+  VerdictCache(std::size_t max_entries, std::uint64_t seed);
+
+  struct Entry {
+    std::uint64_t key;
+    std::uint64_t generation;
+  };
+
+  std::size_t max_entries_;
+  std::uint64_t seed_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+  Stats stats_{};
+};
+
+}  // namespace datadog::nginx::security
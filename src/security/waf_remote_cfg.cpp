@@ -12,18 +12,23 @@
 
 #include <algorithm>
 #include <charconv>
+#include <chrono>
 #include <initializer_list>
+#include <map>
 #include <optional>
 #include <ostream>
 #include <regex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
 
 #include "ddwaf_memres.h"
 #include "ddwaf_obj.h"
+#include "json_parser.h"
 #include "library.h"
 #include "ngx_logger.h"
+#include "remote_cfg_relay.h"
 
 namespace rc = datadog::remote_config;
 namespace dnsec = datadog::nginx::security;
@@ -35,6 +40,10 @@ using Capability = rc::capability::Flag;
 
 namespace {
 
+// how often the workers that do not poll for AppSec look for a relayed
+// configuration
+constexpr auto kRelayCheckInterval = std::chrono::seconds(1);
+
 // A configuration key has the form:
 // (datadog/<org_id> | employee)/<PRODUCT>/<config_id>/<name>"
 class ParsedConfigKey {
@@ -183,15 +192,12 @@ class AppSecUserConfig {
             !exclusions_.empty()};
   }
 
-  static AppSecUserConfig from_json(ParsedConfigKey key,
-                                    rapidjson::Document &json) {
-    if (!json.IsObject()) {
+  static AppSecUserConfig from_json(
+      ParsedConfigKey key, dnsec::ddwaf_owned_obj<dnsec::ddwaf_obj> oo) {
+    if (oo.get().type != DDWAF_OBJ_MAP) {
       throw std::invalid_argument("user config json not a map");
     }
 
-    dnsec::ddwaf_owned_obj oo =
-        dnsec::json_to_object(json, dnsec::kConfigMaxDepth);
-
     return AppSecUserConfig{key, dnsec::ddwaf_owned_map{std::move(oo)}};
   }
 };
@@ -246,18 +252,74 @@ class CollectedAsmData {
                      ParsedConfigKey::Hash>
       data_;
 
+  // the merged entry of one data id: {id: "...", type: "...", data: [...]}
+  // It's kept across updates and only rebuilt when one of the configs with
+  // entries for this id is added, changed or removed, so that pushing an IP
+  // to a denylist does not re-merge all the other data.
+  struct MergedEntry {
+    dnsec::DdwafMemres memres;
+    dnsec::ddwaf_obj obj{};  // mixed ownership (data_ and memres)
+  };
+  std::map<std::string, MergedEntry, std::less<>> merged_;
+  // ids whose entry in merged_ is stale
+  std::set<std::string, std::less<>> dirty_ids_;
+
  public:
   void add_config(const ParsedConfigKey &key,
                   dnsec::ddwaf_owned_arr new_config) {
+    mark_ids_dirty(new_config.get());
+
+    auto it = data_.find(key);
+    if (it != data_.end()) {
+      mark_ids_dirty(it->second.get());
+      data_.erase(it);
+    }
     data_.emplace(key, std::move(new_config));
   }
 
-  void remove_config(const ParsedConfigKey &key) { data_.erase(key); }
+  void remove_config(const ParsedConfigKey &key) {
+    auto it = data_.find(key);
+    if (it == data_.end()) {
+      return;
+    }
+    mark_ids_dirty(it->second.get());
+    data_.erase(it);
+  }
+
+  // whether merged_data() would differ from the last time it was called
+  bool has_changes() const { return !dirty_ids_.empty(); }
 
   // returns [{id: "...", type: "...", data: [{...}, ...]}]
   // by merging the data value from all entries with the same id
-  dnsec::ddwaf_arr_obj merged_data(dnsec::DdwafMemres &memres) const {
-    // first we need to group all the data by id
+  dnsec::ddwaf_arr_obj merged_data(dnsec::DdwafMemres &memres) {
+    if (!dirty_ids_.empty()) {
+      remerge_dirty_ids();
+    }
+
+    dnsec::ddwaf_arr_obj ret;  // mixed ownership (merged_ and memres)
+    ret.make_array(merged_.size(), memres);
+    std::size_t i = 0;
+    for (auto &&[id, entry] : merged_) {
+      ret.at_unchecked(i++).shallow_copy_val_from(entry.obj);
+    }
+    return ret;
+  }
+
+ private:
+  void mark_ids_dirty(const dnsec::ddwaf_arr_obj &arr) {
+    for (auto &&data_entry_obj : arr) {
+      dnsec::ddwaf_map_obj data_entry{data_entry_obj};
+      std::string_view id =
+          data_entry.get<dnsec::ddwaf_str_obj>("id"sv).value();
+      if (dirty_ids_.find(id) == dirty_ids_.end()) {
+        dirty_ids_.emplace(id);
+      }
+    }
+  }
+
+  void remerge_dirty_ids() {
+    // first we need to group the data of the dirty ids by id. The data arrays
+    // of the other ids are not looked at
     auto grouped_entries =
         std::unordered_map<std::string_view,
                            std::vector<dnsec::ddwaf_map_obj>>{};
@@ -268,62 +330,75 @@ class CollectedAsmData {
         dnsec::ddwaf_map_obj data_entry{data_entry_obj};
         std::string_view id =
             data_entry.get<dnsec::ddwaf_str_obj>("id"sv).value();
-        grouped_entries[id].push_back(data_entry);
+        if (dirty_ids_.find(id) != dirty_ids_.end()) {
+          grouped_entries[id].push_back(data_entry);
+        }
       }
     }
 
-    // then we need to merge the data
-    dnsec::ddwaf_arr_obj ret;  // mixed ownership (data_ and memres)
-    std::size_t num_ids = grouped_entries.size();
-    ret.make_array(num_ids, memres);
-
-    std::size_t i = 0;
+    // then we need to merge the data. Nothing is replaced until all the
+    // entries are merged, so a type mismatch leaves merged_ untouched
+    std::vector<std::pair<std::string_view, MergedEntry>> new_entries;
+    new_entries.reserve(grouped_entries.size());
     for (auto &&[id, vec] : grouped_entries) {
-      // out has a format like this:
-      // - id: ip_data
-      //   type: ip_with_expiration
-      //   data:
-      //     - value: 192.168.1.1
-      //       expiration: 555
-      //     - ... merged from all entries
-      dnsec::ddwaf_obj &out = ret.at_unchecked(i++);
-
-      dnsec::ddwaf_map_obj &merged_map = out.make_map(3, memres);
-      // id is a string_view backed by one of the data etnries
-      merged_map.at_unchecked(0).set_key("id"sv).make_string(id);
-
-      // check if the type is always the same for this id
-      std::string_view first_type =
-          vec.at(0).get<dnsec::ddwaf_str_obj>("type"sv).value();
-      for (std::size_t j = 1; j < vec.size(); ++j) {
-        if (vec.at(j).get<dnsec::ddwaf_str_obj>("type"sv).value() !=
-            first_type) {
-          throw std::invalid_argument(
-              "type is not the same for all data entries with id=" +
-              std::string{id});
-        }
-      }
-      merged_map.at_unchecked(1).set_key("type"sv).make_string(first_type);
+      new_entries.emplace_back(id, merge_entries(id, vec));
+    }
 
-      // finally, the merged "data" key
-      std::size_t total_data_entries = 0;
-      for (dnsec::ddwaf_map_obj &obj : vec) {
-        total_data_entries += obj.get<dnsec::ddwaf_arr_obj>("data"sv).size();
-      }
-      dnsec::ddwaf_arr_obj &merged_data =
-          merged_map.at_unchecked(2).set_key("data"sv).make_array(
-              total_data_entries, memres);
-
-      std::size_t k = 0;
-      for (dnsec::ddwaf_map_obj &obj : vec) {
-        dnsec::ddwaf_arr_obj cur_data = obj.get<dnsec::ddwaf_arr_obj>("data"sv);
-        std::memcpy(&merged_data.at_unchecked<ddwaf_object>(k), cur_data.array,
-                    cur_data.size() * sizeof(dnsec::ddwaf_obj));
-        k += cur_data.size();
+    for (auto &&id : dirty_ids_) {
+      merged_.erase(id);
+    }
+    for (auto &&[id, entry] : new_entries) {
+      merged_.emplace(std::string{id}, std::move(entry));
+    }
+    dirty_ids_.clear();
+  }
+
+  static MergedEntry merge_entries(
+      std::string_view id, const std::vector<dnsec::ddwaf_map_obj> &vec) {
+    // out has a format like this:
+    // - id: ip_data
+    //   type: ip_with_expiration
+    //   data:
+    //     - value: 192.168.1.1
+    //       expiration: 555
+    //     - ... merged from all entries
+    MergedEntry ret;
+    dnsec::DdwafMemres &memres = ret.memres;
+
+    dnsec::ddwaf_map_obj &merged_map = ret.obj.make_map(3, memres);
+    // copied rather than borrowed from data_, whose configs come and go
+    merged_map.at_unchecked(0).set_key("id"sv).make_string(id, memres);
+
+    // check if the type is always the same for this id
+    std::string_view first_type =
+        vec.at(0).get<dnsec::ddwaf_str_obj>("type"sv).value();
+    for (std::size_t j = 1; j < vec.size(); ++j) {
+      if (vec.at(j).get<dnsec::ddwaf_str_obj>("type"sv).value() !=
+          first_type) {
+        throw std::invalid_argument(
+            "type is not the same for all data entries with id=" +
+            std::string{id});
       }
-      assert(total_data_entries == k);
     }
-    assert(num_ids == i);
+    merged_map.at_unchecked(1).set_key("type"sv).make_string(first_type);
+
+    // finally, the merged "data" key
+    std::size_t total_data_entries = 0;
+    for (const dnsec::ddwaf_map_obj &obj : vec) {
+      total_data_entries += obj.get<dnsec::ddwaf_arr_obj>("data"sv).size();
+    }
+    dnsec::ddwaf_arr_obj &merged_data =
+        merged_map.at_unchecked(2).set_key("data"sv).make_array(
+            total_data_entries, memres);
+
+    std::size_t k = 0;
+    for (const dnsec::ddwaf_map_obj &obj : vec) {
+      dnsec::ddwaf_arr_obj cur_data = obj.get<dnsec::ddwaf_arr_obj>("data"sv);
+      std::memcpy(&merged_data.at_unchecked<ddwaf_object>(k), cur_data.array,
+                  cur_data.size() * sizeof(dnsec::ddwaf_obj));
+      k += cur_data.size();
+    }
+    assert(total_data_entries == k);
 
     return ret;
   }
@@ -360,12 +435,12 @@ class CurrentAppSecConfig {
   void asm_data_add_config(const ParsedConfigKey &key,
                            dnsec::ddwaf_owned_arr new_config) {
     asm_data_.add_config(key, std::move(new_config));
-    dirty_status_.data = true;
+    dirty_status_.data = asm_data_.has_changes();
   }
 
   void asm_data_remove_config(const ParsedConfigKey &key) {
     asm_data_.remove_config(key);
-    dirty_status_.data = true;
+    dirty_status_.data = asm_data_.has_changes();
   }
 
   void user_config_add_config(AppSecUserConfig new_config) {
@@ -379,7 +454,11 @@ class CurrentAppSecConfig {
   // Main method
   // returns a mixed ownership object, with some static data,
   // some data owned by this object (indirectly), and newly allocated
-  // data owned by the caller
+  // data owned by the caller. Only the sections that changed since the last
+  // call are included; ddwaf_update keeps the others from the previous
+  // handle. The merged sections are shallow: the rules, exclusions, etc. of
+  // the configs are never copied, and for rules_data only the ids touched by
+  // the changed configs are merged again
   std::optional<dnsec::ddwaf_owned_map> merged_update_config() {
     if (!dirty_status_.is_any_dirty()) {
       return std::nullopt;
@@ -406,7 +485,7 @@ class CurrentAppSecConfig {
                   .get_opt<dnsec::ddwaf_arr_obj>("processors"sv)
                   .value_or(dnsec::ddwaf_arr_obj{}));
       mo.at_unchecked(i++)
-          .set_key("scannners"sv)
+          .set_key("scanners"sv)
           .shallow_copy_val_from(
               dd_config()
                   .get_opt<dnsec::ddwaf_arr_obj>("scanners"sv)
@@ -461,7 +540,8 @@ class CurrentAppSecConfig {
   const dnsec::ddwaf_map_obj &dd_config() { return dd_config_.get()->get(); }
 
   dnsec::ddwaf_arr_obj get_merged_custom_rules(dnsec::DdwafMemres &memres) {
-    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps(user_configs_.size());
+    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps;
+    arr_of_maps.reserve(user_configs_.size());
     for (auto &&uc : user_configs_) {
       arr_of_maps.push_back(uc.custom_rules());
     }
@@ -470,7 +550,8 @@ class CurrentAppSecConfig {
   }
 
   dnsec::ddwaf_arr_obj get_merged_exclusions(dnsec::DdwafMemres &memres) {
-    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps(user_configs_.size() + 1);
+    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps;
+    arr_of_maps.reserve(user_configs_.size() + 1);
 
     dnsec::ddwaf_arr_obj dd_rules_exclusions =
         dd_config()
@@ -487,7 +568,8 @@ class CurrentAppSecConfig {
 
   // does not include default actions
   dnsec::ddwaf_arr_obj get_merged_actions(dnsec::DdwafMemres &memres) {
-    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps(user_configs_.size() + 1);
+    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps;
+    arr_of_maps.reserve(user_configs_.size() + 1);
 
     dnsec::ddwaf_arr_obj dd_actions =
         dd_config()
@@ -503,7 +585,8 @@ class CurrentAppSecConfig {
   }
 
   dnsec::ddwaf_arr_obj get_merged_rule_overrides(dnsec::DdwafMemres &memres) {
-    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps(user_configs_.size() + 1);
+    std::vector<dnsec::ddwaf_arr_obj> arr_of_maps;
+    arr_of_maps.reserve(user_configs_.size() + 1);
 
     dnsec::ddwaf_arr_obj dd_rules_override =
         dd_config()
@@ -558,6 +641,16 @@ class CurrentAppSecConfig {
   }
 };
 
+auto parse_config_json(std::string_view content, std::string_view product)
+    -> dnsec::ddwaf_owned_obj<dnsec::ddwaf_obj> {
+  try {
+    return dnsec::parse_json(content, dnsec::kConfigJsonLimits);
+  } catch (const std::invalid_argument &e) {
+    throw std::invalid_argument("failed to parse remote config for " +
+                                std::string{product} + ": " + e.what());
+  }
+}
+
 class JsonParsedConfig {
  public:
   JsonParsedConfig(const std::string &content) {
@@ -656,6 +749,9 @@ class AsmFeaturesListener : public ProductListener<AsmFeaturesListener> {
 
     AppSecFeatures features{content};
     bool new_state = features.asm_enabled();
+    if (dnsec::RemoteConfigRelay::enabled()) {
+      dnsec::RemoteConfigRelay::publish_active(new_state);
+    }
     bool old_state = dnsec::Library::active();
     if (new_state == old_state) {
       return;
@@ -686,18 +782,9 @@ class AsmDDListener : public ProductListener<AsmDDListener> {
         default_config_{default_config} {}
 
   void on_update_impl(const ParsedConfigKey &key, const std::string &content) {
-    // convert content to rapidjson::Document:
-    rapidjson::Document doc;
-    rapidjson::ParseResult result = doc.Parse(content.c_str(), content.size());
-    if (!result) {
-      throw std::invalid_argument(
-          "failed to parse remote config for asm_dd: " +
-          std::string{rapidjson::GetParseError_En(result.Code())});
-    }
-
     std::shared_ptr<dnsec::ddwaf_owned_map> new_config =
         std::make_shared<dnsec::ddwaf_owned_map>(
-            dnsec::json_to_object(doc, dnsec::kConfigMaxDepth));
+            parse_config_json(content, "asm_dd"sv));
 
     cur_appsec_cfg_.set_dd_config(std::move(new_config));
   }
@@ -720,30 +807,27 @@ class AsmDataListener : public ProductListener<AsmDataListener> {
       : ProductListener{logger}, cur_appsec_cfg_{cur_appsec_cfg} {}
 
   void on_update_impl(const ParsedConfigKey &key, const std::string &content) {
-    rapidjson::Document doc;
-    rapidjson::ParseResult result = doc.Parse(content.c_str(), content.size());
-    if (!result) {
-      throw std::invalid_argument(
-          "failed to parse remote config for asm_data: " +
-          std::string{rapidjson::GetParseError_En(result.Code())});
-    }
+    dnsec::ddwaf_owned_obj<dnsec::ddwaf_obj> doc =
+        parse_config_json(content, "asm_data"sv);
 
-    if (!doc.IsObject()) {
+    if (doc.get().type != DDWAF_OBJ_MAP) {
       throw std::invalid_argument("asm_data remote config not an object");
     }
 
-    if (doc.HasMember("rules_data")) {
-      auto &rules_data = doc["rules_data"];
-      if (!rules_data.IsArray()) {
+    std::optional<dnsec::ddwaf_obj> rules_data =
+        dnsec::ddwaf_map_obj{doc.get()}.get_opt("rules_data"sv);
+    if (rules_data) {
+      if (rules_data->type != DDWAF_OBJ_ARRAY) {
         throw std::invalid_argument("rules_data is not an array");
       }
       logger_.log_debug([&key, &rules_data](std::ostream &oss) {
         oss << "rules_data: key(" << key.config_id() << ") "
-            << "size(" << rules_data.Size() << ")";
+            << "size(" << rules_data->size() << ")";
       });
 
-      dnsec::ddwaf_owned_arr new_data{
-          dnsec::json_to_object(rules_data, dnsec::kConfigMaxDepth)};
+      // keep the array (and the memory of the whole document) only
+      doc.get().shallow_copy_val_from(*rules_data);
+      dnsec::ddwaf_owned_arr new_data{std::move(doc)};
       cur_appsec_cfg_.asm_data_add_config(key, std::move(new_data));
     } else {
       // no data
@@ -774,15 +858,8 @@ class AsmUserConfigListener : public ProductListener<AsmUserConfigListener> {
       : ProductListener{logger}, cur_appsec_cfg_{cur_appsec_cfg} {}
 
   void on_update_impl(const ParsedConfigKey &key, const std::string &content) {
-    rapidjson::Document doc;
-    rapidjson::ParseResult result = doc.Parse(content.c_str(), content.size());
-    if (!result) {
-      throw std::invalid_argument(
-          "failed to parse remote config for ASM product (user config): " +
-          std::string{rapidjson::GetParseError_En(result.Code())});
-    }
-
-    AppSecUserConfig new_config{AppSecUserConfig::from_json(key, doc)};
+    AppSecUserConfig new_config{AppSecUserConfig::from_json(
+        key, parse_config_json(content, "ASM product (user config)"sv))};
     cur_appsec_cfg_.user_config_add_config(std::move(new_config));
   }
 
@@ -820,6 +897,8 @@ class AppSecConfigService {
   std::shared_ptr<dnsec::ddwaf_owned_map> default_config_;
   CurrentAppSecConfig current_config_;
   std::shared_ptr<dn::NgxLogger> logger_;
+  // of the last configuration relayed by the poller that was applied
+  std::uint64_t relayed_generation_{0};
 
   static inline std::unique_ptr<AppSecConfigService> instance_;  // NOLINT
 
@@ -859,6 +938,12 @@ class AppSecConfigService {
   void subscribe_to_remote_config(datadog::tracing::DatadogAgentConfig &ddac,
                                   bool accept_cfg_update,
                                   bool is_subscribe_activation) {
+    if (dnsec::RemoteConfigRelay::enabled() &&
+        !dnsec::RemoteConfigRelay::is_poller()) {
+      follow_poller(ddac, accept_cfg_update, is_subscribe_activation);
+      return;
+    }
+
     if (is_subscribe_activation) {
       subscribe_activation(ddac);
     }
@@ -874,6 +959,9 @@ class AppSecConfigService {
             if (maybe_upd) {
               auto &&upd = *maybe_upd;
               dnsec::Library::update_ruleset(upd.get());
+              if (dnsec::RemoteConfigRelay::enabled()) {
+                dnsec::RemoteConfigRelay::publish_update(upd.get());
+              }
             }
           }));
     }
@@ -886,6 +974,50 @@ class AppSecConfigService {
         new AsmFeaturesListener(*logger_));
   }
 
+  // With datadog_appsec_remote_config_zone, only the first worker polls the
+  // agent. The others apply the WAF configuration it relays, and register no
+  // AppSec listener: the polls of their tracer, for the products of the
+  // tracer itself (APM_TRACING), are answered with the responses it relays
+  // (see TracingLibrary::make_tracer).
+  void follow_poller(datadog::tracing::DatadogAgentConfig &ddac,
+                     bool accept_cfg_update, bool is_subscribe_activation) {
+    auto apply = [this, accept_cfg_update, is_subscribe_activation] {
+      apply_relayed(accept_cfg_update, is_subscribe_activation);
+    };
+    apply();
+    if (ddac.event_scheduler) {
+      // canceled when the tracer, which owns the scheduler, is destroyed
+      ddac.event_scheduler->schedule_recurring_event(kRelayCheckInterval,
+                                                     std::move(apply));
+    }
+  }
+
+  void apply_relayed(bool accept_cfg_update, bool is_subscribe_activation) {
+    if (is_subscribe_activation) {
+      std::optional<bool> active = dnsec::RemoteConfigRelay::active();
+      if (active && *active != dnsec::Library::active()) {
+        dnsec::Library::set_active(*active);
+      }
+    }
+
+    if (!accept_cfg_update) {
+      return;
+    }
+    try {
+      std::optional<dnsec::ddwaf_owned_map> maybe_upd =
+          dnsec::RemoteConfigRelay::update_since(relayed_generation_);
+      if (maybe_upd) {
+        dnsec::Library::update_ruleset(maybe_upd->get());
+      }
+    } catch (const std::exception &e) {
+      logger_->log_error([&e](std::ostream &oss) {
+        oss << "failed to apply the remote config relayed by the first "
+               "worker: "
+            << e.what();
+      });
+    }
+  }
+
   void subscribe_rules_and_data(datadog::tracing::DatadogAgentConfig &ddac) {
     // ASM_DD
     ddac.remote_configuration_listeners.emplace_back(
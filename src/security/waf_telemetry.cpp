@@ -0,0 +1,184 @@
+#include "waf_telemetry.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <string_view>
+
+extern "C" {
+#include <ngx_string.h>
+}
+
+using namespace std::literals;
+
+namespace {
+
+namespace dnsec = datadog::nginx::security;
+
+std::uint64_t to_us(std::chrono::nanoseconds ns) {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(ns).count());
+}
+
+void append_uint(std::string &out, std::string_view key, std::uint64_t value) {
+  char buf[64];
+  int const n = std::snprintf(buf, sizeof(buf), "\"%.*s\":%llu,",
+                              static_cast<int>(key.size()), key.data(),
+                              static_cast<unsigned long long>(value));
+  out.append(buf, static_cast<std::size_t>(n));
+}
+
+void append_histogram(std::string &out, std::string_view key,
+                      const dnsec::HdrHistogram &h) {
+  out += '"';
+  out += key;
+  out += "\":{"sv;
+  append_uint(out, "count"sv, h.count());
+  append_uint(out, "min"sv, h.min());
+  char buf[64];
+  int const n = std::snprintf(buf, sizeof(buf), "\"mean\":%.1f,", h.mean());
+  out.append(buf, static_cast<std::size_t>(n));
+  append_uint(out, "p50"sv, h.value_at_quantile(0.5));
+  append_uint(out, "p90"sv, h.value_at_quantile(0.9));
+  append_uint(out, "p99"sv, h.value_at_quantile(0.99));
+  append_uint(out, "p999"sv, h.value_at_quantile(0.999));
+  append_uint(out, "max"sv, h.max());
+  out.back() = '}';
+  out += ',';
+}
+
+}  // namespace
+
+namespace datadog::nginx::security {
+
+std::size_t HdrHistogram::index_for(std::uint64_t value) noexcept {
+  value = std::min(value, (std::uint64_t{1} << kMaxValueBits) - 1);
+  if (value < (1 << kSubBucketBits)) {
+    return static_cast<std::size_t>(value);
+  }
+  // shift such that the top kSubBucketBits bits are kept
+  unsigned const shift = static_cast<unsigned>(std::bit_width(value)) -
+                         kSubBucketBits;  // >= 1
+  auto const sub = static_cast<std::size_t>(value >> shift);  // [half, 2*half)
+  return (1 << kSubBucketBits) + (shift - 1) * kSubBucketHalf +
+         (sub - kSubBucketHalf);
+}
+
+std::uint64_t HdrHistogram::highest_equivalent(std::size_t index) noexcept {
+  if (index < (1 << kSubBucketBits)) {
+    return index;
+  }
+  index -= 1 << kSubBucketBits;
+  unsigned const shift = static_cast<unsigned>(index / kSubBucketHalf) + 1;
+  std::uint64_t const sub = index % kSubBucketHalf + kSubBucketHalf;
+  return ((sub + 1) << shift) - 1;
+}
+
+void HdrHistogram::record(std::uint64_t value) noexcept {
+  counts_[index_for(value)]++;
+  count_++;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += static_cast<double>(value);
+}
+
+double HdrHistogram::mean() const noexcept {
+  return count_ ? sum_ / static_cast<double>(count_) : 0.0;
+}
+
+std::uint64_t HdrHistogram::value_at_quantile(double q) const noexcept {
+  if (count_ == 0) {
+    return 0;
+  }
+  auto const rank =
+      static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(count_)));
+  auto const target = std::max<std::uint64_t>(1, rank);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < counts_.size(); i++) {
+    seen += counts_[i];
+    if (seen >= target) {
+      return std::min(highest_equivalent(i), max_);
+    }
+  }
+  return max_;
+}
+
+WafTelemetry &WafTelemetry::instance() {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static WafTelemetry telemetry;
+  return telemetry;
+}
+
+void WafTelemetry::record(const WafRunMetrics &metrics) noexcept {
+  requests_++;
+  runs_ += metrics.runs;
+  timeouts_ += metrics.timeouts;
+  if (metrics.timeouts > 0) {
+    requests_with_timeouts_++;
+  }
+  serialization_.record(to_us(metrics.serialization));
+  queue_wait_.record(to_us(metrics.queue_wait));
+  duration_.record(to_us(metrics.duration));
+  duration_ext_.record(to_us(metrics.duration_ext));
+}
+
+std::string WafTelemetry::to_json() const {
+  std::string out{"{"};
+  append_uint(out, "pid"sv, static_cast<std::uint64_t>(ngx_pid));
+  append_uint(out, "requests"sv, requests_);
+  append_uint(out, "waf_runs"sv, runs_);
+  append_uint(out, "timeouts"sv, timeouts_);
+  append_uint(out, "requests_with_timeouts"sv, requests_with_timeouts_);
+  append_histogram(out, "serialization_us"sv, serialization_);
+  append_histogram(out, "queue_wait_us"sv, queue_wait_);
+  append_histogram(out, "duration_us"sv, duration_);
+  append_histogram(out, "duration_ext_us"sv, duration_ext_);
+  out.back() = '}';
+  out += '\n';
+  return out;
+}
+
+ngx_int_t waf_status_handler(ngx_http_request_t *request) noexcept try {
+  if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  ngx_int_t rc = ngx_http_discard_request_body(request);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  // the stats of the worker that serves the request
+  std::string const body = WafTelemetry::instance().to_json();
+
+  request->headers_out.status = NGX_HTTP_OK;
+  ngx_str_set(&request->headers_out.content_type, "application/json");
+  request->headers_out.content_type_len =
+      request->headers_out.content_type.len;
+  request->headers_out.content_length_n = static_cast<off_t>(body.size());
+
+  rc = ngx_http_send_header(request);
+  if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+    return rc;
+  }
+
+  ngx_buf_t *b = ngx_create_temp_buf(request->pool, body.size());
+  if (b == nullptr) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->last = ngx_cpymem(b->last, body.data(), body.size());
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+
+  ngx_chain_t out{};
+  out.buf = b;
+  return ngx_http_output_filter(request, &out);
+} catch (const std::exception &e) {
+  ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                "waf status handler failed: %s", e.what());
+  return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+}  // namespace datadog::nginx::security
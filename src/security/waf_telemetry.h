@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+
+namespace datadog::nginx::security {
+
+// Time spent on the WAF by one request, over all its runs. Filled on the
+// thread pool and on the event loop thread, one after the other.
+struct WafRunMetrics {
+  // converting request/response data to WAF objects
+  std::chrono::nanoseconds serialization{};
+  // between a task being posted to the thread pool and a thread picking it up
+  std::chrono::nanoseconds queue_wait{};
+  // as reported by the WAF (ddwaf_result::total_runtime)
+  std::chrono::nanoseconds duration{};
+  // wall time of the ddwaf_run calls
+  std::chrono::nanoseconds duration_ext{};
+  std::uint32_t runs{};
+  std::uint32_t timeouts{};
+};
+
+// Log-linear histogram in the spirit of HdrHistogram: values are counted
+// exactly up to 127 and with 7 significant bits (< 1% error) above that, up
+// to 2^40. Recording is a couple of bit operations and an increment.
+class HdrHistogram {
+ public:
+  void record(std::uint64_t value) noexcept;
+
+  std::uint64_t count() const noexcept { return count_; }
+  std::uint64_t min() const noexcept { return count_ ? min_ : 0; }
+  std::uint64_t max() const noexcept { return max_; }
+  double mean() const noexcept;
+  // highest value equivalent to the one at the given quantile (0 to 1)
+  std::uint64_t value_at_quantile(double q) const noexcept;
+
+ private:
+  static constexpr unsigned kSubBucketBits = 7;
+  static constexpr unsigned kMaxValueBits = 40;
+  static constexpr std::size_t kSubBucketHalf = 1 << (kSubBucketBits - 1);
+  static constexpr std::size_t kNumCounts =
+      (1 << kSubBucketBits) + (kMaxValueBits - kSubBucketBits) * kSubBucketHalf;
+
+  static std::size_t index_for(std::uint64_t value) noexcept;
+  static std::uint64_t highest_equivalent(std::size_t index) noexcept;
+
+  std::array<std::uint64_t, kNumCounts> counts_{};
+  std::uint64_t count_{};
+  std::uint64_t min_{UINT64_MAX};
+  std::uint64_t max_{};
+  double sum_{};
+};
+
+// Per-worker aggregate of the WafRunMetrics of the requests it served.
+// Only accessed from the event loop thread.
+class WafTelemetry {
+ public:
+  static WafTelemetry &instance();
+
+  void record(const WafRunMetrics &metrics) noexcept;
+
+  // JSON document served by datadog_appsec_waf_status (values in µs)
+  std::string to_json() const;
+
+ private:
+  WafTelemetry() = default;
+
+  std::uint64_t requests_{};
+  std::uint64_t runs_{};
+  std::uint64_t timeouts_{};
+  std::uint64_t requests_with_timeouts_{};
+  HdrHistogram serialization_;
+  HdrHistogram queue_wait_;
+  HdrHistogram duration_;
+  HdrHistogram duration_ext_;
+};
+
+// content handler of the locations with datadog_appsec_waf_status
+ngx_int_t waf_status_handler(ngx_http_request_t *request) noexcept;
+
+}  // namespace datadog::nginx::security
@@ -0,0 +1,54 @@
+#include "trace_batch.h"
+
+#include <datadog/rate.h>
+#include <datadog/version.h>
+#include <rapidjson/document.h>
+
+namespace datadog {
+namespace nginx {
+
+void write_batch_header(std::string &batch, std::uint32_t num_chunks) {
+  batch[0] = static_cast<char>(0xdd);  // array 32
+  batch[1] = static_cast<char>(num_chunks >> 24);
+  batch[2] = static_cast<char>(num_chunks >> 16);
+  batch[3] = static_cast<char>(num_chunks >> 8);
+  batch[4] = static_cast<char>(num_chunks);
+}
+
+void set_batch_headers(dd::DictWriter &headers, std::size_t num_chunks) {
+  headers.set("Content-Type", "application/msgpack");
+  headers.set("Datadog-Meta-Lang", "cpp");
+  headers.set("Datadog-Meta-Tracer-Version", dd::tracer_version);
+  headers.set("X-Datadog-Trace-Count", std::to_string(num_chunks));
+}
+
+std::optional<dd::CollectorResponse> parse_agent_response(
+    std::string_view body) {
+  rapidjson::Document document;
+  document.Parse(body.data(), body.size());
+  if (document.HasParseError() || !document.IsObject()) {
+    return std::nullopt;
+  }
+  auto rates = document.FindMember("rate_by_service");
+  if (rates == document.MemberEnd() || !rates->value.IsObject()) {
+    return std::nullopt;
+  }
+
+  dd::CollectorResponse response;
+  for (const auto &member : rates->value.GetObject()) {
+    if (!member.value.IsNumber()) {
+      continue;
+    }
+    auto rate = dd::Rate::from(member.value.GetDouble());
+    if (rate.if_error() != nullptr) {
+      continue;
+    }
+    response.sample_rate_by_key.emplace(
+        std::string(member.name.GetString(), member.name.GetStringLength()),
+        *rate);
+  }
+  return response;
+}
+
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <datadog/collector_response.h>
+#include <datadog/dict_writer.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "dd.h"
+
+namespace datadog {
+namespace nginx {
+
+// Batches of serialized trace chunks for the agent's /v0.4/traces endpoint,
+// as sent by the collectors of this module (RingCollector, QueueCollector).
+//
+// A batch is a msgpack array of the chunks, which are arrays of spans. Its
+// header has a fixed size, so that it is written once the number of chunks
+// is known: a batch starts as kBatchHeaderSize placeholder bytes, to which
+// the chunks are appended.
+inline constexpr std::size_t kBatchHeaderSize = 5;
+
+// The agent accepts payloads of up to 50 MB; batches are kept well under it.
+inline constexpr std::size_t kMaxBatchSize = 4 * 1024 * 1024;
+
+void write_batch_header(std::string &batch, std::uint32_t num_chunks);
+
+// HTTP headers of a batch of `num_chunks` chunks
+void set_batch_headers(dd::DictWriter &headers, std::size_t num_chunks);
+
+// The sample rates by service of a response of the agent to a batch, for
+// TraceSampler::handle_collector_response. Nothing if the body has none.
+std::optional<dd::CollectorResponse> parse_agent_response(
+    std::string_view body);
+
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,105 @@
+#include "trace_queue.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace datadog {
+namespace nginx {
+
+TraceQueue::TraceQueue(std::size_t budget, drop_policy policy)
+    : budget_(budget), policy_(policy) {}
+
+TraceQueue::priority TraceQueue::priority_of(int sampling_priority) noexcept {
+  if (sampling_priority <= 0) {
+    return priority::DROP;
+  }
+  if (sampling_priority == 1) {
+    return priority::AUTO_KEEP;
+  }
+  return priority::USER_KEEP;
+}
+
+bool TraceQueue::push(std::string chunk, priority prio,
+                      std::size_t reserved) {
+  auto const index = static_cast<std::size_t>(prio);
+  std::size_t const size = chunk.size();
+  std::size_t const available = budget_ - std::min(reserved, budget_);
+
+  // what can be evicted to make room
+  std::size_t evictable = bytes_;
+  if (policy_ == drop_policy::LOWEST_PRIORITY) {
+    evictable = 0;
+    for (std::size_t i = 0; i <= index; i++) {
+      evictable += queue_bytes_[i];
+    }
+  }
+  if (size > available || bytes_ - evictable + size > available) {
+    stats_.dropped_rejected++;
+    return false;
+  }
+
+  while (bytes_ + size > available) {
+    if (policy_ == drop_policy::OLDEST) {
+      std::deque<Entry> *queue = oldest();
+      pop(static_cast<priority>(queue - queues_.data()));
+      stats_.dropped_oldest++;
+      continue;
+    }
+
+    std::size_t lowest = 0;
+    while (queues_[lowest].empty()) {
+      lowest++;
+    }
+    pop(static_cast<priority>(lowest));
+    if (lowest < index) {
+      stats_.dropped_lower_priority++;
+    } else {
+      stats_.dropped_oldest++;
+    }
+  }
+
+  queues_[index].push_back(Entry{next_sequence_++, std::move(chunk)});
+  queue_bytes_[index] += size;
+  bytes_ += size;
+  stats_.queued++;
+  return true;
+}
+
+std::size_t TraceQueue::drain(std::string &batch, std::size_t max_bytes) {
+  std::size_t count = 0;
+  while (std::deque<Entry> *queue = oldest()) {
+    std::string const &chunk = queue->front().chunk;
+    if (count != 0 && batch.size() + chunk.size() > max_bytes) {
+      break;
+    }
+    batch.append(chunk);
+    pop(static_cast<priority>(queue - queues_.data()));
+    count++;
+  }
+
+  stats_.drained += count;
+  return count;
+}
+
+std::deque<TraceQueue::Entry> *TraceQueue::oldest() {
+  std::deque<Entry> *result = nullptr;
+  for (auto &queue : queues_) {
+    if (!queue.empty() &&
+        (result == nullptr ||
+         queue.front().sequence < result->front().sequence)) {
+      result = &queue;
+    }
+  }
+  return result;
+}
+
+void TraceQueue::pop(priority prio) {
+  auto const index = static_cast<std::size_t>(prio);
+  std::size_t const size = queues_[index].front().chunk.size();
+  queues_[index].pop_front();
+  queue_bytes_[index] -= size;
+  bytes_ -= size;
+}
+
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+namespace datadog {
+namespace nginx {
+
+// Per-worker queue of serialized trace chunks waiting to be sent to the
+// agent, within a memory budget (datadog_trace_queue_size). When a chunk does
+// not fit, queued chunks are evicted according to the drop policy
+// (datadog_trace_queue_drop):
+//  - OLDEST: the oldest chunks, whatever their priority;
+//  - LOWEST_PRIORITY: the oldest chunks of the lowest priority, but never
+//    chunks of a higher priority than the new one. A new chunk that could
+//    only fit by evicting those is dropped instead, so that the traces kept
+//    by the user or by sampling rules (e.g. those with appsec events) are the
+//    last to go.
+//
+// Chunks are drained oldest first. Only accessed from the event loop.
+class TraceQueue {
+ public:
+  enum class drop_policy : ngx_uint_t {
+    OLDEST,
+    LOWEST_PRIORITY,
+  };
+
+  // from the sampling priority of the chunk
+  enum class priority : std::uint8_t {
+    DROP,       // <= 0: sent for the agent's stats only
+    AUTO_KEEP,  // 1
+    USER_KEEP,  // >= 2: rules, manual keep, appsec
+  };
+
+  struct Stats {
+    std::uint64_t queued;
+    std::uint64_t drained;
+    // evicted for a newer chunk of the same priority, or of any priority
+    // with the OLDEST policy
+    std::uint64_t dropped_oldest;
+    // evicted for a chunk of a higher priority
+    std::uint64_t dropped_lower_priority;
+    // new chunks that did not fit: larger than the available budget, or with
+    // only chunks of a higher priority to evict
+    std::uint64_t dropped_rejected;
+  };
+
+  TraceQueue(std::size_t budget, drop_policy policy);
+
+  static priority priority_of(int sampling_priority) noexcept;
+
+  // `reserved` bytes of the budget are held elsewhere (e.g. by batches being
+  // sent), and are not available to the queue.
+  // @return bool - false if the chunk was dropped.
+  bool push(std::string chunk, priority prio, std::size_t reserved);
+
+  // Appends chunks to `batch`, oldest first, as long as `batch` stays under
+  // `max_bytes` (a single chunk is always taken).
+  // @return std::size_t - The number of chunks appended.
+  std::size_t drain(std::string &batch, std::size_t max_bytes);
+
+  std::size_t budget() const noexcept { return budget_; }
+  // size of the queued chunks
+  std::size_t bytes() const noexcept { return bytes_; }
+  const Stats &stats() const noexcept { return stats_; }
+
+ private:
+  struct Entry {
+    std::uint64_t sequence;
+    std::string chunk;
+  };
+
+  static constexpr std::size_t kNumPriorities = 3;
+
+  // the queue holding the oldest chunk, or nullptr if empty
+  std::deque<Entry> *oldest();
+  // pops the front of the queue of `prio`
+  void pop(priority prio);
+
+  std::size_t budget_;
+  drop_policy policy_;
+  // one FIFO per priority; the sequence numbers give the order across them
+  std::array<std::deque<Entry>, kNumPriorities> queues_;
+  std::array<std::size_t, kNumPriorities> queue_bytes_{};
+  std::size_t bytes_{0};
+  std::uint64_t next_sequence_{0};
+  Stats stats_{};
+};
+
+}  // namespace nginx
+}  // namespace datadog
@@ -0,0 +1,335 @@
+#include "trace_ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+extern "C" {
+#include <ngx_cycle.h>
+#include <ngx_log.h>
+#include <ngx_process.h>
+#include <ngx_slab.h>
+#include <ngx_times.h>
+}
+
+namespace datadog {
+namespace nginx {
+namespace {
+
+std::uint64_t lease_of(ngx_pid_t pid, time_t expiry) {
+  return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(pid)) << 32) |
+         static_cast<std::uint32_t>(expiry);
+}
+
+ngx_pid_t lease_pid(std::uint64_t lease) {
+  return static_cast<ngx_pid_t>(lease >> 32);
+}
+
+time_t lease_expiry(std::uint64_t lease) {
+  return static_cast<time_t>(lease & 0xffffffff);
+}
+
+// A ticket whose chunk is still not written after this long is skipped: its
+// worker died while writing it.
+constexpr time_t kStallSecs = 2;
+
+// ticket that a drain stopped at, in this worker, and since when
+std::uint64_t stalled_ticket = UINT64_MAX;  // NOLINT
+time_t stalled_since = 0;                   // NOLINT
+
+}  // namespace
+
+TraceRing::Ring *TraceRing::ring_{nullptr};
+
+ngx_int_t TraceRing::init_zone(ngx_shm_zone_t *zone, void *data) noexcept {
+  if (data != nullptr) {
+    // configuration reload with an unchanged zone: keep the pending chunks
+    zone->data = data;
+    return NGX_OK;
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto *shpool = reinterpret_cast<ngx_slab_pool_t *>(zone->shm.addr);
+  if (zone->shm.exists) {
+    zone->data = shpool->data;
+    return NGX_OK;
+  }
+
+  // the slots take at most three quarters of the zone, the rest is left for
+  // the ring and the slab allocator bookkeeping
+  std::size_t const num_slots = zone->shm.size / 4 * 3 / sizeof(Slot);
+  if (num_slots == 0) {
+    ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0,
+                  "trace ring zone %V is too small", &zone->shm.name);
+    return NGX_ERROR;
+  }
+
+  auto *ring = static_cast<Ring *>(ngx_slab_calloc(shpool, sizeof(Ring)));
+  void *slots_mem = ngx_slab_calloc(shpool, num_slots * sizeof(Slot));
+  if (ring == nullptr || slots_mem == nullptr) {
+    ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0,
+                  "could not allocate the trace ring in zone %V",
+                  &zone->shm.name);
+    return NGX_ERROR;
+  }
+
+  auto *slots = static_cast<Slot *>(slots_mem);
+  for (std::size_t i = 0; i < num_slots; i++) {
+    new (&slots[i]) Slot{};
+  }
+  ring->num_slots = num_slots;
+  ring->slots = slots;
+
+  shpool->data = ring;
+  zone->data = ring;
+
+  ngx_log_error(NGX_LOG_INFO, zone->shm.log, 0,
+                "trace ring zone %V holds up to %uz trace chunks",
+                &zone->shm.name, num_slots);
+
+  return NGX_OK;
+}
+
+void TraceRing::initialize(const datadog_main_conf_t &conf) {
+  if (conf.trace_ring_zone == nullptr) {
+    ring_ = nullptr;
+    return;
+  }
+
+  ring_ = static_cast<Ring *>(conf.trace_ring_zone->data);
+}
+
+bool TraceRing::push(std::string_view chunk) noexcept {
+  if (chunk.size() > kSlotSize) {
+    ring_->dropped_oversized.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  std::uint64_t const ticket =
+      ring_->write.fetch_add(1, std::memory_order_relaxed);
+  Slot &slot = ring_->slots[ticket % ring_->num_slots];
+
+  // The chunk that the slot held is overwritten, drained or not: the reader
+  // counts the chunks it did not get as it goes past their tickets.
+  std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+  do {
+    if (sequence > 2 * ticket) {
+      // taken for a newer ticket already, which the reader sees
+      return false;
+    }
+    if ((sequence & 1) != 0) {
+      // an older chunk is still being written: leave a tombstone, otherwise
+      // the reader would wait for this ticket until it gives up on it
+      std::uint64_t abandoned = slot.abandoned.load(std::memory_order_relaxed);
+      while (abandoned < ticket + 1 &&
+             !slot.abandoned.compare_exchange_weak(
+                 abandoned, ticket + 1, std::memory_order_release)) {
+      }
+      return false;
+    }
+  } while (!slot.sequence.compare_exchange_weak(sequence, 2 * ticket + 1,
+                                                std::memory_order_acq_rel));
+
+  std::memcpy(slot.data, chunk.data(), chunk.size());
+  slot.size.store(static_cast<std::uint32_t>(chunk.size()),
+                  std::memory_order_relaxed);
+  slot.sequence.store(2 * ticket + 2, std::memory_order_release);
+
+  ring_->pushed.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+std::size_t TraceRing::drain(std::string &batch, std::size_t max_bytes) {
+  std::size_t count = 0;
+  for (;;) {
+    std::uint64_t ticket = ring_->read.load(std::memory_order_acquire);
+    std::uint64_t const write = ring_->write.load(std::memory_order_acquire);
+    if (ticket >= write) {
+      break;
+    }
+
+    if (write - ticket > ring_->num_slots) {
+      // lapped: the slots of the tickets before `write - num_slots` were all
+      // taken again, so go past them at once
+      std::uint64_t const oldest = write - ring_->num_slots;
+      if (ring_->read.compare_exchange_strong(ticket, oldest,
+                                              std::memory_order_acq_rel)) {
+        ring_->dropped_oldest.fetch_add(oldest - ticket,
+                                        std::memory_order_relaxed);
+      }
+      continue;
+    }
+
+    Slot &slot = ring_->slots[ticket % ring_->num_slots];
+    std::uint64_t const sequence =
+        slot.sequence.load(std::memory_order_acquire);
+
+    if (sequence < 2 * ticket + 2 &&
+        slot.abandoned.load(std::memory_order_acquire) >= ticket + 1) {
+      // its writer gave up on it
+      if (ring_->read.compare_exchange_strong(ticket, ticket + 1,
+                                              std::memory_order_acq_rel)) {
+        ring_->dropped_contended.fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+
+    if (sequence < 2 * ticket + 2) {
+      // not written yet; skipped if its writer does not finish
+      if (ticket != stalled_ticket) {
+        stalled_ticket = ticket;
+        stalled_since = ngx_time();
+        break;
+      }
+      if (ngx_time() - stalled_since < kStallSecs) {
+        break;
+      }
+      if (ring_->read.compare_exchange_strong(ticket, ticket + 1,
+                                              std::memory_order_acq_rel)) {
+        ring_->dropped_contended.fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+
+    if (sequence > 2 * ticket + 2) {
+      // overwritten by a newer chunk, as the writers lapped the reader
+      if (ring_->read.compare_exchange_strong(ticket, ticket + 1,
+                                              std::memory_order_acq_rel)) {
+        ring_->dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+
+    std::size_t const size = slot.size.load(std::memory_order_relaxed);
+    if (count != 0 && batch.size() + size > max_bytes) {
+      break;
+    }
+
+    std::size_t const old_size = batch.size();
+    batch.append(reinterpret_cast<const char *>(slot.data),
+                 std::min(size, kSlotSize));
+    // the copy is only valid if no writer took the slot meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+      // overwritten while being copied
+      batch.resize(old_size);
+      if (ring_->read.compare_exchange_strong(ticket, ticket + 1,
+                                              std::memory_order_acq_rel)) {
+        ring_->dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+      }
+      continue;
+    }
+    if (!ring_->read.compare_exchange_strong(ticket, ticket + 1,
+                                             std::memory_order_acq_rel)) {
+      // drained by another worker that was the flusher until now
+      batch.resize(old_size);
+      continue;
+    }
+    count++;
+  }
+
+  ring_->drained.fetch_add(count, std::memory_order_relaxed);
+  return count;
+}
+
+bool TraceRing::lead(time_t lease_secs) noexcept {
+  time_t const now = ngx_time();
+  std::uint64_t lease = ring_->lease.load(std::memory_order_acquire);
+  for (;;) {
+    if (lease_pid(lease) != ngx_pid && lease != 0 &&
+        lease_expiry(lease) >= now) {
+      return false;
+    }
+    if (ring_->lease.compare_exchange_weak(lease,
+                                           lease_of(ngx_pid, now + lease_secs),
+                                           std::memory_order_acq_rel)) {
+      return true;
+    }
+  }
+}
+
+void TraceRing::resign() noexcept {
+  std::uint64_t lease = ring_->lease.load(std::memory_order_acquire);
+  if (lease_pid(lease) == ngx_pid) {
+    ring_->lease.compare_exchange_strong(lease, 0, std::memory_order_acq_rel);
+  }
+}
+
+void TraceRing::record_batch(std::size_t chunks, bool sent) noexcept {
+  ring_->batches.fetch_add(1, std::memory_order_relaxed);
+  if (!sent) {
+    ring_->dropped_unsent.fetch_add(chunks, std::memory_order_relaxed);
+  }
+}
+
+void TraceRing::publish_rates(std::string_view response) noexcept {
+  if (response.size() > kRatesSize) {
+    return;
+  }
+
+  // only the flusher publishes, so there is a single writer
+  std::uint64_t const sequence =
+      ring_->rates_sequence.load(std::memory_order_relaxed);
+  ring_->rates_sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(ring_->rates, response.data(), response.size());
+  ring_->rates_size.store(static_cast<std::uint32_t>(response.size()),
+                          std::memory_order_relaxed);
+  ring_->rates_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::string TraceRing::rates_since(std::uint64_t &generation) {
+  std::uint64_t const sequence =
+      ring_->rates_sequence.load(std::memory_order_acquire);
+  if (sequence == generation || (sequence & 1) != 0) {
+    return {};
+  }
+
+  std::size_t const size =
+      std::min<std::size_t>(ring_->rates_size.load(std::memory_order_relaxed),
+                            kRatesSize);
+  std::string response(ring_->rates, size);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (ring_->rates_sequence.load(std::memory_order_relaxed) != sequence) {
+    // being published; picked up next time
+    return {};
+  }
+
+  generation = sequence;
+  return response;
+}
+
+TraceRing::Stats TraceRing::stats() noexcept {
+  auto load = [](const std::atomic<std::uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  std::uint64_t const write = load(ring_->write);
+  std::uint64_t const read = load(ring_->read);
+  return Stats{
+      .pushed = load(ring_->pushed),
+      .drained = load(ring_->drained),
+      .dropped_oldest = load(ring_->dropped_oldest),
+      .dropped_oversized = load(ring_->dropped_oversized),
+      .dropped_contended = load(ring_->dropped_contended),
+      .dropped_unsent = load(ring_->dropped_unsent),
+      .batches = load(ring_->batches),
+      .pending = write > read ? std::min<std::uint64_t>(write - read,
+                                                        ring_->num_slots)
+                              : 0,
+      .capacity = ring_->num_slots,
+  };
+}
+
+void TraceRing::log_stats(ngx_log_t &log) {
+  Stats const s = stats();
+  ngx_log_error(NGX_LOG_NOTICE, &log, 0,
+                "trace ring: %uL pushed, %uL drained in %uL batches, "
+                "%uL/%uz pending, dropped: %uL oldest, %uL oversized, "
+                "%uL contended, %uL unsent",
+                s.pushed, s.drained, s.batches, s.pending, s.capacity,
+                s.dropped_oldest, s.dropped_oversized, s.dropped_contended,
+                s.dropped_unsent);
+}
+
+}  // namespace nginx
+}  // namespace datadog
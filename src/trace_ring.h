@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "datadog_conf.h"
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+namespace datadog {
+namespace nginx {
+
+// Cross-worker ring of serialized trace chunks, in a shared memory zone
+// (datadog_trace_ring_zone). Every worker appends the chunks it finishes, and
+// a single worker, holding a lease renewed at each flush, drains them into
+// large batches for the agent.
+//
+// The ring has fixed-size slots, claimed with a ticket taken from a shared
+// counter. When the ring is full, a new chunk overwrites the oldest one that
+// was not drained yet. Readers copy a slot and check its sequence number
+// afterwards, so that a slot overwritten meanwhile is skipped. Nothing blocks:
+// a chunk that does not fit a slot, or whose slot is being written by another
+// worker, is dropped, and its ticket marked as such. The reader goes through
+// every ticket still in the ring, and counts the chunks it does not get.
+class TraceRing {
+ public:
+  // largest serialized chunk
+  static constexpr std::size_t kSlotSize = 16 * 1024;
+
+  struct Stats {
+    std::uint64_t pushed;
+    std::uint64_t drained;
+    // overwritten before being drained
+    std::uint64_t dropped_oldest;
+    std::uint64_t dropped_oversized;
+    // never written: the slot was being written by another worker, or the
+    // worker died while writing it
+    std::uint64_t dropped_contended;
+    // lost in batches the agent did not accept
+    std::uint64_t dropped_unsent;
+    std::uint64_t batches;
+    // chunks waiting in the ring
+    std::uint64_t pending;
+    std::size_t capacity;
+  };
+
+  // shared memory zone initializer (ngx_shm_zone_t::init)
+  static ngx_int_t init_zone(ngx_shm_zone_t *zone, void *data) noexcept;
+
+  // called in each worker after the zone has been mapped
+  static void initialize(const datadog_main_conf_t &conf);
+
+  static bool enabled() noexcept { return ring_ != nullptr; }
+
+  // Copies `chunk` into the ring.
+  // @return bool - false if the chunk was dropped.
+  static bool push(std::string_view chunk) noexcept;
+
+  // Appends chunks to `batch`, oldest first, as long as `batch` stays under
+  // `max_bytes` (a single chunk is always taken).
+  // @return std::size_t - The number of chunks appended.
+  static std::size_t drain(std::string &batch, std::size_t max_bytes);
+
+  // Whether this worker is the flusher. The lease is taken if it is free or
+  // expired, and is extended by `lease_secs` otherwise.
+  static bool lead(time_t lease_secs) noexcept;
+  // gives the lease up, if held, so that another worker takes over at once
+  static void resign() noexcept;
+
+  // counts a batch of `chunks` sent to the agent, which may have failed
+  static void record_batch(std::size_t chunks, bool sent) noexcept;
+
+  // Publishes the body of the last agent response, which has the sample
+  // rates by service, to the other workers. Bodies larger than the space
+  // reserved for them are not published.
+  static void publish_rates(std::string_view response) noexcept;
+  // The last published response, if newer than `generation`, which is then
+  // updated. Empty otherwise.
+  static std::string rates_since(std::uint64_t &generation);
+
+  static Stats stats() noexcept;
+  static void log_stats(ngx_log_t &log);
+
+ private:
+  struct Slot {
+    // 2t+1 while the chunk of ticket t is written, 2t+2 once it is written
+    std::atomic<std::uint64_t> sequence;
+    // t+1 for the latest ticket t whose writer gave the slot up because an
+    // older writer held it, so that the reader skips t without waiting
+    std::atomic<std::uint64_t> abandoned;
+    std::atomic<std::uint32_t> size;
+    u_char data[kSlotSize];
+  };
+
+  static constexpr std::size_t kRatesSize = 4096;
+
+  // allocated in the zone; the mapping is inherited by the workers, so the
+  // pointer is valid in all of them
+  struct Ring {
+    // next ticket to write, and next ticket to read
+    std::atomic<std::uint64_t> write;
+    std::atomic<std::uint64_t> read;
+    // pid of the flusher in the high 32 bits, end of its lease (seconds) in
+    // the low 32 bits
+    std::atomic<std::uint64_t> lease;
+
+    std::atomic<std::uint64_t> pushed;
+    std::atomic<std::uint64_t> drained;
+    std::atomic<std::uint64_t> dropped_oldest;
+    std::atomic<std::uint64_t> dropped_oversized;
+    std::atomic<std::uint64_t> dropped_contended;
+    std::atomic<std::uint64_t> dropped_unsent;
+    std::atomic<std::uint64_t> batches;
+
+    // last agent response, behind a sequence number as the slots are
+    std::atomic<std::uint64_t> rates_sequence;
+    std::atomic<std::uint32_t> rates_size;
+    char rates[kRatesSize];
+
+    std::size_t num_slots;
+    Slot *slots;
+  };
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+
+  static Ring *ring_;  // NOLINT
+};
+
+}  // namespace nginx
+}  // namespace datadog
@@ -24,11 +24,17 @@ extern "C" {
 #include "datadog_conf.h"
 #include "dd.h"
 #include "ngx_event_scheduler.h"
+#include "ngx_http_client.h"
 #include "ngx_logger.h"
+#include "queue_collector.h"
+#include "ring_collector.h"
 #ifdef WITH_WAF
+#include "security/remote_cfg_relay.h"
 #include "security/waf_remote_cfg.h"
 #endif
 #include "string_util.h"
+#include "trace_queue.h"
+#include "trace_ring.h"
 
 namespace datadog {
 namespace nginx {
@@ -37,7 +43,12 @@ dd::Expected<dd::Tracer> TracingLibrary::make_tracer(
     const datadog_main_conf_t &nginx_conf, std::shared_ptr<dd::Logger> logger) {
   dd::TracerConfig config;
   config.logger = std::move(logger);
-  config.agent.event_scheduler = std::make_shared<NgxEventScheduler>();
+  auto event_scheduler = std::make_shared<NgxEventScheduler>();
+  config.agent.event_scheduler = event_scheduler;
+  // Requests to the agent are sent from the event loop, rather than from a
+  // libcurl thread. The nginx HTTP client does not support TLS.
+  auto http_client = std::make_shared<NgxHTTPClient>();
+  config.agent.http_client = http_client;
   config.integration_name = "nginx";
   config.integration_version = NGINX_VERSION;
 
@@ -92,6 +103,34 @@ dd::Expected<dd::Tracer> TracingLibrary::make_tracer(
         !has_custom_ruleset,         // no custom ruleset => ruleset via rem cfg
         !appsec_enabling_explicit);  // no explicit => control via rem cfg
   }
+
+  // With datadog_appsec_remote_config_zone, only the first worker polls the
+  // agent. It relays the responses it gets, with which the other workers
+  // answer the polls of their tracer instead of sending them.
+  if (security::RemoteConfigRelay::enabled()) {
+    auto is_remote_config = [](const dd::HTTPClient::URL &url) {
+      return url.path.ends_with("/v0.7/config");
+    };
+    if (security::RemoteConfigRelay::is_poller()) {
+      http_client->set_tap([is_remote_config](const dd::HTTPClient::URL &url,
+                                              int status,
+                                              std::string_view body) {
+        if (status == 200 && is_remote_config(url)) {
+          security::RemoteConfigRelay::publish_response(body);
+        }
+      });
+    } else {
+      http_client->set_shortcut(
+          [is_remote_config](const dd::HTTPClient::URL &url,
+                             std::string_view body)
+              -> std::optional<std::string> {
+            if (!is_remote_config(url)) {
+              return std::nullopt;
+            }
+            return security::RemoteConfigRelay::answer(body);
+          });
+    }
+  }
 #endif
 
   auto final_config = dd::finalize_config(config);
@@ -99,6 +138,42 @@ dd::Expected<dd::Tracer> TracingLibrary::make_tracer(
     return final_config.error();
   }
 
+  // The agent's URL is only known once finalized: the environment
+  // (DD_TRACE_AGENT_URL, DD_AGENT_HOST, DD_TRACE_AGENT_PORT) takes precedence
+  // over datadog_agent_url.
+  const dd::HTTPClient::URL url =
+      std::get<dd::FinalizedDatadogAgentConfig>(final_config->collector).url;
+  const bool agent_over_tls = (url.scheme == "https");
+  const bool bounded_queue = nginx_conf.trace_queue_size != NGX_CONF_UNSET_SIZE;
+  if (agent_over_tls) {
+    if (TraceRing::enabled() || bounded_queue) {
+      config.logger->log_error(
+          "datadog_trace_ring_zone and datadog_trace_queue_size are ignored: "
+          "they do not support agents reached over https");
+    }
+    // let dd-trace-cpp use its default, libcurl based, client
+    config.agent.http_client = nullptr;
+  } else if (TraceRing::enabled()) {
+    // the ring is bounded by its zone already
+    config.collector = std::make_shared<RingCollector>(
+        url, http_client, event_scheduler, config.logger);
+  } else if (bounded_queue) {
+    const auto policy =
+        nginx_conf.trace_queue_drop == NGX_CONF_UNSET_UINT
+            ? TraceQueue::drop_policy::OLDEST
+            : static_cast<TraceQueue::drop_policy>(nginx_conf.trace_queue_drop);
+    config.collector = std::make_shared<QueueCollector>(
+        url, nginx_conf.trace_queue_size, policy, http_client, event_scheduler,
+        config.logger);
+  } else {
+    return dd::Tracer(*final_config);
+  }
+
+  final_config = dd::finalize_config(config);
+  if (!final_config) {
+    return final_config.error();
+  }
+
   return dd::Tracer(*final_config);
 }
 
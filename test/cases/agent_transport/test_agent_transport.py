@@ -0,0 +1,164 @@
+from .. import case
+from .. import formats
+
+from pathlib import Path
+import re
+import tempfile
+import time
+import uuid
+
+# logged by the mock agent for the requests sent with a "/transport/<token>"
+# prefix
+TRANSPORT_PATTERN = re.compile(
+    r'Transport (?P<token>\S+): (?P<path>\S+) on connection '
+    r'(?P<connection>\d+)')
+
+# logged by the module when a request to the agent fails
+FAILURE = 'request to the Datadog Agent at'
+
+
+class TestAgentTransport(case.TestCase):
+    """The requests of the tracer (traces, remote configuration polls,
+    telemetry) are sent from the event loop of the worker, over keep-alive
+    connections to the agent. Remote configuration is polled every second in
+    the test environment, which keeps those connections busy.
+    """
+
+    def run_nginx(self, agent_url, numbers, seconds=4, during=None):
+        """Run nginx with the specified `agent_url` for about `seconds`, send
+        it a request for each of the specified `numbers`, and call `during`,
+        if any, meanwhile. Return the error log of nginx and the log lines of
+        the agent.
+        """
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        extra_env = {'DD_TRACE_AGENT_URL': agent_url}
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        with tempfile.NamedTemporaryFile(mode='w+') as error_log:
+            with self.orch.custom_nginx(conf_path.read_text(),
+                                        extra_env,
+                                        healthcheck_port=8080,
+                                        error_log=error_log):
+                if during is not None:
+                    during()
+                for n in numbers:
+                    status, _, _ = self.orch.send_nginx_http_request(
+                        f'/http?n={n}', port=8080)
+                    self.assertEqual(status, 200)
+                time.sleep(seconds)
+            error_log_text = Path(error_log.name).read_text()
+
+        return error_log_text, self.orch.sync_service('agent')
+
+    def received_request_numbers(self, log_lines):
+        seen = set()
+        for line in log_lines:
+            segments = formats.parse_trace(line)
+            if segments is None:
+                continue
+            for segment in segments:
+                for span in segment:
+                    if span['service'] != 'nginx':
+                        continue
+                    seen.add(span['meta'].get('request.number'))
+        return seen
+
+    def transport_requests(self, log_lines, token):
+        """Return the (path, connection number) of each request logged by the
+        agent for `token`, in order.
+        """
+        requests = []
+        for line in log_lines:
+            match = TRANSPORT_PATTERN.search(line)
+            if match is None or match['token'] != token:
+                continue
+            requests.append((match['path'], int(match['connection'])))
+        return requests
+
+    def test_connections_are_reused(self):
+        """Verify that a worker sends its requests over at most two
+        connections, which stay open between requests.
+        """
+        token = str(uuid.uuid4())
+        numbers = {'1', '2', '3'}
+        error_log, log_lines = self.run_nginx(
+            f'http://agent:8126/transport/{token}', numbers)
+
+        requests = self.transport_requests(log_lines, token)
+        context = {'requests': requests, 'error_log': error_log}
+        self.assertGreaterEqual(len(requests), 5, context)
+        self.assertLessEqual(len({conn for _, conn in requests}), 2, context)
+        self.assertNotIn(FAILURE, error_log)
+        self.assertLessEqual(numbers, self.received_request_numbers(log_lines))
+
+    def test_request_retried_on_closed_connection(self):
+        """Verify that a request sent on a keep-alive connection that the agent
+        closed is sent again on a new connection, without an error.
+        """
+        token = str(uuid.uuid4())
+        numbers = {'1', '2', '3'}
+        error_log, log_lines = self.run_nginx(
+            f'http://agent:8126/transport/{token}/drop_reused', numbers)
+
+        dropped = [line for line in log_lines if line.startswith('Dropped ')]
+        requests = self.transport_requests(log_lines, token)
+        context = {'requests': requests, 'error_log': error_log}
+        self.assertGreaterEqual(len(dropped), 1, context)
+        self.assertNotIn(FAILURE, error_log)
+        self.assertLessEqual(numbers, self.received_request_numbers(log_lines))
+
+    def test_chunked_responses(self):
+        """Verify that responses sent in chunks are decoded, and that their
+        connection is reused afterwards.
+        """
+        token = str(uuid.uuid4())
+        numbers = {'1', '2', '3'}
+        error_log, log_lines = self.run_nginx(
+            f'http://agent:8126/transport/{token}/chunked', numbers)
+
+        requests = self.transport_requests(log_lines, token)
+        context = {'requests': requests, 'error_log': error_log}
+        self.assertGreaterEqual(len(requests), 5, context)
+        self.assertLessEqual(len({conn for _, conn in requests}), 2, context)
+        self.assertNotIn(FAILURE, error_log)
+        self.assertLessEqual(numbers, self.received_request_numbers(log_lines))
+
+    def test_unix_socket(self):
+        """Verify that traces reach an agent given as a unix domain socket."""
+        numbers = {'1', '2', '3'}
+        error_log, log_lines = self.run_nginx(
+            'unix:///var/run/datadog/apm.socket', numbers, seconds=1)
+
+        self.assertNotIn(FAILURE, error_log)
+        self.assertLessEqual(numbers, self.received_request_numbers(log_lines))
+
+    def test_agent_restart(self):
+        """Verify that once the agent is back from a restart, which closed all
+        of the connections, requests are sent on new connections.
+        """
+        token = str(uuid.uuid4())
+
+        def restart():
+            # a few requests before the restart
+            time.sleep(3)
+            self.assertEqual(self.orch.restart_agent(2000), 200)
+            time.sleep(3)
+
+        numbers = {'1', '2', '3'}
+        error_log, log_lines = self.run_nginx(
+            f'http://agent:8126/transport/{token}', numbers, during=restart)
+
+        restarted = next(i for i, line in enumerate(log_lines)
+                         if line.startswith('Restarted'))
+        before = self.transport_requests(log_lines[:restarted], token)
+        after = self.transport_requests(log_lines[restarted:], token)
+        context = {'before': before, 'after': after, 'error_log': error_log}
+        self.assertGreaterEqual(len(before), 1, context)
+        self.assertGreaterEqual(len(after), 1, context)
+        connections_before = {conn for _, conn in before}
+        connections_after = {conn for _, conn in after}
+        self.assertEqual(connections_before & connections_after, set(),
+                         context)
+        self.assertLessEqual(numbers, self.received_request_numbers(log_lines))
@@ -10,6 +10,7 @@ import os
 from pathlib import Path
 import queue
 import re
+import shlex
 import shutil
 import signal
 import subprocess
@@ -544,6 +545,47 @@ class Orchestration:
                                      method=method)
         return fields["response_code"], headers, body
 
+    def send_nginx_http_request_bursts(self,
+                                       bursts,
+                                       port=80,
+                                       headers={},
+                                       pause_seconds=0.3):
+        """Send bursts of "GET" requests to nginx, one after the other, and
+        return the list of the HTTP status codes of all the requests.
+
+        `bursts` is a list of lists of paths. The requests of a burst are sent
+        by a single curl command, over one connection, so that they are only
+        milliseconds apart. There is a pause of `pause_seconds` between two
+        bursts. All of it runs from one `docker compose exec`, which would
+        otherwise take much longer than the pauses.
+        """
+        header_args = " ".join(f"--header {shlex.quote(f'{name}: {value}')}"
+                               for name, value in headers.items())
+        script = ""
+        for i, paths in enumerate(bursts):
+            if i != 0:
+                script += f"sleep {pause_seconds}\n"
+            urls = " ".join("--output /dev/null " +
+                            shlex.quote(f"http://nginx:{port}{path}")
+                            for path in paths)
+            script += ("curl --silent --show-error "
+                       f"--write-out '%{{response_code}}\\n' {header_args} "
+                       f"{urls}\n")
+
+        print("fetching", bursts, file=self.verbose, flush=True)
+        command = docker_compose_command("exec", "-T", "--", "client",
+                                         "/bin/sh")
+        result = subprocess.run(
+            command,
+            input=script,
+            stdout=subprocess.PIPE,
+            stderr=self.verbose,
+            env=child_env(),
+            encoding="utf8",
+            check=True,
+        )
+        return [int(line) for line in result.stdout.split()]
+
     def setup_remote_config_payload(self, payload):
         """Sets up the next remote config response"""
         url = f"http://agent:8126/save_rem_cfg_resp"
@@ -554,6 +596,18 @@ class Orchestration:
                                      method="POST")
         return fields["response_code"], headers, body
 
+    def restart_agent(self, milliseconds):
+        """Make the agent close all of its connections, and refuse new ones
+        for the specified number of `milliseconds`, as if it restarted.
+        """
+        url = f"http://agent:8126/restart/{milliseconds}"
+        print("posting", url, file=self.verbose, flush=True)
+        fields, _, _ = curl(url, {},
+                            body="",
+                            stderr=self.verbose,
+                            method="POST")
+        return fields["response_code"]
+
     def send_nginx_grpc_request(self, symbol, port=1337):
         """Send an empty gRPC request to the nginx endpoint at "/", where
         the gRPC request is named by `symbol`, which has the form
@@ -820,7 +874,11 @@ END_CONF
         )
 
     @contextlib.contextmanager
-    def custom_nginx(self, nginx_conf, extra_env=None, healthcheck_port=None):
+    def custom_nginx(self,
+                     nginx_conf,
+                     extra_env=None,
+                     healthcheck_port=None,
+                     error_log=None):
         """Yield a managed `Popen` object referring to a new instance of nginx
         running in the nginx service container, where the new instance uses the
         specified `nginx_conf` and has in its environment the optionally
@@ -829,6 +887,9 @@ END_CONF
         Optionally specify an integer `healthcheck_port` at which the
         "/healthcheck" endpoint will be polled in order to determine when the
         nginx instance is ready.
+        Optionally specify a file object `error_log` to which the error log of
+        the nginx instance (notice level and above) is written, instead of to
+        the verbose output.
         """
         # "-T" means "don't allocate a TTY".  This is necessary to avoid the
         # error "the input device is not a TTY".
@@ -888,7 +949,7 @@ END_CONF
             command,
             stdin=subprocess.DEVNULL,
             stdout=self.verbose,
-            stderr=self.verbose,
+            stderr=self.verbose if error_log is None else error_log,
             env=child_env(),
         )
 
@@ -1,3 +1,4 @@
+import gzip
 import hashlib
 import time
 import string
@@ -295,10 +296,8 @@ class TestRUMInjection(case.TestCase):
 
     def test_proxy_injection(self):
         """
-        Verify the module can inject on proxy request.
-
-        Also verify the plugin set `x-datadog-sdk-injection` to signal
-        downstream to let it NGINX inject the RUM SDK.
+        Verify the module can inject on proxy request, without adding headers
+        to the request sent upstream.
         """
         service = {"host": "localhost", "port": 8081}
 
@@ -335,8 +334,182 @@ class TestRUMInjection(case.TestCase):
 
         self.assertEqual(status, 200)
         self.assertInjection(headers, body)
-        self.assertTrue(injection_header is not None)
-        self.assertEqual(injection_header, "1")
+        self.assertTrue(injection_header is None)
+
+    def test_no_injection_when_upstream_injected(self):
+        """
+        Verify the SDK is not injected again in a response an upstream nginx
+        already injected it in.
+        """
+        service = {"host": "localhost", "port": 8081}
+        page = "<html><head></head><body>Hello, Mars!</body></html>"
+
+        @Request.application
+        def app(request: Request) -> Response:
+            response = Response(page, 200, content_type="text/html")
+            response.headers["x-datadog-rum-injected"] = "1"
+            return response
+
+        s = make_server(service["host"], service["port"], app)
+        t = Thread(target=s.serve_forever)
+        t.start()
+
+        status, lines = self.load_conf("rum_enabled.conf")
+        self.assertEqual(0, status, lines)
+
+        status, headers, body = self.orch.send_nginx_http_request("/proxy")
+
+        s.shutdown()
+        t.join()
+
+        headers = self.make_dict_headers(headers)
+        self.assertEqual(status, 200)
+        self.assertEqual(body, page)
+        self.assertEqual(headers["content-length"], str(len(page)))
+
+    def test_injection_after_large_head(self):
+        """
+        Verify the SDK is injected once, at the end of the head, when the
+        head spans many buffers and most of the page skips the injector.
+        """
+        service = {"host": "localhost", "port": 8081}
+
+        before = "<!DOCTYPE html>\n<html>\n<head>\n" + "".join(
+            f'<link rel="stylesheet" href="/static/{i}.css">\n'
+            for i in range(4000))
+        after = "</head>\n<body>\n" + "".join(
+            f"<div><h1>{i}</h1><b>Hello, Mars!</b></div>\n"
+            for i in range(4000)) + "</body>\n</html>\n"
+
+        @Request.application
+        def app(request: Request) -> Response:
+            return Response(before + after, 200, content_type="text/html")
+
+        s = make_server(service["host"], service["port"], app)
+        t = Thread(target=s.serve_forever)
+        t.start()
+
+        status, lines = self.load_conf("rum_enabled.conf")
+        self.assertEqual(0, status, lines)
+
+        status, headers, body = self.orch.send_nginx_http_request("/proxy")
+
+        s.shutdown()
+        t.join()
+
+        self.assertEqual(status, 200)
+        self.assertInjection(headers, body)
+        self.assertTrue(body.startswith(before))
+        self.assertTrue(body.endswith(after))
+        self.assertEqual(1, body.count("datadog-rum.js"))
+        self.assertEqual(
+            int(self.make_dict_headers(headers)["content-length"]),
+            len(body.encode("utf8")))
+
+    def test_gzip_injection(self):
+        """
+        Verify the SDK is injected in a gzip encoded response with
+        `datadog_rum_gzip on`, and that the page survives being decompressed
+        and compressed again.
+        """
+        service = {"host": "localhost", "port": 8081}
+
+        before = "<!DOCTYPE html>\n<html>\n<head>\n<title>Service</title>\n"
+        after = "</head>\n<body>\n" + "".join(
+            f"<p>{i}: Hello, Mars!</p>\n"
+            for i in range(20000)) + "</body>\n</html>\n"
+
+        @Request.application
+        def app(request: Request) -> Response:
+            response = Response(gzip.compress((before + after).encode()),
+                                200,
+                                content_type="text/html")
+            response.headers["Content-Encoding"] = "gzip"
+            return response
+
+        s = make_server(service["host"], service["port"], app)
+        t = Thread(target=s.serve_forever)
+        t.start()
+
+        status, lines = self.load_conf("rum_enabled.conf")
+        self.assertEqual(0, status, lines)
+
+        status, headers, body = self.orch.send_nginx_http_request(
+            "/proxy-gzip")
+
+        s.shutdown()
+        t.join()
+
+        headers = self.make_dict_headers(headers)
+        self.assertEqual(status, 200)
+        self.assertEqual(headers.get("x-datadog-rum-injected"), "1")
+        self.assertTrue("content-length" not in headers)
+        self.assertTrue(body.startswith(before))
+        self.assertTrue(body.endswith(after))
+        self.assertEqual(1, body.count("datadog-rum.js"))
+
+    def test_cached_injection_point(self):
+        """
+        Verify a response with the same ETag and length as a previous one is
+        split at the same offset, and that a response whose bytes before that
+        offset changed is padded instead, and searched again afterwards.
+        """
+        service = {"host": "localhost", "port": 8081}
+
+        page = {
+            "head": "<!DOCTYPE html>\n<html>\n<head>\n<title>Mars</title>\n",
+            "body": "</head>\n<body>\nHello, Mars!\n</body>\n</html>\n",
+        }
+
+        @Request.application
+        def app(request: Request) -> Response:
+            response = Response(page["head"] + page["body"],
+                                200,
+                                content_type="text/html")
+            response.headers["ETag"] = '"mars"'
+            return response
+
+        s = make_server(service["host"], service["port"], app)
+        t = Thread(target=s.serve_forever)
+        t.start()
+
+        status, lines = self.load_conf("rum_offset_cache.conf")
+        self.assertEqual(0, status, lines)
+
+        try:
+            status, headers, first = self.orch.send_nginx_http_request(
+                "/proxy")
+            self.assertEqual(status, 200)
+            self.assertInjection(headers, first)
+
+            status, headers, second = self.orch.send_nginx_http_request(
+                "/proxy")
+            self.assertEqual(status, 200)
+            self.orch.wait_for_log_message("nginx",
+                                           "injected at the cached injection",
+                                           timeout_secs=5)
+            self.assertEqual(first, second)
+
+            # same ETag and length, different doctype and title
+            page["head"] = page["head"].replace("DOCTYPE", "doctype").replace(
+                "Mars", "Moon")
+            status, headers, third = self.orch.send_nginx_http_request(
+                "/proxy")
+            self.assertEqual(status, 200)
+            self.assertTrue("datadog-rum.js" not in third)
+            self.assertEqual(
+                int(self.make_dict_headers(headers)["content-length"]),
+                len(third.encode("utf8")))
+            self.assertTrue(third.startswith(page["head"] + page["body"]))
+
+            status, headers, fourth = self.orch.send_nginx_http_request(
+                "/proxy")
+            self.assertEqual(status, 200)
+            self.assertInjection(headers, fourth)
+            self.assertTrue(fourth.startswith(page["head"]))
+        finally:
+            s.shutdown()
+            t.join()
 
     def test_injection_based_on_content_type(self):
         """
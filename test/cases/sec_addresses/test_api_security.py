@@ -0,0 +1,51 @@
+import json
+from pathlib import Path
+
+from .. import case
+
+
+class TestApiSecurity(case.TestCase):
+    config_setup_done = False
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        if self.waf_disabled:
+            return
+
+        # avoid reconfiguration (cuts time almost in half)
+        if not TestApiSecurity.config_setup_done:
+            conf_path = Path(__file__).parent / './conf/http_api_security.conf'
+            conf_text = conf_path.read_text()
+            status, log_lines = self.orch.nginx_replace_config(
+                conf_text, conf_path.name)
+            self.assertEqual(0, status, log_lines)
+
+            TestApiSecurity.config_setup_done = True
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def get_spans(self):
+        self.orch.reload_nginx()
+        log_lines = self.orch.sync_service('agent')
+        return [
+            span for line in log_lines if line.startswith('[[{')
+            for trace in json.loads(line) for span in trace
+        ]
+
+    def test_one_schema_per_endpoint(self):
+        for path in ('/http/a', '/http/b', '/other/a'):
+            status, _, _ = self.orch.send_nginx_http_request(path, 80)
+            self.assertEqual(status, 200)
+
+        spans = [
+            span for span in self.get_spans()
+            if '_dd.appsec.s.req.headers' in span.get('meta', {})
+        ]
+        # /http/a and /http/b are the same endpoint (same location)
+        self.assertEqual(len(spans), 2)
+        for span in spans:
+            self.assertIsInstance(
+                json.loads(span['meta']['_dd.appsec.s.req.headers']), list)
+            self.assertIn('_dd.appsec.s.res.headers', span['meta'])
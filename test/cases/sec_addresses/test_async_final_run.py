@@ -0,0 +1,57 @@
+from pathlib import Path
+
+from .. import case
+
+
+class TestAsyncFinalRun(case.TestCase):
+    config_setup_done = False
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        if self.waf_disabled:
+            return
+
+        # avoid reconfiguration (cuts time almost in half)
+        if not TestAsyncFinalRun.config_setup_done:
+            waf_path = Path(__file__).parent / './conf/waf.json'
+            waf_text = waf_path.read_text()
+            self.orch.nginx_replace_file('/tmp/waf.json', waf_text)
+
+            conf_path = Path(
+                __file__).parent / './conf/http_async_final_run.conf'
+            conf_text = conf_path.read_text()
+            status, log_lines = self.orch.nginx_replace_config(
+                conf_text, conf_path.name)
+            self.assertEqual(0, status, log_lines)
+
+            TestAsyncFinalRun.config_setup_done = True
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def get_appsec_data(self):
+        rep = self.orch.find_first_appsec_report()
+        if rep is None:
+            self.failureException('No _dd.appsec.json found in traces')
+        return rep
+
+    def test_resp_header_value(self):
+        status, _, _ = self.orch.send_nginx_http_request(
+            '/resp_header_value1', 80)
+        self.assertEqual(status, 200)
+
+        appsec_data = self.get_appsec_data()
+        self.assertEqual(
+            appsec_data['triggers'][0]['rule_matches'][0]['parameters'][0]
+            ['value'], 'matched value')
+
+    def test_status(self):
+        status, _, _ = self.orch.send_nginx_http_request(
+            '/http/status/502', 80)
+        self.assertEqual(status, 502)
+
+        appsec_data = self.get_appsec_data()
+        self.assertEqual(
+            appsec_data['triggers'][0]['rule_matches'][0]['parameters'][0]
+            ['value'], '502')
@@ -0,0 +1,53 @@
+import json
+from pathlib import Path
+
+from .. import case
+
+
+class TestEventJsonLimit(case.TestCase):
+    config_setup_done = False
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        if self.waf_disabled:
+            return
+
+        # avoid reconfiguration (cuts time almost in half)
+        if not TestEventJsonLimit.config_setup_done:
+            waf_path = Path(__file__).parent / './conf/waf.json'
+            waf_text = waf_path.read_text()
+            self.orch.nginx_replace_file('/tmp/waf.json', waf_text)
+
+            conf_path = Path(
+                __file__).parent / './conf/http_event_json_limit.conf'
+            conf_text = conf_path.read_text()
+            status, log_lines = self.orch.nginx_replace_config(
+                conf_text, conf_path.name)
+            self.assertEqual(0, status, log_lines)
+
+            TestEventJsonLimit.config_setup_done = True
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def test_events_dropped(self):
+        status, _, _ = self.orch.send_nginx_http_request(
+            '/resp_header_value1', 80)
+        self.assertEqual(status, 200)
+
+        self.orch.reload_nginx()
+        log_lines = self.orch.sync_service('agent')
+        spans = [
+            span for line in log_lines if line.startswith('[[{')
+            for trace in json.loads(line) for span in trace
+        ]
+        span = next(
+            (s for s in spans if '_dd.appsec.json' in s.get('meta', {})), None)
+        self.assertIsNotNone(span)
+        # the limit leaves room for the envelope only
+        self.assertEqual(json.loads(span['meta']['_dd.appsec.json']),
+                         {'triggers': []})
+        self.assertEqual(span['meta']['appsec.event'], 'true')
+        self.assertGreaterEqual(
+            span['metrics']['_dd.appsec.json.dropped_events'], 1)
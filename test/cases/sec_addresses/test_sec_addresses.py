@@ -53,6 +53,14 @@ class TestSecAddresses(case.TestCase):
         self.orch.send_nginx_http_request(endpoint, 80, method='PUT')
         return self.do_request_common()
 
+    def do_request_body(self, content_type, body):
+        status, _, _ = self.orch.send_nginx_http_request(
+            '/http', 80, {'Content-Type': content_type},
+            method='POST',
+            req_body=body)
+        self.assertEqual(status, 200)
+        return self.do_request_common()
+
     def do_request_common(self):
         rep = self.orch.find_first_appsec_report()
         if rep is None:
@@ -150,6 +158,117 @@ class TestSecAddresses(case.TestCase):
             result['triggers'][0]['rule_matches'][0]['parameters'][0]['value'],
             '%amatched value')
 
+    def test_body_urlencoded_key(self):
+        result = self.do_request_body('application/x-www-form-urlencoded',
+                                      'a=b&matched%20key=c')
+        self.assertEqual(
+            result['triggers'][0]['rule_matches'][0]['parameters'][0]
+            ['key_path'], ['matched key'])
+
+    def test_body_urlencoded_value(self):
+        result = self.do_request_body('application/x-www-form-urlencoded',
+                                      'key=another+value&key=matched+value')
+        self.assertEqual(
+            result['triggers'][0]['rule_matches'][0]['parameters'][0]['value'],
+            'matched value')
+
+    def test_body_multipart_value(self):
+        body = ('--XyZ\r\n'
+                'Content-Disposition: form-data; name="upload"; '
+                'filename="a.txt"\r\n'
+                '\r\n'
+                'matched value\r\n'
+                '--XyZ\r\n'
+                'Content-Disposition: form-data; name="field"\r\n'
+                '\r\n'
+                'matched value\r\n'
+                '--XyZ--\r\n')
+        result = self.do_request_body('multipart/form-data; boundary=XyZ',
+                                      body)
+        # the contents of the file part are not inspected
+        parameters = result['triggers'][0]['rule_matches'][0]['parameters']
+        self.assertEqual(parameters[0]['key_path'], ['field'])
+        self.assertEqual(parameters[0]['value'], 'matched value')
+
+    def test_body_json_key(self):
+        result = self.do_request_body('application/json',
+                                      '{"a": {"matched key": [1, 2]}}')
+        self.assertEqual(
+            result['triggers'][0]['rule_matches'][0]['parameters'][0]
+            ['key_path'], ['a', 'matched key'])
+
+    def test_body_json_value(self):
+        result = self.do_request_body(
+            'application/vnd.api+json; charset=utf-8',
+            '{"data": [{"attr": "another value"}, "matched\\u0020value"]}')
+        self.assertEqual(
+            result['triggers'][0]['rule_matches'][0]['parameters'][0]['value'],
+            'matched value')
+
+    def test_body_grpc_value(self):
+        # one uncompressed message, {1: {1: "matched value"}}
+        inner = '\x0a\x0dmatched value'
+        message = '\x0a' + chr(len(inner)) + inner
+        body = '\x00\x00\x00\x00' + chr(len(message)) + message
+        result = self.do_request_body('application/grpc', body)
+        match = result['triggers'][0]['rule_matches'][0]['parameters'][0]
+        self.assertEqual(match['address'], 'grpc.server.request.message')
+        self.assertEqual(match['key_path'], ['1', '1'])
+        self.assertEqual(match['value'], 'matched value')
+
+    def test_body_grpc_fields_bounded(self):
+        # 130 fields holding a message of one field each, then the matching
+        # value: nested fields count towards datadog_appsec_max_body_fields
+        # (256), so the matching one is not given to the WAF
+        inner = '\x0a\x0dmatched value'
+        message = '\x0a\x02\x08\x01' * 130 + '\x0a' + chr(len(inner)) + inner
+        body = ('\x00\x00\x00' + chr(len(message) >> 8) +
+                chr(len(message) & 0xff) + message)
+        result = self.do_request_body('application/grpc', body)
+        self.assertIsNone(result)
+
+    def test_response_body_json(self):
+        result = self.do_response_headers('/resp_body_json')
+        match = result['triggers'][0]['rule_matches'][0]['parameters'][0]
+        self.assertEqual(match['address'], 'server.response.body')
+        self.assertEqual(match['value'], 'leaked secret 1234')
+
+    def test_response_body_html(self):
+        result = self.do_response_headers('/resp_body_html')
+        match = result['triggers'][0]['rule_matches'][0]['parameters'][0]
+        self.assertEqual(match['address'], 'server.response.body')
+
+    def test_response_body_other_content_type(self):
+        status, _, _ = self.orch.send_nginx_http_request('/resp_body_text', 80)
+        self.assertEqual(status, 200)
+        self.assertIsNone(self.orch.find_first_appsec_report())
+
+    def test_waf_metrics(self):
+        status, _, _ = self.orch.send_nginx_http_request('/http', 80)
+        self.assertEqual(status, 200)
+
+        status, _, body = self.orch.send_nginx_http_request('/waf_status', 80)
+        self.assertEqual(status, 200)
+        stats = json.loads(body)
+        self.assertGreaterEqual(stats['requests'], 1)
+        self.assertGreaterEqual(stats['waf_runs'], 2)
+        for hist in ('serialization_us', 'queue_wait_us', 'duration_us',
+                     'duration_ext_us'):
+            self.assertEqual(stats[hist]['count'], stats['requests'])
+
+        self.orch.reload_nginx()
+        log_lines = self.orch.sync_service('agent')
+        spans = [
+            span for line in log_lines if line.startswith('[[{')
+            for trace in json.loads(line) for span in trace
+        ]
+        span = next((s for s in spans
+                     if '_dd.appsec.waf.duration_ext' in s.get('metrics', {})),
+                    None)
+        self.assertIsNotNone(span)
+        for key in ('duration', 'serialization', 'queue_wait', 'timeouts'):
+            self.assertIn('_dd.appsec.waf.' + key, span['metrics'])
+
     def test_cookie_simple(self):
         result = self.do_request_headers({'Cookie': 'key=matched+value'})
         self.assertEqual(
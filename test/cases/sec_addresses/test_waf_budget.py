@@ -0,0 +1,59 @@
+import json
+from pathlib import Path
+
+from .. import case
+
+
+class TestWafBudget(case.TestCase):
+    config_setup_done = False
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        if self.waf_disabled:
+            return
+
+        # avoid reconfiguration (cuts time almost in half)
+        if not TestWafBudget.config_setup_done:
+            waf_path = Path(__file__).parent / './conf/waf.json'
+            waf_text = waf_path.read_text()
+            self.orch.nginx_replace_file('/tmp/waf.json', waf_text)
+
+            conf_path = Path(__file__).parent / './conf/http_waf_budget.conf'
+            conf_text = conf_path.read_text()
+            status, log_lines = self.orch.nginx_replace_config(
+                conf_text, conf_path.name)
+            self.assertEqual(0, status, log_lines)
+
+            TestWafBudget.config_setup_done = True
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def get_span(self, path):
+        status, _, _ = self.orch.send_nginx_http_request(path, 80)
+        self.assertEqual(status, 200)
+
+        self.orch.reload_nginx()
+        log_lines = self.orch.sync_service('agent')
+        spans = [
+            span for line in log_lines if line.startswith('[[{')
+            for trace in json.loads(line) for span in trace
+        ]
+        span = next((s for s in spans
+                     if s['meta'].get('http.url', '').endswith(path)), None)
+        self.assertIsNotNone(span)
+        return span
+
+    def test_budget_left(self):
+        span = self.get_span('/http?a=matched+value')
+        self.assertIn('_dd.appsec.json', span['meta'])
+        self.assertNotIn('_dd.appsec.waf.budget_exhausted', span['metrics'])
+
+    def test_budget_exhausted(self):
+        span = self.get_span('/no_budget?a=matched+value')
+        self.assertNotIn('_dd.appsec.json', span['meta'])
+        self.assertEqual(span['metrics']['_dd.appsec.waf.budget_exhausted'],
+                         1)
+        # the skipped runs are counted as timeouts
+        self.assertGreaterEqual(span['metrics']['_dd.appsec.waf.timeouts'], 1)
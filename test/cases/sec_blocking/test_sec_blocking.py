@@ -109,6 +109,48 @@ class TestSecBlocking(case.TestCase):
         self.assertEqual(status, 501)
         self.assertEqual(headers['content-type'], 'application/json')
 
+    def test_same_accept_value_twice(self):
+        headers = {'User-Agent': 'block_default', 'Accept': 'text/html'}
+        for _ in range(2):
+            status, resp_headers, body = self.orch.send_nginx_http_request(
+                '/http', 80, headers)
+            resp_headers = {
+                k.lower(): v
+                for k, v in dict(resp_headers).items()
+            }
+            self.assertEqual(status, 403)
+            self.assertEqual(resp_headers['content-type'],
+                             'text/html;charset=utf-8')
+            self.assertEqual(int(resp_headers['content-length']),
+                             len(body.encode()))
+            self.assertRegex(body, r'<title>You\'ve been blocked')
+
+    def test_body_bytes_sent(self):
+        status, _, body, log_lines = self.run_with_ua('block_default', '*/*')
+        self.assertEqual(status, 403)
+
+        traces = [
+            json.loads(line) for line in log_lines if line.startswith('[[{')
+        ]
+
+        def predicate(x):
+            return x[0][0]['meta'].get('appsec.blocked') == 'true'
+
+        trace = next((trace for trace in traces if predicate(trace)), None)
+        if trace is None:
+            self.fail('No trace found with appsec.blocked=true')
+        # the header written with the body is not counted
+        self.assertEqual(trace[0][0]['meta']['body_bytes_sent'],
+                         str(len(body.encode())))
+
+    def test_header_filters_run(self):
+        # the response goes through the header filters: nginx's own headers
+        # and those of add_header are sent with it
+        status, headers, _, _ = self.run_with_ua('block_default', '*/*')
+        self.assertEqual(status, 403)
+        self.assertRegex(headers.get('server', ''), r'^nginx')
+        self.assertEqual(headers.get('x-test-header'), 'added')
+
     def test_redirect_action(self):
         status, headers, _, _ = self.run_with_ua('redirect', '*/*')
         self.assertEqual(status, 301)
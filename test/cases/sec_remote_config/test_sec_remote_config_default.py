@@ -161,6 +161,94 @@ class TestSecRemoteConfig(case.TestCase):
             '/', headers={'X-real-ip': '1.2.3.100'})
         self.assertEqual(200, code)
 
+    @staticmethod
+    def blocked_ips(*networks):
+        """The content of an ASM_DATA configuration that blocks `networks`."""
+        return json.dumps({
+            "rules_data": [{
+                "id":
+                "blocked_ips",
+                "type":
+                "ip_with_expiration",
+                "data": [{
+                    "expiration": 0,
+                    "value": network
+                } for network in networks]
+            }]
+        })
+
+    def apply_asm_data(self, configs):
+        """Apply the ASM_DATA configurations in `configs`, by name, with
+        appsec enabled, and wait until they are all acknowledged."""
+        spec = {
+            'datadog/2/ASM_FEATURES/asm_features_activation/config':
+            '{"asm":{"enabled":true}}'
+        }
+        for name, content in configs.items():
+            spec[f'datadog/2/ASM_DATA/{name}/config'] = content
+        # versions are in seconds
+        time.sleep(1)
+        version = self.apply_cfg(spec)
+        rem_cfg_req = self.wait_for_req_with_version(version, 15)
+        states = {
+            el['id']: el['apply_state']
+            for el in rem_cfg_req['client']['state']['config_states']
+        }
+        for name in configs:
+            self.assertEqual(2, states.get(name), states)
+
+    def assert_blocking(self, blocked, allowed):
+        """Assert that requests from the IPs in `blocked` are blocked, and
+        that requests from those in `allowed` are not."""
+        for ip in blocked:
+            code, _, _ = self.orch.send_nginx_http_request(
+                '/', headers={'X-real-ip': ip})
+            self.assertEqual(403, code, ip)
+        for ip in allowed:
+            code, _, _ = self.orch.send_nginx_http_request(
+                '/', headers={'X-real-ip': ip})
+            self.assertEqual(200, code, ip)
+
+    def test_waf_data_merged_across_configs(self):
+        """The data of all the ASM_DATA configurations with the same id is
+        merged, and after each update the WAF blocks exactly what the current
+        configurations hold."""
+        self.apply_asm_data({
+            'data_a': self.blocked_ips('1.2.3.0/24'),
+            'data_b': self.blocked_ips('5.6.7.0/24'),
+        })
+        self.assert_blocking(blocked=['1.2.3.100', '5.6.7.8'],
+                             allowed=['1.2.4.1', '9.9.9.9'])
+
+        # update one config among several
+        self.apply_asm_data({
+            'data_a': self.blocked_ips('1.2.4.0/24'),
+            'data_b': self.blocked_ips('5.6.7.0/24'),
+        })
+        self.assert_blocking(blocked=['1.2.4.1', '5.6.7.8'],
+                             allowed=['1.2.3.100', '9.9.9.9'])
+
+        # remove one
+        self.apply_asm_data({'data_a': self.blocked_ips('1.2.4.0/24')})
+        self.assert_blocking(blocked=['1.2.4.1'],
+                             allowed=['1.2.3.100', '5.6.7.8', '9.9.9.9'])
+
+        # send the same key again, with new data: it replaces the old one
+        self.apply_asm_data(
+            {'data_a': self.blocked_ips('1.2.5.0/24', '5.6.7.0/24')})
+        self.assert_blocking(blocked=['1.2.5.1', '5.6.7.8'],
+                             allowed=['1.2.3.100', '1.2.4.1', '9.9.9.9'])
+
+        # and with the same data, which changes nothing
+        self.apply_asm_data(
+            {'data_a': self.blocked_ips('1.2.5.0/24', '5.6.7.0/24')})
+        self.assert_blocking(blocked=['1.2.5.1', '5.6.7.8'],
+                             allowed=['1.2.3.100', '1.2.4.1', '9.9.9.9'])
+
+        self.drop_cfg()
+        self.assert_blocking(blocked=[],
+                             allowed=['1.2.5.1', '5.6.7.8', '1.2.4.1'])
+
     def test_asm_dd(self):
         version = self.apply_cfg({
             'datadog/2/ASM_FEATURES/asm_features_activation/config':
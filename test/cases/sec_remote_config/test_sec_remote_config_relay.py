@@ -0,0 +1,132 @@
+import json
+import time
+from pathlib import Path
+
+from .. import case
+from .test_sec_remote_config_default import TestSecRemoteConfig
+
+
+class TestSecRemoteConfigRelay(case.TestCase):
+    """Test that the configuration polled by the first worker reaches the
+    others through datadog_appsec_remote_config_zone"""
+
+    requires_waf = True
+
+    # the other workers look for a relayed configuration every second
+    RELAY_DELAY_SECS = 2
+
+    def setUp(self):
+        super().setUp()
+        conf_path = Path(__file__).parent / f'./conf/http_relay.conf'
+        conf_text = conf_path.read_text()
+        status, log_lines = self.orch.nginx_replace_config(
+            conf_text, conf_path.name)
+        self.assertEqual(0, status, log_lines)
+
+    def apply_cfg(self, spec):
+        payload, version = TestSecRemoteConfig.generate_resp(spec)
+        status, _, _ = self.orch.setup_remote_config_payload(payload)
+        self.assertEqual(200, status)
+        self.orch.wait_for_log_message(
+            'agent',
+            f'Remote config request with version {version}.*',
+            timeout_secs=15)
+        time.sleep(self.RELAY_DELAY_SECS)
+
+    def assert_all_workers(self, expected_code, headers):
+        # enough requests for every worker to serve some
+        for _ in range(20):
+            code, _, _ = self.orch.send_nginx_http_request('/',
+                                                           headers=headers)
+            self.assertEqual(expected_code, code)
+
+    def test_waf_data_is_relayed(self):
+        self.apply_cfg({
+            'datadog/2/ASM_FEATURES/asm_features_activation/config':
+            '{"asm":{"enabled":true}}',
+            'datadog/2/ASM_DATA/mydata/config':
+            json.dumps({
+                "rules_data": [{
+                    "id":
+                    "blocked_ips",
+                    "type":
+                    "ip_with_expiration",
+                    "data": [{
+                        "expiration": 0,
+                        "value": "1.2.3.0/24"
+                    }]
+                }]
+            })
+        })
+        self.assert_all_workers(403, {'X-real-ip': '1.2.3.100'})
+        self.assert_all_workers(200, {'X-real-ip': '1.2.4.1'})
+
+        self.apply_cfg({})
+        self.assert_all_workers(200, {'X-real-ip': '1.2.3.100'})
+
+    def test_only_the_first_worker_polls(self):
+        """Only the first worker polls the agent, for the AppSec products and
+        for those of the tracer. The polls of the other workers are answered
+        with the responses it relays."""
+        self.orch.sync_service('agent')
+        # the workers poll every second
+        time.sleep(3)
+        log_lines = self.orch.sync_service('agent')
+
+        products_by_client = {}
+        prefix = 'Remote config request with version '
+        for line in log_lines:
+            if not line.startswith(prefix):
+                continue
+            request = json.loads(line.split(': ', 1)[1])
+            client = request['client']
+            products_by_client[client['id']] = set(client['products'])
+
+        self.assertEqual(1, len(products_by_client), products_by_client)
+        products = next(iter(products_by_client.values()))
+        self.assertIn('ASM_DD', products)
+        self.assertIn('APM_TRACING', products)
+
+    def test_tracer_config_is_relayed(self):
+        """The configuration of the tracer (APM_TRACING) polled by the first
+        worker applies to the spans of all of them."""
+        self.apply_cfg({
+            'datadog/2/APM_TRACING/relayed_tags/config':
+            json.dumps({
+                "id": "relayed_tags",
+                "revision": 1,
+                "schema_version": "v1.0.0",
+                "action": "enable",
+                # as in conf/http_relay.conf
+                "service_target": {
+                    "service": "nginx",
+                    "env": "relay"
+                },
+                "lib_config": {
+                    "tracing_tags": ["relayed:yes"]
+                }
+            })
+        })
+        try:
+            self.assert_all_workers(200, {})
+            # the workers send their traces when they exit
+            self.orch.reload_nginx()
+            log_lines = self.orch.sync_service('agent')
+        finally:
+            self.apply_cfg({})
+
+        tags_by_process = {}
+        for line in log_lines:
+            if not line.startswith('[[{'):
+                continue
+            for trace in json.loads(line):
+                for span in trace:
+                    if span.get('parent_id') != 0:
+                        continue
+                    process = span.get('metrics', {}).get('process_id')
+                    tags_by_process.setdefault(process, set()).add(
+                        span.get('meta', {}).get('relayed'))
+
+        self.assertGreaterEqual(len(tags_by_process), 2, tags_by_process)
+        for tags in tags_by_process.values():
+            self.assertEqual({'yes'}, tags, tags_by_process)
@@ -0,0 +1,73 @@
+import json
+
+from .. import case
+
+from pathlib import Path
+
+
+class TestSecThrottle(case.TestCase):
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        conf_text = conf_path.read_text()
+
+        status, log_lines = self.orch.nginx_replace_config(
+            conf_text, conf_path.name)
+        self.assertEqual(0, status, log_lines)
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def send(self, user_agent):
+        headers = {'User-Agent': user_agent, 'Accept': 'application/json'}
+        status, _, body = self.orch.send_nginx_http_request(
+            '/http', 80, headers)
+        return status, body
+
+    def test_client_throttled_after_threshold(self):
+        # monitoring-only rule: these requests go through, but are counted
+        for _ in range(2):
+            status, _ = self.send('dd-test-scanner-log')
+            self.assertEqual(status, 200)
+
+        # clean request from the same client, answered without the WAF
+        status, body = self.send('Mistake Not...')
+        self.assertEqual(status, 403)
+        self.assertRegex(body, r'"title":"You\'ve been blocked')
+
+        self.orch.reload_nginx()
+        log_lines = self.orch.sync_service('agent')
+        traces = [
+            json.loads(line) for line in log_lines if line.startswith('[[{')
+        ]
+
+        def predicate(x):
+            return x[0][0]['meta'].get('appsec.throttled') == 'true'
+
+        trace = next((trace for trace in traces if predicate(trace)), None)
+        if trace is None:
+            self.fail('No trace found with appsec.throttled=true')
+        self.assertEqual(trace[0][0]['meta'].get('appsec.blocked'), 'true')
+
+    def test_zero_window_rejected(self):
+        self.assert_config_rejected(
+            'conf/zero_window.conf',
+            '"datadog_appsec_throttle_window" directive must be at least 1s')
+
+    def test_zero_threshold_rejected(self):
+        self.assert_config_rejected('conf/zero_threshold.conf',
+                                    'value must be equal to or greater than 1')
+
+    def assert_config_rejected(self, config_relative_path, diagnostic_excerpt):
+        config_path = Path(__file__).parent / config_relative_path
+        status, log_lines = self.orch.nginx_test_config(
+            config_path.read_text(), config_path.name)
+
+        self.assertNotEqual(status, 0)
+        self.assertTrue(any(diagnostic_excerpt in line for line in log_lines),
+                        {
+                            'diagnostic_excerpt': diagnostic_excerpt,
+                            'log_lines': log_lines
+                        })
@@ -0,0 +1,165 @@
+import json
+import time
+from pathlib import Path
+
+from .. import case
+from .. import formats
+# imported as a module, so that its tests are not collected again here
+from ..sec_remote_config import test_sec_remote_config_default as remote_cfg
+
+
+class TestSecVerdictCache(case.TestCase):
+    """Test that byte-identical requests without WAF matches skip the WAF,
+    with datadog_appsec_verdict_cache_size."""
+
+    requires_waf = True
+
+    def setUp(self):
+        super().setUp()
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        conf_text = conf_path.read_text()
+        status, log_lines = self.orch.nginx_replace_config(
+            conf_text, conf_path.name)
+        self.assertEqual(0, status, log_lines)
+        self.is_dirty = False
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+    def tearDown(self):
+        if self.is_dirty:
+            self.apply_cfg({})
+        super().tearDown()
+
+    def apply_cfg(self, spec):
+        """Have the agent send the remote configuration files in `spec`, and
+        wait for the worker to report that it applied them."""
+        payload, version = remote_cfg.TestSecRemoteConfig.generate_resp(spec)
+        status, _, _ = self.orch.setup_remote_config_payload(payload)
+        self.assertEqual(200, status)
+        self.is_dirty = bool(spec)
+        self.orch.wait_for_log_message(
+            'agent',
+            f'Remote config request with version {version}.*',
+            timeout_secs=15)
+        # Consume the rest of the logging from the agent.
+        self.orch.sync_service('agent')
+
+    def send(self, path='/', headers={}):
+        """Send a request and return its status and the root span of its
+        trace, once the worker sent it to the agent (every two seconds)."""
+        status, _, _ = self.orch.send_nginx_http_request(path,
+                                                         headers=headers)
+        deadline = time.monotonic() + 10
+        while True:
+            for line in self.orch.sync_service('agent'):
+                trace = formats.parse_trace(line)
+                if trace is not None:
+                    return status, trace[0][0]
+            self.assertLess(time.monotonic(), deadline,
+                            'no trace for the request')
+            time.sleep(0.5)
+
+    def assert_cache_hit(self, span):
+        self.assertEqual(1, span['metrics'].get('_dd.appsec.waf.cache_hit'),
+                         span)
+        # neither the request nor the response was given to the WAF
+        self.assertNotIn('_dd.appsec.waf.duration', span['metrics'], span)
+
+    def assert_cache_miss(self, span):
+        self.assertNotIn('_dd.appsec.waf.cache_hit', span['metrics'], span)
+        self.assertIn('_dd.appsec.waf.duration', span['metrics'], span)
+
+    def test_repeated_benign_request_skips_waf(self):
+        headers = {'X-real-ip': '1.2.3.100'}
+        status, span = self.send(headers=headers)
+        self.assertEqual(200, status)
+        self.assert_cache_miss(span)
+
+        for _ in range(2):
+            status, span = self.send(headers=headers)
+            self.assertEqual(200, status)
+            self.assert_cache_hit(span)
+
+    def test_matching_request_is_not_cached(self):
+        # monitoring-only rule: the request goes through, with an event
+        headers = {'User-agent': 'dd-test-scanner-log'}
+        for _ in range(3):
+            status, span = self.send(headers=headers)
+            self.assertEqual(200, status)
+            self.assert_cache_miss(span)
+            self.assertIn('_dd.appsec.json', span['meta'], span)
+
+    def test_asm_data_update_invalidates(self):
+        headers = {'X-real-ip': '1.2.3.100'}
+        self.send(headers=headers)
+        status, span = self.send(headers=headers)
+        self.assertEqual(200, status)
+        self.assert_cache_hit(span)
+
+        self.apply_cfg({
+            'datadog/2/ASM_DATA/mydata/config':
+            json.dumps({
+                "rules_data": [{
+                    "id":
+                    "blocked_ips",
+                    "type":
+                    "ip_with_expiration",
+                    "data": [{
+                        "expiration": 0,
+                        "value": "1.2.3.0/24"
+                    }]
+                }]
+            })
+        })
+        status, span = self.send(headers=headers)
+        self.assertEqual(403, status)
+        self.assert_cache_miss(span)
+
+        # the unblocked request is given to the new ruleset once, then cached
+        self.apply_cfg({})
+        status, span = self.send(headers=headers)
+        self.assertEqual(200, status)
+        self.assert_cache_miss(span)
+        status, span = self.send(headers=headers)
+        self.assertEqual(200, status)
+        self.assert_cache_hit(span)
+
+    def test_asm_dd_update_invalidates(self):
+        path = '/?q=matched+value'
+        self.send(path)
+        status, span = self.send(path)
+        self.assertEqual(200, status)
+        self.assert_cache_hit(span)
+
+        self.apply_cfg({
+            'datadog/2/ASM_DD/full_cfg/config':
+            json.dumps({
+                "version":
+                "2.1",
+                "rules": [{
+                    "id":
+                    "partial_match_values",
+                    "name":
+                    "Partially match values",
+                    "tags": {
+                        "type": "security_scanner",
+                        "category": "attack_attempt"
+                    },
+                    "conditions": [{
+                        "parameters": {
+                            "inputs": [{
+                                "address": "server.request.query"
+                            }],
+                            "regex": ".*matched.+value.*"
+                        },
+                        "operator": "match_regex"
+                    }],
+                    "transformers": ["values_only"],
+                    "on_match": ["block"]
+                }]
+            })
+        })
+        status, span = self.send(path)
+        self.assertEqual(403, status)
+        self.assert_cache_miss(span)
@@ -0,0 +1,303 @@
+from .. import case
+from .. import formats
+
+from pathlib import Path
+import re
+import tempfile
+import time
+import uuid
+
+# Sent with the requests of `conf/eviction.conf`, whose spans are tagged with
+# it: a trace is then about 12.5 kB, and the budget of 44 kB holds three.
+PADDING = {'X-Padding': 'x' * 12000}
+
+# logged by each worker whenever traces are dropped, and when it exits
+STATS_PATTERN = re.compile(
+    r'trace queue: (?P<queued>\d+) queued, (?P<sent>\d+) sent in '
+    r'(?P<batches>\d+) batches, \d+/\d+ bytes pending, dropped: '
+    r'(?P<oldest>\d+) oldest, (?P<lower_priority>\d+) lower priority, '
+    r'(?P<rejected>\d+) rejected, (?P<agent_down>\d+) agent down, '
+    r'(?P<unsent>\d+) unsent, agent down (?P<breaker_trips>\d+) times')
+
+
+def last_stats(error_log_text):
+    """Return the counters of the last statistics line in the specified
+    `error_log_text`, as a dict, or `None` if there is none.
+    """
+    matches = list(STATS_PATTERN.finditer(error_log_text))
+    if not matches:
+        return None
+    counters = matches[-1].groupdict()
+    return {name: int(value) for name, value in counters.items()}
+
+
+class TestTraceQueue(case.TestCase):
+
+    def received_request_numbers(self):
+        """Return the set of "request.number" tags of the nginx spans that the
+        agent received since the last sync.
+        """
+        log_lines = self.orch.sync_service('agent')
+        seen = set()
+        for line in log_lines:
+            segments = formats.parse_trace(line)
+            if segments is None:
+                continue
+            for segment in segments:
+                for span in segment:
+                    if span['service'] != 'nginx':
+                        continue
+                    seen.add(span['meta'].get('request.number'))
+        return seen
+
+    def test_queued_traces_are_sent(self):
+        """Verify that with `datadog_trace_queue_size`, the traces of the
+        workers reach the agent.
+        """
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        # The agent is found from the environment, as dd-trace-cpp does.
+        # Remote configuration is not available with the queue.
+        extra_env = {
+            'DD_AGENT_HOST': 'agent',
+            'DD_REMOTE_CONFIGURATION_ENABLED': 'false',
+        }
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        numbers = {str(n) for n in range(10)}
+        with self.orch.custom_nginx(conf_path.read_text(),
+                                    extra_env,
+                                    healthcheck_port=8080):
+            for n in numbers:
+                status, _, _ = self.orch.send_nginx_http_request(
+                    f'/http?n={n}', port=8080)
+                self.assertEqual(status, 200)
+
+        # The workers send what is left in their queue when they exit.
+        seen = self.received_request_numbers()
+        self.assertEqual(numbers - seen, set())
+
+    def run_eviction(self, policy):
+        """Fill the queue of a worker using the specified drop `policy` while
+        a batch is held by a slow agent, and return the final counters of the
+        queue and the request numbers of the traces that reached the agent.
+
+        The first burst fills half the budget, so that its two traces are
+        sent at once. The agent takes 1.5 seconds to answer, and meanwhile the
+        queue has room for one trace only (44 kB - 2 x 12.5 kB), for which the
+        traces of the second burst compete: a trace dropped by sampling
+        ("b1"), a trace kept by a sampling rule ("keep"), then two more traces
+        dropped by sampling.
+        """
+        conf_path = Path(__file__).parent / './conf/eviction.conf'
+        conf_text = conf_path.read_text().replace('${policy}', policy)
+        extra_env = {
+            'DD_TRACE_AGENT_URL': 'http://agent:8126/slow/1500',
+            'DD_REMOTE_CONFIGURATION_ENABLED': 'false',
+        }
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        with tempfile.NamedTemporaryFile(mode='w+') as error_log:
+            with self.orch.custom_nginx(conf_text,
+                                        extra_env,
+                                        healthcheck_port=8080,
+                                        error_log=error_log):
+                statuses = self.orch.send_nginx_http_request_bursts(
+                    [['/drop?n=a1', '/drop?n=a2'],
+                     [
+                         '/drop?n=b1', '/keep?n=keep', '/drop?n=b2',
+                         '/drop?n=b3'
+                     ]],
+                    port=8080,
+                    headers=PADDING)
+                self.assertEqual(statuses, [200] * 6)
+            stats = last_stats(Path(error_log.name).read_text())
+
+        self.assertIsNotNone(stats)
+        return stats, self.received_request_numbers()
+
+    def test_lowest_priority_keeps_user_kept_traces(self):
+        """Verify that with `datadog_trace_queue_drop lowest_priority`, a trace
+        kept by a sampling rule evicts one dropped by sampling, and that later
+        traces dropped by sampling are rejected rather than evicting it.
+        """
+        stats, received = self.run_eviction('lowest_priority')
+
+        context = {'stats': stats, 'received': received}
+        self.assertGreaterEqual(stats['lower_priority'], 1, context)
+        self.assertGreaterEqual(stats['rejected'], 2, context)
+        self.assertEqual(stats['oldest'], 0, context)
+        self.assertIn('keep', received, context)
+        self.assertEqual(received & {'b1', 'b2', 'b3'}, set(), context)
+        self.assertLessEqual({'a1', 'a2'}, received, context)
+
+    def test_oldest_evicts_whatever_the_priority(self):
+        """Verify that with `datadog_trace_queue_drop oldest`, each new trace
+        evicts the oldest queued one, even if it was kept by a sampling rule.
+        """
+        stats, received = self.run_eviction('oldest')
+
+        context = {'stats': stats, 'received': received}
+        self.assertGreaterEqual(stats['oldest'], 3, context)
+        self.assertEqual(stats['lower_priority'], 0, context)
+        self.assertNotIn('keep', received, context)
+        self.assertIn('b3', received, context)
+        self.assertLessEqual({'a1', 'a2'}, received, context)
+
+    def run_flush_schedule(self, during):
+        """Run nginx with `conf/eviction.conf` and an agent that logs the
+        requests it receives, and call `during` meanwhile with the token of
+        those requests. Return the final counters of the queue.
+        """
+        conf_path = Path(__file__).parent / './conf/eviction.conf'
+        conf_text = conf_path.read_text().replace('${policy}', 'oldest')
+        token = str(uuid.uuid4())
+        extra_env = {
+            'DD_TRACE_AGENT_URL': f'http://agent:8126/transport/{token}',
+            'DD_REMOTE_CONFIGURATION_ENABLED': 'false',
+        }
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        with tempfile.NamedTemporaryFile(mode='w+') as error_log:
+            with self.orch.custom_nginx(conf_text,
+                                        extra_env,
+                                        healthcheck_port=8080,
+                                        error_log=error_log):
+                during(token)
+            return last_stats(Path(error_log.name).read_text())
+
+    def wait_for_batch(self, token):
+        """Wait for the agent to receive a batch of traces for `token`, and
+        return the time at which it was seen.
+        """
+        self.orch.wait_for_log_message(
+            'agent', f'Transport {re.escape(token)}: /v0.4/traces ',
+            timeout_secs=10)
+        return time.monotonic()
+
+    def test_flush_starts_early(self):
+        """Verify that once half the budget is queued, traces are sent on the
+        spot rather than at the end of the flush interval (2 seconds).
+        """
+
+        def during(token):
+            # A small trace is sent at the next flush, which starts a new
+            # interval of 2 seconds.
+            status, _, _ = self.orch.send_nginx_http_request(
+                '/drop?n=small', port=8080)
+            self.assertEqual(status, 200)
+            flushed_at = self.wait_for_batch(token)
+
+            # Two traces fill half the budget.
+            statuses = self.orch.send_nginx_http_request_bursts(
+                [['/drop?n=e1', '/drop?n=e2']], port=8080, headers=PADDING)
+            self.assertEqual(statuses, [200] * 2)
+            elapsed = self.wait_for_batch(token) - flushed_at
+            self.assertLess(elapsed, 1.5)
+
+        # The trace of the first batch was consumed while waiting for the
+        # second.
+        self.run_flush_schedule(during)
+        self.assertLessEqual({'e1', 'e2'}, self.received_request_numbers())
+
+    def test_idle_worker_sends_nothing(self):
+        """Verify that once its traces are sent, an idle worker does not send
+        more batches to the agent.
+        """
+
+        def during(token):
+            status, _, _ = self.orch.send_nginx_http_request('/drop?n=1',
+                                                             port=8080)
+            self.assertEqual(status, 200)
+            self.wait_for_batch(token)
+
+            # Several flush intervals, which grow while there is nothing to
+            # send.
+            time.sleep(7)
+            log_lines = self.orch.sync_service('agent')
+            batches = [
+                line for line in log_lines
+                if line.startswith(f'Transport {token}: /v0.4/traces ')
+            ]
+            self.assertEqual(batches, [], log_lines)
+
+        stats = self.run_flush_schedule(during)
+        self.assertIsNotNone(stats)
+        self.assertEqual(stats['batches'], 1, stats)
+
+    def test_breaker_opens_and_closes(self):
+        """Verify that once the agent fails batches in a row, traces are
+        dropped without being queued, and that they are sent again once a
+        probe finds the agent back.
+        """
+        conf_path = Path(__file__).parent / './conf/eviction.conf'
+        conf_text = conf_path.read_text().replace('${policy}', 'oldest')
+        # The agent answers with a 503 for 3 seconds.
+        token = str(uuid.uuid4())
+        extra_env = {
+            'DD_TRACE_AGENT_URL': f'http://agent:8126/unavailable/{token}/3',
+            'DD_REMOTE_CONFIGURATION_ENABLED': 'false',
+        }
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        with tempfile.NamedTemporaryFile(mode='w+') as error_log:
+            with self.orch.custom_nginx(conf_text,
+                                        extra_env,
+                                        healthcheck_port=8080,
+                                        error_log=error_log):
+                # Each pair fills half the budget and is sent at once. The
+                # first three batches fail, which opens the breaker, and the
+                # last pair is dropped.
+                statuses = self.orch.send_nginx_http_request_bursts(
+                    [[f'/drop?n=d{2 * i + 1}', f'/drop?n=d{2 * i + 2}']
+                     for i in range(4)],
+                    port=8080,
+                    headers=PADDING)
+                self.assertEqual(statuses, [200] * 8)
+
+                # The breaker stays open for 5 seconds, then the next flush
+                # probes the agent.
+                log_text = ''
+                deadline = time.monotonic() + 30
+                while 'the agent is reachable again' not in log_text:
+                    self.assertLess(time.monotonic(), deadline, log_text)
+                    time.sleep(0.5)
+                    log_text = Path(error_log.name).read_text()
+                self.assertIn('the agent is unreachable', log_text)
+
+                status, _, _ = self.orch.send_nginx_http_request(
+                    '/drop?n=after', port=8080, headers=PADDING)
+                self.assertEqual(status, 200)
+            stats = last_stats(Path(error_log.name).read_text())
+
+        received = self.received_request_numbers()
+        context = {'stats': stats, 'received': received}
+        self.assertIsNotNone(stats)
+        self.assertEqual(stats['breaker_trips'], 1, context)
+        self.assertGreaterEqual(stats['agent_down'], 2, context)
+        self.assertGreaterEqual(stats['unsent'], 6, context)
+        self.assertIn('after', received, context)
+        self.assertEqual(received & {'d7', 'd8'}, set(), context)
+
+    def test_remote_configuration_must_be_disabled(self):
+        """Verify that `datadog_trace_queue_size` is rejected while remote
+        configuration, which it does not support, is enabled (the default).
+        """
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        status, log_lines = self.orch.nginx_test_config(
+            conf_path.read_text(), conf_path.name)
+
+        self.assertNotEqual(status, 0)
+        excerpt = ('datadog_trace_queue_size does not support remote '
+                   'configuration')
+        self.assertTrue(any(excerpt in line for line in log_lines), {
+            'excerpt': excerpt,
+            'log_lines': log_lines
+        })
@@ -0,0 +1,63 @@
+from .. import case
+from .. import formats
+
+from pathlib import Path
+
+
+class TestTraceRing(case.TestCase):
+
+    def test_traces_of_all_workers_are_sent(self):
+        """Verify that with `datadog_trace_ring_zone`, the traces finished by
+        any worker reach the agent, through the single flusher.
+        """
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        # The agent is found from the environment, as dd-trace-cpp does.
+        # Remote configuration is not available with the ring.
+        extra_env = {
+            'DD_AGENT_HOST': 'agent',
+            'DD_REMOTE_CONFIGURATION_ENABLED': 'false',
+        }
+
+        # Consume any previous logging from the agent.
+        self.orch.sync_service('agent')
+
+        numbers = {str(n) for n in range(20)}
+        with self.orch.custom_nginx(conf_path.read_text(),
+                                    extra_env,
+                                    healthcheck_port=8080):
+            for n in numbers:
+                status, _, _ = self.orch.send_nginx_http_request(
+                    f'/http?n={n}', port=8080)
+                self.assertEqual(status, 200)
+
+        # The flusher sends what is left in the ring when it exits.
+        log_lines = self.orch.sync_service('agent')
+
+        seen = set()
+        for line in log_lines:
+            segments = formats.parse_trace(line)
+            if segments is None:
+                continue
+            for segment in segments:
+                for span in segment:
+                    if span['service'] != 'nginx':
+                        continue
+                    seen.add(span['meta'].get('request.number'))
+
+        self.assertEqual(numbers - seen, set())
+
+    def test_remote_configuration_must_be_disabled(self):
+        """Verify that `datadog_trace_ring_zone` is rejected while remote
+        configuration, which it does not support, is enabled (the default).
+        """
+        conf_path = Path(__file__).parent / './conf/http.conf'
+        status, log_lines = self.orch.nginx_test_config(
+            conf_path.read_text(), conf_path.name)
+
+        self.assertNotEqual(status, 0)
+        excerpt = ('datadog_trace_ring_zone does not support remote '
+                   'configuration')
+        self.assertTrue(any(excerpt in line for line in log_lines), {
+            'excerpt': excerpt,
+            'log_lines': log_lines
+        })
@@ -1,6 +1,7 @@
 // This is an HTTP server that listens on port 8126, and prints to standard
 // output a JSON representation of all traces that it receives.
 
+const fs = require('fs');
 const http = require('http');
 const msgpack = require('massagepack');
 const process = require('process');
@@ -27,7 +28,7 @@ const requestListener = (() => {
     return req_json['client']['state']['targets_version'];
   }
 
-  return (request, response) => {
+  function handle(request, response) {
     if (request.url.endsWith('/traces')) {
       let body = [];
       request.on('data', chunk => {
@@ -75,14 +76,132 @@ const requestListener = (() => {
       response.end();
       return;
     }
+  }
+
+  // Tests can give nginx an agent URL with a path prefix to make the agent
+  // misbehave. The rest of the path is then handled as usual. Prefixes are
+  // applied in this order:
+  //  - "/transport/<token>": the request is logged with the number of the
+  //    connection it came on;
+  //  - "/drop_reused": a request on a connection that was already answered
+  //    once is not answered, and the connection is closed, as by an agent
+  //    that closes idle connections just as they are reused;
+  //  - "/chunked": the response is sent in chunks of a few bytes;
+  //  - "/slow/<milliseconds>": the response is delayed;
+  //  - "/unavailable/<token>/<seconds>": requests are answered with a 503
+  //    until that many seconds after the first request with the same token,
+  //    as by an agent that is down.
+  const unavailableSince = new Map();
+
+  return (request, response) => {
+    const socket = request.socket;
+
+    const restart = request.url.match(/^\/restart\/(\d+)$/);
+    if (restart) {
+      request.resume();
+      response.on('finish', () => restartServer(Number(restart[1])));
+      response.writeHead(200);
+      response.end();
+      return;
+    }
+
+    const transport = request.url.match(/^\/transport\/([^/]+)(\/.*)$/);
+    if (transport) {
+      const [, token, rest] = transport;
+      console.log(`Transport ${token}: ${rest} on connection ${socket.number}`);
+      request.url = rest;
+    }
+
+    const dropReused = request.url.match(/^\/drop_reused(\/.*)$/);
+    if (dropReused) {
+      if (socket.answered) {
+        console.log(`Dropped ${dropReused[1]} on connection ${socket.number}`);
+        socket.destroy();
+        return;
+      }
+      request.url = dropReused[1];
+    }
+    response.on('finish', () => {
+      socket.answered = true;
+    });
+
+    const chunked = request.url.match(/^\/chunked(\/.*)$/);
+    if (chunked) {
+      request.url = chunked[1];
+      // Writing before the end makes node send each write as a chunk.
+      const end = response.end.bind(response);
+      response.end = data => {
+        const bytes = Buffer.from(data === undefined ? '' : data);
+        for (let i = 0; i < bytes.length; i += 5) {
+          response.write(bytes.subarray(i, i + 5));
+        }
+        end();
+      };
+    }
+
+    const slow = request.url.match(/^\/slow\/(\d+)(\/.*)$/);
+    if (slow) {
+      request.url = slow[2];
+      setTimeout(() => handle(request, response), Number(slow[1]));
+      return;
+    }
+
+    const unavailable =
+        request.url.match(/^\/unavailable\/([^/]+)\/(\d+)(\/.*)$/);
+    if (unavailable) {
+      const [, token, seconds, rest] = unavailable;
+      if (!unavailableSince.has(token)) {
+        unavailableSince.set(token, Date.now());
+      }
+      if (Date.now() - unavailableSince.get(token) < Number(seconds) * 1000) {
+        console.log(`Unavailable for ${token}: ${rest}`);
+        request.resume();
+        response.writeHead(503);
+        response.end();
+        return;
+      }
+      request.url = rest;
+    }
+
+    handle(request, response);
   };
 })();
 
+let connections = 0;
+const numberConnection = socket => {
+  socket.number = ++connections;
+};
+
 const port = 8126;
 console.log(`node.js web server (agent) is running on port ${port}`);
 const server = http.createServer(requestListener);
+server.on('connection', numberConnection);
 server.listen(port);
 
+// `POST /restart/<milliseconds>` makes the agent behave as if it restarted:
+// all of its connections are closed, and new ones are refused for that long.
+function restartServer(milliseconds) {
+  console.log(`Restarting for ${milliseconds} milliseconds`);
+  server.close();
+  server.closeAllConnections();
+  setTimeout(() => {
+    server.listen(port);
+    console.log('Restarted');
+  }, milliseconds);
+}
+
+// The same agent is reachable over a unix domain socket, in a volume shared
+// with the nginx service.
+const socketPath = '/var/run/datadog/apm.socket';
+fs.rmSync(socketPath, {force: true});
+console.log(`node.js web server (agent) is listening on ${socketPath}`);
+const unixServer = http.createServer(requestListener);
+unixServer.on('connection', numberConnection);
+unixServer.listen(socketPath, () => {
+  // nginx workers do not run as the same user
+  fs.chmodSync(socketPath, 0o777);
+});
+
 // In order for the span(s) associated with an HTTP request to be considered
 // finished, the body of the response corresponding to the request must have
 // ended.
@@ -111,7 +230,7 @@ admin.listen(adminPort);
 process.on('SIGTERM', function () {
   console.log('Received SIGTERM');
 
-  let remaining = 2;
+  let remaining = 3;
   function callback() {
     if (--remaining === 0) {
       process.exit(0);
@@ -120,4 +239,5 @@ process.on('SIGTERM', function () {
 
   admin.close(callback);
   server.close(callback);
+  unixServer.close(callback);
 });